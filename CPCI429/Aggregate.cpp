@@ -0,0 +1,435 @@
+/*++
+
+Module Name:
+
+    aggregate.c
+
+Abstract:
+
+    This file contains windowed aggregation. For each configured source
+    the receive path decodes the data field with the source's encoding
+    descriptor (Decode.h) and keeps count, minimum, maximum, sum and last
+    value (CPCI429AggregateUpdate). The health timer ends each channel's
+    window, publishes its aggregates and completes one
+    CPCI429_IOCTL_WAIT_AGGREGATES request with every channel window that
+    is ready, so monitors wake once per window rather than once per
+    word.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "aggregate.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429AggregateInitialize)
+#endif
+
+NTSTATUS
+CPCI429AggregateInitialize(
+	_In_ WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	ULONG i;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+	KeInitializeSpinLock(&pDeviceContext->AggregateLock);
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		KeInitializeSpinLock(&pDeviceContext->RxChannels[i].Aggregator.Lock);
+	}
+
+	//
+	// Aggregate waits are held across power transitions.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->AggregateWaitQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+	}
+
+	return status;
+}
+
+VOID
+CPCI429AggregateRelease(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Turns aggregation off on every channel. The label table that maps
+    words to aggregates goes away with the hardware.
+
+--*/
+{
+	PAGGREGATOR aggregator;
+	KIRQL irql;
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		aggregator = &DeviceContext->RxChannels[i].Aggregator;
+
+		KeAcquireSpinLock(&aggregator->Lock, &irql);
+		InterlockedExchange64(&aggregator->Window, 0);
+		aggregator->SlotCount = 0;
+		KeReleaseSpinLock(&aggregator->Lock, irql);
+	}
+
+	KeAcquireSpinLock(&DeviceContext->AggregateLock, &irql);
+	DeviceContext->AggregateReady = 0;
+	KeReleaseSpinLock(&DeviceContext->AggregateLock, irql);
+}
+
+static
+VOID
+CPCI429AggregateDeliver(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Hands ready channel windows to parked wait requests, as many per
+    request as fit, until either runs out.
+
+--*/
+{
+	NTSTATUS status;
+	WDFREQUEST request;
+	PUCHAR buffer;
+	size_t length;
+	size_t offset;
+	ULONG channel;
+	ULONG n;
+	KIRQL irql;
+
+	for (;;) {
+		KeAcquireSpinLock(&DeviceContext->AggregateLock, &irql);
+
+		if (DeviceContext->AggregateReady == 0 ||
+			!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->AggregateWaitQueue, &request))) {
+			KeReleaseSpinLock(&DeviceContext->AggregateLock, irql);
+			return;
+		}
+
+		status = WdfRequestRetrieveOutputBuffer(request, CPCI429_AGGREGATE_WINDOW_BYTES(0), (PVOID*)&buffer, &length);
+		if (!NT_SUCCESS(status)) {
+			KeReleaseSpinLock(&DeviceContext->AggregateLock, irql);
+			WdfRequestComplete(request, status);
+			continue;
+		}
+
+		offset = 0;
+		for (n = 0; n < CPCI429_MAX_RX_CHANNELS; n++) {
+			PAGGREGATOR aggregator;
+			PCPCI429_AGGREGATE_WINDOW window;
+			size_t bytes;
+
+			channel = (DeviceContext->AggregateNext + n) % CPCI429_MAX_RX_CHANNELS;
+			if ((DeviceContext->AggregateReady & (1UL << channel)) == 0) {
+				continue;
+			}
+
+			aggregator = &DeviceContext->RxChannels[channel].Aggregator;
+			bytes = CPCI429_AGGREGATE_WINDOW_BYTES(aggregator->PublishedCount);
+			if (length - offset < bytes) {
+				break;
+			}
+
+			window = (PCPCI429_AGGREGATE_WINDOW)(buffer + offset);
+			window->Channel = channel;
+			window->Count = aggregator->PublishedCount;
+			window->WindowStart = aggregator->PublishedStart;
+			window->WindowEnd = aggregator->PublishedEnd;
+			window->WindowsMissed = aggregator->WindowsMissed;
+			RtlCopyMemory(window->Aggregates, aggregator->Published, aggregator->PublishedCount * sizeof(CPCI429_AGGREGATE));
+
+			DeviceContext->AggregateReady &= ~(1UL << channel);
+			offset += bytes;
+		}
+		DeviceContext->AggregateNext = (DeviceContext->AggregateNext + 1) % CPCI429_MAX_RX_CHANNELS;
+
+		KeReleaseSpinLock(&DeviceContext->AggregateLock, irql);
+
+		WdfRequestCompleteWithInformation(request, offset != 0 ? STATUS_SUCCESS : STATUS_BUFFER_TOO_SMALL, offset);
+	}
+}
+
+PAGGREGATOR
+CPCI429AggregateBeginDrain(
+	_In_ PRX_CHANNEL Channel
+)
+/*++
+
+Routine Description:
+
+    Takes the aggregator lock for a drain, at DISPATCH_LEVEL. Returns
+    NULL, without the lock, if aggregation was turned off meanwhile.
+
+--*/
+{
+	PAGGREGATOR aggregator = &Channel->Aggregator;
+
+	KeAcquireSpinLockAtDpcLevel(&aggregator->Lock);
+
+	if (aggregator->Window == 0) {
+		KeReleaseSpinLockFromDpcLevel(&aggregator->Lock);
+		return NULL;
+	}
+
+	return aggregator;
+}
+
+VOID
+CPCI429AggregateEndDrain(
+	_In_ PAGGREGATOR Aggregator
+)
+{
+	KeReleaseSpinLockFromDpcLevel(&Aggregator->Lock);
+}
+
+static
+VOID
+CPCI429AggregatePublish(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG Channel,
+	_Inout_ PAGGREGATOR Aggregator,
+	_In_ ULONGLONG Now
+)
+/*++
+
+Routine Description:
+
+    Ends the current window: publishes its aggregates and starts the
+    next one. Called with the aggregator lock held.
+
+--*/
+{
+	ULONG i;
+
+	KeAcquireSpinLockAtDpcLevel(&DeviceContext->AggregateLock);
+
+	for (i = 0; i < Aggregator->SlotCount; i++) {
+		PAGGREGATE_SLOT slot = &Aggregator->Slots[i];
+		PCPCI429_AGGREGATE aggregate = &Aggregator->Published[i];
+
+		aggregate->Label = Aggregator->Sources[i].Label;
+		aggregate->Sdi = Aggregator->Sources[i].Sdi;
+		aggregate->Reserved = 0;
+		aggregate->Count = slot->Count;
+		aggregate->Min = slot->Min;
+		aggregate->Max = slot->Max;
+		aggregate->Mean = slot->Count != 0 ? (LONG)(slot->Sum / (LONG64)slot->Count) : 0;
+		aggregate->Last = slot->Last;
+		aggregate->Sum = slot->Sum;
+		aggregate->LastWord = slot->LastWord;
+		aggregate->Reserved2 = 0;
+		aggregate->LastTime = slot->LastTime;
+
+		slot->Count = 0;
+		slot->Min = 0;
+		slot->Max = 0;
+		slot->Last = 0;
+		slot->Sum = 0;
+		slot->LastWord = 0;
+		slot->LastTime = 0;
+	}
+	Aggregator->PublishedCount = Aggregator->SlotCount;
+	Aggregator->PublishedStart = Aggregator->WindowStart;
+	Aggregator->PublishedEnd = Now;
+
+	if ((DeviceContext->AggregateReady & (1UL << Channel)) != 0) {
+		Aggregator->WindowsMissed++;
+	}
+	DeviceContext->AggregateReady |= 1UL << Channel;
+
+	KeReleaseSpinLockFromDpcLevel(&DeviceContext->AggregateLock);
+
+	Aggregator->WindowStart = Now;
+}
+
+VOID
+CPCI429AggregateTick(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONGLONG Now
+)
+/*++
+
+Routine Description:
+
+    Called by the health timer. Ends the windows that are due, so window
+    lengths are accurate to the timer period.
+
+--*/
+{
+	PAGGREGATOR aggregator;
+	BOOLEAN published = FALSE;
+	KIRQL irql;
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		aggregator = &DeviceContext->RxChannels[i].Aggregator;
+
+		if (aggregator->Window == 0) {
+			continue;
+		}
+
+		KeAcquireSpinLock(&aggregator->Lock, &irql);
+
+		if (aggregator->Window != 0 && Now - aggregator->WindowStart >= (ULONGLONG)aggregator->Window) {
+			CPCI429AggregatePublish(DeviceContext, i, aggregator, Now);
+			published = TRUE;
+		}
+
+		KeReleaseSpinLock(&aggregator->Lock, irql);
+	}
+
+	if (published) {
+		CPCI429AggregateDeliver(DeviceContext);
+	}
+}
+
+NTSTATUS
+CPCI429AggregateSetConfig(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SET_AGGREGATION from the sequential control
+    queue. Replaces the channel's sources and starts a fresh window; a
+    window in progress is discarded.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_AGGREGATE_CONFIG config;
+	PRX_CHANNEL channel;
+	PAGGREGATOR aggregator;
+	CPCI429_DECODE_ENTRY decode[CPCI429_MAX_AGGREGATES];
+	ULONG used[CPCI429_LABEL_SDI_COUNT / 32];
+	KIRQL irql;
+	ULONG i;
+	ULONG sdi;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_AGGREGATE_CONFIG), (PVOID*)&config, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (config->Channel >= CPCI429_MAX_RX_CHANNELS || config->SourceCount > CPCI429_MAX_AGGREGATES) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	//
+	// Every source must decode and no label and SDI may feed two of them.
+	//
+	RtlZeroMemory(used, sizeof(used));
+	for (i = 0; i < config->SourceCount; i++) {
+		PCPCI429_AGGREGATE_SOURCE source = &config->Sources[i];
+
+		if ((source->Sdi != CPCI429_SDI_ANY_SOURCE && source->Sdi > 3) ||
+			source->Encoding < CPCI429_ENCODING_BNR || source->Encoding > CPCI429_ENCODING_DISCRETE ||
+			!CPCI429DecodeInitEntry(&decode[i], source->Encoding, source->FirstBit, source->LastBit)) {
+			return STATUS_INVALID_PARAMETER;
+		}
+		for (sdi = 0; sdi < 4; sdi++) {
+			ULONG index = (sdi << 8) | source->Label;
+
+			if (source->Sdi != CPCI429_SDI_ANY_SOURCE && source->Sdi != sdi) {
+				continue;
+			}
+			if ((used[index >> 5] & (1UL << (index & 31))) != 0) {
+				return STATUS_INVALID_PARAMETER;
+			}
+			used[index >> 5] |= 1UL << (index & 31);
+		}
+	}
+
+	channel = &DeviceContext->RxChannels[config->Channel];
+	aggregator = &channel->Aggregator;
+
+	KeAcquireSpinLock(&channel->ConsumerLock, &irql);
+
+	//
+	// The ring lock keeps the label table from being freed under us.
+	//
+	if (channel->Labels == NULL) {
+		KeReleaseSpinLock(&channel->ConsumerLock, irql);
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	KeAcquireSpinLockAtDpcLevel(&aggregator->Lock);
+
+	for (i = 0; i < CPCI429_LABEL_SDI_COUNT; i++) {
+		channel->Labels[i].AggregateSlot = 0;
+	}
+	for (i = 0; i < config->SourceCount; i++) {
+		PCPCI429_AGGREGATE_SOURCE source = &config->Sources[i];
+
+		for (sdi = 0; sdi < 4; sdi++) {
+			if (source->Sdi == CPCI429_SDI_ANY_SOURCE || source->Sdi == sdi) {
+				channel->Labels[(sdi << 8) | source->Label].AggregateSlot = (USHORT)(i + 1);
+			}
+		}
+
+		aggregator->Sources[i] = *source;
+		RtlZeroMemory(&aggregator->Slots[i], sizeof(aggregator->Slots[i]));
+		aggregator->Slots[i].Decode = decode[i];
+	}
+	aggregator->SlotCount = config->SourceCount;
+	aggregator->WindowStart = KeQueryInterruptTime();
+	InterlockedExchange64(&aggregator->Window, config->SourceCount != 0 ? (LONG64)config->WindowMs * 10000 : 0);
+
+	KeAcquireSpinLockAtDpcLevel(&DeviceContext->AggregateLock);
+	aggregator->WindowsMissed = 0;
+	DeviceContext->AggregateReady &= ~(1UL << config->Channel);
+	KeReleaseSpinLockFromDpcLevel(&DeviceContext->AggregateLock);
+
+	KeReleaseSpinLockFromDpcLevel(&aggregator->Lock);
+	KeReleaseSpinLock(&channel->ConsumerLock, irql);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429AggregateWait(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Parks a CPCI429_IOCTL_WAIT_AGGREGATES request, then delivers any
+    window finished before it was parked.
+
+--*/
+{
+	NTSTATUS status;
+	PVOID buffer;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, CPCI429_AGGREGATE_WINDOW_BYTES(0), &buffer, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestForwardToIoQueue(Request, DeviceContext->AggregateWaitQueue);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	CPCI429AggregateDeliver(DeviceContext);
+}
@@ -0,0 +1,84 @@
+/*++
+
+Module Name:
+
+    aggregate.h
+
+Abstract:
+
+    This file contains the windowed aggregation definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+NTSTATUS
+CPCI429AggregateInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CPCI429AggregateRelease(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+NTSTATUS
+CPCI429AggregateSetConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+PAGGREGATOR
+CPCI429AggregateBeginDrain(
+    _In_ PRX_CHANNEL Channel
+    );
+
+VOID
+CPCI429AggregateEndDrain(
+    _In_ PAGGREGATOR Aggregator
+    );
+
+VOID
+CPCI429AggregateTick(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ ULONGLONG Now
+    );
+
+VOID
+CPCI429AggregateWait(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+//
+// Per-word accumulation for the receive path, between
+// CPCI429AggregateBeginDrain and CPCI429AggregateEndDrain. Integer only.
+//
+FORCEINLINE
+VOID
+CPCI429AggregateUpdate(
+    _Inout_ PAGGREGATE_SLOT Slot,
+    _In_ ULONG Word,
+    _In_ ULONGLONG Now
+    )
+{
+    LONG value = CPCI429DecodeRaw(&Slot->Decode, Word);
+
+    if (Slot->Count == 0 || value < Slot->Min) {
+        Slot->Min = value;
+    }
+    if (Slot->Count == 0 || value > Slot->Max) {
+        Slot->Max = value;
+    }
+    Slot->Count++;
+    Slot->Sum += value;
+    Slot->Last = value;
+    Slot->LastWord = Word;
+    Slot->LastTime = Now;
+}
+
+EXTERN_C_END
@@ -0,0 +1,461 @@
+/*++
+
+Module Name:
+
+    bulk.c
+
+Abstract:
+
+    This file contains the bulk transfer engine. It sends a caller's
+    buffer over one transmit channel as a sequence of handshaked blocks
+    and answers the peer's handshake words from the receive DPC, so no
+    user-mode round trip sits between a CTS or ACK and the next data
+    word. A periodic timer keeps the transmit FIFO topped up and resends
+    blocks whose answer does not arrive in time.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "bulk.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429BulkInitialize)
+#pragma alloc_text (PAGE, CPCI429BulkStop)
+#pragma alloc_text (PAGE, CPCI429EvtBulkWorkItem)
+#endif
+
+NTSTATUS
+CPCI429BulkInitialize(
+	_In_ WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_WORKITEM_CONFIG workItemConfig;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+	pDeviceContext->BulkTxChannel = CPCI429_CHANNEL_NONE;
+
+	//
+	// Like the self-test pump, the refill needs a real 1 ms period.
+	//
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, CPCI429EvtBulkTimer, CPCI429_BULK_TIMER_MS);
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDeviceContext->BulkTimer);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfTimerCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	WDF_WORKITEM_CONFIG_INIT(&workItemConfig, CPCI429EvtBulkWorkItem);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+
+	status = WdfWorkItemCreate(&workItemConfig, &attributes, &pDeviceContext->BulkWorkItem);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfWorkItemCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+	queueConfig.EvtIoCanceledOnQueue = CPCI429EvtBulkCanceled;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->BulkQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+	}
+
+	return status;
+}
+
+static
+NTSTATUS
+CPCI429BulkStatus(
+	_In_ BULK_OUTCOME Outcome
+)
+{
+	switch (Outcome) {
+	case BulkDelivered:
+		return STATUS_SUCCESS;
+	case BulkTimedOut:
+		return STATUS_IO_TIMEOUT;
+	case BulkRejected:
+		return STATUS_DEVICE_DATA_ERROR;
+	case BulkPeerAborted:
+		return STATUS_REQUEST_ABORTED;
+	case BulkDeviceGone:
+		return STATUS_DEVICE_NOT_READY;
+	default:
+		return STATUS_CANCELLED;
+	}
+}
+
+static
+VOID
+CPCI429BulkComplete(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request,
+	_In_ NTSTATUS Status,
+	_In_ ULONGLONG Information
+)
+/*++
+
+Routine Description:
+
+    Completes the transfer request and frees the transmit channel for the
+    next one. Called only once the engine no longer touches the buffer.
+
+--*/
+{
+	WdfRequestCompleteWithInformation(Request, Status, (ULONG_PTR)Information);
+	InterlockedExchange((volatile LONG*)&DeviceContext->BulkTxChannel, (LONG)CPCI429_CHANNEL_NONE);
+}
+
+static
+VOID
+CPCI429BulkFinishLater(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+	if (InterlockedCompareExchange(&DeviceContext->BulkFinishing, 1, 0) == 0) {
+		WdfWorkItemEnqueue(DeviceContext->BulkWorkItem);
+	}
+}
+
+static
+VOID
+CPCI429BulkPump(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_Inout_ PBULK_TRANSFER Bulk,
+	_In_ ULONGLONG Now
+)
+/*++
+
+Routine Description:
+
+    Advances the sender as far as the transmit FIFO and the handshake
+    allow. Called with the transfer's lock held.
+
+--*/
+{
+	ULONG base = CPCI429_TX_CHANNEL_BASE(Bulk->Sender.TxChannel);
+	ULONG word;
+
+	while (CPCI429BulkNextWord(&Bulk->Sender, Now, &word)) {
+		if (CPCI429ReadRegister(DeviceContext, base + CPCI429_CH_FIFO_STATUS) & CPCI429_FIFO_FULL) {
+			return;
+		}
+		CPCI429WriteRegister(DeviceContext, base + CPCI429_CH_FIFO_DATA, word);
+		CPCI429BulkWordSent(&Bulk->Sender, Now);
+	}
+}
+
+VOID
+CPCI429BulkStart(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_BULK_TRANSFER from the transmit queue. Claims
+    the transmit channel, parks the request and sends the first RTS. One
+    transfer runs at a time.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_BULK_CONFIG config;
+	PVOID data;
+	size_t length;
+	PBULK_TRANSFER bulk;
+	LARGE_INTEGER frequency;
+	ULONGLONG start;
+	ULONG base;
+	ULONG control;
+	KIRQL irql;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_BULK_CONFIG), (PVOID*)&config, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request, 1, &data, &length);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+	if (!CPCI429BulkValidConfig(config)) {
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return;
+	}
+	if (DeviceContext->BAR0_VirtualAddress == NULL) {
+		WdfRequestComplete(Request, STATUS_DEVICE_NOT_READY);
+		return;
+	}
+	if (InterlockedCompareExchange((volatile LONG*)&DeviceContext->BulkTxChannel,
+		(LONG)config->TxChannel, (LONG)CPCI429_CHANNEL_NONE) != (LONG)CPCI429_CHANNEL_NONE) {
+		WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+		return;
+	}
+
+	bulk = (PBULK_TRANSFER)CPCI429PoolAllocate(&DeviceContext->Pools[CPCI429_POOL_CONTEXTS]);
+	if (bulk == NULL) {
+		InterlockedExchange((volatile LONG*)&DeviceContext->BulkTxChannel, (LONG)CPCI429_CHANNEL_NONE);
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return;
+	}
+	RtlZeroMemory(bulk, sizeof(BULK_TRANSFER));
+
+	start = (ULONGLONG)KeQueryPerformanceCounter(&frequency).QuadPart;
+	CPCI429BulkBegin(&bulk->Sender, config, (const UCHAR*)data, length, start, (ULONGLONG)frequency.QuadPart);
+	KeInitializeSpinLock(&bulk->Lock);
+
+	base = CPCI429_TX_CHANNEL_BASE(config->TxChannel);
+	bulk->SavedTxControl = CPCI429ReadRegister(DeviceContext, base + CPCI429_CH_CONTROL);
+
+	control = CPCI429_CTRL_ENABLE | CPCI429_CTRL_ODD_PARITY;
+	if (config->Speed == CPCI429_SPEED_HIGH) {
+		control |= CPCI429_CTRL_HIGH_SPEED;
+	}
+	CPCI429WriteRegister(DeviceContext, base + CPCI429_CH_CONTROL, control);
+
+	DeviceContext->BulkCanceledRequest = NULL;
+	DeviceContext->BulkCanceled = FALSE;
+	DeviceContext->BulkAborted = FALSE;
+
+	status = WdfRequestForwardToIoQueue(Request, DeviceContext->BulkQueue);
+	if (!NT_SUCCESS(status)) {
+		CPCI429WriteRegister(DeviceContext, base + CPCI429_CH_CONTROL, bulk->SavedTxControl);
+		CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_CONTEXTS], bulk);
+		InterlockedExchange((volatile LONG*)&DeviceContext->BulkTxChannel, (LONG)CPCI429_CHANNEL_NONE);
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&DeviceContext->Bulk, bulk);
+
+	KeAcquireSpinLock(&bulk->Lock, &irql);
+	CPCI429BulkPump(DeviceContext, bulk, (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart);
+	KeReleaseSpinLock(&bulk->Lock, irql);
+
+	WdfTimerStart(DeviceContext->BulkTimer, WDF_REL_TIMEOUT_IN_MS(CPCI429_BULK_TIMER_MS));
+}
+
+BOOLEAN
+CPCI429BulkReceive(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PBULK_TRANSFER Bulk,
+	_In_ ULONG Channel,
+	_In_ ULONG Word
+)
+/*++
+
+Routine Description:
+
+    Called by the receive DPC for every word while a transfer runs.
+    Handshake words from the peer advance the sender at once.
+
+Return Value:
+
+    TRUE if the word was a handshake word for the transfer.
+
+--*/
+{
+	ULONGLONG now;
+	BOOLEAN finished;
+
+	if (Channel != Bulk->Sender.RxChannel || CPCI429_WORD_LABEL(Word) != Bulk->Sender.ControlLabel) {
+		return FALSE;
+	}
+
+	now = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+	KeAcquireSpinLockAtDpcLevel(&Bulk->Lock);
+
+	CPCI429BulkAnswer(&Bulk->Sender, Channel, Word, now);
+	CPCI429BulkPump(DeviceContext, Bulk, now);
+	finished = Bulk->Sender.State == BulkDone;
+
+	KeReleaseSpinLockFromDpcLevel(&Bulk->Lock);
+
+	if (finished) {
+		CPCI429BulkFinishLater(DeviceContext);
+	}
+
+	return TRUE;
+}
+
+VOID
+CPCI429EvtBulkTimer(
+	_In_ WDFTIMER Timer
+)
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	PBULK_TRANSFER bulk = pDeviceContext->Bulk;
+	ULONGLONG now;
+	BOOLEAN finished;
+
+	if (bulk == NULL || pDeviceContext->BulkFinishing != 0) {
+		return;
+	}
+
+	now = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+	KeAcquireSpinLockAtDpcLevel(&bulk->Lock);
+
+	if (pDeviceContext->BulkCanceled && bulk->Sender.State != BulkDone) {
+		CPCI429BulkEnd(&bulk->Sender, BulkCanceled, now);
+	}
+	CPCI429BulkPump(pDeviceContext, bulk, now);
+	finished = bulk->Sender.State == BulkDone;
+
+	KeReleaseSpinLockFromDpcLevel(&bulk->Lock);
+
+	if (finished) {
+		CPCI429BulkFinishLater(pDeviceContext);
+	}
+}
+
+VOID
+CPCI429EvtBulkWorkItem(
+	_In_ WDFWORKITEM WorkItem
+)
+/*++
+
+Routine Description:
+
+    Ends the transfer: stops the timer, waits out the receive DPCs,
+    restores the transmit channel, records the status and completes the
+    request, whether it is still queued or was canceled off the queue.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfWorkItemGetParentObject(WorkItem));
+	PBULK_TRANSFER bulk = pDeviceContext->Bulk;
+	PCPCI429_BULK_STATUS result;
+	WDFREQUEST request;
+
+	PAGED_CODE();
+
+	WdfTimerStop(pDeviceContext->BulkTimer, TRUE);
+
+	InterlockedExchangePointer((PVOID volatile*)&pDeviceContext->Bulk, NULL);
+	KeFlushQueuedDpcs();
+
+	if (bulk == NULL) {
+		InterlockedExchange(&pDeviceContext->BulkFinishing, 0);
+		return;
+	}
+	if (bulk->Sender.State != BulkDone) {
+		CPCI429BulkEnd(&bulk->Sender, pDeviceContext->BulkAborted ? BulkDeviceGone : BulkCanceled,
+			(ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart);
+	}
+
+	CPCI429WriteRegister(pDeviceContext, CPCI429_TX_CHANNEL_BASE(bulk->Sender.TxChannel) + CPCI429_CH_CONTROL,
+		bulk->SavedTxControl);
+
+	result = &pDeviceContext->BulkStatus;
+	CPCI429BulkResults(&bulk->Sender, result);
+	result->Status = CPCI429BulkStatus(bulk->Sender.Outcome);
+
+	CPCI429PoolFree(&pDeviceContext->Pools[CPCI429_POOL_CONTEXTS], bulk);
+	InterlockedExchange(&pDeviceContext->BulkFinishing, 0);
+
+	if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(pDeviceContext->BulkQueue, &request))) {
+		CPCI429BulkComplete(pDeviceContext, request, result->Status, result->BytesDelivered);
+		return;
+	}
+
+	//
+	// Canceled off the queue. If its cancel callback has not run yet, it
+	// finds the marker and completes the request itself.
+	//
+	request = (WDFREQUEST)InterlockedExchangePointer((PVOID volatile*)&pDeviceContext->BulkCanceledRequest,
+		CPCI429_BULK_REQUEST_ENDED);
+	if (request != NULL) {
+		CPCI429BulkComplete(pDeviceContext, request, STATUS_CANCELLED, result->BytesDelivered);
+	}
+}
+
+VOID
+CPCI429EvtBulkCanceled(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request
+)
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+
+	//
+	// The engine may still be reading the request's buffer, so only the
+	// work item, once it has stopped the engine, completes the request.
+	//
+	if (InterlockedCompareExchangePointer((PVOID volatile*)&pDeviceContext->BulkCanceledRequest,
+		Request, NULL) == CPCI429_BULK_REQUEST_ENDED) {
+		CPCI429BulkComplete(pDeviceContext, Request, STATUS_CANCELLED, pDeviceContext->BulkStatus.BytesDelivered);
+		return;
+	}
+
+	pDeviceContext->BulkCanceled = TRUE;
+	CPCI429BulkFinishLater(pDeviceContext);
+}
+
+VOID
+CPCI429BulkStop(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Ends a running transfer early because the device is leaving D0.
+
+--*/
+{
+	PAGED_CODE();
+
+	if (DeviceContext->Bulk == NULL) {
+		return;
+	}
+
+	DeviceContext->BulkAborted = TRUE;
+	WdfTimerStop(DeviceContext->BulkTimer, TRUE);
+
+	if (InterlockedCompareExchange(&DeviceContext->BulkFinishing, 1, 0) == 0) {
+		CPCI429EvtBulkWorkItem(DeviceContext->BulkWorkItem);
+	}
+
+	WdfWorkItemFlush(DeviceContext->BulkWorkItem);
+}
+
+VOID
+CPCI429BulkCompleteStatus(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_BULK_STATUS bulkStatus;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_BULK_STATUS), (PVOID*)&bulkStatus, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	*bulkStatus = DeviceContext->BulkStatus;
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_BULK_STATUS));
+}
@@ -0,0 +1,73 @@
+/*++
+
+Module Name:
+
+    bulk.h
+
+Abstract:
+
+    This file contains the bulk transfer engine definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+#define CPCI429_BULK_TIMER_MS       1
+
+//
+// Left in BulkCanceledRequest by a work item that found the request
+// already taken off the queue by a cancel that has not been seen yet.
+//
+#define CPCI429_BULK_REQUEST_ENDED ((WDFREQUEST)(ULONG_PTR)1)
+
+//
+// One running transfer. The sender, on the performance counter, is
+// guarded by Lock; the pump timer and the receive DPC both drive it.
+//
+typedef struct _BULK_TRANSFER
+{
+	ULONG SavedTxControl;
+	KSPIN_LOCK Lock;
+	BULK_SENDER Sender;
+
+} BULK_TRANSFER, *PBULK_TRANSFER;
+
+NTSTATUS
+CPCI429BulkInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CPCI429BulkStart(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429BulkStop(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+BOOLEAN
+CPCI429BulkReceive(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ PBULK_TRANSFER Bulk,
+    _In_ ULONG Channel,
+    _In_ ULONG Word
+    );
+
+VOID
+CPCI429BulkCompleteStatus(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+EVT_WDF_TIMER CPCI429EvtBulkTimer;
+EVT_WDF_WORKITEM CPCI429EvtBulkWorkItem;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE CPCI429EvtBulkCanceled;
+
+EXTERN_C_END
@@ -0,0 +1,304 @@
+/*++
+
+Module Name:
+
+    bulksender.h
+
+Abstract:
+
+    The sending side of the bulk block transfer protocol, shared by the
+    driver's bulk engine and the Linux user-mode backend. Each side keeps
+    its own locking, clock and completion and drives the state machine as
+
+        while CPCI429BulkNextWord
+            write the word to the transmit FIFO, stop if it is full
+            CPCI429BulkWordSent
+
+    from its pump, and hands every word of the answer channel to
+    CPCI429BulkAnswer before pumping again. Times are in ticks of the
+    side's clock, TickFrequency per second.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _BULKSENDER_H
+#define _BULKSENDER_H
+
+#include "RxPath.h"
+
+#define CPCI429_BULK_DEFAULT_BLOCK      1024
+#define CPCI429_BULK_DEFAULT_TIMEOUT_MS 1000
+#define CPCI429_BULK_WORD_BITS          36      // 32 data bits and the 4-bit gap
+
+typedef enum _BULK_STATE
+{
+	BulkSendRts,
+	BulkWaitCts,
+	BulkSendData,
+	BulkWaitAck,
+	BulkDone
+
+} BULK_STATE;
+
+//
+// Why a transfer ended. Each side maps this to its own status code.
+//
+typedef enum _BULK_OUTCOME
+{
+	BulkRunning,
+	BulkDelivered,
+	BulkTimedOut,               // MaxRetries handshakes went unanswered
+	BulkRejected,               // MaxRetries NAKs for one block
+	BulkPeerAborted,
+	BulkCanceled,
+	BulkDeviceGone
+
+} BULK_OUTCOME;
+
+typedef struct _BULK_SENDER
+{
+	const UCHAR* Data;
+	ULONGLONG Length;
+	ULONG TxChannel;
+	ULONG RxChannel;
+	ULONG DataLabel;
+	ULONG ControlLabel;
+	ULONG BlockWords;
+	ULONG MaxRetries;
+	ULONG Speed;                // bits per second
+	ULONGLONG Timeout;          // ticks
+	ULONGLONG TickFrequency;
+	ULONGLONG Start;
+	ULONGLONG Stopped;
+
+	BULK_STATE State;
+	BULK_OUTCOME Outcome;
+	ULONGLONG Offset;           // first byte of the current block
+	ULONG Block;
+	ULONG BlockCount;           // words in the current block
+	ULONG WordIndex;            // next word of the current block to send
+	ULONG Retries;
+	ULONGLONG Deadline;         // when the awaited answer is due
+	CPCI429_BULK_STATUS Result;
+
+} BULK_SENDER, *PBULK_SENDER;
+
+//
+// TRUE if Config describes a transfer that can be started.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429BulkValidConfig(
+	_In_ const CPCI429_BULK_CONFIG *Config
+)
+{
+	return Config->TxChannel < CPCI429_MAX_TX_CHANNELS && Config->RxChannel < CPCI429_MAX_RX_CHANNELS &&
+		Config->BlockWords <= CPCI429_BULK_MAX_BLOCK_WORDS;
+}
+
+//
+// Starts sending Length bytes of Data, at least one, at Start. Sender
+// must be zeroed.
+//
+FORCEINLINE
+VOID
+CPCI429BulkBegin(
+	_Inout_ PBULK_SENDER Sender,
+	_In_ const CPCI429_BULK_CONFIG *Config,
+	_In_ const UCHAR* Data,
+	_In_ ULONGLONG Length,
+	_In_ ULONGLONG Start,
+	_In_ ULONGLONG TickFrequency
+)
+{
+	Sender->Data = Data;
+	Sender->Length = Length;
+	Sender->TxChannel = Config->TxChannel;
+	Sender->RxChannel = Config->RxChannel;
+	Sender->DataLabel = Config->DataLabel;
+	Sender->ControlLabel = Config->ControlLabel;
+	Sender->BlockWords = Config->BlockWords != 0 ? Config->BlockWords : CPCI429_BULK_DEFAULT_BLOCK;
+	Sender->MaxRetries = Config->MaxRetries;
+	Sender->Speed = Config->Speed == CPCI429_SPEED_HIGH ? 100000 : 12500;
+	Sender->Timeout = TickFrequency *
+		(Config->TimeoutMs != 0 ? Config->TimeoutMs : CPCI429_BULK_DEFAULT_TIMEOUT_MS) / 1000;
+	Sender->TickFrequency = TickFrequency;
+	Sender->Start = Start;
+	Sender->State = BulkSendRts;
+	Sender->Outcome = BulkRunning;
+}
+
+FORCEINLINE
+VOID
+CPCI429BulkEnd(
+	_Inout_ PBULK_SENDER Sender,
+	_In_ BULK_OUTCOME Outcome,
+	_In_ ULONGLONG Now
+)
+{
+	Sender->State = BulkDone;
+	Sender->Outcome = Outcome;
+	Sender->Stopped = Now;
+}
+
+//
+// The next word to queue, with odd parity. Resends the block or gives
+// up once an answer is overdue. Returns FALSE while the sender waits.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429BulkNextWord(
+	_Inout_ PBULK_SENDER Sender,
+	_In_ ULONGLONG Now,
+	_Out_ PULONG Word
+)
+{
+	ULONGLONG position;
+	ULONG word;
+
+	for (;;) {
+		switch (Sender->State) {
+		case BulkSendRts:
+			Sender->BlockCount = (ULONG)((Sender->Length - Sender->Offset + 1) / 2 < Sender->BlockWords ?
+				(Sender->Length - Sender->Offset + 1) / 2 : Sender->BlockWords);
+			word = CPCI429_BULK_CONTROL_WORD(Sender->ControlLabel, CPCI429_BULK_RTS, Sender->BlockCount);
+			break;
+
+		case BulkSendData:
+			position = Sender->Offset + 2 * (ULONGLONG)Sender->WordIndex;
+			word = Sender->Data[position];
+			if (position + 1 < Sender->Length) {
+				word |= (ULONG)Sender->Data[position + 1] << 8;
+			}
+			word = CPCI429_BULK_DATA_WORD(Sender->DataLabel, Sender->WordIndex, word);
+			break;
+
+		case BulkWaitCts:
+		case BulkWaitAck:
+			if (Now < Sender->Deadline) {
+				return FALSE;
+			}
+			Sender->Result.Timeouts++;
+			if (++Sender->Retries > Sender->MaxRetries) {
+				CPCI429BulkEnd(Sender, BulkTimedOut, Now);
+				return FALSE;
+			}
+			Sender->Result.Retransmits++;
+			Sender->State = BulkSendRts;
+			continue;
+
+		default:
+			return FALSE;
+		}
+
+		*Word = CPCI429OddParity(word) ? word : word | 0x80000000;
+		return TRUE;
+	}
+}
+
+//
+// The word from CPCI429BulkNextWord is in the transmit FIFO.
+//
+FORCEINLINE
+VOID
+CPCI429BulkWordSent(
+	_Inout_ PBULK_SENDER Sender,
+	_In_ ULONGLONG Now
+)
+{
+	Sender->Result.WordsSent++;
+
+	if (Sender->State == BulkSendRts) {
+		Sender->State = BulkWaitCts;
+		Sender->Deadline = Now + Sender->Timeout;
+	} else if (Sender->State == BulkSendData && ++Sender->WordIndex == Sender->BlockCount) {
+		//
+		// The block may still be queued in the FIFO; the answer is not
+		// due before the line has sent it.
+		//
+		Sender->State = BulkWaitAck;
+		Sender->Deadline = Now + Sender->Timeout +
+			(ULONGLONG)Sender->BlockCount * CPCI429_BULK_WORD_BITS * Sender->TickFrequency / Sender->Speed;
+	}
+}
+
+//
+// Handles one word drained from receive channel Channel. Returns TRUE if
+// it was a handshake word for the transfer, which is not queued.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429BulkAnswer(
+	_Inout_ PBULK_SENDER Sender,
+	_In_ ULONG Channel,
+	_In_ ULONG Word,
+	_In_ ULONGLONG Now
+)
+{
+	ULONG type = CPCI429_BULK_TYPE(Word);
+	ULONG value = CPCI429_BULK_VALUE(Word);
+	ULONG block = Sender->Block & 0x7FFF;
+
+	if (Channel != Sender->RxChannel || CPCI429_WORD_LABEL(Word) != Sender->ControlLabel) {
+		return FALSE;
+	}
+
+	if (type == CPCI429_BULK_CTS && Sender->State == BulkWaitCts && value == block) {
+		Sender->State = BulkSendData;
+		Sender->WordIndex = 0;
+	} else if (type == CPCI429_BULK_ACK && Sender->State == BulkWaitAck && value == block) {
+		Sender->Offset += 2 * (ULONGLONG)Sender->BlockCount;
+		if (Sender->Offset > Sender->Length) {
+			Sender->Offset = Sender->Length;
+		}
+		Sender->Block++;
+		Sender->Result.Blocks++;
+		Sender->Retries = 0;
+		if (Sender->Offset == Sender->Length) {
+			CPCI429BulkEnd(Sender, BulkDelivered, Now);
+		} else {
+			Sender->State = BulkSendRts;
+		}
+	} else if (type == CPCI429_BULK_NAK && Sender->State == BulkWaitAck && value == block) {
+		if (++Sender->Retries > Sender->MaxRetries) {
+			CPCI429BulkEnd(Sender, BulkRejected, Now);
+		} else {
+			Sender->Result.Retransmits++;
+			Sender->State = BulkSendRts;
+		}
+	} else if (type == CPCI429_BULK_ABORT && Sender->State != BulkDone) {
+		CPCI429BulkEnd(Sender, BulkPeerAborted, Now);
+	} else {
+		Sender->Result.UnexpectedWords++;
+	}
+
+	return TRUE;
+}
+
+//
+// Fills in the results of an ended transfer. Status is left to the
+// caller.
+//
+FORCEINLINE
+VOID
+CPCI429BulkResults(
+	_In_ const BULK_SENDER *Sender,
+	_Out_ PCPCI429_BULK_STATUS Result
+)
+{
+	ULONGLONG elapsed = Sender->Stopped - Sender->Start;
+	ULONGLONG lineBits = elapsed * Sender->Speed / Sender->TickFrequency;
+
+	*Result = Sender->Result;
+	Result->BytesDelivered = Sender->Offset;
+	Result->Elapsed = elapsed;
+	Result->TickFrequency = Sender->TickFrequency;
+	Result->BytesPerSecond = elapsed != 0 ? Sender->Offset * Sender->TickFrequency / elapsed : 0;
+	Result->LineUtilization = lineBits != 0 ?
+		(ULONG)(Result->WordsSent * CPCI429_BULK_WORD_BITS * 10000 / lineBits) : 0;
+}
+
+#endif // _BULKSENDER_H
@@ -0,0 +1,724 @@
+/*++
+
+Module Name:
+
+    capture.h
+
+Abstract:
+
+    Compressed capture format for recorded ARINC 429 traffic, shared by
+    the driver and applications.
+
+    Records are encoded in independent chunks. Within a chunk each
+    record costs:
+
+        timestamp   delta-of-delta, zigzag; 1 bit when the spacing is
+                    unchanged, otherwise 2 width bits and 8-64 value bits
+        channel     1 bit when unchanged, otherwise 3 bits
+        flags       1 bit when zero, otherwise 8 bits
+        label, SDI  10 bits
+        data, SSM,  XOR against the previous word of the same channel,
+        parity      label and SDI; 1 bit when unchanged, otherwise the
+                    trailing-zero count, length and the changed bits
+
+    so a repeating label costs about two bytes instead of sixteen. All
+    prediction state starts from zero in every chunk. The chunk header
+    carries the time range and the labels present, which lets a reader
+    skip chunks without decoding them.
+
+    The chunk encoder and decoder are integer only and usable in the
+    driver, but their prediction state holds a word for every channel,
+    label and SDI, 32 KB, so the driver must allocate encoders and
+    decoders from nonpaged pool rather than on the stack. The file layer
+    is for user mode:
+
+        CPCI429_CAPTURE_FILE_HEADER
+        chunk ...
+        CPCI429_CAPTURE_INDEX_ENTRY[ChunkCount]
+        CPCI429_CAPTURE_TRAILER
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include "Public.h"
+
+#ifndef _KERNEL_MODE
+#include <string.h>
+#endif
+
+#define CPCI429_CAPTURE_CHUNK_MAGIC 0x4B433934  // "49CK"
+#define CPCI429_CAPTURE_CHUNK_BYTES 65536       // default chunk buffer size
+#define CPCI429_CAPTURE_RECORD_BYTES 16         // worst case for one encoded record
+
+//
+// One captured word. Flags holds the low bits of the CPCI429_RX_FLAG_*
+// value of the record.
+//
+typedef struct _CPCI429_CAPTURE_RECORD {
+	ULONG Word;
+	UCHAR Channel;
+	UCHAR Flags;
+	USHORT Reserved;
+	ULONGLONG Timestamp;
+} CPCI429_CAPTURE_RECORD, *PCPCI429_CAPTURE_RECORD;
+
+//
+// Chunk header, followed by the little-endian bit stream. Bytes covers
+// both.
+//
+typedef struct _CPCI429_CAPTURE_CHUNK {
+	ULONG Magic;
+	ULONG Bytes;
+	ULONG Count;
+	ULONG ChannelMask;
+	ULONGLONG FirstTime;
+	ULONGLONG LastTime;
+	ULONG LabelMask[8];         // bit n: label n occurs in the chunk
+} CPCI429_CAPTURE_CHUNK, *PCPCI429_CAPTURE_CHUNK;
+
+//
+// Prediction state, shared by the encoder and the decoder. At 32 KB it
+// is too large for a kernel stack.
+//
+typedef struct _CPCI429_CAPTURE_STATE {
+	ULONGLONG PrevTime;
+	LONGLONG PrevDelta;
+	ULONG PrevChannel;
+	ULONG Prev[CPCI429_MAX_RX_CHANNELS][CPCI429_LABEL_SDI_COUNT];
+} CPCI429_CAPTURE_STATE, *PCPCI429_CAPTURE_STATE;
+
+typedef struct _CPCI429_CAPTURE_ENCODER {
+	PCPCI429_CAPTURE_CHUNK Chunk;
+	ULONG Capacity;
+	ULONG Offset;               // stream bytes written
+	ULONGLONG Bits;
+	ULONG BitCount;
+	CPCI429_CAPTURE_STATE State;
+} CPCI429_CAPTURE_ENCODER, *PCPCI429_CAPTURE_ENCODER;
+
+typedef struct _CPCI429_CAPTURE_DECODER {
+	const UCHAR *Stream;
+	ULONG Length;
+	ULONG Offset;
+	ULONGLONG Bits;
+	ULONG BitCount;
+	CPCI429_CAPTURE_STATE State;
+} CPCI429_CAPTURE_DECODER, *PCPCI429_CAPTURE_DECODER;
+
+static __inline
+VOID
+CPCI429CapturePutBits(
+	_Inout_ PCPCI429_CAPTURE_ENCODER Encoder,
+	_In_ ULONG Value,
+	_In_ ULONG Count
+)
+{
+	Encoder->Bits |= (ULONGLONG)Value << Encoder->BitCount;
+	Encoder->BitCount += Count;
+
+	if (Encoder->BitCount >= 32) {
+		PUCHAR out = (PUCHAR)(Encoder->Chunk + 1) + Encoder->Offset;
+
+		out[0] = (UCHAR)Encoder->Bits;
+		out[1] = (UCHAR)(Encoder->Bits >> 8);
+		out[2] = (UCHAR)(Encoder->Bits >> 16);
+		out[3] = (UCHAR)(Encoder->Bits >> 24);
+		Encoder->Offset += 4;
+		Encoder->Bits >>= 32;
+		Encoder->BitCount -= 32;
+	}
+}
+
+static __inline
+BOOLEAN
+CPCI429CaptureGetBits(
+	_Inout_ PCPCI429_CAPTURE_DECODER Decoder,
+	_In_ ULONG Count,
+	_Out_ PULONG Value
+)
+{
+	if (Decoder->BitCount < Count) {
+		while (Decoder->BitCount <= 56 && Decoder->Offset < Decoder->Length) {
+			Decoder->Bits |= (ULONGLONG)Decoder->Stream[Decoder->Offset++] << Decoder->BitCount;
+			Decoder->BitCount += 8;
+		}
+		if (Decoder->BitCount < Count) {
+			return FALSE;
+		}
+	}
+
+	*Value = (ULONG)(Decoder->Bits & (((ULONGLONG)1 << Count) - 1));
+	Decoder->Bits >>= Count;
+	Decoder->BitCount -= Count;
+
+	return TRUE;
+}
+
+//
+// Starts a chunk in Buffer, which must hold at least the header and one
+// record.
+//
+static __inline
+VOID
+CPCI429CaptureEncodeBegin(
+	_Out_ PCPCI429_CAPTURE_ENCODER Encoder,
+	_Out_writes_bytes_(Capacity) PVOID Buffer,
+	_In_ ULONG Capacity
+)
+{
+	memset(Encoder, 0, sizeof(*Encoder));
+	Encoder->Chunk = (PCPCI429_CAPTURE_CHUNK)Buffer;
+	Encoder->Capacity = Capacity - sizeof(CPCI429_CAPTURE_CHUNK);
+	memset(Encoder->Chunk, 0, sizeof(CPCI429_CAPTURE_CHUNK));
+	Encoder->Chunk->Magic = CPCI429_CAPTURE_CHUNK_MAGIC;
+}
+
+//
+// Appends one record. Returns FALSE, without encoding it, when the chunk
+// is full; the caller then ends the chunk and starts the next one.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureEncode(
+	_Inout_ PCPCI429_CAPTURE_ENCODER Encoder,
+	_In_ const CPCI429_CAPTURE_RECORD *Record
+)
+{
+	PCPCI429_CAPTURE_CHUNK chunk = Encoder->Chunk;
+	PCPCI429_CAPTURE_STATE state = &Encoder->State;
+	ULONG channel = Record->Channel & (CPCI429_MAX_RX_CHANNELS - 1);
+	ULONG index = CPCI429_LABEL_SDI_INDEX(Record->Word);
+	ULONG change;
+	LONGLONG delta;
+	ULONGLONG zigzag;
+	ULONG width;
+	ULONG label;
+
+	if (Encoder->Offset + 4 + CPCI429_CAPTURE_RECORD_BYTES > Encoder->Capacity) {
+		return FALSE;
+	}
+
+	if (chunk->Count == 0) {
+		chunk->FirstTime = Record->Timestamp;
+		state->PrevTime = Record->Timestamp;
+	}
+
+	delta = (LONGLONG)(Record->Timestamp - state->PrevTime);
+	zigzag = (ULONGLONG)(((delta - state->PrevDelta) << 1) ^ ((delta - state->PrevDelta) >> 63));
+	state->PrevTime = Record->Timestamp;
+	state->PrevDelta = delta;
+
+	if (zigzag == 0) {
+		CPCI429CapturePutBits(Encoder, 0, 1);
+	} else {
+		width = zigzag < 0x100 ? 0 : zigzag < 0x10000 ? 1 : zigzag < 0x100000000ULL ? 2 : 3;
+		CPCI429CapturePutBits(Encoder, 1 | (width << 1), 3);
+		if (width == 3) {
+			CPCI429CapturePutBits(Encoder, (ULONG)zigzag, 32);
+			CPCI429CapturePutBits(Encoder, (ULONG)(zigzag >> 32), 32);
+		} else {
+			CPCI429CapturePutBits(Encoder, (ULONG)zigzag, 8 << width);
+		}
+	}
+
+	if (channel == state->PrevChannel) {
+		CPCI429CapturePutBits(Encoder, 0, 1);
+	} else {
+		CPCI429CapturePutBits(Encoder, 1 | (channel << 1), 4);
+		state->PrevChannel = channel;
+	}
+
+	if (Record->Flags == 0) {
+		CPCI429CapturePutBits(Encoder, 0, 1);
+	} else {
+		CPCI429CapturePutBits(Encoder, 1 | ((ULONG)Record->Flags << 1), 9);
+	}
+
+	CPCI429CapturePutBits(Encoder, index, 10);
+
+	change = (Record->Word ^ state->Prev[channel][index]) >> 10;
+	state->Prev[channel][index] = Record->Word;
+
+	if (change == 0) {
+		CPCI429CapturePutBits(Encoder, 0, 1);
+	} else {
+		ULONG trailing;
+		ULONG highest;
+
+		_BitScanForward(&trailing, change);
+		_BitScanReverse(&highest, change);
+		width = highest - trailing + 1;
+
+		CPCI429CapturePutBits(Encoder, 1 | (trailing << 1) | ((width - 1) << 6), 11);
+		CPCI429CapturePutBits(Encoder, change >> trailing, width);
+	}
+
+	label = CPCI429_WORD_LABEL(Record->Word);
+	chunk->LabelMask[label >> 5] |= 1UL << (label & 31);
+	chunk->ChannelMask |= 1UL << channel;
+	chunk->LastTime = Record->Timestamp;
+	chunk->Count++;
+
+	return TRUE;
+}
+
+//
+// Flushes the stream and completes the header. Returns the chunk size in
+// bytes.
+//
+static __inline
+ULONG
+CPCI429CaptureEncodeEnd(
+	_Inout_ PCPCI429_CAPTURE_ENCODER Encoder
+)
+{
+	if (Encoder->BitCount != 0) {
+		CPCI429CapturePutBits(Encoder, 0, 32 - Encoder->BitCount);
+	}
+
+	Encoder->Chunk->Bytes = sizeof(CPCI429_CAPTURE_CHUNK) + Encoder->Offset;
+
+	return Encoder->Chunk->Bytes;
+}
+
+//
+// Decodes a whole chunk into Records, which must hold Chunk->Count
+// entries. Returns FALSE if the chunk is malformed.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureDecode(
+	_Out_ PCPCI429_CAPTURE_DECODER Decoder,
+	_In_reads_bytes_(Bytes) const CPCI429_CAPTURE_CHUNK *Chunk,
+	_In_ ULONG Bytes,
+	_Out_writes_(Chunk->Count) PCPCI429_CAPTURE_RECORD Records
+)
+{
+	PCPCI429_CAPTURE_STATE state = &Decoder->State;
+	ULONG i;
+
+	if (Bytes < sizeof(CPCI429_CAPTURE_CHUNK) || Chunk->Magic != CPCI429_CAPTURE_CHUNK_MAGIC ||
+		Chunk->Bytes < sizeof(CPCI429_CAPTURE_CHUNK) || Chunk->Bytes > Bytes) {
+		return FALSE;
+	}
+
+	memset(Decoder, 0, sizeof(*Decoder));
+	Decoder->Stream = (const UCHAR*)(Chunk + 1);
+	Decoder->Length = Chunk->Bytes - sizeof(CPCI429_CAPTURE_CHUNK);
+	state->PrevTime = Chunk->FirstTime;
+
+	for (i = 0; i < Chunk->Count; i++) {
+		ULONG value;
+		ULONG high;
+		ULONG index;
+		ULONGLONG zigzag = 0;
+
+		if (!CPCI429CaptureGetBits(Decoder, 1, &value)) {
+			return FALSE;
+		}
+		if (value != 0) {
+			ULONG width;
+
+			if (!CPCI429CaptureGetBits(Decoder, 2, &width)) {
+				return FALSE;
+			}
+			if (width == 3) {
+				if (!CPCI429CaptureGetBits(Decoder, 32, &value) || !CPCI429CaptureGetBits(Decoder, 32, &high)) {
+					return FALSE;
+				}
+				zigzag = ((ULONGLONG)high << 32) | value;
+			} else {
+				if (!CPCI429CaptureGetBits(Decoder, 8 << width, &value)) {
+					return FALSE;
+				}
+				zigzag = value;
+			}
+		}
+		state->PrevDelta += (LONGLONG)(zigzag >> 1) ^ -(LONGLONG)(zigzag & 1);
+		state->PrevTime += (ULONGLONG)state->PrevDelta;
+		Records[i].Timestamp = state->PrevTime;
+
+		if (!CPCI429CaptureGetBits(Decoder, 1, &value)) {
+			return FALSE;
+		}
+		if (value != 0) {
+			if (!CPCI429CaptureGetBits(Decoder, 3, &value)) {
+				return FALSE;
+			}
+			state->PrevChannel = value;
+		}
+		Records[i].Channel = (UCHAR)state->PrevChannel;
+
+		if (!CPCI429CaptureGetBits(Decoder, 1, &value)) {
+			return FALSE;
+		}
+		if (value != 0 && !CPCI429CaptureGetBits(Decoder, 8, &value)) {
+			return FALSE;
+		}
+		Records[i].Flags = (UCHAR)value;
+		Records[i].Reserved = 0;
+
+		if (!CPCI429CaptureGetBits(Decoder, 10, &index) || !CPCI429CaptureGetBits(Decoder, 1, &value)) {
+			return FALSE;
+		}
+		if (value != 0) {
+			ULONG trailing;
+			ULONG width;
+
+			if (!CPCI429CaptureGetBits(Decoder, 5, &trailing) || !CPCI429CaptureGetBits(Decoder, 5, &width)) {
+				return FALSE;
+			}
+			width++;
+			if (trailing + width > 22 || !CPCI429CaptureGetBits(Decoder, width, &value)) {
+				return FALSE;
+			}
+			state->Prev[state->PrevChannel][index] ^= (value << trailing) << 10;
+		}
+		state->Prev[state->PrevChannel][index] = (state->Prev[state->PrevChannel][index] & ~0x3FFUL) | index;
+		Records[i].Word = state->Prev[state->PrevChannel][index];
+	}
+
+	return TRUE;
+}
+
+#ifndef _KERNEL_MODE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#define CPCI429CaptureSeek(file, offset, origin) _fseeki64((file), (__int64)(offset), (origin))
+#else
+#define CPCI429CaptureSeek(file, offset, origin) fseeko((file), (off_t)(offset), (origin))
+#endif
+
+#define CPCI429_CAPTURE_FILE_MAGIC  0x46433934  // "49CF"
+#define CPCI429_CAPTURE_VERSION     1
+
+typedef struct _CPCI429_CAPTURE_FILE_HEADER {
+	ULONG Magic;
+	ULONG Version;
+	ULONG ChunkBytes;           // largest chunk in the file
+	ULONG Reserved;
+} CPCI429_CAPTURE_FILE_HEADER, *PCPCI429_CAPTURE_FILE_HEADER;
+
+//
+// Index entries repeat the chunk headers with their file offsets, in
+// time order, so a reader can seek by time or label after reading only
+// the end of the file.
+//
+typedef struct _CPCI429_CAPTURE_INDEX_ENTRY {
+	ULONGLONG Offset;
+	ULONGLONG FirstTime;
+	ULONGLONG LastTime;
+	ULONG Bytes;
+	ULONG Count;
+	ULONG ChannelMask;
+	ULONG LabelMask[8];
+	ULONG Reserved;
+} CPCI429_CAPTURE_INDEX_ENTRY, *PCPCI429_CAPTURE_INDEX_ENTRY;
+
+typedef struct _CPCI429_CAPTURE_TRAILER {
+	ULONGLONG IndexOffset;
+	ULONG ChunkCount;
+	ULONG Magic;                // CPCI429_CAPTURE_FILE_MAGIC, last in the file
+} CPCI429_CAPTURE_TRAILER, *PCPCI429_CAPTURE_TRAILER;
+
+typedef struct _CPCI429_CAPTURE_WRITER {
+	FILE *File;
+	ULONGLONG Offset;
+	PCPCI429_CAPTURE_INDEX_ENTRY Index;
+	ULONG ChunkCount;
+	ULONG IndexCapacity;
+	CPCI429_CAPTURE_ENCODER Encoder;
+	ULONGLONG Buffer[CPCI429_CAPTURE_CHUNK_BYTES / sizeof(ULONGLONG)];
+} CPCI429_CAPTURE_WRITER, *PCPCI429_CAPTURE_WRITER;
+
+//
+// Starts a capture file. Records must be written in timestamp order.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureWriterOpen(
+	_Out_ PCPCI429_CAPTURE_WRITER Writer,
+	_In_ FILE *File
+)
+{
+	CPCI429_CAPTURE_FILE_HEADER header;
+
+	memset(Writer, 0, FIELD_OFFSET(CPCI429_CAPTURE_WRITER, Encoder));
+	Writer->File = File;
+
+	header.Magic = CPCI429_CAPTURE_FILE_MAGIC;
+	header.Version = CPCI429_CAPTURE_VERSION;
+	header.ChunkBytes = CPCI429_CAPTURE_CHUNK_BYTES;
+	header.Reserved = 0;
+	if (fwrite(&header, sizeof(header), 1, File) != 1) {
+		return FALSE;
+	}
+	Writer->Offset = sizeof(header);
+
+	CPCI429CaptureEncodeBegin(&Writer->Encoder, Writer->Buffer, sizeof(Writer->Buffer));
+
+	return TRUE;
+}
+
+static __inline
+BOOLEAN
+CPCI429CaptureWriterFlush(
+	_Inout_ PCPCI429_CAPTURE_WRITER Writer
+)
+{
+	PCPCI429_CAPTURE_CHUNK chunk = Writer->Encoder.Chunk;
+	PCPCI429_CAPTURE_INDEX_ENTRY entry;
+	ULONG bytes;
+
+	if (chunk->Count == 0) {
+		return TRUE;
+	}
+
+	if (Writer->ChunkCount == Writer->IndexCapacity) {
+		ULONG capacity = Writer->IndexCapacity != 0 ? Writer->IndexCapacity * 2 : 64;
+		PCPCI429_CAPTURE_INDEX_ENTRY index = (PCPCI429_CAPTURE_INDEX_ENTRY)realloc(Writer->Index, capacity * sizeof(*index));
+
+		if (index == NULL) {
+			return FALSE;
+		}
+		Writer->Index = index;
+		Writer->IndexCapacity = capacity;
+	}
+
+	bytes = CPCI429CaptureEncodeEnd(&Writer->Encoder);
+	if (fwrite(chunk, bytes, 1, Writer->File) != 1) {
+		return FALSE;
+	}
+
+	entry = &Writer->Index[Writer->ChunkCount++];
+	entry->Offset = Writer->Offset;
+	entry->FirstTime = chunk->FirstTime;
+	entry->LastTime = chunk->LastTime;
+	entry->Bytes = bytes;
+	entry->Count = chunk->Count;
+	entry->ChannelMask = chunk->ChannelMask;
+	memcpy(entry->LabelMask, chunk->LabelMask, sizeof(entry->LabelMask));
+	entry->Reserved = 0;
+	Writer->Offset += bytes;
+
+	CPCI429CaptureEncodeBegin(&Writer->Encoder, Writer->Buffer, sizeof(Writer->Buffer));
+
+	return TRUE;
+}
+
+static __inline
+BOOLEAN
+CPCI429CaptureWrite(
+	_Inout_ PCPCI429_CAPTURE_WRITER Writer,
+	_In_reads_(Count) const CPCI429_CAPTURE_RECORD *Records,
+	_In_ ULONG Count
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Count; i++) {
+		if (!CPCI429CaptureEncode(&Writer->Encoder, &Records[i])) {
+			if (!CPCI429CaptureWriterFlush(Writer) || !CPCI429CaptureEncode(&Writer->Encoder, &Records[i])) {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Writes the last chunk, the index and the trailer. The file itself is
+// left open.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureWriterClose(
+	_Inout_ PCPCI429_CAPTURE_WRITER Writer
+)
+{
+	CPCI429_CAPTURE_TRAILER trailer;
+	BOOLEAN ok;
+
+	ok = CPCI429CaptureWriterFlush(Writer);
+
+	trailer.IndexOffset = Writer->Offset;
+	trailer.ChunkCount = Writer->ChunkCount;
+	trailer.Magic = CPCI429_CAPTURE_FILE_MAGIC;
+
+	if (ok && Writer->ChunkCount != 0) {
+		ok = fwrite(Writer->Index, sizeof(*Writer->Index), Writer->ChunkCount, Writer->File) == Writer->ChunkCount;
+	}
+	if (ok) {
+		ok = fwrite(&trailer, sizeof(trailer), 1, Writer->File) == 1;
+	}
+
+	free(Writer->Index);
+	Writer->Index = NULL;
+
+	return ok;
+}
+
+//
+// Writes one CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE window as a whole capture
+// file, so that each trigger leaves a file of just the traffic around
+// it. Writer is only used for the duration of the call.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureWriteWindow(
+	_Out_ PCPCI429_CAPTURE_WRITER Writer,
+	_In_ FILE *File,
+	_In_ const CPCI429_TRIGGER_CAPTURE *Window
+)
+{
+	CPCI429_CAPTURE_RECORD record;
+	BOOLEAN ok;
+	ULONG i;
+
+	if (!CPCI429CaptureWriterOpen(Writer, File)) {
+		return FALSE;
+	}
+
+	ok = TRUE;
+	for (i = 0; ok && i < Window->RecordCount; i++) {
+		record.Word = Window->Records[i].Word;
+		record.Channel = (UCHAR)Window->Channel;
+		record.Flags = (UCHAR)Window->Records[i].Flags;
+		record.Reserved = 0;
+		record.Timestamp = Window->Records[i].Timestamp;
+		ok = CPCI429CaptureWrite(Writer, &record, 1);
+	}
+
+	if (!CPCI429CaptureWriterClose(Writer)) {
+		ok = FALSE;
+	}
+
+	return ok;
+}
+
+//
+// Reads the index of a capture file. Returns a malloc'ed array the
+// caller frees, or NULL if the file has no valid trailer.
+//
+static __inline
+PCPCI429_CAPTURE_INDEX_ENTRY
+CPCI429CaptureReadIndex(
+	_In_ FILE *File,
+	_Out_ PULONG ChunkCount
+)
+{
+	CPCI429_CAPTURE_TRAILER trailer;
+	PCPCI429_CAPTURE_INDEX_ENTRY index;
+
+	*ChunkCount = 0;
+
+	if (CPCI429CaptureSeek(File, -(LONGLONG)sizeof(trailer), SEEK_END) != 0 ||
+		fread(&trailer, sizeof(trailer), 1, File) != 1 ||
+		trailer.Magic != CPCI429_CAPTURE_FILE_MAGIC ||
+		CPCI429CaptureSeek(File, trailer.IndexOffset, SEEK_SET) != 0) {
+		return NULL;
+	}
+
+	index = (PCPCI429_CAPTURE_INDEX_ENTRY)malloc(trailer.ChunkCount * sizeof(*index) + 1);
+	if (index == NULL) {
+		return NULL;
+	}
+	if (fread(index, sizeof(*index), trailer.ChunkCount, File) != trailer.ChunkCount) {
+		free(index);
+		return NULL;
+	}
+
+	*ChunkCount = trailer.ChunkCount;
+
+	return index;
+}
+
+//
+// First chunk that may hold records at or after Time, or ChunkCount if
+// there is none.
+//
+static __inline
+ULONG
+CPCI429CaptureFindTime(
+	_In_reads_(ChunkCount) const CPCI429_CAPTURE_INDEX_ENTRY *Index,
+	_In_ ULONG ChunkCount,
+	_In_ ULONGLONG Time
+)
+{
+	ULONG low = 0;
+	ULONG high = ChunkCount;
+
+	while (low < high) {
+		ULONG middle = low + (high - low) / 2;
+
+		if (Index[middle].LastTime < Time) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+
+	return low;
+}
+
+//
+// Next chunk from Start on that contains Label, or ChunkCount.
+//
+static __inline
+ULONG
+CPCI429CaptureFindLabel(
+	_In_reads_(ChunkCount) const CPCI429_CAPTURE_INDEX_ENTRY *Index,
+	_In_ ULONG ChunkCount,
+	_In_ ULONG Start,
+	_In_ UCHAR Label
+)
+{
+	for (; Start < ChunkCount; Start++) {
+		if (Index[Start].LabelMask[Label >> 5] & (1UL << (Label & 31))) {
+			break;
+		}
+	}
+
+	return Start;
+}
+
+//
+// Reads and decodes one chunk. Buffer must hold Entry->Bytes bytes and
+// Records Entry->Count records.
+//
+static __inline
+BOOLEAN
+CPCI429CaptureReadChunk(
+	_In_ FILE *File,
+	_In_ const CPCI429_CAPTURE_INDEX_ENTRY *Entry,
+	_Out_ PCPCI429_CAPTURE_DECODER Decoder,
+	_Out_writes_bytes_(Entry->Bytes) PVOID Buffer,
+	_Out_writes_(Entry->Count) PCPCI429_CAPTURE_RECORD Records
+)
+{
+	const CPCI429_CAPTURE_CHUNK *chunk = (const CPCI429_CAPTURE_CHUNK*)Buffer;
+
+	if (CPCI429CaptureSeek(File, Entry->Offset, SEEK_SET) != 0 || fread(Buffer, Entry->Bytes, 1, File) != 1) {
+		return FALSE;
+	}
+	if (chunk->Count != Entry->Count) {
+		return FALSE;
+	}
+
+	return CPCI429CaptureDecode(Decoder, chunk, Entry->Bytes, Records);
+}
+
+#endif // _KERNEL_MODE
+
+#endif // _CAPTURE_H
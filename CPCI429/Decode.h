@@ -0,0 +1,483 @@
+/*++
+
+Module Name:
+
+    decode.h
+
+Abstract:
+
+    Engineering-unit decoding of received ARINC 429 words, shared by the
+    driver and applications.
+
+    An interface-control description (ICD) lists, per label and SDI, how
+    the data field is encoded. It is compiled into a dense table of
+    CPCI429_LABEL_SDI_COUNT entries indexed with CPCI429_LABEL_SDI_INDEX,
+    so decoding a word is one table load and a few shifts, without
+    per-label switch statements.
+
+    Raw decoding is integer only and usable in the driver. Scaling to
+    engineering units and loading ICD text or JSON are for user mode;
+    Linux/Cpci429DecodeBench.c measures batch decoding throughput.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _DECODE_H
+#define _DECODE_H
+
+#include "Public.h"
+
+#ifndef _KERNEL_MODE
+#include <string.h>
+#endif
+
+#define CPCI429_ENCODING_NONE     0
+#define CPCI429_ENCODING_BNR      1   // two's complement, sign in LastBit
+#define CPCI429_ENCODING_BCD      2   // 4-bit digits, least significant digit at FirstBit
+#define CPCI429_ENCODING_DISCRETE 3   // unsigned bit field
+
+//
+// One compiled ICD entry. Bit numbers are ARINC 429 bit numbers, 1 being
+// the first label bit, so a typical BNR field is FirstBit 11..LastBit 29.
+//
+typedef struct _CPCI429_DECODE_ENTRY {
+	UCHAR Encoding;             // CPCI429_ENCODING_*
+	UCHAR Shift;                // FirstBit - 1
+	UCHAR Width;                // LastBit - FirstBit + 1
+	UCHAR Reserved;
+	ULONG Mask;                 // (1 << Width) - 1
+	ULONG SignBit;              // BNR: 1 << (Width - 1), otherwise 0
+	double Resolution;          // engineering units per raw count
+} CPCI429_DECODE_ENTRY, *PCPCI429_DECODE_ENTRY;
+
+typedef struct _CPCI429_DECODE_TABLE {
+	CPCI429_DECODE_ENTRY Entry[CPCI429_LABEL_SDI_COUNT];
+} CPCI429_DECODE_TABLE, *PCPCI429_DECODE_TABLE;
+
+//
+// Fills the integer part of an entry, leaving Resolution at zero; this is
+// all the driver needs. Returns FALSE for an invalid bit range.
+//
+static __inline
+BOOLEAN
+CPCI429DecodeInitEntry(
+	_Out_ PCPCI429_DECODE_ENTRY Entry,
+	_In_ UCHAR Encoding,
+	_In_ UCHAR FirstBit,
+	_In_ UCHAR LastBit
+)
+{
+	memset(Entry, 0, sizeof(*Entry));
+
+	if (FirstBit < 1 || LastBit > 32 || LastBit < FirstBit) {
+		return FALSE;
+	}
+
+	Entry->Encoding = Encoding;
+	Entry->Shift = (UCHAR)(FirstBit - 1);
+	Entry->Width = (UCHAR)(LastBit - FirstBit + 1);
+	Entry->Mask = Entry->Width == 32 ? 0xFFFFFFFF : ((1UL << Entry->Width) - 1);
+	Entry->SignBit = Encoding == CPCI429_ENCODING_BNR ? (1UL << (Entry->Width - 1)) : 0;
+
+	return TRUE;
+}
+
+//
+// Fills one table entry. Sdi of CPCI429_SDI_ANY_SOURCE fills all four SDI
+// slots of the label. Returns FALSE for an invalid bit range.
+//
+static __inline
+BOOLEAN
+CPCI429DecodeSetEntry(
+	_Inout_ PCPCI429_DECODE_TABLE Table,
+	_In_ UCHAR Label,
+	_In_ UCHAR Sdi,
+	_In_ UCHAR Encoding,
+	_In_ UCHAR FirstBit,
+	_In_ UCHAR LastBit,
+	_In_ double Resolution
+)
+{
+	CPCI429_DECODE_ENTRY entry;
+	ULONG sdi;
+
+	if ((Sdi != CPCI429_SDI_ANY_SOURCE && Sdi > 3) || !CPCI429DecodeInitEntry(&entry, Encoding, FirstBit, LastBit)) {
+		return FALSE;
+	}
+
+	entry.Resolution = Resolution;
+
+	for (sdi = 0; sdi < 4; sdi++) {
+		if (Sdi == CPCI429_SDI_ANY_SOURCE || Sdi == sdi) {
+			Table->Entry[(sdi << 8) | Label] = entry;
+		}
+	}
+
+	return TRUE;
+}
+
+//
+// Raw integer value of a word: sign-extended for BNR, the decimal value
+// of the digits for BCD, the bit field for discretes. BNR and discretes
+// take a shift, a mask and a sign extension; BCD converts a digit at a
+// time. The sign extension is done unsigned, so a 32-bit field cannot
+// overflow.
+//
+static __inline
+LONG
+CPCI429DecodeRaw(
+	_In_ const CPCI429_DECODE_ENTRY *Entry,
+	_In_ ULONG Word
+)
+{
+	ULONG field = (Word >> Entry->Shift) & Entry->Mask;
+
+	if (Entry->Encoding == CPCI429_ENCODING_BCD) {
+		LONG value = 0;
+		LONG scale = 1;
+		ULONG width;
+
+		for (width = 0; width < Entry->Width; width += 4, field >>= 4) {
+			value += (LONG)(field & 0xF) * scale;
+			scale *= 10;
+		}
+		return value;
+	}
+
+	return (LONG)((field ^ Entry->SignBit) - Entry->SignBit);
+}
+
+#ifndef _KERNEL_MODE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Decodes Count words into engineering units. Words whose label and SDI
+// have no entry decode to 0.0; Valid, when given, receives 1 for decoded
+// words and 0 for the rest.
+//
+static __inline
+VOID
+CPCI429DecodeBatch(
+	_In_ const CPCI429_DECODE_TABLE *Table,
+	_In_reads_(Count) const ULONG *Words,
+	_In_ ULONG Count,
+	_Out_writes_(Count) double *Values,
+	_Out_writes_opt_(Count) UCHAR *Valid
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Count; i++) {
+		const CPCI429_DECODE_ENTRY *entry = &Table->Entry[CPCI429_LABEL_SDI_INDEX(Words[i])];
+
+		Values[i] = (double)CPCI429DecodeRaw(entry, Words[i]) * entry->Resolution;
+		if (Valid != NULL) {
+			Valid[i] = entry->Encoding != CPCI429_ENCODING_NONE;
+		}
+	}
+}
+
+//
+// Compiles an ICD text file into Table. One entry per line:
+//
+//     <label octal> <sdi 0-3 or *> <BNR|BCD|DIS> <first bit> <last bit> [resolution]
+//
+// for example "203 * BNR 11 29 0.25". The label is the received label
+// byte written in octal. Blank lines and lines starting with '#' are
+// ignored. Returns the number of entries loaded, or -1 with ErrorLine set
+// to the first line that could not be parsed.
+//
+static __inline
+int
+CPCI429DecodeLoadIcd(
+	_In_ FILE *File,
+	_Out_ PCPCI429_DECODE_TABLE Table,
+	_Out_opt_ int *ErrorLine
+)
+{
+	char line[256];
+	int lineNumber = 0;
+	int loaded = 0;
+
+	memset(Table, 0, sizeof(*Table));
+
+	while (fgets(line, sizeof(line), File) != NULL) {
+		unsigned int label;
+		char sdiText[4];
+		char encodingText[8];
+		unsigned int firstBit;
+		unsigned int lastBit;
+		double resolution = 1.0;
+		UCHAR encoding;
+		UCHAR sdi;
+		int fields;
+
+		lineNumber++;
+
+		fields = sscanf(line, " %o %3s %7s %u %u %lf", &label, sdiText, encodingText, &firstBit, &lastBit, &resolution);
+		if (fields <= 0 || line[strspn(line, " \t")] == '#') {
+			continue;
+		}
+
+		if (strcmp(encodingText, "BNR") == 0) {
+			encoding = CPCI429_ENCODING_BNR;
+		} else if (strcmp(encodingText, "BCD") == 0) {
+			encoding = CPCI429_ENCODING_BCD;
+		} else if (strcmp(encodingText, "DIS") == 0) {
+			encoding = CPCI429_ENCODING_DISCRETE;
+		} else {
+			encoding = CPCI429_ENCODING_NONE;
+		}
+
+		sdi = sdiText[0] == '*' ? CPCI429_SDI_ANY_SOURCE : (UCHAR)(sdiText[0] - '0');
+
+		if (fields < 5 || label > 0xFF || firstBit > 32 || lastBit > 32 || encoding == CPCI429_ENCODING_NONE ||
+			!CPCI429DecodeSetEntry(Table, (UCHAR)label, sdi, encoding, (UCHAR)firstBit, (UCHAR)lastBit, resolution)) {
+			if (ErrorLine != NULL) {
+				*ErrorLine = lineNumber;
+			}
+			return -1;
+		}
+
+		loaded++;
+	}
+
+	return loaded;
+}
+
+//
+// Helpers of CPCI429DecodeLoadIcdJson. A JSON ICD only needs strings
+// without escapes and numbers, so that is all they read.
+//
+static __inline
+const char *
+CPCI429DecodeJsonSkip(
+	_In_ const char *Text
+)
+{
+	while (*Text == ' ' || *Text == '\t' || *Text == '\r' || *Text == '\n') {
+		Text++;
+	}
+
+	return Text;
+}
+
+static __inline
+BOOLEAN
+CPCI429DecodeJsonString(
+	_Inout_ const char **Cursor,
+	_Out_writes_(Size) char *Text,
+	_In_ size_t Size
+)
+{
+	const char *p = *Cursor;
+	size_t length = 0;
+
+	if (*p != '"') {
+		return FALSE;
+	}
+	for (p++; *p != '"'; p++) {
+		if (*p == '\0' || *p == '\\' || length + 1 >= Size) {
+			return FALSE;
+		}
+		Text[length++] = *p;
+	}
+	Text[length] = '\0';
+	*Cursor = p + 1;
+
+	return TRUE;
+}
+
+//
+// Reads one ICD object at *Cursor into Table.
+//
+static __inline
+BOOLEAN
+CPCI429DecodeJsonEntry(
+	_Inout_ const char **Cursor,
+	_Inout_ PCPCI429_DECODE_TABLE Table
+)
+{
+	const char *p = CPCI429DecodeJsonSkip(*Cursor);
+	char key[16];
+	char text[16];
+	char *end;
+	double number;
+	BOOLEAN isText;
+	unsigned long label = 0x100;
+	unsigned long sdi = 0x100;
+	UCHAR encoding = CPCI429_ENCODING_NONE;
+	double firstBit = 0;
+	double lastBit = 0;
+	double resolution = 1.0;
+
+	if (*p != '{') {
+		return FALSE;
+	}
+
+	for (p++;;) {
+		p = CPCI429DecodeJsonSkip(p);
+		if (!CPCI429DecodeJsonString(&p, key, sizeof(key))) {
+			return FALSE;
+		}
+		p = CPCI429DecodeJsonSkip(p);
+		if (*p != ':') {
+			return FALSE;
+		}
+		p = CPCI429DecodeJsonSkip(p + 1);
+
+		isText = *p == '"';
+		if (isText) {
+			if (!CPCI429DecodeJsonString(&p, text, sizeof(text))) {
+				return FALSE;
+			}
+			number = 0;
+		} else {
+			number = strtod(p, &end);
+			if (end == p) {
+				return FALSE;
+			}
+			p = end;
+		}
+
+		if (strcmp(key, "label") == 0 && isText) {
+			label = strtoul(text, &end, 8);
+			if (text[0] == '\0' || *end != '\0') {
+				return FALSE;
+			}
+		} else if (strcmp(key, "sdi") == 0) {
+			if (isText && strcmp(text, "*") == 0) {
+				sdi = CPCI429_SDI_ANY_SOURCE;
+			} else if (!isText && number >= 0 && number <= 3 && number == (ULONG)number) {
+				sdi = (ULONG)number;
+			} else {
+				return FALSE;
+			}
+		} else if (strcmp(key, "encoding") == 0 && isText) {
+			if (strcmp(text, "BNR") == 0) {
+				encoding = CPCI429_ENCODING_BNR;
+			} else if (strcmp(text, "BCD") == 0) {
+				encoding = CPCI429_ENCODING_BCD;
+			} else if (strcmp(text, "DIS") == 0) {
+				encoding = CPCI429_ENCODING_DISCRETE;
+			} else {
+				return FALSE;
+			}
+		} else if (strcmp(key, "firstBit") == 0 && !isText) {
+			firstBit = number;
+		} else if (strcmp(key, "lastBit") == 0 && !isText) {
+			lastBit = number;
+		} else if (strcmp(key, "resolution") == 0 && !isText) {
+			resolution = number;
+		}
+
+		p = CPCI429DecodeJsonSkip(p);
+		if (*p == '}') {
+			break;
+		}
+		if (*p != ',') {
+			return FALSE;
+		}
+		p++;
+	}
+
+	if (label > 0xFF || sdi == 0x100 || encoding == CPCI429_ENCODING_NONE ||
+		firstBit < 1 || firstBit > 32 || lastBit < 1 || lastBit > 32 ||
+		!CPCI429DecodeSetEntry(Table, (UCHAR)label, (UCHAR)sdi, encoding, (UCHAR)firstBit, (UCHAR)lastBit, resolution)) {
+		return FALSE;
+	}
+
+	*Cursor = p + 1;
+
+	return TRUE;
+}
+
+//
+// Compiles a JSON ICD into Table. The file is an array of entries such as
+//
+//     { "label": "203", "sdi": "*", "encoding": "BNR", "firstBit": 11, "lastBit": 29, "resolution": 0.25 }
+//
+// with the same meaning as a line of the text form: the label is a
+// string of octal digits, sdi is 0-3 or "*" and resolution may be left
+// out. Other members with string or number values are ignored. Returns
+// the number of entries loaded, or -1 with ErrorLine set to the line of
+// the first entry that could not be used.
+//
+static __inline
+int
+CPCI429DecodeLoadIcdJson(
+	_In_ FILE *File,
+	_Out_ PCPCI429_DECODE_TABLE Table,
+	_Out_opt_ int *ErrorLine
+)
+{
+	char *text = NULL;
+	char *grown;
+	size_t length = 0;
+	size_t capacity = 0;
+	size_t count;
+	const char *p;
+	const char *entry;
+	int loaded = 0;
+
+	memset(Table, 0, sizeof(*Table));
+
+	do {
+		if (capacity - length < 4096 + 1) {
+			capacity = capacity == 0 ? 65536 : capacity * 2;
+			grown = (char *)realloc(text, capacity);
+			if (grown == NULL) {
+				free(text);
+				return -1;
+			}
+			text = grown;
+		}
+		count = fread(text + length, 1, capacity - length - 1, File);
+		length += count;
+	} while (count != 0);
+	text[length] = '\0';
+
+	p = CPCI429DecodeJsonSkip(text);
+	entry = p;
+	if (*p == '[') {
+		p = CPCI429DecodeJsonSkip(p + 1);
+		entry = p;
+		if (*p == ']') {
+			free(text);
+			return 0;
+		}
+		while (CPCI429DecodeJsonEntry(&p, Table)) {
+			loaded++;
+			p = CPCI429DecodeJsonSkip(p);
+			if (*p == ']') {
+				free(text);
+				return loaded;
+			}
+			if (*p != ',') {
+				break;
+			}
+			p = CPCI429DecodeJsonSkip(p + 1);
+			entry = p;
+		}
+	}
+
+	if (ErrorLine != NULL) {
+		*ErrorLine = 1;
+		for (p = text; p < entry; p++) {
+			*ErrorLine += *p == '\n';
+		}
+	}
+	free(text);
+
+	return -1;
+}
+
+#endif // _KERNEL_MODE
+
+#endif // _DECODE_H
@@ -15,6 +15,7 @@ Environment:
 --*/
 
 #include "driver.h"
+#include <ntstrsafe.h>
 #include "device.tmh"
 
 #pragma warning(disable:4013) 
@@ -27,6 +28,7 @@ Environment:
 #pragma alloc_text (PAGE, CPCI429EvtDeviceReleaseHardware)
 #pragma alloc_text (PAGE, CPCI429EvtDeviceD0Entry)
 #pragma alloc_text (PAGE, CPCI429EvtDeviceD0Exit)
+#pragma alloc_text (PAGE, CPCI429ReadConfiguration)
 #endif
 
 NTSTATUS
@@ -151,6 +153,20 @@ CPCI429EvtDevicePrepareHardware(
 		}
 	}
 	pDeviceContext->Counter_i = i;
+
+	status = CPCI429RxAllocateRings(pDeviceContext);
+	if (!NT_SUCCESS(status)) {
+		CPCI429RxFreeRings(pDeviceContext);
+		return status;
+	}
+
+	status = CPCI429PoolsAllocate(pDeviceContext);
+	if (!NT_SUCCESS(status)) {
+		CPCI429PoolsFree(pDeviceContext);
+		CPCI429RxFreeRings(pDeviceContext);
+		return status;
+	}
+
 	DbgPrint("EvtDevicePrepareHardware - ends\n");
 
 	return STATUS_SUCCESS;
@@ -169,6 +185,11 @@ CPCI429EvtDeviceReleaseHardware(
 
 	pDeviceContext = DeviceGetContext(Device);
 
+	CPCI429AggregateRelease(pDeviceContext);
+	CPCI429TriggerRelease(pDeviceContext);
+	CPCI429PoolsFree(pDeviceContext);
+	CPCI429RxFreeRings(pDeviceContext);
+
 	if (pDeviceContext->MemBaseAddress) {
 		//MmUnmalIoSpaceַϵͳں˵ַ(ַ)Ĺ
 		MmUnmapIoSpace(pDeviceContext->MemBaseAddress, pDeviceContext->MemLength);
@@ -186,9 +207,10 @@ CPCI429EvtDeviceD0Entry(
 	IN WDF_POWER_DEVICE_STATE PreviousState
 )
 {
-	UNREFERENCED_PARAMETER(Device);
 	UNREFERENCED_PARAMETER(PreviousState);
 
+	CPCI429HealthStart(DeviceGetContext(Device));
+
 	return STATUS_SUCCESS;
 }
 
@@ -198,11 +220,153 @@ CPCI429EvtDeviceD0Exit(
 	IN WDF_POWER_DEVICE_STATE TargetState
 )
 {
-	UNREFERENCED_PARAMETER(Device);
 	UNREFERENCED_PARAMETER(TargetState);
 
 	PAGED_CODE();
 
+	CPCI429BulkStop(DeviceGetContext(Device));
+	CPCI429SelfTestStop(DeviceGetContext(Device));
+	CPCI429HealthStop(DeviceGetContext(Device));
+
 	return STATUS_SUCCESS;
 }
 
+NTSTATUS
+CPCI429ReadConfiguration(
+	_In_ WDFDEVICE Device
+)
+/*++
+
+Routine Description:
+
+Finds the board's NUMA node and reads the per-board tuning values from
+the device's hardware key. Missing or invalid values keep their defaults.
+
+    RxRingWords         - receive ring capacity per channel, power of two
+    SharedRingWords     - fan-out ring capacity per channel, power of two
+    InterruptGroup      - processor group of InterruptAffinity
+    InterruptAffinity   - interrupt target processors, 0 for the board's node;
+                          REG_QWORD to reach processors above 31
+    RxDpcProcessor<n>   - processor index for receive channel n's DPC
+    PoolRecordBlocks    - blocks in the receive record pool
+    PoolBlockRecords    - records per record pool block, power of two
+    PoolContexts        - blocks in the self-test and bulk context pool
+    RxFifoHighWater     - board FIFO fill at which receive drains in bursts
+
+Arguments:
+
+Device - Handle to a framework device object.
+
+Return Value:
+
+NTSTATUS
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	NTSTATUS status;
+	WDFKEY key;
+	ULONG value;
+	ULONGLONG affinity;
+	ULONG affinityType;
+	ULONG i;
+	WCHAR nameBuffer[32];
+	UNICODE_STRING valueName;
+	DECLARE_CONST_UNICODE_STRING(ringWordsName, L"RxRingWords");
+	DECLARE_CONST_UNICODE_STRING(sharedWordsName, L"SharedRingWords");
+	DECLARE_CONST_UNICODE_STRING(groupName, L"InterruptGroup");
+	DECLARE_CONST_UNICODE_STRING(affinityName, L"InterruptAffinity");
+	DECLARE_CONST_UNICODE_STRING(recordBlocksName, L"PoolRecordBlocks");
+	DECLARE_CONST_UNICODE_STRING(blockRecordsName, L"PoolBlockRecords");
+	DECLARE_CONST_UNICODE_STRING(contextsName, L"PoolContexts");
+	DECLARE_CONST_UNICODE_STRING(highWaterName, L"RxFifoHighWater");
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+
+	pDeviceContext->Config.RxRingWords = CPCI429_DEFAULT_RX_RING_WORDS;
+	pDeviceContext->Config.SharedRingWords = CPCI429_DEFAULT_SHARED_RING_WORDS;
+	pDeviceContext->Config.InterruptGroup = 0;
+	pDeviceContext->Config.InterruptAffinity = 0;
+	pDeviceContext->Config.PoolRecordBlocks = CPCI429_DEFAULT_POOL_RECORD_BLOCKS;
+	pDeviceContext->Config.PoolBlockRecords = CPCI429_DEFAULT_POOL_BLOCK_RECORDS;
+	pDeviceContext->Config.PoolContexts = CPCI429_DEFAULT_POOL_CONTEXTS;
+	pDeviceContext->Config.RxFifoHighWater = CPCI429_DEFAULT_RX_FIFO_HIGH_WATER;
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		pDeviceContext->Config.RxDpcProcessor[i] = CPCI429_PROCESSOR_DEFAULT;
+	}
+
+	if (!NT_SUCCESS(IoGetDeviceNumaNode(WdfDeviceWdmGetPhysicalDevice(Device), &pDeviceContext->Node))) {
+		pDeviceContext->Node = 0;
+	}
+	KeQueryNodeActiveAffinity(pDeviceContext->Node, &pDeviceContext->NodeAffinity, NULL);
+	if (pDeviceContext->NodeAffinity.Mask == 0) {
+		pDeviceContext->NodeAffinity.Group = 0;
+		pDeviceContext->NodeAffinity.Mask = KeQueryGroupAffinity(0);
+	}
+
+	status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+	if (!NT_SUCCESS(status)) {
+		return STATUS_SUCCESS;
+	}
+
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &ringWordsName, &value)) &&
+		value >= 64 && (value & (value - 1)) == 0) {
+		pDeviceContext->Config.RxRingWords = value;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &sharedWordsName, &value)) &&
+		value >= 64 && (value & (value - 1)) == 0) {
+		pDeviceContext->Config.SharedRingWords = value;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &groupName, &value))) {
+		pDeviceContext->Config.InterruptGroup = value;
+	}
+	affinity = 0;
+	if (NT_SUCCESS(WdfRegistryQueryValue(key, &affinityName, sizeof(affinity), &affinity, NULL, &affinityType)) &&
+		(affinityType == REG_DWORD || affinityType == REG_QWORD)) {
+		pDeviceContext->Config.InterruptAffinity = (KAFFINITY)affinity;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &recordBlocksName, &value)) && value <= 1024) {
+		pDeviceContext->Config.PoolRecordBlocks = value;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &blockRecordsName, &value)) &&
+		value >= 64 && value <= 0x10000 && (value & (value - 1)) == 0) {
+		pDeviceContext->Config.PoolBlockRecords = value;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &contextsName, &value)) && value >= 1 && value <= 16) {
+		pDeviceContext->Config.PoolContexts = value;
+	}
+	if (NT_SUCCESS(WdfRegistryQueryULong(key, &highWaterName, &value)) &&
+		value >= 1 && value <= CPCI429_FIFO_COUNT(0xFFFFFFFF)) {
+		pDeviceContext->Config.RxFifoHighWater = value;
+	}
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		RtlInitEmptyUnicodeString(&valueName, nameBuffer, sizeof(nameBuffer));
+		if (NT_SUCCESS(RtlUnicodeStringPrintf(&valueName, L"RxDpcProcessor%u", i)) &&
+			NT_SUCCESS(WdfRegistryQueryULong(key, &valueName, &value))) {
+			pDeviceContext->Config.RxDpcProcessor[i] = value;
+		}
+	}
+
+	WdfRegistryClose(key);
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429EvtDeviceContextCleanup(
+	_In_ WDFOBJECT Device
+)
+/*++
+
+Routine Description:
+
+Frees the memory that lives as long as the device rather than the
+hardware resources.
+
+--*/
+{
+	CPCI429FanoutCleanup(DeviceGetContext((WDFDEVICE)Device));
+}
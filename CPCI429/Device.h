@@ -15,6 +15,11 @@ Environment:
 --*/
 
 #include "public.h"
+#include "registers.h"
+#include "rxpath.h"
+#include "loopback.h"
+#include "bulksender.h"
+#include "decode.h"
 
 EXTERN_C_START
 
@@ -23,6 +28,211 @@ EXTERN_C_START
 
 #define MAXLEN 1024
 
+#define CPCI429_DEFAULT_RX_RING_WORDS 4096
+#define CPCI429_DEFAULT_SHARED_RING_WORDS 4096
+#define CPCI429_DEFAULT_POOL_RECORD_BLOCKS 16
+#define CPCI429_DEFAULT_POOL_BLOCK_RECORDS 4096
+#define CPCI429_DEFAULT_POOL_CONTEXTS 2
+#define CPCI429_DEFAULT_RX_FIFO_HIGH_WATER 64
+#define CPCI429_PROCESSOR_DEFAULT     0xFFFFFFFF
+#define CPCI429_CHANNEL_NONE          0xFFFFFFFF
+
+//
+// Per-board configuration, read from the device's hardware registry key
+// in CPCI429ReadConfiguration.
+//
+typedef struct _DEVICE_CONFIG
+{
+	ULONG RxRingWords;          // per-channel ring capacity, power of two
+	ULONG SharedRingWords;      // per-channel fan-out ring capacity, power of two
+	ULONG InterruptGroup;
+	KAFFINITY InterruptAffinity; // 0: processors of the board's NUMA node
+	ULONG RxDpcProcessor[CPCI429_MAX_RX_CHANNELS]; // processor index, or CPCI429_PROCESSOR_DEFAULT
+	ULONG PoolRecordBlocks;     // blocks in the record pool
+	ULONG PoolBlockRecords;     // records per record pool block, power of two
+	ULONG PoolContexts;         // blocks in the context pool
+	ULONG RxFifoHighWater;      // FIFO fill at which the receive path drains in bursts
+
+} DEVICE_CONFIG, *PDEVICE_CONFIG;
+
+//
+// Fixed-size block pool carved from one non-paged arena when the
+// hardware is prepared, so that nothing on the data path allocates from
+// system pool. Free blocks are kept on an interlocked list.
+//
+typedef struct _BLOCK_POOL
+{
+	SLIST_HEADER FreeList;
+	WDFMEMORY Arena;
+	ULONG BlockSize;
+	ULONG Capacity;
+	volatile LONG InUse;
+	volatile LONG HighWater;
+	volatile LONG64 Allocations;
+	volatile LONG64 Exhaustions;
+
+} BLOCK_POOL, *PBLOCK_POOL;
+
+//
+// Trigger capture state of a receive channel. The channel DPC holds Lock
+// while it drains an armed channel, so the history is written without
+// further synchronization; the health timer and the control queue take
+// it to fire, close and arm. Indices count records ever written to
+// History, which is a record pool block of HistoryMask + 1 records.
+//
+typedef struct _TRIGGER_CAPTURE
+{
+	KSPIN_LOCK Lock;
+	PCPCI429_RX_RECORD History;     // NULL while disarmed
+	ULONG HistoryMask;
+	ULONG Sources;                  // CPCI429_TRIGGER_ON_*
+	ULONGLONG Written;
+	ULONG PreRecords;
+	ULONGLONG PostInterval;         // 100ns units
+	ULONG MatchLabels[256 / 32];    // labels with a match entry
+	ULONG MatchCount;
+	CPCI429_TRIGGER_MATCH Matches[CPCI429_MAX_TRIGGER_MATCHES];
+
+	//
+	// The open window, [WindowStart, Written) so far.
+	//
+	BOOLEAN Open;
+	BOOLEAN Closed;                 // a window was finished during this drain
+	USHORT Cause;
+	ULONG Source;
+	ULONGLONG WindowStart;
+	ULONGLONG TriggerIndex;
+	ULONGLONG TriggerTime;
+	ULONGLONG CloseTime;
+
+	volatile LONG64 Triggers;
+	volatile LONG64 TriggersIgnored;    // fired while a window was open
+	volatile LONG64 WindowsDropped;     // no pool block, or too many unclaimed
+
+} TRIGGER_CAPTURE, *PTRIGGER_CAPTURE;
+
+//
+// Windowed aggregation of a receive channel. The channel DPC holds Lock
+// while it drains a channel with a window set and accumulates into
+// Slots; the health timer takes it to end the window. Published is the
+// last finished window, guarded by the device's AggregateLock.
+//
+typedef struct _AGGREGATE_SLOT
+{
+	CPCI429_DECODE_ENTRY Decode;
+	ULONG Count;
+	LONG Min;
+	LONG Max;
+	LONG Last;
+	LONG64 Sum;
+	ULONG LastWord;
+	ULONGLONG LastTime;
+
+} AGGREGATE_SLOT, *PAGGREGATE_SLOT;
+
+typedef struct _AGGREGATOR
+{
+	KSPIN_LOCK Lock;
+	volatile LONG64 Window;         // 100ns units, 0 while off
+	ULONGLONG WindowStart;
+	ULONG SlotCount;
+	CPCI429_AGGREGATE_SOURCE Sources[CPCI429_MAX_AGGREGATES];
+	AGGREGATE_SLOT Slots[CPCI429_MAX_AGGREGATES];
+
+	ULONG PublishedCount;
+	ULONGLONG PublishedStart;
+	ULONGLONG PublishedEnd;
+	ULONGLONG WindowsMissed;
+	CPCI429_AGGREGATE Published[CPCI429_MAX_AGGREGATES];
+
+} AGGREGATOR, *PAGGREGATOR;
+
+//
+// A finished window waiting for CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE.
+//
+typedef struct _TRIGGER_WINDOW
+{
+	PCPCI429_RX_RECORD Records;     // record pool block
+	CPCI429_TRIGGER_CAPTURE Header; // RecordCount records in Records
+
+} TRIGGER_WINDOW, *PTRIGGER_WINDOW;
+
+//
+// Receive channel state. The channel DPC is the only producer of the
+// ring; readers serialize among themselves on ConsumerLock.
+//
+typedef struct _RX_CHANNEL
+{
+	struct _DEVICE_CONTEXT *DeviceContext;
+	ULONG Channel;
+
+	PCPCI429_RX_RECORD Ring;
+	SIZE_T RingBytes;
+	ULONG RingMask;
+	volatile ULONG Head;        // next slot written by the DPC
+	volatile ULONG Tail;        // next slot read by a consumer
+	KSPIN_LOCK ConsumerLock;
+	WDFQUEUE ReadWaitQueue;     // manual, parked CPCI429_IOCTL_RX_READ_WAIT
+
+	PLABEL_ENTRY Labels;        // CPCI429_LABEL_SDI_COUNT entries, after the ring
+
+	//
+	// Label and SDI indices with a staleness limit, scanned by the health
+	// timer. Entries are appended only, by the control queue.
+	//
+	USHORT StaleWatch[CPCI429_MAX_STALE_WATCH];
+	volatile LONG StaleWatchCount;
+
+	//
+	// Fan-out ring, mapped read-only into subscriber processes. It lives
+	// as long as the device, not the hardware, because mappings may
+	// outlast a release.
+	//
+	PCPCI429_SHARED_RING Shared;
+	PCPCI429_RX_RECORD SharedRecords;
+	SIZE_T SharedBytes;
+	PMDL SharedMdl;
+	LIST_ENTRY Subscribers;
+	KSPIN_LOCK SubscriberLock;
+	volatile LONG SubscriberCount;
+	ULONG OnChangeMask[256 / 32];
+	volatile LONG64 HeartbeatInterval;  // 100ns units
+
+	TRIGGER_CAPTURE Capture;
+	AGGREGATOR Aggregator;
+
+	RX_FIFO_STATE Fifo;         // owned by the channel's DPC
+
+	KDPC Dpc;
+	PROCESSOR_NUMBER TargetProcessor;
+	USHORT Node;
+
+	volatile LONG64 WordsReceived;
+	volatile LONG64 WordsQueued;
+	volatile LONG64 RingOverflows;
+	volatile LONG64 WordsSuppressed;
+	volatile LONG64 Heartbeats;
+	volatile LONG64 ParityErrors;
+	volatile LONG64 SsmFailures;
+	volatile LONG64 GapViolations;
+	volatile LONG64 StaleAlarms;
+	volatile LONG64 FifoOverruns;
+	volatile LONG64 FifoWordsLost;
+	volatile LONG64 BurstDrains;
+
+} RX_CHANNEL, *PRX_CHANNEL;
+
+//
+// Receive work done on each processor, indexed by processor index.
+//
+typedef struct _CPU_STATS
+{
+	LONG64 Dpcs;
+	LONG64 Words;
+	LONG64 DpcTicks;
+
+} CPU_STATS, *PCPU_STATS;
+
 //
 // The device context performs the same job as
 // a WDM device extension in the driver frameworks
@@ -37,6 +247,86 @@ typedef struct _DEVICE_CONTEXT
 	ULONG MemLength;
 	ULONG OffsetAddressFromApp;
 
+	WDFQUEUE RxQueue;       // parallel, data path
+	WDFQUEUE TxQueue;       // parallel, data path
+	WDFQUEUE ControlQueue;  // sequential, configuration
+
+	DEVICE_CONFIG Config;
+	USHORT Node;                // NUMA node of the board
+	GROUP_AFFINITY NodeAffinity;
+	WDFINTERRUPT Interrupt;
+
+	RX_CHANNEL RxChannels[CPCI429_MAX_RX_CHANNELS];
+
+	PCPU_STATS CpuStats;
+	ULONG CpuCount;
+
+	BLOCK_POOL Pools[CPCI429_POOL_COUNT];   // by CPCI429_POOL_*
+
+	//
+	// Health alarms not yet handed to a waiting request, oldest first.
+	//
+	WDFTIMER HealthTimer;
+	WDFQUEUE HealthWaitQueue;   // manual, parked CPCI429_IOCTL_WAIT_HEALTH_ALARM
+	KSPIN_LOCK HealthLock;
+	CPCI429_HEALTH_EVENT HealthEvents[64];
+	ULONG HealthEventFirst;
+	ULONG HealthEventCount;
+	LONG64 HealthEventsDropped;
+
+	//
+	// Finished trigger capture windows not yet handed to a waiting
+	// request, oldest first.
+	//
+	WDFQUEUE TriggerWaitQueue;  // manual, parked CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE
+	KSPIN_LOCK TriggerLock;
+	TRIGGER_WINDOW TriggerWindows[8];
+	ULONG TriggerWindowFirst;
+	ULONG TriggerWindowCount;
+
+	//
+	// Channels whose Aggregator.Published has not been collected, one
+	// bit each.
+	//
+	WDFQUEUE AggregateWaitQueue;    // manual, parked CPCI429_IOCTL_WAIT_AGGREGATES
+	KSPIN_LOCK AggregateLock;
+	ULONG AggregateReady;
+	ULONG AggregateNext;            // channel to look at first, for fairness
+
+	//
+	// Loopback self-test. SelfTest is published to the channel DPCs while
+	// a run is active; SelfTestFinishing is set from the end of the run
+	// until its resources are released. SelfTestChannels holds the
+	// transmit channels the run owns, from before they are configured
+	// until they are restored.
+	//
+	WDFTIMER SelfTestTimer;
+	WDFWORKITEM SelfTestWorkItem;
+	WDFQUEUE SelfTestQueue;     // manual, the pending CPCI429_IOCTL_SELF_TEST
+	struct _SELF_TEST* volatile SelfTest;
+	volatile LONG SelfTestChannels;
+	volatile LONG SelfTestFinishing;
+	volatile BOOLEAN SelfTestCanceled;
+	volatile BOOLEAN SelfTestAborted;
+
+	//
+	// Bulk transfer engine, same lifetime rules as the self-test.
+	// BulkTxChannel is the transmit channel the running transfer owns,
+	// CPCI429_CHANNEL_NONE otherwise. The request's buffer is the data,
+	// so a canceled request is parked in BulkCanceledRequest until the
+	// work item has stopped the engine.
+	//
+	WDFTIMER BulkTimer;
+	WDFWORKITEM BulkWorkItem;
+	WDFQUEUE BulkQueue;         // manual, the pending CPCI429_IOCTL_BULK_TRANSFER
+	struct _BULK_TRANSFER* volatile Bulk;
+	volatile LONG BulkFinishing;
+	volatile ULONG BulkTxChannel;
+	WDFREQUEST volatile BulkCanceledRequest;
+	volatile BOOLEAN BulkCanceled;
+	volatile BOOLEAN BulkAborted;
+	CPCI429_BULK_STATUS BulkStatus;     // last finished transfer
+
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 //
@@ -46,6 +336,66 @@ typedef struct _DEVICE_CONTEXT
 //
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
 
+FORCEINLINE
+ULONG
+CPCI429ReadRegister(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG Offset
+)
+{
+	return CPCI429_BAR_READ(DeviceContext->BAR0_VirtualAddress, Offset);
+}
+
+FORCEINLINE
+VOID
+CPCI429WriteRegister(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG Offset,
+	_In_ ULONG Value
+)
+{
+	CPCI429_BAR_WRITE(DeviceContext->BAR0_VirtualAddress, Offset, Value);
+}
+
+//
+// Lock-free running maximum for statistics counters.
+//
+FORCEINLINE
+VOID
+CPCI429InterlockedMax(
+	_Inout_ volatile LONG *Target,
+	_In_ LONG Value
+)
+{
+	LONG current = *Target;
+
+	while (Value > current) {
+		LONG previous = InterlockedCompareExchange(Target, Value, current);
+		if (previous == current) {
+			break;
+		}
+		current = previous;
+	}
+}
+
+FORCEINLINE
+VOID
+CPCI429InterlockedMax64(
+	_Inout_ volatile LONG64 *Target,
+	_In_ LONG64 Value
+)
+{
+	LONG64 current = *Target;
+
+	while (Value > current) {
+		LONG64 previous = InterlockedCompareExchange64(Target, Value, current);
+		if (previous == current) {
+			break;
+		}
+		current = previous;
+	}
+}
+
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD CPCI429EvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP CPCI429EvtDriverContextCleanup;
@@ -54,6 +404,12 @@ EVT_WDF_DEVICE_D0_ENTRY CPCI429EvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT CPCI429EvtDeviceD0Exit;
 EVT_WDF_DEVICE_PREPARE_HARDWARE CPCI429EvtDevicePrepareHardware;
 EVT_WDF_DEVICE_RELEASE_HARDWARE CPCI429EvtDeviceReleaseHardware;
+EVT_WDF_OBJECT_CONTEXT_CLEANUP CPCI429EvtDeviceContextCleanup;
+
+NTSTATUS
+CPCI429ReadConfiguration(
+	_In_ WDFDEVICE Device
+);
 
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CPCI429EvtIoDeviceControl;
 
@@ -124,8 +124,9 @@ Return Value:
 	WDFDEVICE device;
 	PDEVICE_CONTEXT deviceContext;
 
-	WDFQUEUE queue;
-	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES requestAttributes;
+	WDF_OBJECT_ATTRIBUTES fileAttributes;
+	WDF_FILEOBJECT_CONFIG fileConfig;
 
     UNREFERENCED_PARAMETER(Driver);
 
@@ -162,7 +163,24 @@ Return Value:
 
 	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, DEVICE_CONTEXT);
 
-	deviceAttributes.SynchronizationScope = WdfSynchronizationScopeDevice;
+	//
+	// No device-wide synchronization: the data-path queues are parallel and
+	// the control queue is sequential on its own.
+	//
+	deviceAttributes.SynchronizationScope = WdfSynchronizationScopeNone;
+	deviceAttributes.EvtCleanupCallback = CPCI429EvtDeviceContextCleanup;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, REQUEST_CONTEXT);
+	WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
+	//
+	// Each handle carries its own fan-out subscription.
+	//
+	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, WDF_NO_EVENT_CALLBACK, WDF_NO_EVENT_CALLBACK, CPCI429EvtFileCleanup);
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&fileAttributes, FILE_CONTEXT);
+	WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &fileAttributes);
+
+	WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, CPCI429EvtIoInCallerContext);
 
 	status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
 	if (!NT_SUCCESS(status)) {
@@ -170,33 +188,58 @@ Return Value:
 		return status;
 	}
 	deviceContext = DeviceGetContext(device);
-	//defaultʼdefaultУһʼdefault
-	WDF_IO_QUEUE_CONFIG_INIT(
-		&queueConfig,
-		WdfIoQueueDispatchSequential
-	);
 
-	queueConfig.EvtIoInternalDeviceControl = CPCI429EvtIoDeviceControl;
+	status = CPCI429ReadConfiguration(device);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
 
-	status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &queue);
+	status = CPCI429InterruptCreate(device);
 	if (!NT_SUCCESS(status)) {
-		DbgPrint("[%s:%d]: IOCREATEFAILED", __FUNCDNAME__, __LINE__);
 		return status;
 	}
-	//Ĭ϶
-	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(
-		&queueConfig,
-		WdfIoQueueDispatchParallel
-	);
-	
-	queueConfig.EvtIoDeviceControl = CPCI429EvtIoDeviceControl;
 
-	status = WdfIoQueueCreate(
-		device,
-		&queueConfig,
-		WDF_NO_OBJECT_ATTRIBUTES,
-		&queue
-	);
+	status = CPCI429RxInitialize(deviceContext);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: RXINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+
+	status = CPCI429FanoutInitialize(deviceContext);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: FANOUTINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	status = CPCI429HealthInitialize(device);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: HEALTHINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	status = CPCI429TriggerInitialize(device);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: TRIGGERINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	status = CPCI429AggregateInitialize(device);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: AGGREGATEINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	status = CPCI429SelfTestInitialize(device);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: SELFTESTINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	status = CPCI429BulkInitialize(device);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: BULKINITFAILED", __FUNCDNAME__, __LINE__);
+		return status;
+	}
+	//
+	// Route device control requests to separate data-path and
+	// control-path queues.
+	//
+	status = CPCI429QueueInitialize(device);
 	if (!NT_SUCCESS(status)) {
 		DbgPrint("[%s:%d]: QUEUECREATEFAILED", __FUNCDNAME__, __LINE__);
 		return status;
@@ -26,6 +26,15 @@ Environment:
 #include "Public.h"
 #include "device.h"
 #include "queue.h"
+#include "rx.h"
+#include "pool.h"
+#include "fanout.h"
+#include "health.h"
+#include "trigger.h"
+#include "aggregate.h"
+#include "selftest.h"
+#include "bulk.h"
+#include "interrupt.h"
 #include "trace.h"
 
 EXTERN_C_START
@@ -0,0 +1,457 @@
+/*++
+
+Module Name:
+
+    fanout.c
+
+Abstract:
+
+    This file contains the receive fan-out: one shared, read-only ring per
+    receive channel that any number of subscriber handles read through
+    their own mapping. The channel DPC writes each record once, and every
+    handle keeps its own cursor and label filter in its file context. A
+    reader that falls a full ring behind is told how much it lost instead
+    of holding the writer back.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "fanout.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429FanoutInitialize)
+#pragma alloc_text (PAGE, CPCI429FanoutSubscribe)
+#pragma alloc_text (PAGE, CPCI429EvtFileCleanup)
+#endif
+
+NTSTATUS
+CPCI429FanoutInitialize(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Allocates each channel's shared ring on the node of the channel's DPC
+    processor, with the header in its own page so the records start page
+    aligned. The whole ring is zeroed, since it is mapped into user mode.
+    Anything allocated here is freed by CPCI429FanoutCleanup.
+
+--*/
+{
+	PHYSICAL_ADDRESS lowest;
+	PHYSICAL_ADDRESS highest;
+	PHYSICAL_ADDRESS boundary;
+	ULONG i;
+
+	PAGED_CODE();
+
+	lowest.QuadPart = 0;
+	highest.QuadPart = MAXLONGLONG;
+	boundary.QuadPart = 0;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+
+		InitializeListHead(&channel->Subscribers);
+		KeInitializeSpinLock(&channel->SubscriberLock);
+	}
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+		SIZE_T bytes = PAGE_SIZE + DeviceContext->Config.SharedRingWords * sizeof(CPCI429_RX_RECORD);
+		PCPCI429_SHARED_RING shared;
+		PMDL mdl;
+
+		shared = (PCPCI429_SHARED_RING)MmAllocateContiguousNodeMemory(
+			bytes, lowest, highest, boundary, PAGE_READWRITE, channel->Node);
+		if (shared == NULL) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		RtlZeroMemory(shared, bytes);
+		shared->Capacity = DeviceContext->Config.SharedRingWords;
+		shared->RecordOffset = PAGE_SIZE;
+
+		mdl = IoAllocateMdl(shared, (ULONG)bytes, FALSE, FALSE, NULL);
+		if (mdl == NULL) {
+			MmFreeContiguousMemory(shared);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		MmBuildMdlForNonPagedPool(mdl);
+
+		channel->Shared = shared;
+		channel->SharedRecords = (PCPCI429_RX_RECORD)WDF_PTR_ADD_OFFSET(shared, PAGE_SIZE);
+		channel->SharedBytes = bytes;
+		channel->SharedMdl = mdl;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429FanoutCleanup(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Frees the shared rings. Called from device context cleanup, after the
+    last handle, and with it the last user mapping, has gone away.
+
+--*/
+{
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+
+		if (channel->SharedMdl != NULL) {
+			IoFreeMdl(channel->SharedMdl);
+			channel->SharedMdl = NULL;
+		}
+		if (channel->Shared != NULL) {
+			MmFreeContiguousMemory(channel->Shared);
+			channel->Shared = NULL;
+			channel->SharedRecords = NULL;
+		}
+	}
+}
+
+static
+BOOLEAN
+CPCI429FanoutCollect(
+	_In_ PRX_CHANNEL Channel,
+	_Inout_ PFILE_CONTEXT File,
+	_Out_ PCPCI429_SUBSCRIBER_WAIT_RESULT Result
+)
+/*++
+
+Routine Description:
+
+    Decides whether a subscriber has anything to be woken for and, if so,
+    fills Result and moves its cursor to the current head. Records that
+    match none of the subscriber's labels are skipped without a wakeup.
+    Called with the channel's SubscriberLock held.
+
+--*/
+{
+	ULONGLONG head = Channel->Shared->Head;
+	ULONGLONG capacity = Channel->Shared->Capacity;
+	ULONGLONG lost = 0;
+	ULONGLONG n;
+
+	if (head - File->Cursor > capacity) {
+		lost = head - capacity - File->Cursor;
+		File->Cursor = head - capacity;
+	}
+
+	if (lost == 0) {
+		if (head == File->Cursor) {
+			return FALSE;
+		}
+
+		if (!File->AllLabels) {
+			for (n = File->Cursor; n < head; n++) {
+				ULONG label = CPCI429_WORD_LABEL(Channel->SharedRecords[n & (capacity - 1)].Word);
+
+				if ((File->LabelMask[label >> 5] & (1UL << (label & 31))) != 0) {
+					break;
+				}
+			}
+			if (n == head) {
+				File->Cursor = head;
+				return FALSE;
+			}
+		}
+	}
+
+	Result->First = File->Cursor;
+	Result->End = head;
+	Result->Lost = lost;
+	File->Cursor = head;
+
+	return TRUE;
+}
+
+VOID
+CPCI429FanoutSubscribe(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SUBSCRIBE. Runs from EvtIoInCallerContext, since
+    the shared ring has to be mapped into the requesting process.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_SUBSCRIBE subscribe;
+	PCPCI429_SUBSCRIPTION subscription;
+	PFILE_CONTEXT file;
+	PRX_CHANNEL channel;
+	PVOID userAddress = NULL;
+	KIRQL irql;
+	ULONG i;
+
+	PAGED_CODE();
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_SUBSCRIBE), (PVOID*)&subscribe, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_SUBSCRIPTION), (PVOID*)&subscription, NULL);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	file = FileGetContext(WdfRequestGetFileObject(Request));
+
+	if (subscribe->Channel >= CPCI429_MAX_RX_CHANNELS) {
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return;
+	}
+
+	//
+	// Claim the handle so that a concurrent SUBSCRIBE on it cannot map the
+	// ring a second time.
+	//
+	if (InterlockedCompareExchange(&file->Claimed, 1, 0) != 0) {
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_STATE);
+		return;
+	}
+
+	channel = &DeviceContext->RxChannels[subscribe->Channel];
+
+	if (InterlockedIncrement(&channel->SubscriberCount) > CPCI429_MAX_SUBSCRIBERS) {
+		InterlockedDecrement(&channel->SubscriberCount);
+		InterlockedExchange(&file->Claimed, 0);
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return;
+	}
+
+	__try {
+		userAddress = MmMapLockedPagesSpecifyCache(channel->SharedMdl, UserMode, MmCached,
+			NULL, FALSE, NormalPagePriority | MdlMappingNoWrite);
+	} __except (EXCEPTION_EXECUTE_HANDLER) {
+		userAddress = NULL;
+	}
+	if (userAddress == NULL) {
+		InterlockedDecrement(&channel->SubscriberCount);
+		InterlockedExchange(&file->Claimed, 0);
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return;
+	}
+
+	file->UserAddress = userAddress;
+	file->Process = PsGetCurrentProcess();
+	ObReferenceObject(file->Process);
+
+	file->AllLabels = TRUE;
+	for (i = 0; i < ARRAYSIZE(file->LabelMask); i++) {
+		file->LabelMask[i] = subscribe->LabelMask[i];
+		if (subscribe->LabelMask[i] != 0) {
+			file->AllLabels = FALSE;
+		}
+	}
+
+	KeAcquireSpinLock(&channel->SubscriberLock, &irql);
+	file->Cursor = channel->Shared->Head;
+	file->PendingWait = NULL;
+	file->Channel = channel;
+	InsertTailList(&channel->Subscribers, &file->Link);
+	KeReleaseSpinLock(&channel->SubscriberLock, irql);
+
+	subscription->RingAddress = (ULONGLONG)(ULONG_PTR)userAddress;
+	subscription->StartSequence = file->Cursor;
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_SUBSCRIPTION));
+}
+
+VOID
+CPCI429FanoutWait(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SUBSCRIBER_WAIT. Completes at once if the handle
+    has new matching records or has been overrun, otherwise parks the
+    request in the file context until the channel DPC publishes some.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_SUBSCRIBER_WAIT_RESULT result;
+	PFILE_CONTEXT file;
+	PRX_CHANNEL channel;
+	KIRQL irql;
+
+	UNREFERENCED_PARAMETER(DeviceContext);
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_SUBSCRIBER_WAIT_RESULT), (PVOID*)&result, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	file = FileGetContext(WdfRequestGetFileObject(Request));
+	channel = file->Channel;
+	if (channel == NULL) {
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_STATE);
+		return;
+	}
+
+	KeAcquireSpinLock(&channel->SubscriberLock, &irql);
+
+	if (file->PendingWait != NULL) {
+		KeReleaseSpinLock(&channel->SubscriberLock, irql);
+		WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+		return;
+	}
+
+	if (CPCI429FanoutCollect(channel, file, result)) {
+		KeReleaseSpinLock(&channel->SubscriberLock, irql);
+		WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_SUBSCRIBER_WAIT_RESULT));
+		return;
+	}
+
+	status = WdfRequestMarkCancelableEx(Request, CPCI429EvtSubscriberWaitCanceled);
+	if (!NT_SUCCESS(status)) {
+		KeReleaseSpinLock(&channel->SubscriberLock, irql);
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	file->PendingWait = Request;
+	file->PendingResult = result;
+
+	KeReleaseSpinLock(&channel->SubscriberLock, irql);
+}
+
+VOID
+CPCI429FanoutNotify(
+	_In_ PRX_CHANNEL Channel
+)
+/*++
+
+Routine Description:
+
+    Called by the channel DPC after it published records. Completes the
+    parked waits of subscribers that have something to read.
+
+--*/
+{
+	WDFREQUEST completed[CPCI429_MAX_SUBSCRIBERS];
+	ULONG count = 0;
+	PLIST_ENTRY link;
+	ULONG i;
+
+	KeAcquireSpinLockAtDpcLevel(&Channel->SubscriberLock);
+
+	for (link = Channel->Subscribers.Flink; link != &Channel->Subscribers; link = link->Flink) {
+		PFILE_CONTEXT file = CONTAINING_RECORD(link, FILE_CONTEXT, Link);
+
+		if (file->PendingWait == NULL || count == ARRAYSIZE(completed)) {
+			continue;
+		}
+		if (!CPCI429FanoutCollect(Channel, file, file->PendingResult)) {
+			continue;
+		}
+
+		//
+		// If the request is being canceled, the cancel routine owns it and
+		// clears PendingWait itself.
+		//
+		if (NT_SUCCESS(WdfRequestUnmarkCancelable(file->PendingWait))) {
+			completed[count++] = file->PendingWait;
+			file->PendingWait = NULL;
+		}
+	}
+
+	KeReleaseSpinLockFromDpcLevel(&Channel->SubscriberLock);
+
+	for (i = 0; i < count; i++) {
+		WdfRequestCompleteWithInformation(completed[i], STATUS_SUCCESS, sizeof(CPCI429_SUBSCRIBER_WAIT_RESULT));
+	}
+}
+
+VOID
+CPCI429EvtSubscriberWaitCanceled(
+	_In_ WDFREQUEST Request
+)
+{
+	PFILE_CONTEXT file = FileGetContext(WdfRequestGetFileObject(Request));
+	KIRQL irql;
+
+	KeAcquireSpinLock(&file->Channel->SubscriberLock, &irql);
+	if (file->PendingWait == Request) {
+		file->PendingWait = NULL;
+	}
+	KeReleaseSpinLock(&file->Channel->SubscriberLock, irql);
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+VOID
+CPCI429EvtFileCleanup(
+	_In_ WDFFILEOBJECT FileObject
+)
+/*++
+
+Routine Description:
+
+    Drops the handle's subscription when its last handle is closed and
+    unmaps the shared ring from the process that mapped it.
+
+--*/
+{
+	PFILE_CONTEXT file = FileGetContext(FileObject);
+	PRX_CHANNEL channel = file->Channel;
+	WDFREQUEST request;
+	KAPC_STATE apcState;
+	KIRQL irql;
+
+	PAGED_CODE();
+
+	if (channel == NULL) {
+		return;
+	}
+
+	KeAcquireSpinLock(&channel->SubscriberLock, &irql);
+	RemoveEntryList(&file->Link);
+	request = file->PendingWait;
+	if (request != NULL && NT_SUCCESS(WdfRequestUnmarkCancelable(request))) {
+		file->PendingWait = NULL;
+	} else {
+		request = NULL;
+	}
+	KeReleaseSpinLock(&channel->SubscriberLock, irql);
+
+	if (request != NULL) {
+		WdfRequestComplete(request, STATUS_CANCELLED);
+	}
+
+	InterlockedDecrement(&channel->SubscriberCount);
+
+	if (file->Process == PsGetCurrentProcess()) {
+		MmUnmapLockedPages(file->UserAddress, channel->SharedMdl);
+	} else {
+		KeStackAttachProcess(file->Process, &apcState);
+		MmUnmapLockedPages(file->UserAddress, channel->SharedMdl);
+		KeUnstackDetachProcess(&apcState);
+	}
+	ObDereferenceObject(file->Process);
+	file->UserAddress = NULL;
+	file->Process = NULL;
+}
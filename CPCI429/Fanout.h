@@ -0,0 +1,76 @@
+/*++
+
+Module Name:
+
+    fanout.h
+
+Abstract:
+
+    This file contains the receive fan-out definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+//
+// Per-handle context. A handle subscribes to at most one receive channel.
+// Everything except Link is protected by the channel's SubscriberLock
+// once Channel is set.
+//
+typedef struct _FILE_CONTEXT {
+
+    LIST_ENTRY Link;            // on the channel's Subscribers list
+    PRX_CHANNEL Channel;        // NULL until subscribed
+    volatile LONG Claimed;      // set by the one SUBSCRIBE that may proceed
+    BOOLEAN AllLabels;
+    ULONG LabelMask[256 / 32];
+    ULONGLONG Cursor;           // next sequence this handle has not seen
+
+    WDFREQUEST PendingWait;
+    PCPCI429_SUBSCRIBER_WAIT_RESULT PendingResult;
+
+    PVOID UserAddress;          // mapping of the shared ring
+    PEPROCESS Process;          // process that owns UserAddress
+
+} FILE_CONTEXT, *PFILE_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILE_CONTEXT, FileGetContext)
+
+NTSTATUS
+CPCI429FanoutInitialize(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429FanoutCleanup(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429FanoutSubscribe(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429FanoutWait(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429FanoutNotify(
+    _In_ PRX_CHANNEL Channel
+    );
+
+//
+// Events from the file object and requests
+//
+EVT_WDF_FILE_CLEANUP CPCI429EvtFileCleanup;
+EVT_WDF_REQUEST_CANCEL CPCI429EvtSubscriberWaitCanceled;
+
+EXTERN_C_END
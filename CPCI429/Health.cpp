@@ -0,0 +1,376 @@
+/*++
+
+Module Name:
+
+    health.c
+
+Abstract:
+
+    This file contains the bus health monitor. The receive path keeps the
+    per-label statistics itself (CPCI429LabelUpdate in rxpath.h); this
+    module holds
+    the configuration, snapshot and alarm side. A periodic timer checks
+    the labels that have a staleness limit and raises alarms, which
+    complete CPCI429_IOCTL_WAIT_HEALTH_ALARM requests parked in a manual
+    queue, so monitor processes never poll.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "health.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429HealthInitialize)
+#pragma alloc_text (PAGE, CPCI429HealthStop)
+#endif
+
+NTSTATUS
+CPCI429HealthInitialize(
+	_In_ WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+	KeInitializeSpinLock(&pDeviceContext->HealthLock);
+
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, CPCI429EvtHealthTimer, CPCI429_HEALTH_TIMER_MS);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDeviceContext->HealthTimer);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfTimerCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	//
+	// Alarm waits are held across power transitions.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->HealthWaitQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+	}
+
+	return status;
+}
+
+VOID
+CPCI429HealthStart(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+	WdfTimerStart(DeviceContext->HealthTimer, WDF_REL_TIMEOUT_IN_MS(CPCI429_HEALTH_TIMER_MS));
+}
+
+VOID
+CPCI429HealthStop(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+{
+	PAGED_CODE();
+
+	WdfTimerStop(DeviceContext->HealthTimer, TRUE);
+}
+
+static
+VOID
+CPCI429HealthDeliver(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Hands pending alarms to parked wait requests until either runs out.
+
+--*/
+{
+	NTSTATUS status;
+	WDFREQUEST request;
+	PCPCI429_HEALTH_EVENT events;
+	size_t length;
+	ULONG count;
+	ULONG i;
+	KIRQL irql;
+
+	for (;;) {
+		KeAcquireSpinLock(&DeviceContext->HealthLock, &irql);
+
+		if (DeviceContext->HealthEventCount == 0 ||
+			!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->HealthWaitQueue, &request))) {
+			KeReleaseSpinLock(&DeviceContext->HealthLock, irql);
+			return;
+		}
+
+		status = WdfRequestRetrieveOutputBuffer(request, sizeof(CPCI429_HEALTH_EVENT), (PVOID*)&events, &length);
+		if (!NT_SUCCESS(status)) {
+			KeReleaseSpinLock(&DeviceContext->HealthLock, irql);
+			WdfRequestComplete(request, status);
+			continue;
+		}
+
+		count = (ULONG)(length / sizeof(CPCI429_HEALTH_EVENT));
+		if (count > DeviceContext->HealthEventCount) {
+			count = DeviceContext->HealthEventCount;
+		}
+		for (i = 0; i < count; i++) {
+			events[i] = DeviceContext->HealthEvents[(DeviceContext->HealthEventFirst + i) % ARRAYSIZE(DeviceContext->HealthEvents)];
+		}
+		DeviceContext->HealthEventFirst = (DeviceContext->HealthEventFirst + count) % ARRAYSIZE(DeviceContext->HealthEvents);
+		DeviceContext->HealthEventCount -= count;
+
+		KeReleaseSpinLock(&DeviceContext->HealthLock, irql);
+
+		WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, count * sizeof(CPCI429_HEALTH_EVENT));
+	}
+}
+
+VOID
+CPCI429HealthRaise(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONG Channel,
+	_In_ ULONG LabelSdi,
+	_In_ USHORT Type,
+	_In_ ULONGLONG Time
+)
+/*++
+
+Routine Description:
+
+    Records an alarm and wakes a waiting monitor. When nobody collects
+    alarms the oldest ones are dropped and counted.
+
+--*/
+{
+	PCPCI429_HEALTH_EVENT event;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&DeviceContext->HealthLock, &irql);
+
+	if (DeviceContext->HealthEventCount == ARRAYSIZE(DeviceContext->HealthEvents)) {
+		DeviceContext->HealthEventFirst = (DeviceContext->HealthEventFirst + 1) % ARRAYSIZE(DeviceContext->HealthEvents);
+		DeviceContext->HealthEventCount--;
+		DeviceContext->HealthEventsDropped++;
+	}
+
+	event = &DeviceContext->HealthEvents[(DeviceContext->HealthEventFirst + DeviceContext->HealthEventCount) % ARRAYSIZE(DeviceContext->HealthEvents)];
+	event->Channel = Channel;
+	event->LabelSdi = (USHORT)LabelSdi;
+	event->Type = Type;
+	event->Time = Time;
+	DeviceContext->HealthEventCount++;
+
+	KeReleaseSpinLock(&DeviceContext->HealthLock, irql);
+
+	CPCI429HealthDeliver(DeviceContext);
+}
+
+VOID
+CPCI429EvtHealthTimer(
+	_In_ WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+    Raises a staleness alarm for every watched label that has gone
+    longer than its limit without a word. A label that has never been
+    received counts from the moment its limit was set. Only the watch
+    list is scanned, not the whole label table. The same tick closes
+    trigger capture windows on channels that have gone quiet and ends
+    aggregation windows.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	ULONGLONG now = KeQueryInterruptTime();
+	ULONG i;
+	LONG n;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &pDeviceContext->RxChannels[i];
+		LONG watchCount = channel->StaleWatchCount;
+
+		if (channel->Labels == NULL) {
+			continue;
+		}
+
+		for (n = 0; n < watchCount; n++) {
+			ULONG index = channel->StaleWatch[n];
+
+			if (CPCI429LabelCheckStale(&channel->Labels[index], now)) {
+				InterlockedIncrement64(&channel->StaleAlarms);
+				CPCI429HealthRaise(pDeviceContext, i, index, CPCI429_HEALTH_STALE, now);
+				if ((channel->Capture.Sources & CPCI429_TRIGGER_ON_STALE) != 0) {
+					CPCI429TriggerFire(channel, CPCI429_TRIGGER_CAUSE_STALE, index, now);
+				}
+			}
+		}
+	}
+
+	CPCI429TriggerTick(pDeviceContext, now);
+	CPCI429AggregateTick(pDeviceContext, now);
+}
+
+NTSTATUS
+CPCI429HealthSetLabel(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SET_LABEL_HEALTH from the sequential control
+    queue, which is the only writer of the limits and the watch list.
+    Limits live in the label table, so they have to be set again after
+    the hardware has been released and prepared.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_LABEL_HEALTH_CONFIG config;
+	PRX_CHANNEL channel;
+	ULONGLONG now;
+	ULONG sdi;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_LABEL_HEALTH_CONFIG), (PVOID*)&config, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (config->Channel >= CPCI429_MAX_RX_CHANNELS ||
+		(config->Sdi != CPCI429_SDI_ANY_SOURCE && config->Sdi > 3)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	channel = &DeviceContext->RxChannels[config->Channel];
+	if (channel->Labels == NULL) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	now = KeQueryInterruptTime();
+
+	for (sdi = 0; sdi < 4; sdi++) {
+		ULONG index = (sdi << 8) | config->Label;
+		LONG n;
+
+		if (config->Sdi != CPCI429_SDI_ANY_SOURCE && config->Sdi != sdi) {
+			continue;
+		}
+
+		CPCI429LabelSetLimits(&channel->Labels[index], config, now);
+
+		if (config->StaleMs == 0) {
+			continue;
+		}
+
+		for (n = 0; n < channel->StaleWatchCount; n++) {
+			if (channel->StaleWatch[n] == index) {
+				break;
+			}
+		}
+		if (n == channel->StaleWatchCount) {
+			if (n == CPCI429_MAX_STALE_WATCH) {
+				return STATUS_INSUFFICIENT_RESOURCES;
+			}
+			channel->StaleWatch[n] = (USHORT)index;
+			InterlockedIncrement(&channel->StaleWatchCount);
+		}
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429HealthCompleteSnapshot(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PULONG channelIndex;
+	PCPCI429_LABEL_HEALTH health;
+	PRX_CHANNEL channel;
+	ULONGLONG now;
+	KIRQL irql;
+	ULONG i;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&channelIndex, NULL);
+	if (NT_SUCCESS(status)) {
+		status = *channelIndex < CPCI429_MAX_RX_CHANNELS ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+	}
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request,
+			CPCI429_LABEL_SDI_COUNT * sizeof(CPCI429_LABEL_HEALTH), (PVOID*)&health, NULL);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	channel = &DeviceContext->RxChannels[*channelIndex];
+	now = KeQueryInterruptTime();
+
+	//
+	// The ring lock keeps the table from being freed under us. The DPC
+	// keeps updating while we copy, which is fine for statistics.
+	//
+	KeAcquireSpinLock(&channel->ConsumerLock, &irql);
+
+	if (channel->Labels == NULL) {
+		KeReleaseSpinLock(&channel->ConsumerLock, irql);
+		WdfRequestComplete(Request, STATUS_DEVICE_NOT_READY);
+		return;
+	}
+
+	for (i = 0; i < CPCI429_LABEL_SDI_COUNT; i++) {
+		CPCI429LabelGetHealth(&channel->Labels[i], now, &health[i]);
+	}
+
+	KeReleaseSpinLock(&channel->ConsumerLock, irql);
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, CPCI429_LABEL_SDI_COUNT * sizeof(CPCI429_LABEL_HEALTH));
+}
+
+VOID
+CPCI429HealthWait(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Parks a CPCI429_IOCTL_WAIT_HEALTH_ALARM request, then delivers any
+    alarm raised before it was parked.
+
+--*/
+{
+	NTSTATUS status;
+	PVOID buffer;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_HEALTH_EVENT), &buffer, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestForwardToIoQueue(Request, DeviceContext->HealthWaitQueue);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	CPCI429HealthDeliver(DeviceContext);
+}
@@ -0,0 +1,65 @@
+/*++
+
+Module Name:
+
+    health.h
+
+Abstract:
+
+    This file contains the bus health monitor definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+#define CPCI429_HEALTH_TIMER_MS 10
+
+NTSTATUS
+CPCI429HealthInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CPCI429HealthStart(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429HealthStop(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429HealthRaise(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ ULONG Channel,
+    _In_ ULONG LabelSdi,
+    _In_ USHORT Type,
+    _In_ ULONGLONG Time
+    );
+
+NTSTATUS
+CPCI429HealthSetLabel(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429HealthCompleteSnapshot(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429HealthWait(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+EVT_WDF_TIMER CPCI429EvtHealthTimer;
+
+EXTERN_C_END
@@ -0,0 +1,139 @@
+/*++
+
+Module Name:
+
+    interrupt.c
+
+Abstract:
+
+    This file contains the interrupt entry points and callbacks.
+
+    The ISR only acknowledges the board and queues the DPC of each
+    receive channel that has data. Every channel DPC is targeted at its
+    own processor, so the receive work of several boards is spread over
+    the cores of their NUMA nodes instead of landing on the one core
+    that services the interrupt.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "interrupt.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429InterruptCreate)
+#endif
+
+NTSTATUS
+CPCI429InterruptCreate(
+	_In_ WDFDEVICE Device
+)
+/*++
+
+Routine Description:
+
+    Creates the interrupt object and applies the affinity policy. An
+    explicit InterruptAffinity from the registry wins; otherwise the
+    interrupt is kept on the processors of the board's NUMA node.
+
+Arguments:
+
+    Device - Handle to a framework device object.
+
+Return Value:
+
+    NTSTATUS
+
+--*/
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_INTERRUPT_CONFIG interruptConfig;
+	WDF_INTERRUPT_EXTENDED_POLICY policy;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+
+	WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, CPCI429EvtInterruptIsr, NULL);
+	interruptConfig.EvtInterruptEnable = CPCI429EvtInterruptEnable;
+	interruptConfig.EvtInterruptDisable = CPCI429EvtInterruptDisable;
+
+	status = WdfInterruptCreate(Device, &interruptConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->Interrupt);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfInterruptCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	WDF_INTERRUPT_EXTENDED_POLICY_INIT(&policy);
+	policy.Priority = WdfIrqPriorityHigh;
+	policy.Policy = WdfIrqPolicySpecifiedProcessors;
+
+	if (pDeviceContext->Config.InterruptAffinity != 0) {
+		policy.TargetProcessorSet.Group = (USHORT)pDeviceContext->Config.InterruptGroup;
+		policy.TargetProcessorSet.Mask = pDeviceContext->Config.InterruptAffinity;
+	} else {
+		policy.TargetProcessorSet = pDeviceContext->NodeAffinity;
+	}
+
+	WdfInterruptSetExtendedPolicy(pDeviceContext->Interrupt, &policy);
+
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN
+CPCI429EvtInterruptIsr(
+	_In_ WDFINTERRUPT Interrupt,
+	_In_ ULONG MessageID
+)
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	ULONG pending;
+	ULONG channel;
+
+	UNREFERENCED_PARAMETER(MessageID);
+
+	pDeviceContext = DeviceGetContext(WdfInterruptGetDevice(Interrupt));
+
+	pending = CPCI429RegAckRxInterrupts(pDeviceContext->BAR0_VirtualAddress);
+	if (pending == 0) {
+		return FALSE;
+	}
+
+	for (channel = 0; pending != 0; channel++, pending >>= 1) {
+		if (pending & 1) {
+			KeInsertQueueDpc(&pDeviceContext->RxChannels[channel].Dpc, NULL, NULL);
+		}
+	}
+
+	return TRUE;
+}
+
+NTSTATUS
+CPCI429EvtInterruptEnable(
+	_In_ WDFINTERRUPT Interrupt,
+	_In_ WDFDEVICE AssociatedDevice
+)
+{
+	UNREFERENCED_PARAMETER(Interrupt);
+
+	CPCI429RegEnableRxInterrupts(DeviceGetContext(AssociatedDevice)->BAR0_VirtualAddress, CPCI429_INT_RX_MASK);
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+CPCI429EvtInterruptDisable(
+	_In_ WDFINTERRUPT Interrupt,
+	_In_ WDFDEVICE AssociatedDevice
+)
+{
+	UNREFERENCED_PARAMETER(Interrupt);
+
+	CPCI429RegEnableRxInterrupts(DeviceGetContext(AssociatedDevice)->BAR0_VirtualAddress, 0);
+
+	return STATUS_SUCCESS;
+}
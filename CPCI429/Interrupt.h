@@ -0,0 +1,31 @@
+/*++
+
+Module Name:
+
+    interrupt.h
+
+Abstract:
+
+    This file contains the interrupt definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+NTSTATUS
+CPCI429InterruptCreate(
+    _In_ WDFDEVICE Device
+    );
+
+//
+// Events from the interrupt object
+//
+EVT_WDF_INTERRUPT_ISR CPCI429EvtInterruptIsr;
+EVT_WDF_INTERRUPT_ENABLE CPCI429EvtInterruptEnable;
+EVT_WDF_INTERRUPT_DISABLE CPCI429EvtInterruptDisable;
+
+EXTERN_C_END
@@ -0,0 +1,313 @@
+/*++
+
+Module Name:
+
+    loopback.h
+
+Abstract:
+
+    The loopback self-test's run state and word checking, shared by the
+    driver and the Linux user-mode backend. Each side supplies its own
+    pump, clock and completion; both generate the same words, check what
+    comes back the same way and report the same results. Times are in
+    ticks of the side's clock, TickFrequency per second.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _LOOPBACK_H
+#define _LOOPBACK_H
+
+#include "RxPath.h"
+
+#define CPCI429_SELF_TEST_GRACE_MS 100   // drain time after the last word is sent
+#define CPCI429_SELF_TEST_BURST    256   // words per channel per pump
+#define CPCI429_SELF_TEST_STAMPS   1024  // power of two, more than can be in flight
+#define CPCI429_SELF_TEST_WORD_BITS 36   // 32 data bits and the 4-bit gap
+
+//
+// One self-test run. Send state is owned by the pump, receive state by
+// whoever drains the receive channel.
+//
+typedef struct _SELF_TEST_CHANNEL
+{
+	volatile ULONG NextSend;
+	ULONG NextExpected;
+	ULONG SavedTxControl;
+	ULONG SavedRxControl;
+	CPCI429_SELF_TEST_CHANNEL Result;
+	ULONGLONG Stamps[CPCI429_SELF_TEST_STAMPS];
+
+} SELF_TEST_CHANNEL, *PSELF_TEST_CHANNEL;
+
+typedef struct _SELF_TEST
+{
+	ULONG ChannelMask;
+	ULONG Label;
+	ULONGLONG MaxLatency;       // ticks
+	ULONG MaxQueued;            // transmit FIFO words, half a grace period of line time
+	ULONG BitRate;              // bits per second on the tested lines
+	ULONGLONG TickFrequency;
+	ULONGLONG Start;
+	ULONGLONG Deadline;
+	ULONGLONG Stopped;
+	BOOLEAN Draining;
+	ULONGLONG Dpcs;             // CPU totals at the start of the run
+	ULONGLONG DpcTicks;
+	ULONGLONG Pumps;
+	ULONGLONG PumpTicks;
+	SELF_TEST_CHANNEL Channel[CPCI429_MAX_TX_CHANNELS];
+
+} SELF_TEST, *PSELF_TEST;
+
+//
+// TRUE if Config describes a run that can be started.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429SelfTestValidConfig(
+	_In_ const CPCI429_SELF_TEST_CONFIG *Config
+)
+{
+	return Config->ChannelMask != 0 && (Config->ChannelMask >> CPCI429_MAX_TX_CHANNELS) == 0 &&
+		Config->Loopback <= CPCI429_LOOPBACK_EXTERNAL &&
+		Config->DurationMs != 0 && Config->DurationMs <= CPCI429_SELF_TEST_MAX_MS &&
+		Config->Label <= 0xFF;
+}
+
+//
+// Starts the run in Test, which must be zeroed, at Start.
+//
+FORCEINLINE
+VOID
+CPCI429SelfTestBegin(
+	_Inout_ PSELF_TEST Test,
+	_In_ const CPCI429_SELF_TEST_CONFIG *Config,
+	_In_ ULONGLONG Start,
+	_In_ ULONGLONG TickFrequency
+)
+{
+	ULONG i;
+
+	Test->ChannelMask = Config->ChannelMask;
+	Test->Label = Config->Label;
+	Test->TickFrequency = TickFrequency;
+	Test->Start = Start;
+	Test->Deadline = Start + TickFrequency * Config->DurationMs / 1000;
+	Test->MaxLatency = TickFrequency * Config->MaxLatencyUs / 1000000;
+	Test->BitRate = Config->Speed == CPCI429_SPEED_HIGH ? 100000 : 12500;
+	Test->MaxQueued = Test->BitRate * CPCI429_SELF_TEST_GRACE_MS / 2000 / CPCI429_SELF_TEST_WORD_BITS;
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		if (Test->ChannelMask & (1UL << i)) {
+			Test->Channel[i].Result.LatencyMin = MAXULONGLONG;
+		}
+	}
+}
+
+//
+// The channel control value for the tested pairs.
+//
+FORCEINLINE
+ULONG
+CPCI429SelfTestControl(
+	_In_ const CPCI429_SELF_TEST_CONFIG *Config,
+	_In_ BOOLEAN Receiver
+)
+{
+	ULONG control = CPCI429_CTRL_ENABLE | CPCI429_CTRL_ODD_PARITY;
+
+	if (Config->Speed == CPCI429_SPEED_HIGH) {
+		control |= CPCI429_CTRL_HIGH_SPEED;
+	}
+	if (Receiver && Config->Loopback == CPCI429_LOOPBACK_INTERNAL) {
+		control |= CPCI429_CTRL_LOOPBACK;
+	}
+
+	return control;
+}
+
+//
+// How many words to queue on a transmit channel whose FIFO status is
+// TxStatus. Keeping the FIFO shallow lets every word sent before the
+// deadline come back within the grace period, even at low speed.
+//
+FORCEINLINE
+ULONG
+CPCI429SelfTestRoom(
+	_In_ const SELF_TEST *Test,
+	_In_ ULONG TxStatus
+)
+{
+	ULONG queued = CPCI429_FIFO_COUNT(TxStatus);
+
+	if ((TxStatus & CPCI429_FIFO_FULL) || queued >= Test->MaxQueued) {
+		return 0;
+	}
+
+	return Test->MaxQueued - queued < CPCI429_SELF_TEST_BURST ? Test->MaxQueued - queued : CPCI429_SELF_TEST_BURST;
+}
+
+//
+// The stamp of a word written at Now behind Queued words in the transmit
+// FIFO: when it is expected to start onto the line, with the FIFO
+// draining back-to-back. Latency so covers the bus and the receive path
+// rather than the queue the pump keeps in front of each word.
+//
+FORCEINLINE
+ULONGLONG
+CPCI429SelfTestSendTime(
+	_In_ const SELF_TEST *Test,
+	_In_ ULONGLONG Now,
+	_In_ ULONG Queued
+)
+{
+	return Now + (ULONGLONG)Queued * CPCI429_SELF_TEST_WORD_BITS * Test->TickFrequency / Test->BitRate;
+}
+
+//
+// The word sent with sequence number Sequence on Channel.
+//
+FORCEINLINE
+ULONG
+CPCI429SelfTestWord(
+	_In_ ULONG Label,
+	_In_ ULONG Channel,
+	_In_ ULONG Sequence
+)
+{
+	ULONG word = (Label & 0xFF) | ((Channel & 0x3) << 8) | ((Sequence & 0x7FFFF) << 10);
+
+	return CPCI429OddParity(word) ? word : word | 0x80000000;
+}
+
+//
+// Checks one word drained from a receive channel during a run. Stamp is
+// the clock at the start of the drain. Returns TRUE if the channel is
+// under test and the word was consumed.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429SelfTestReceive(
+	_Inout_ PSELF_TEST Test,
+	_In_ ULONG Channel,
+	_In_ ULONG Word,
+	_In_ ULONGLONG Stamp
+)
+{
+	PSELF_TEST_CHANNEL channel;
+	PCPCI429_SELF_TEST_CHANNEL result;
+	ULONGLONG latency;
+	ULONGLONG us;
+	ULONG sequence;
+	ULONG bucket;
+
+	if (Channel >= CPCI429_MAX_TX_CHANNELS || !(Test->ChannelMask & (1UL << Channel))) {
+		return FALSE;
+	}
+
+	channel = &Test->Channel[Channel];
+	result = &channel->Result;
+
+	if (CPCI429_WORD_LABEL(Word) != Test->Label || CPCI429_WORD_SDI(Word) != (Channel & 0x3) ||
+		!CPCI429OddParity(Word)) {
+		result->ContentErrors++;
+		return TRUE;
+	}
+
+	//
+	// Skip ahead over missing words; a number from behind is a duplicate
+	// or out of order and is only counted.
+	//
+	sequence = CPCI429_WORD_DATA(Word);
+	if (sequence != (channel->NextExpected & 0x7FFFF)) {
+		ULONG skipped = (sequence - channel->NextExpected) & 0x7FFFF;
+
+		result->SequenceErrors++;
+		if (skipped >= 0x40000) {
+			return TRUE;
+		}
+		channel->NextExpected += skipped;
+	}
+
+	if (channel->NextSend - channel->NextExpected - 1 >= CPCI429_SELF_TEST_STAMPS) {
+		//
+		// Not sent in this run, or so old its stamp has been reused.
+		//
+		result->ContentErrors++;
+		channel->NextExpected++;
+		return TRUE;
+	}
+
+	MemoryBarrier();
+	latency = channel->Stamps[channel->NextExpected & (CPCI429_SELF_TEST_STAMPS - 1)];
+	latency = Stamp > latency ? Stamp - latency : 0;
+
+	if (latency < result->LatencyMin) {
+		result->LatencyMin = latency;
+	}
+	if (latency > result->LatencyMax) {
+		result->LatencyMax = latency;
+	}
+	result->LatencySum += latency;
+	if (Test->MaxLatency != 0 && latency > Test->MaxLatency) {
+		result->LateWords++;
+	}
+
+	us = latency * 1000000 / Test->TickFrequency;
+	bucket = us == 0 ? 0 : (ULONG)RtlFindMostSignificantBit(us) + 1;
+	if (bucket >= CPCI429_LATENCY_BUCKETS) {
+		bucket = CPCI429_LATENCY_BUCKETS - 1;
+	}
+	result->LatencyHistogram[bucket]++;
+
+	result->WordsReceived++;
+	channel->NextExpected++;
+
+	return TRUE;
+}
+
+//
+// Fills in the results of a finished run once nothing drains the tested
+// channels any more. Outcome and the host cost beyond the pump are left
+// to the caller.
+//
+FORCEINLINE
+VOID
+CPCI429SelfTestResults(
+	_Inout_ PSELF_TEST Test,
+	_Out_ PCPCI429_SELF_TEST_RESULT Result
+)
+{
+	ULONG i;
+
+	RtlZeroMemory(Result, sizeof(CPCI429_SELF_TEST_RESULT));
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PCPCI429_SELF_TEST_CHANNEL channel = &Test->Channel[i].Result;
+
+		if (!(Test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		if (channel->WordsSent > channel->WordsReceived + channel->ContentErrors) {
+			channel->WordsLost = channel->WordsSent - channel->WordsReceived - channel->ContentErrors;
+		}
+		if (channel->WordsReceived == 0) {
+			channel->LatencyMin = 0;
+		}
+	}
+
+	Result->TickFrequency = Test->TickFrequency;
+	Result->Elapsed = Test->Stopped - Test->Start;
+	Result->Pumps = Test->Pumps;
+	Result->PumpTicks = Test->PumpTicks;
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		Result->Channel[i] = Test->Channel[i].Result;
+	}
+}
+
+#endif // _LOOPBACK_H
@@ -0,0 +1,223 @@
+/*++
+
+Module Name:
+
+    pool.c
+
+Abstract:
+
+    This file contains the preallocated block pools. Each pool is one
+    non-paged arena cut into fixed-size blocks when the hardware is
+    prepared and released with the hardware, so allocations at
+    DISPATCH_LEVEL are an interlocked pop and never reach system pool.
+    A pool that runs dry fails the allocation and counts an exhaustion.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include <ntintsafe.h>
+#include "pool.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429PoolsAllocate)
+#pragma alloc_text (PAGE, CPCI429PoolsFree)
+#endif
+
+static
+NTSTATUS
+CPCI429PoolCreate(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_Out_ PBLOCK_POOL Pool,
+	_In_ SIZE_T BlockSize,
+	_In_ ULONG Capacity
+)
+{
+	NTSTATUS status;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	PUCHAR arena;
+	SIZE_T arenaBytes;
+	ULONG i;
+
+	PAGED_CODE();
+
+	InitializeSListHead(&Pool->FreeList);
+	Pool->Arena = NULL;
+	Pool->BlockSize = 0;
+	Pool->Capacity = 0;
+	Pool->InUse = 0;
+	Pool->HighWater = 0;
+	Pool->Allocations = 0;
+	Pool->Exhaustions = 0;
+
+	//
+	// Every block starts with the free list link, which must be aligned.
+	//
+	BlockSize = (BlockSize + MEMORY_ALLOCATION_ALIGNMENT - 1) & ~(SIZE_T)(MEMORY_ALLOCATION_ALIGNMENT - 1);
+	if (BlockSize > MAXULONG || !NT_SUCCESS(RtlSIZETMult(BlockSize, Capacity, &arenaBytes))) {
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (arenaBytes == 0) {
+		return STATUS_SUCCESS;
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = WdfObjectContextGetObject(DeviceContext);
+
+	status = WdfMemoryCreate(&attributes, NonPagedPool, 'S924', arenaBytes, &Pool->Arena, (PVOID*)&arena);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: pool arena allocation failed, %Iu bytes", __FUNCDNAME__, __LINE__, arenaBytes);
+		Pool->Arena = NULL;
+		return status;
+	}
+
+	for (i = Capacity; i > 0; i--) {
+		InterlockedPushEntrySList(&Pool->FreeList, (PSLIST_ENTRY)(arena + (i - 1) * BlockSize));
+	}
+
+	Pool->BlockSize = (ULONG)BlockSize;
+	Pool->Capacity = Capacity;
+
+	return STATUS_SUCCESS;
+}
+
+static
+VOID
+CPCI429PoolDestroy(
+	_Inout_ PBLOCK_POOL Pool
+)
+{
+	PAGED_CODE();
+
+	NT_ASSERT(Pool->InUse == 0);
+
+	InterlockedFlushSList(&Pool->FreeList);
+	if (Pool->Arena != NULL) {
+		WdfObjectDelete(Pool->Arena);
+		Pool->Arena = NULL;
+	}
+	Pool->Capacity = 0;
+}
+
+NTSTATUS
+CPCI429PoolsAllocate(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Sizes the pools from the configuration. Called when the hardware is
+    prepared; the counters restart with every sizing.
+
+--*/
+{
+	NTSTATUS status;
+	SIZE_T contextSize;
+
+	PAGED_CODE();
+
+	status = CPCI429PoolCreate(DeviceContext, &DeviceContext->Pools[CPCI429_POOL_RECORDS],
+		(SIZE_T)DeviceContext->Config.PoolBlockRecords * sizeof(CPCI429_RX_RECORD),
+		DeviceContext->Config.PoolRecordBlocks);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	contextSize = max(sizeof(SELF_TEST), sizeof(BULK_TRANSFER));
+
+	return CPCI429PoolCreate(DeviceContext, &DeviceContext->Pools[CPCI429_POOL_CONTEXTS],
+		contextSize, DeviceContext->Config.PoolContexts);
+}
+
+VOID
+CPCI429PoolsFree(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Releases the pool arenas. D0Exit has already stopped everything that
+    holds a block.
+
+--*/
+{
+	ULONG i;
+
+	PAGED_CODE();
+
+	for (i = 0; i < CPCI429_POOL_COUNT; i++) {
+		CPCI429PoolDestroy(&DeviceContext->Pools[i]);
+	}
+}
+
+PVOID
+CPCI429PoolAllocate(
+	_In_ PBLOCK_POOL Pool
+)
+/*++
+
+Routine Description:
+
+    Takes a block from the pool, at IRQL <= DISPATCH_LEVEL. Returns NULL
+    when every block is in use or the pool has not been sized.
+
+--*/
+{
+	PSLIST_ENTRY block;
+
+	block = InterlockedPopEntrySList(&Pool->FreeList);
+	if (block == NULL) {
+		InterlockedIncrement64(&Pool->Exhaustions);
+		return NULL;
+	}
+
+	InterlockedIncrement64(&Pool->Allocations);
+	CPCI429InterlockedMax(&Pool->HighWater, InterlockedIncrement(&Pool->InUse));
+
+	return block;
+}
+
+VOID
+CPCI429PoolFree(
+	_In_ PBLOCK_POOL Pool,
+	_In_ PVOID Block
+)
+{
+	InterlockedDecrement(&Pool->InUse);
+	InterlockedPushEntrySList(&Pool->FreeList, (PSLIST_ENTRY)Block);
+}
+
+VOID
+CPCI429PoolCompleteStats(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_POOL_STATS_SNAPSHOT snapshot;
+	ULONG i;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_POOL_STATS_SNAPSHOT), (PVOID*)&snapshot, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	for (i = 0; i < CPCI429_POOL_COUNT; i++) {
+		PBLOCK_POOL pool = &DeviceContext->Pools[i];
+
+		snapshot->Pool[i].BlockSize = pool->BlockSize;
+		snapshot->Pool[i].Capacity = pool->Capacity;
+		snapshot->Pool[i].InUse = (ULONG)pool->InUse;
+		snapshot->Pool[i].HighWater = (ULONG)pool->HighWater;
+		snapshot->Pool[i].Allocations = (ULONGLONG)pool->Allocations;
+		snapshot->Pool[i].Exhaustions = (ULONGLONG)pool->Exhaustions;
+	}
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_POOL_STATS_SNAPSHOT));
+}
@@ -0,0 +1,46 @@
+/*++
+
+Module Name:
+
+    pool.h
+
+Abstract:
+
+    This file contains the preallocated block pool definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+NTSTATUS
+CPCI429PoolsAllocate(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429PoolsFree(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+PVOID
+CPCI429PoolAllocate(
+    _In_ PBLOCK_POOL Pool
+    );
+
+VOID
+CPCI429PoolFree(
+    _In_ PBLOCK_POOL Pool,
+    _In_ PVOID Block
+    );
+
+VOID
+CPCI429PoolCompleteStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+EXTERN_C_END
@@ -21,15 +21,621 @@ Environment:
 #ifndef _USER_H
 #define _USER_H
 
+#ifdef _WIN32
 #include <initguid.h>
 
 DEFINE_GUID (GUID_DEVINTERFACE_CPCI429,
     0xdd01f255,0x19ac,0x4e7e,0xae,0x35,0x15,0x6b,0xa0,0x4a,0xc4,0xe6);
 // {dd01f255-19ac-4e7e-ae35-156ba04ac4e6}
+#endif
 
 #define CPCI429_IOCTL_IN_BUFFERED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x800, METHOD_BUFFERED, FILE_ANY_ACCESS)//the least value is 0x800
 #define CPCI429_IOCTL_OUT_BUFFERED CTL_CODE(FILE_DEVICE_UNKNOWN, 0x801, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define CPCI429_IOCTL_READ_PADDRESS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x802, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define CPCI429_IOCTL_WRITE_OFFSETADDRESS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_ANY_ACCESS)
 
+//
+// Data-path IOCTLs. These are dispatched to their own parallel queues so
+// they are never held up behind configuration traffic.
+//
+#define CPCI429_IOCTL_RX_READ CTL_CODE(FILE_DEVICE_UNKNOWN, 0x810, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_TX_SUBMIT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x811, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_RX_READ_RECORDS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x812, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SUBSCRIBE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x813, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SUBSCRIBER_WAIT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x814, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_WAIT_HEALTH_ALARM CTL_CODE(FILE_DEVICE_UNKNOWN, 0x815, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_BULK_TRANSFER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x816, METHOD_IN_DIRECT, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_RX_READ_WAIT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x817, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x818, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_WAIT_AGGREGATES CTL_CODE(FILE_DEVICE_UNKNOWN, 0x819, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Control-path IOCTLs. These are serialized on one sequential queue.
+//
+#define CPCI429_IOCTL_SET_CHANNEL_CONFIG CTL_CODE(FILE_DEVICE_UNKNOWN, 0x820, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SET_ON_CHANGE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x821, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SET_LABEL_HEALTH CTL_CODE(FILE_DEVICE_UNKNOWN, 0x822, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SELF_TEST CTL_CODE(FILE_DEVICE_UNKNOWN, 0x823, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SET_TRIGGER_CAPTURE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x824, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_TRIGGER CTL_CODE(FILE_DEVICE_UNKNOWN, 0x825, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_SET_AGGREGATION CTL_CODE(FILE_DEVICE_UNKNOWN, 0x826, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+//
+// Statistics IOCTLs. Answered directly from the default queue.
+//
+#define CPCI429_IOCTL_GET_QUEUE_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x830, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_GET_CPU_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x831, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_GET_RX_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x832, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_GET_LABEL_HEALTH CTL_CODE(FILE_DEVICE_UNKNOWN, 0x833, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_GET_BULK_STATUS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x834, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define CPCI429_IOCTL_GET_POOL_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 0x835, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define CPCI429_MAX_RX_CHANNELS 8
+#define CPCI429_MAX_TX_CHANNELS 8
+
+#define CPCI429_SPEED_LOW  0   // 12.5 kbps
+#define CPCI429_SPEED_HIGH 1   // 100 kbps
+
+#define CPCI429_DIRECTION_RX 0
+#define CPCI429_DIRECTION_TX 1
+
+//
+// ARINC 429 word fields, bit 0 being the first bit on the wire.
+//
+#define CPCI429_WORD_LABEL(w)  ((w) & 0xFF)
+#define CPCI429_WORD_SDI(w)    (((w) >> 8) & 0x3)
+#define CPCI429_WORD_DATA(w)   (((w) >> 10) & 0x7FFFF)
+#define CPCI429_WORD_SSM(w)    (((w) >> 29) & 0x3)
+#define CPCI429_WORD_PARITY(w) (((w) >> 31) & 0x1)
+
+//
+// Label and SDI together identify one source; tables indexed this way
+// have CPCI429_LABEL_SDI_COUNT entries.
+//
+#define CPCI429_LABEL_SDI_INDEX(w) ((w) & 0x3FF)
+#define CPCI429_LABEL_SDI_COUNT    1024
+
+//
+// CPCI429_IOCTL_RX_READ and CPCI429_IOCTL_RX_READ_RECORDS input. The output
+// buffer receives as many raw 32-bit words, or CPCI429_RX_RECORDs, as fit,
+// oldest first. CPCI429_IOCTL_RX_READ_WAIT reads records like
+// RX_READ_RECORDS but stays pending while the ring is empty, so one
+// overlapped request per channel replaces polling.
+//
+typedef struct _CPCI429_RX_READ {
+	ULONG Channel;
+} CPCI429_RX_READ, *PCPCI429_RX_READ;
+
+//
+// CPCI429_IOCTL_TX_SUBMIT input. WordCount words follow the header. The
+// request's information field is set to the number of words accepted.
+//
+typedef struct _CPCI429_TX_SUBMIT {
+	ULONG Channel;
+	ULONG WordCount;
+	ULONG Words[1];
+} CPCI429_TX_SUBMIT, *PCPCI429_TX_SUBMIT;
+
+typedef struct _CPCI429_CHANNEL_CONFIG {
+	ULONG Channel;
+	ULONG Direction;    // CPCI429_DIRECTION_*
+	ULONG Speed;        // CPCI429_SPEED_*
+	ULONG OddParity;    // nonzero to generate/check odd parity on bit 32
+	ULONG Enable;
+} CPCI429_CHANNEL_CONFIG, *PCPCI429_CHANNEL_CONFIG;
+
+//
+// One received word as kept in the driver's per-channel receive ring.
+// Timestamp is system interrupt time (100ns units) at drain.
+//
+typedef struct _CPCI429_RX_RECORD {
+	ULONG Word;
+	ULONG Flags;        // CPCI429_RX_FLAG_*
+	ULONGLONG Timestamp;
+} CPCI429_RX_RECORD, *PCPCI429_RX_RECORD;
+
+#define CPCI429_RX_FLAG_HEARTBEAT 0x00000001   // unchanged on-change word, sent to show the label is alive
+#define CPCI429_RX_FLAG_GAP       0x00000002   // words were lost to a full board FIFO just before this one
+
+//
+// Words lost in the gap before a CPCI429_RX_FLAG_GAP record, saturating
+// at 0xFFFF, which also marks a gap the board had not yet counted when
+// it was delivered. The exact totals are in the channel's receive
+// statistics.
+//
+#define CPCI429_RX_GAP_SHIFT 16
+#define CPCI429_RX_GAP_WORDS(flags) ((flags) >> CPCI429_RX_GAP_SHIFT)
+
+//
+// Fan-out of one receive channel to several readers. A handle subscribes
+// with CPCI429_IOCTL_SUBSCRIBE and gets the channel's shared ring mapped
+// read-only into its process. The driver writes each received record to
+// that ring once; every subscriber handle keeps its own cursor.
+//
+#define CPCI429_MAX_SUBSCRIBERS 16
+
+//
+// Header at the start of the shared mapping. Record n lives at slot
+// n & (Capacity - 1). Records [.., Head) are complete. A copy of record n
+// is only valid if WriteHead, re-read after the copy, is no more than
+// n + Capacity.
+//
+typedef struct _CPCI429_SHARED_RING {
+	volatile ULONGLONG Head;
+	volatile ULONGLONG WriteHead;
+	ULONG Capacity;
+	ULONG RecordOffset;         // bytes from the start of the mapping to slot 0
+} CPCI429_SHARED_RING, *PCPCI429_SHARED_RING;
+
+#define CPCI429_SHARED_RECORD(ring, n) \
+	((PCPCI429_RX_RECORD)((PUCHAR)(ring) + (ring)->RecordOffset) + ((n) & ((ring)->Capacity - 1)))
+
+//
+// CPCI429_IOCTL_SUBSCRIBE input. An all-zero LabelMask subscribes to every
+// label; otherwise CPCI429_IOCTL_SUBSCRIBER_WAIT only completes when a
+// record with a selected label has arrived.
+//
+typedef struct _CPCI429_SUBSCRIBE {
+	ULONG Channel;
+	ULONG LabelMask[256 / 32];
+} CPCI429_SUBSCRIBE, *PCPCI429_SUBSCRIBE;
+
+typedef struct _CPCI429_SUBSCRIPTION {
+	ULONGLONG RingAddress;      // PCPCI429_SHARED_RING in the caller's process
+	ULONGLONG StartSequence;
+} CPCI429_SUBSCRIPTION, *PCPCI429_SUBSCRIPTION;
+
+//
+// CPCI429_IOCTL_SUBSCRIBER_WAIT output. Records [First, End) are new for
+// this handle. Lost is nonzero when the reader fell more than a ring
+// behind; First then starts at the oldest record still in the ring.
+//
+typedef struct _CPCI429_SUBSCRIBER_WAIT_RESULT {
+	ULONGLONG First;
+	ULONGLONG End;
+	ULONGLONG Lost;
+} CPCI429_SUBSCRIBER_WAIT_RESULT, *PCPCI429_SUBSCRIBER_WAIT_RESULT;
+
+//
+// CPCI429_IOCTL_SET_ON_CHANGE input. Labels whose bit is set in LabelMask
+// are only delivered when their data or SSM differs from the last word
+// seen with the same label and SDI, or when HeartbeatMs has passed since
+// that source was last delivered. A HeartbeatMs of 0 sends no heartbeats.
+//
+typedef struct _CPCI429_ON_CHANGE_CONFIG {
+	ULONG Channel;
+	ULONG HeartbeatMs;
+	ULONG LabelMask[256 / 32];
+} CPCI429_ON_CHANGE_CONFIG, *PCPCI429_ON_CHANGE_CONFIG;
+
+//
+// CPCI429_IOCTL_GET_RX_STATS output, one entry per receive channel.
+// WordsReceived counts words read from the board; WordsQueued counts the
+// ones that reached the receive ring. FifoWordsLost counts words the
+// board dropped because its FIFO was full, over FifoOverruns episodes,
+// one for each time the FIFO's overflow bit was seen to latch;
+// BurstDrains counts FIFO reads above the high-water mark.
+//
+typedef struct _CPCI429_RX_CHANNEL_STATS {
+	ULONGLONG WordsReceived;
+	ULONGLONG WordsQueued;
+	ULONGLONG RingOverflows;
+	ULONGLONG WordsSuppressed;
+	ULONGLONG Heartbeats;
+	ULONGLONG ParityErrors;
+	ULONGLONG SsmFailures;
+	ULONGLONG GapViolations;
+	ULONGLONG StaleAlarms;
+	ULONGLONG Triggers;
+	ULONGLONG TriggerWindowsDropped;
+	ULONGLONG FifoOverruns;
+	ULONGLONG FifoWordsLost;
+	ULONGLONG BurstDrains;
+} CPCI429_RX_CHANNEL_STATS, *PCPCI429_RX_CHANNEL_STATS;
+
+typedef struct _CPCI429_RX_STATS_SNAPSHOT {
+	CPCI429_RX_CHANNEL_STATS Channel[CPCI429_MAX_RX_CHANNELS];
+} CPCI429_RX_STATS_SNAPSHOT, *PCPCI429_RX_STATS_SNAPSHOT;
+
+//
+// Per-label bus health, kept incrementally by the receive path.
+//
+// CPCI429_IOCTL_SET_LABEL_HEALTH input. Sdi may be CPCI429_SDI_ANY_SOURCE
+// to apply to all four SDI values of Label. A zero limit is not checked.
+// A label with StaleMs set raises a CPCI429_HEALTH_STALE alarm when no
+// word has arrived for that long, counted from the last word or, for a
+// label not yet received, from when the limit was set, and
+// CPCI429_HEALTH_RECOVERED with the next word.
+//
+#define CPCI429_SDI_ANY_SOURCE 0xFF
+
+typedef struct _CPCI429_LABEL_HEALTH_CONFIG {
+	ULONG Channel;
+	UCHAR Label;
+	UCHAR Sdi;
+	UCHAR SsmFailMask;          // bit n set: SSM value n counts as a failure
+	UCHAR Reserved;
+	ULONG MinIntervalMs;        // words closer than this are rate violations
+	ULONG MaxIntervalMs;        // words further apart than this are gap violations
+	ULONG StaleMs;
+} CPCI429_LABEL_HEALTH_CONFIG, *PCPCI429_LABEL_HEALTH_CONFIG;
+
+//
+// CPCI429_IOCTL_GET_LABEL_HEALTH takes a ULONG channel and returns
+// CPCI429_LABEL_SDI_COUNT entries indexed by CPCI429_LABEL_SDI_INDEX.
+// Times are in 100ns units. Intervals are measured at FIFO drain time.
+//
+typedef struct _CPCI429_LABEL_HEALTH {
+	ULONGLONG SinceLastUpdate;  // 0 if the label was never received
+	ULONG Updates;
+	ULONG MinInterval;
+	ULONG MaxInterval;
+	ULONG EwmaInterval;
+	ULONG GapViolations;
+	ULONG RateViolations;
+	ULONG ParityErrors;
+	ULONG SsmFailures;
+	ULONG Stale;
+	ULONG Reserved;
+} CPCI429_LABEL_HEALTH, *PCPCI429_LABEL_HEALTH;
+
+//
+// CPCI429_IOCTL_WAIT_HEALTH_ALARM output: as many pending alarms as fit.
+// The request stays pending until at least one alarm is raised.
+//
+#define CPCI429_HEALTH_STALE     1
+#define CPCI429_HEALTH_RECOVERED 2
+
+typedef struct _CPCI429_HEALTH_EVENT {
+	ULONG Channel;
+	USHORT LabelSdi;            // CPCI429_LABEL_SDI_INDEX of the source
+	USHORT Type;                // CPCI429_HEALTH_*
+	ULONGLONG Time;             // interrupt time
+} CPCI429_HEALTH_EVENT, *PCPCI429_HEALTH_EVENT;
+
+//
+// Trigger capture. An armed receive channel keeps its most recent words
+// in a history ring; a trigger turns the PreTriggerRecords words before
+// it and everything received for PostTriggerMs after it into one window,
+// which completes a CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE request. Between
+// triggers nothing leaves the driver.
+//
+// The history is one block of the record pool, so PoolBlockRecords
+// bounds a window; a window whose post-trigger side fills the history
+// is closed early and flagged CPCI429_TRIGGER_TRUNCATED. While a window
+// is open further triggers on the channel are only counted.
+//
+// CPCI429_IOCTL_SET_TRIGGER_CAPTURE input. Enable zero disarms the
+// channel. A word fires a match trigger when its label has a match entry
+// and (Word & Mask) == Value for that entry. Like the health limits, the
+// configuration has to be set again after the hardware has been released
+// and prepared.
+//
+#define CPCI429_TRIGGER_ON_MATCH  0x00000001
+#define CPCI429_TRIGGER_ON_PARITY 0x00000002    // a word with even parity
+#define CPCI429_TRIGGER_ON_STALE  0x00000004    // a CPCI429_HEALTH_STALE alarm
+
+#define CPCI429_MAX_TRIGGER_MATCHES 8
+
+typedef struct _CPCI429_TRIGGER_MATCH {
+	UCHAR Label;
+	UCHAR Reserved[3];
+	ULONG Mask;
+	ULONG Value;
+} CPCI429_TRIGGER_MATCH, *PCPCI429_TRIGGER_MATCH;
+
+typedef struct _CPCI429_TRIGGER_CONFIG {
+	ULONG Channel;
+	ULONG Enable;
+	ULONG Sources;              // CPCI429_TRIGGER_ON_*; CPCI429_IOCTL_TRIGGER always fires
+	ULONG PreTriggerRecords;    // below the pool's PoolBlockRecords
+	ULONG PostTriggerMs;
+	ULONG MatchCount;
+	CPCI429_TRIGGER_MATCH Matches[CPCI429_MAX_TRIGGER_MATCHES];
+} CPCI429_TRIGGER_CONFIG, *PCPCI429_TRIGGER_CONFIG;
+
+//
+// CPCI429_IOCTL_TRIGGER takes a ULONG channel and fires its trigger now.
+//
+// CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE output: the oldest finished window
+// of any channel, RecordCount records following the header, oldest
+// first. The request stays pending until a window is finished. Records
+// that do not fit the buffer are counted in RecordsDropped.
+//
+#define CPCI429_TRIGGER_CAUSE_MATCH    1
+#define CPCI429_TRIGGER_CAUSE_PARITY   2
+#define CPCI429_TRIGGER_CAUSE_STALE    3
+#define CPCI429_TRIGGER_CAUSE_EXPLICIT 4
+
+#define CPCI429_TRIGGER_TRUNCATED 0x0001    // closed before PostTriggerMs had passed
+
+typedef struct _CPCI429_TRIGGER_CAPTURE {
+	ULONG Channel;
+	USHORT Cause;               // CPCI429_TRIGGER_CAUSE_*
+	USHORT Flags;               // CPCI429_TRIGGER_*
+	ULONGLONG TriggerTime;      // interrupt time
+	ULONG Source;               // the word for match and parity, the CPCI429_LABEL_SDI_INDEX for stale
+	ULONG PreTriggerCount;      // records before the trigger
+	ULONG RecordCount;
+	ULONG RecordsDropped;
+	CPCI429_RX_RECORD Records[1];
+} CPCI429_TRIGGER_CAPTURE, *PCPCI429_TRIGGER_CAPTURE;
+
+//
+// Windowed aggregation. For each configured source of a channel the
+// receive path keeps the count, minimum, maximum, sum and last value of
+// the decoded data field over windows of WindowMs, and at the end of
+// every window the channel's aggregates are published for
+// CPCI429_IOCTL_WAIT_AGGREGATES. A monitor then wakes once per window
+// instead of once per word.
+//
+// CPCI429_IOCTL_SET_AGGREGATION input. Encoding and the bit range follow
+// Decode.h (CPCI429_ENCODING_*, ARINC bit numbers with 1 the first label
+// bit). Sdi may be CPCI429_SDI_ANY_SOURCE to fold all four SDI values of
+// Label into one aggregate. WindowMs zero turns aggregation off. Values
+// are raw decoded counts; applications scale them with the resolution of
+// their ICD. Like the health limits, the configuration has to be set
+// again after the hardware has been released and prepared.
+//
+#define CPCI429_MAX_AGGREGATES 64
+
+typedef struct _CPCI429_AGGREGATE_SOURCE {
+	UCHAR Label;
+	UCHAR Sdi;
+	UCHAR Encoding;
+	UCHAR FirstBit;
+	UCHAR LastBit;
+	UCHAR Reserved[3];
+} CPCI429_AGGREGATE_SOURCE, *PCPCI429_AGGREGATE_SOURCE;
+
+typedef struct _CPCI429_AGGREGATE_CONFIG {
+	ULONG Channel;
+	ULONG WindowMs;
+	ULONG SourceCount;
+	CPCI429_AGGREGATE_SOURCE Sources[CPCI429_MAX_AGGREGATES];
+} CPCI429_AGGREGATE_CONFIG, *PCPCI429_AGGREGATE_CONFIG;
+
+//
+// One source over one window, in the order it was configured. Min, Max,
+// Mean, Sum and Last are zero when Count is. Mean is Sum / Count rounded
+// towards zero.
+//
+typedef struct _CPCI429_AGGREGATE {
+	UCHAR Label;
+	UCHAR Sdi;                  // as configured
+	USHORT Reserved;
+	ULONG Count;
+	LONG Min;
+	LONG Max;
+	LONG Mean;
+	LONG Last;
+	LONGLONG Sum;
+	ULONG LastWord;             // the whole word Last was decoded from, for its SSM
+	ULONG Reserved2;
+	ULONGLONG LastTime;         // interrupt time
+} CPCI429_AGGREGATE, *PCPCI429_AGGREGATE;
+
+//
+// CPCI429_IOCTL_WAIT_AGGREGATES output: as many finished channel windows
+// as fit, each CPCI429_AGGREGATE_WINDOW_BYTES(Count) long and followed by
+// the next. The request stays pending until a window is finished. A
+// window not collected before the channel's next one ends is replaced by
+// it and counted in WindowsMissed.
+//
+typedef struct _CPCI429_AGGREGATE_WINDOW {
+	ULONG Channel;
+	ULONG Count;
+	ULONGLONG WindowStart;      // interrupt time
+	ULONGLONG WindowEnd;
+	ULONGLONG WindowsMissed;    // since aggregation was configured
+	CPCI429_AGGREGATE Aggregates[1];
+} CPCI429_AGGREGATE_WINDOW, *PCPCI429_AGGREGATE_WINDOW;
+
+#define CPCI429_AGGREGATE_WINDOW_BYTES(count) \
+	(FIELD_OFFSET(CPCI429_AGGREGATE_WINDOW, Aggregates) + (count) * sizeof(CPCI429_AGGREGATE))
+
+//
+// CPCI429_IOCTL_SELF_TEST input. Each transmit channel in ChannelMask
+// sends generated words back-to-back to the receive channel with the
+// same index, through the board's internal loopback or an external
+// harness, for DurationMs. Generated words carry Label, the channel
+// number in the SDI and a 19-bit sequence number in the data field.
+// While the test runs, transmit requests on the tested channels fail
+// with STATUS_DEVICE_BUSY and the words received on them are not queued.
+//
+#define CPCI429_LOOPBACK_INTERNAL 0
+#define CPCI429_LOOPBACK_EXTERNAL 1
+
+#define CPCI429_SELF_TEST_MAX_MS  (24 * 60 * 60 * 1000)
+
+typedef struct _CPCI429_SELF_TEST_CONFIG {
+	ULONG ChannelMask;
+	ULONG Loopback;             // CPCI429_LOOPBACK_*
+	ULONG Speed;                // CPCI429_SPEED_*
+	ULONG DurationMs;
+	ULONG Label;
+	ULONG MaxLatencyUs;         // slower words count as late; 0 is not checked
+} CPCI429_SELF_TEST_CONFIG, *PCPCI429_SELF_TEST_CONFIG;
+
+//
+// Latencies are in ticks of TickFrequency, performance counter ticks on
+// the driver, from when a word is estimated to leave the transmit FIFO
+// to the drain of the receive FIFO. The estimate adds the line time of
+// the words queued ahead at the write, so the pump's transmit queue is
+// left out; the word's own 36 bit times on the line are included.
+// Histogram bucket 0 counts latencies under 1us, bucket n those in
+// [2^(n-1), 2^n) us and the last bucket everything slower.
+//
+#define CPCI429_LATENCY_BUCKETS 16
+
+typedef struct _CPCI429_SELF_TEST_CHANNEL {
+	ULONGLONG WordsSent;
+	ULONGLONG WordsReceived;    // with correct label, SDI and parity
+	ULONGLONG WordsLost;        // sent, but neither received nor corrupted
+	ULONGLONG SequenceErrors;   // gaps or reordering in the sequence numbers
+	ULONGLONG ContentErrors;    // wrong label, SDI or parity
+	ULONGLONG LateWords;
+	ULONGLONG TxUnderruns;      // transmit FIFO found empty, the line went idle
+	ULONGLONG LatencyMin;
+	ULONGLONG LatencyMax;
+	ULONGLONG LatencySum;
+	ULONG LatencyHistogram[CPCI429_LATENCY_BUCKETS];
+} CPCI429_SELF_TEST_CHANNEL, *PCPCI429_SELF_TEST_CHANNEL;
+
+//
+// CPCI429_IOCTL_SELF_TEST output, returned when the run ends. Host cost
+// covers every receive DPC during the run plus the transmit pump.
+//
+#define CPCI429_SELF_TEST_COMPLETED 0
+#define CPCI429_SELF_TEST_ABORTED   1   // the device left D0
+
+typedef struct _CPCI429_SELF_TEST_RESULT {
+	ULONG Outcome;              // CPCI429_SELF_TEST_*
+	ULONG Reserved;
+	ULONGLONG TickFrequency;
+	ULONGLONG Elapsed;          // ticks the pump ran
+	ULONGLONG Dpcs;
+	ULONGLONG DpcTicks;
+	ULONGLONG Pumps;
+	ULONGLONG PumpTicks;
+	CPCI429_SELF_TEST_CHANNEL Channel[CPCI429_MAX_TX_CHANNELS];
+} CPCI429_SELF_TEST_RESULT, *PCPCI429_SELF_TEST_RESULT;
+
+//
+// Block transfer protocol run by the driver for bulk loads, in the style
+// of the ARINC 615 Williamsburg handshake. For every block the sender
+// transmits RTS with the block's word count and waits for CTS with the
+// block number, sends the data words, then waits for ACK, or NAK to
+// resend. A block that is not answered within the timeout is resent.
+//
+// Control words carry ControlLabel, the type in bits 26-29 and a 15-bit
+// value in bits 11-25 (ARINC bit numbers). Data words carry DataLabel,
+// two payload bytes in bits 9-24 (first byte low) and the low five bits
+// of the word's index within the block in bits 25-29.
+//
+#define CPCI429_BULK_RTS   1    // value: words in the block
+#define CPCI429_BULK_CTS   2    // value: block number
+#define CPCI429_BULK_ACK   3    // value: block number
+#define CPCI429_BULK_NAK   4    // value: block number
+#define CPCI429_BULK_ABORT 5
+
+#define CPCI429_BULK_TYPE(w)  (((w) >> 25) & 0xF)
+#define CPCI429_BULK_VALUE(w) (((w) >> 10) & 0x7FFF)
+#define CPCI429_BULK_CONTROL_WORD(label, type, value) \
+	((ULONG)(label) | ((ULONG)(type) << 25) | (((ULONG)(value) & 0x7FFF) << 10))
+#define CPCI429_BULK_DATA_WORD(label, index, payload) \
+	((ULONG)(label) | (((ULONG)(payload) & 0xFFFF) << 8) | (((ULONG)(index) & 0x1F) << 24))
+
+#define CPCI429_BULK_MAX_BLOCK_WORDS 0x7FFF
+
+//
+// CPCI429_IOCTL_BULK_TRANSFER input. The output buffer of the request is
+// the data to send, typically a view of a mapped file; the driver reads
+// it directly. The request completes when the last block is
+// acknowledged, with the information field set to the bytes delivered.
+// Transmit requests on TxChannel fail with STATUS_DEVICE_BUSY meanwhile,
+// and ControlLabel words on RxChannel are not queued.
+//
+typedef struct _CPCI429_BULK_CONFIG {
+	ULONG TxChannel;
+	ULONG RxChannel;
+	UCHAR DataLabel;
+	UCHAR ControlLabel;
+	USHORT Reserved;
+	ULONG Speed;                // CPCI429_SPEED_*
+	ULONG BlockWords;           // 0 selects 1024
+	ULONG TimeoutMs;            // per handshake, 0 selects 1000
+	ULONG MaxRetries;           // per block
+} CPCI429_BULK_CONFIG, *PCPCI429_BULK_CONFIG;
+
+//
+// CPCI429_IOCTL_GET_BULK_STATUS output, for the last finished transfer.
+// LineUtilization is the share of the line's capacity spent on words
+// sent, in units of 1/10000, counting 36 bit times per word.
+//
+typedef struct _CPCI429_BULK_STATUS {
+	LONG Status;                // NTSTATUS the transfer completed with
+	ULONG LineUtilization;
+	ULONGLONG BytesDelivered;
+	ULONGLONG BytesPerSecond;
+	ULONGLONG WordsSent;
+	ULONGLONG Blocks;
+	ULONGLONG Retransmits;
+	ULONGLONG Timeouts;
+	ULONGLONG UnexpectedWords;  // handshake words that did not fit the state
+	ULONGLONG Elapsed;          // ticks
+	ULONGLONG TickFrequency;
+} CPCI429_BULK_STATUS, *PCPCI429_BULK_STATUS;
+
+//
+// Queue indices used by CPCI429_IOCTL_GET_QUEUE_STATS.
+//
+#define CPCI429_QUEUE_RX      0
+#define CPCI429_QUEUE_TX      1
+#define CPCI429_QUEUE_CONTROL 2
+#define CPCI429_QUEUE_COUNT   3
+
+//
+// Wait times are in 100ns units and measure the time from arrival on
+// the default queue until the target queue dispatched the request.
+//
+typedef struct _CPCI429_QUEUE_STATS {
+	ULONG CurrentDepth;
+	ULONG MaxDepth;
+	ULONGLONG Requests;
+	ULONGLONG TotalWaitTime;
+	ULONGLONG MaxWaitTime;
+} CPCI429_QUEUE_STATS, *PCPCI429_QUEUE_STATS;
+
+typedef struct _CPCI429_QUEUE_STATS_SNAPSHOT {
+	CPCI429_QUEUE_STATS Queue[CPCI429_QUEUE_COUNT];
+} CPCI429_QUEUE_STATS_SNAPSHOT, *PCPCI429_QUEUE_STATS_SNAPSHOT;
+
+//
+// CPCI429_IOCTL_GET_CPU_STATS output. Reports where each receive channel's
+// DPC runs and how much receive work every processor has done, so load
+// across several boards can be compared per core. DpcTicks is in units of
+// TickFrequency.
+//
+typedef struct _CPCI429_CPU_STATS {
+	ULONGLONG Dpcs;
+	ULONGLONG Words;
+	ULONGLONG DpcTicks;
+} CPCI429_CPU_STATS, *PCPCI429_CPU_STATS;
+
+typedef struct _CPCI429_CPU_STATS_SNAPSHOT {
+	ULONG Node;
+	ULONG ChannelProcessor[CPCI429_MAX_RX_CHANNELS];
+	ULONG ChannelNode[CPCI429_MAX_RX_CHANNELS];
+	ULONGLONG TickFrequency;
+	ULONG CpuCount;
+	ULONG Reserved;
+	CPCI429_CPU_STATS Cpu[1];   // CpuCount entries, by processor index
+} CPCI429_CPU_STATS_SNAPSHOT, *PCPCI429_CPU_STATS_SNAPSHOT;
+
+//
+// Pool indices used by CPCI429_IOCTL_GET_POOL_STATS.
+//
+#define CPCI429_POOL_RECORDS  0     // blocks of receive records
+#define CPCI429_POOL_CONTEXTS 1     // self-test and bulk transfer contexts
+#define CPCI429_POOL_COUNT    2
+
+//
+// Pools are sized when the hardware is prepared. Exhaustions counts
+// allocations that failed because every block was in use; HighWater is
+// the most blocks ever in use at once since the pool was sized.
+//
+typedef struct _CPCI429_POOL_STATS {
+	ULONG BlockSize;            // bytes
+	ULONG Capacity;             // blocks
+	ULONG InUse;
+	ULONG HighWater;
+	ULONGLONG Allocations;
+	ULONGLONG Exhaustions;
+} CPCI429_POOL_STATS, *PCPCI429_POOL_STATS;
+
+typedef struct _CPCI429_POOL_STATS_SNAPSHOT {
+	CPCI429_POOL_STATS Pool[CPCI429_POOL_COUNT];
+} CPCI429_POOL_STATS_SNAPSHOT, *PCPCI429_POOL_STATS_SNAPSHOT;
+
 #endif
\ No newline at end of file
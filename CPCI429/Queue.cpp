@@ -21,9 +21,54 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, CPCI429QueueInitialize)
-#pragma alloc_text (PAGE, CPCI429EvtIoDeviceControl)
 #endif
 
+static
+NTSTATUS
+CPCI429QueueCreate(
+	_In_ WDFDEVICE Device,
+	_In_ WDF_IO_QUEUE_DISPATCH_TYPE DispatchType,
+	_In_ WDF_TRI_STATE PowerManaged,
+	_In_ PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl,
+	_In_ ULONG QueueIndex,
+	_Out_ WDFQUEUE *Queue
+)
+/*++
+
+Routine Description:
+
+     Creates one of the non-default queues that the default queue routes
+     device control requests to, with a QUEUE_CONTEXT for its statistics.
+
+--*/
+{
+	NTSTATUS status;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES queueAttributes;
+	PQUEUE_CONTEXT queueContext;
+
+	PAGED_CODE();
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, DispatchType);
+	queueConfig.PowerManaged = PowerManaged;
+	queueConfig.EvtIoDeviceControl = EvtIoDeviceControl;
+	queueConfig.EvtIoStop = CPCI429EvtIoStop;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&queueAttributes, QUEUE_CONTEXT);
+
+	status = WdfIoQueueCreate(Device, &queueConfig, &queueAttributes, Queue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	queueContext = QueueGetContext(*Queue);
+	RtlZeroMemory(queueContext, sizeof(QUEUE_CONTEXT));
+	queueContext->QueueIndex = QueueIndex;
+
+	return status;
+}
+
 NTSTATUS
 CPCI429QueueInitialize(
     _In_ WDFDEVICE Device
@@ -35,9 +80,10 @@ Routine Description:
      The I/O dispatch callbacks for the frameworks device object
      are configured in this function.
 
-     A single default I/O Queue is configured for parallel request
-     processing, and a driver context memory allocation is created
-     to hold our structure QUEUE_CONTEXT.
+     The default queue is parallel and only routes device control
+     requests: data-path IOCTLs go to the parallel RX and TX queues,
+     everything else goes to the sequential control queue. A slow
+     configuration request therefore never delays the data path.
 
 Arguments:
 
@@ -45,16 +91,19 @@ Arguments:
 
 Return Value:
 
-    VOID
+    NTSTATUS
 
 --*/
 {
     WDFQUEUE queue;
     NTSTATUS status;
     WDF_IO_QUEUE_CONFIG queueConfig;
+    PDEVICE_CONTEXT pDeviceContext;
 
     PAGED_CODE();
 
+    pDeviceContext = DeviceGetContext(Device);
+
     //
     // Configure a default queue so that requests that are not
     // configure-fowarded using WdfDeviceConfigureRequestDispatching to goto
@@ -81,9 +130,91 @@ Return Value:
         return status;
     }
 
+	//
+	// Receive requests only touch the software rings, so the RX queue is
+	// not power-managed. Transmit touches the FIFO registers and stays
+	// power-managed. Control requests are serialized because the raw
+	// register IOCTLs rely on OffsetAddressFromApp set by an earlier call.
+	//
+	status = CPCI429QueueCreate(Device, WdfIoQueueDispatchParallel, WdfFalse,
+		CPCI429EvtIoRxDeviceControl, CPCI429_QUEUE_RX, &pDeviceContext->RxQueue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = CPCI429QueueCreate(Device, WdfIoQueueDispatchParallel, WdfTrue,
+		CPCI429EvtIoTxDeviceControl, CPCI429_QUEUE_TX, &pDeviceContext->TxQueue);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	status = CPCI429QueueCreate(Device, WdfIoQueueDispatchSequential, WdfTrue,
+		CPCI429EvtIoControlDeviceControl, CPCI429_QUEUE_CONTROL, &pDeviceContext->ControlQueue);
+
     return status;
 }
 
+static
+VOID
+CPCI429QueueAccountDispatch(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Called first thing by every routed queue's dispatch callback. Updates
+    the queue's depth and wait-time statistics.
+
+--*/
+{
+	PQUEUE_CONTEXT queueContext = QueueGetContext(Queue);
+	LONG64 wait;
+
+	wait = (LONG64)(KeQueryInterruptTime() - RequestGetContext(Request)->ArrivalTime);
+
+	InterlockedDecrement(&queueContext->CurrentDepth);
+	InterlockedIncrement64(&queueContext->Requests);
+	InterlockedAdd64(&queueContext->TotalWaitTime, wait);
+	CPCI429InterlockedMax64(&queueContext->MaxWaitTime, wait);
+}
+
+static
+VOID
+CPCI429CompleteQueueStats(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_QUEUE_STATS_SNAPSHOT snapshot;
+	WDFQUEUE queues[CPCI429_QUEUE_COUNT];
+	ULONG i;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_QUEUE_STATS_SNAPSHOT), (PVOID*)&snapshot, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	queues[CPCI429_QUEUE_RX] = DeviceContext->RxQueue;
+	queues[CPCI429_QUEUE_TX] = DeviceContext->TxQueue;
+	queues[CPCI429_QUEUE_CONTROL] = DeviceContext->ControlQueue;
+
+	for (i = 0; i < CPCI429_QUEUE_COUNT; i++) {
+		PQUEUE_CONTEXT queueContext = QueueGetContext(queues[i]);
+
+		snapshot->Queue[i].CurrentDepth = (ULONG)queueContext->CurrentDepth;
+		snapshot->Queue[i].MaxDepth = (ULONG)queueContext->MaxDepth;
+		snapshot->Queue[i].Requests = (ULONGLONG)queueContext->Requests;
+		snapshot->Queue[i].TotalWaitTime = (ULONGLONG)queueContext->TotalWaitTime;
+		snapshot->Queue[i].MaxWaitTime = (ULONGLONG)queueContext->MaxWaitTime;
+	}
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_QUEUE_STATS_SNAPSHOT));
+}
+
 /*
 һĬI/Oк͵һEvtIoDefaultKMDFὫ豸е͵ĬI/OУ
 ȻEvtIoDefaultÿһݽ
@@ -92,6 +223,39 @@ Return Value:
 ȻEvtIoReadݽ󡢵EvtIoWriteݽд󡢵EvtIoDeviceControlݽ豸I/O
 */
 
+VOID
+CPCI429EvtIoInCallerContext(
+	_In_ WDFDEVICE Device,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Runs in the requesting thread before the request is queued. Only
+    CPCI429_IOCTL_SUBSCRIBE needs this, because it maps memory into the
+    caller's process; everything else is queued as usual.
+
+--*/
+{
+	NTSTATUS status;
+	WDF_REQUEST_PARAMETERS params;
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+
+	if (params.Type == WdfRequestTypeDeviceControl &&
+		params.Parameters.DeviceIoControl.IoControlCode == CPCI429_IOCTL_SUBSCRIBE) {
+		CPCI429FanoutSubscribe(DeviceGetContext(Device), Request);
+		return;
+	}
+
+	status = WdfDeviceEnqueueRequest(Device, Request);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+	}
+}
+
 VOID
 CPCI429EvtIoDeviceControl(
     _In_ WDFQUEUE Queue,
@@ -105,6 +269,276 @@ CPCI429EvtIoDeviceControl(
 Routine Description:
 
     This event is invoked when the framework receives IRP_MJ_DEVICE_CONTROL request.
+    It routes the request to the queue that owns its IOCTL class.
+
+Arguments:
+
+    Queue -  Handle to the framework queue object that is associated with the
+             I/O request.
+
+    Request - Handle to a framework request object.
+
+    OutputBufferLength - Size of the output buffer in bytes
+
+    InputBufferLength - Size of the input buffer in bytes
+
+    IoControlCode - I/O control code.
+
+Return Value:
+
+    VOID
+
+--*/
+{
+	WDFDEVICE device;
+	PDEVICE_CONTEXT pDeviceContext;
+	PQUEUE_CONTEXT queueContext;
+	WDFQUEUE target;
+	NTSTATUS status;
+
+	device = WdfIoQueueGetDevice(Queue);
+	pDeviceContext = DeviceGetContext(device);
+
+	switch (IoControlCode) {
+	case CPCI429_IOCTL_GET_QUEUE_STATS:
+		CPCI429CompleteQueueStats(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_GET_CPU_STATS:
+		CPCI429RxCompleteCpuStats(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_GET_RX_STATS:
+		CPCI429RxCompleteRxStats(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_GET_LABEL_HEALTH:
+		CPCI429HealthCompleteSnapshot(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_GET_BULK_STATUS:
+		CPCI429BulkCompleteStatus(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_GET_POOL_STATS:
+		CPCI429PoolCompleteStats(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_RX_READ:
+	case CPCI429_IOCTL_RX_READ_RECORDS:
+	case CPCI429_IOCTL_RX_READ_WAIT:
+	case CPCI429_IOCTL_SUBSCRIBER_WAIT:
+	case CPCI429_IOCTL_WAIT_HEALTH_ALARM:
+	case CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE:
+	case CPCI429_IOCTL_WAIT_AGGREGATES:
+		target = pDeviceContext->RxQueue;
+		break;
+
+	case CPCI429_IOCTL_TX_SUBMIT:
+	case CPCI429_IOCTL_BULK_TRANSFER:
+		target = pDeviceContext->TxQueue;
+		break;
+
+	default:
+		target = pDeviceContext->ControlQueue;
+		break;
+	}
+
+	RequestGetContext(Request)->ArrivalTime = KeQueryInterruptTime();
+
+	queueContext = QueueGetContext(target);
+	CPCI429InterlockedMax(&queueContext->MaxDepth, InterlockedIncrement(&queueContext->CurrentDepth));
+
+	status = WdfRequestForwardToIoQueue(Request, target);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfRequestForwardToIoQueue failed %x", __FUNCDNAME__, __LINE__, status);
+		InterlockedDecrement(&queueContext->CurrentDepth);
+		WdfRequestComplete(Request, status);
+	}
+}
+
+VOID
+CPCI429EvtIoRxDeviceControl(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request,
+	_In_ size_t OutputBufferLength,
+	_In_ size_t InputBufferLength,
+	_In_ ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+    Data-path receive requests. Copies words, or whole records for
+    CPCI429_IOCTL_RX_READ_RECORDS, from the channel's receive ring, which
+    the channel DPC fills, until the ring is empty or the output buffer
+    is full. CPCI429_IOCTL_RX_READ_WAIT parks on the channel while the
+    ring is empty.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	NTSTATUS status;
+	PCPCI429_RX_READ rxRead;
+	PVOID buffer;
+	size_t outLength;
+	size_t itemSize;
+	ULONG count;
+
+	CPCI429QueueAccountDispatch(Queue, Request);
+
+	pDeviceContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+
+	switch (IoControlCode) {
+	case CPCI429_IOCTL_RX_READ:
+		itemSize = sizeof(ULONG);
+		break;
+
+	case CPCI429_IOCTL_RX_READ_RECORDS:
+		itemSize = sizeof(CPCI429_RX_RECORD);
+		break;
+
+	case CPCI429_IOCTL_SUBSCRIBER_WAIT:
+		CPCI429FanoutWait(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_WAIT_HEALTH_ALARM:
+		CPCI429HealthWait(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_RX_READ_WAIT:
+		CPCI429RxReadWait(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE:
+		CPCI429TriggerWait(pDeviceContext, Request);
+		return;
+
+	case CPCI429_IOCTL_WAIT_AGGREGATES:
+		CPCI429AggregateWait(pDeviceContext, Request);
+		return;
+
+	default:
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+		return;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_RX_READ), (PVOID*)&rxRead, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request, itemSize, &buffer, &outLength);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+	if (rxRead->Channel >= CPCI429_MAX_RX_CHANNELS) {
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return;
+	}
+
+	count = CPCI429RxRead(&pDeviceContext->RxChannels[rxRead->Channel], buffer,
+		(ULONG)(outLength / itemSize), itemSize == sizeof(CPCI429_RX_RECORD));
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, count * itemSize);
+}
+
+VOID
+CPCI429EvtIoTxDeviceControl(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request,
+	_In_ size_t OutputBufferLength,
+	_In_ size_t InputBufferLength,
+	_In_ ULONG IoControlCode
+)
+/*++
+
+Routine Description:
+
+    Data-path transmit requests. Writes words into the channel's transmit
+    FIFO until all are queued or the FIFO reports full. The information
+    field returns the number of bytes of words accepted.
+
+    CPCI429_IOCTL_BULK_TRANSFER is handed to the bulk transfer engine.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	NTSTATUS status;
+	PCPCI429_TX_SUBMIT txSubmit;
+	size_t inLength;
+	ULONG count;
+
+	CPCI429QueueAccountDispatch(Queue, Request);
+
+	pDeviceContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+
+	if (IoControlCode == CPCI429_IOCTL_BULK_TRANSFER) {
+		CPCI429BulkStart(pDeviceContext, Request);
+		return;
+	}
+	if (IoControlCode != CPCI429_IOCTL_TX_SUBMIT) {
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+		return;
+	}
+
+	status = WdfRequestRetrieveInputBuffer(Request, FIELD_OFFSET(CPCI429_TX_SUBMIT, Words), (PVOID*)&txSubmit, &inLength);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+	if (txSubmit->Channel >= CPCI429_MAX_TX_CHANNELS ||
+		txSubmit->WordCount > (inLength - FIELD_OFFSET(CPCI429_TX_SUBMIT, Words)) / sizeof(ULONG)) {
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return;
+	}
+
+	if ((pDeviceContext->SelfTestChannels & (1L << txSubmit->Channel)) != 0 ||
+		pDeviceContext->BulkTxChannel == txSubmit->Channel) {
+		WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+		return;
+	}
+
+	count = CPCI429RegTxWrite(pDeviceContext->BAR0_VirtualAddress, txSubmit->Channel, txSubmit->Words, txSubmit->WordCount);
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, count * sizeof(ULONG));
+}
+
+static
+NTSTATUS
+CPCI429SetChannelConfig(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_CHANNEL_CONFIG config;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_CHANNEL_CONFIG), (PVOID*)&config, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+
+	if (!CPCI429RegSetChannelConfig(DeviceContext->BAR0_VirtualAddress, config)) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429EvtIoControlDeviceControl(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+    )
+/*++
+
+Routine Description:
+
+    Control-path requests routed from the default queue. The queue is
+    sequential, so these never run concurrently with each other.
 
 Arguments:
 
@@ -134,6 +568,8 @@ Return Value:
 	PVOID outBuffer;
 	ULONG AddressOffset;
 
+	CPCI429QueueAccountDispatch(Queue, Request);
+
 	device = WdfIoQueueGetDevice(Queue);
 	pDeviceContext = DeviceGetContext(device);
 
@@ -219,6 +655,40 @@ Return Value:
 		}
 		break;
 
+	case CPCI429_IOCTL_SET_CHANNEL_CONFIG:
+		status = CPCI429SetChannelConfig(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_SET_ON_CHANGE:
+		status = CPCI429RxSetOnChange(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_SET_LABEL_HEALTH:
+		status = CPCI429HealthSetLabel(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_SET_TRIGGER_CAPTURE:
+		status = CPCI429TriggerSetConfig(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_TRIGGER:
+		status = CPCI429TriggerFireRequest(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_SET_AGGREGATION:
+		status = CPCI429AggregateSetConfig(pDeviceContext, Request);
+		WdfRequestComplete(Request, status);
+		return;
+
+	case CPCI429_IOCTL_SELF_TEST:
+		CPCI429SelfTestStart(pDeviceContext, Request);
+		return;
+
 	default:
 		status = STATUS_INVALID_DEVICE_REQUEST;
 		WdfRequestSetInformation(
@@ -22,12 +22,28 @@ EXTERN_C_START
 //
 typedef struct _QUEUE_CONTEXT {
 
-    ULONG PrivateDeviceData;  // just a placeholder
+    ULONG QueueIndex;           // CPCI429_QUEUE_*
+    volatile LONG CurrentDepth;
+    volatile LONG MaxDepth;
+    volatile LONG64 Requests;
+    volatile LONG64 TotalWaitTime;
+    volatile LONG64 MaxWaitTime;
 
 } QUEUE_CONTEXT, *PQUEUE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
 
+//
+// Per-request context, stamped when the default queue routes the request.
+//
+typedef struct _REQUEST_CONTEXT {
+
+    ULONGLONG ArrivalTime;      // KeQueryInterruptTime at routing
+
+} REQUEST_CONTEXT, *PREQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(REQUEST_CONTEXT, RequestGetContext)
+
 NTSTATUS
 CPCI429QueueInitialize(
     _In_ WDFDEVICE Device
@@ -37,6 +53,10 @@ CPCI429QueueInitialize(
 // Events from the IoQueue object
 //
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CPCI429EvtIoDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CPCI429EvtIoRxDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CPCI429EvtIoTxDeviceControl;
+EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL CPCI429EvtIoControlDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP CPCI429EvtIoStop;
+EVT_WDF_IO_IN_CALLER_CONTEXT CPCI429EvtIoInCallerContext;
 
 EXTERN_C_END
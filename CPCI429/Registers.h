@@ -0,0 +1,224 @@
+/*++
+
+Module Name:
+
+    registers.h
+
+Abstract:
+
+    Board register layout and the register-level operations built on it,
+    shared by the driver and the Linux user-mode backend so that both
+    program the board the same way. Registers are reached through
+    CPCI429_BAR_READ and CPCI429_BAR_WRITE on a mapping of BAR0, which
+    use the platform's MMIO accessors.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _REGISTERS_H
+#define _REGISTERS_H
+
+#include "Public.h"
+
+//
+// Board register layout. Each receive and transmit channel owns a
+// 0x100-byte register window in BAR0.
+//
+#define CPCI429_RX_CHANNEL_BASE(ch) (0x1000 + (ch) * 0x100)
+#define CPCI429_TX_CHANNEL_BASE(ch) (0x2000 + (ch) * 0x100)
+
+#define CPCI429_CH_FIFO_DATA   0x00
+#define CPCI429_CH_FIFO_STATUS 0x04
+#define CPCI429_CH_CONTROL     0x08
+#define CPCI429_CH_FIFO_LOST   0x0C        // receive only: free-running count of words lost to a full FIFO
+
+#define CPCI429_FIFO_EMPTY     0x00000001
+#define CPCI429_FIFO_FULL      0x00000002
+#define CPCI429_FIFO_HALF      0x00000004
+#define CPCI429_FIFO_OVERFLOW  0x00000008
+#define CPCI429_FIFO_COUNT(status) (((status) >> 16) & 0xFFF)
+
+#define CPCI429_CTRL_ENABLE     0x00000001
+#define CPCI429_CTRL_HIGH_SPEED 0x00000002
+#define CPCI429_CTRL_ODD_PARITY 0x00000004
+#define CPCI429_CTRL_LOOPBACK   0x00000008    // receive channel listens to its transmit twin
+
+//
+// Global interrupt registers. Bit n of each refers to receive channel n;
+// writing a set bit to CPCI429_REG_INT_STATUS acknowledges it.
+//
+#define CPCI429_REG_INT_STATUS 0x0004
+#define CPCI429_REG_INT_ENABLE 0x0008
+#define CPCI429_INT_RX_MASK    ((1 << CPCI429_MAX_RX_CHANNELS) - 1)
+
+#define CPCI429_BAR0_SIZE      0x3000      // covers every register above
+
+#if defined(_KERNEL_MODE)
+#define CPCI429_BAR_READ(bar, offset) \
+	READ_REGISTER_ULONG((PULONG)((PUCHAR)(bar) + (offset)))
+#define CPCI429_BAR_WRITE(bar, offset, value) \
+	WRITE_REGISTER_ULONG((PULONG)((PUCHAR)(bar) + (offset)), (value))
+#else
+#define CPCI429_BAR_READ(bar, offset) \
+	(*(volatile ULONG*)((PUCHAR)(bar) + (offset)))
+#define CPCI429_BAR_WRITE(bar, offset, value) \
+	(*(volatile ULONG*)((PUCHAR)(bar) + (offset)) = (value))
+#endif
+
+//
+// Control register value for a CPCI429_CHANNEL_CONFIG.
+//
+FORCEINLINE
+ULONG
+CPCI429RegChannelControl(
+	_In_ const CPCI429_CHANNEL_CONFIG *Config
+)
+{
+	ULONG control = 0;
+
+	if (Config->Enable) {
+		control |= CPCI429_CTRL_ENABLE;
+	}
+	if (Config->Speed == CPCI429_SPEED_HIGH) {
+		control |= CPCI429_CTRL_HIGH_SPEED;
+	}
+	if (Config->OddParity) {
+		control |= CPCI429_CTRL_ODD_PARITY;
+	}
+
+	return control;
+}
+
+//
+// Programs one channel. Returns FALSE for an invalid direction or
+// channel number.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429RegSetChannelConfig(
+	_In_ PVOID Bar,
+	_In_ const CPCI429_CHANNEL_CONFIG *Config
+)
+{
+	if (Config->Direction == CPCI429_DIRECTION_RX && Config->Channel < CPCI429_MAX_RX_CHANNELS) {
+		CPCI429_BAR_WRITE(Bar, CPCI429_RX_CHANNEL_BASE(Config->Channel) + CPCI429_CH_CONTROL,
+			CPCI429RegChannelControl(Config));
+	} else if (Config->Direction == CPCI429_DIRECTION_TX && Config->Channel < CPCI429_MAX_TX_CHANNELS) {
+		CPCI429_BAR_WRITE(Bar, CPCI429_TX_CHANNEL_BASE(Config->Channel) + CPCI429_CH_CONTROL,
+			CPCI429RegChannelControl(Config));
+	} else {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+FORCEINLINE
+BOOLEAN
+CPCI429RegRxEmpty(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel
+)
+{
+	return (CPCI429_BAR_READ(Bar, CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_STATUS) & CPCI429_FIFO_EMPTY) != 0;
+}
+
+FORCEINLINE
+ULONG
+CPCI429RegRxStatus(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel
+)
+{
+	return CPCI429_BAR_READ(Bar, CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_STATUS);
+}
+
+//
+// Words the channel's FIFO has lost since the count in Lost, which is
+// brought up to date. The board's counter is free running, so the
+// difference stays exact across wraps.
+//
+FORCEINLINE
+ULONG
+CPCI429RegRxLostSince(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel,
+	_Inout_ PULONG Lost
+)
+{
+	ULONG lost = CPCI429_BAR_READ(Bar, CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_LOST);
+	ULONG words = lost - *Lost;
+
+	*Lost = lost;
+
+	return words;
+}
+
+FORCEINLINE
+ULONG
+CPCI429RegRxReadWord(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel
+)
+{
+	return CPCI429_BAR_READ(Bar, CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_DATA);
+}
+
+//
+// Writes words into a transmit FIFO until all are queued or it reports
+// full. Returns the number of words queued.
+//
+FORCEINLINE
+ULONG
+CPCI429RegTxWrite(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel,
+	_In_reads_(Count) const ULONG *Words,
+	_In_ ULONG Count
+)
+{
+	ULONG base = CPCI429_TX_CHANNEL_BASE(Channel);
+	ULONG i;
+
+	for (i = 0; i < Count; i++) {
+		if (CPCI429_BAR_READ(Bar, base + CPCI429_CH_FIFO_STATUS) & CPCI429_FIFO_FULL) {
+			break;
+		}
+		CPCI429_BAR_WRITE(Bar, base + CPCI429_CH_FIFO_DATA, Words[i]);
+	}
+
+	return i;
+}
+
+//
+// Acknowledges and returns the pending receive channel interrupts.
+//
+FORCEINLINE
+ULONG
+CPCI429RegAckRxInterrupts(
+	_In_ PVOID Bar
+)
+{
+	ULONG pending = CPCI429_BAR_READ(Bar, CPCI429_REG_INT_STATUS) & CPCI429_INT_RX_MASK;
+
+	if (pending != 0) {
+		CPCI429_BAR_WRITE(Bar, CPCI429_REG_INT_STATUS, pending);
+	}
+
+	return pending;
+}
+
+FORCEINLINE
+VOID
+CPCI429RegEnableRxInterrupts(
+	_In_ PVOID Bar,
+	_In_ ULONG Mask
+)
+{
+	CPCI429_BAR_WRITE(Bar, CPCI429_REG_INT_ENABLE, Mask & CPCI429_INT_RX_MASK);
+}
+
+#endif // _REGISTERS_H
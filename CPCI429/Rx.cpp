@@ -0,0 +1,709 @@
+/*++
+
+Module Name:
+
+    rx.c
+
+Abstract:
+
+    This file contains the receive path: per-channel receive rings that
+    the channel DPCs fill from the board FIFOs and that the RX queue
+    drains into read requests.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "rx.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429RxInitialize)
+#pragma alloc_text (PAGE, CPCI429RxAllocateRings)
+#pragma alloc_text (PAGE, CPCI429RxFreeRings)
+#endif
+
+static
+USHORT
+CPCI429ProcessorNode(
+	_In_ PPROCESSOR_NUMBER ProcNumber,
+	_In_ USHORT DefaultNode
+)
+{
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX info;
+	ULONG length = sizeof(info);
+
+	if (NT_SUCCESS(KeQueryLogicalProcessorRelationship(ProcNumber, RelationNumaNode, &info, &length))) {
+		return (USHORT)info.NumaNode.NodeNumber;
+	}
+
+	return DefaultNode;
+}
+
+static
+UCHAR
+CPCI429NthSetBit(
+	_In_ KAFFINITY Mask,
+	_In_ ULONG N
+)
+{
+	UCHAR bit;
+
+	for (bit = 0; bit < sizeof(KAFFINITY) * 8; bit++) {
+		if ((Mask & ((KAFFINITY)1 << bit)) != 0) {
+			if (N == 0) {
+				return bit;
+			}
+			N--;
+		}
+	}
+
+	return 0;
+}
+
+NTSTATUS
+CPCI429RxInitialize(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Sets up the receive channels and picks the processor each channel DPC
+    runs on. A RxDpcProcessor<n> registry value wins; otherwise channels
+    are spread round-robin over the processors that may service the
+    interrupt, which by default are the board's NUMA node.
+
+--*/
+{
+	NTSTATUS status;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDFMEMORY memory;
+	GROUP_AFFINITY spread;
+	ULONG spreadCount;
+	ULONG i;
+
+	PAGED_CODE();
+
+	if (DeviceContext->Config.InterruptAffinity != 0) {
+		spread.Group = (USHORT)DeviceContext->Config.InterruptGroup;
+		spread.Mask = DeviceContext->Config.InterruptAffinity;
+	} else {
+		spread = DeviceContext->NodeAffinity;
+	}
+	spreadCount = 0;
+	for (i = 0; i < sizeof(KAFFINITY) * 8; i++) {
+		if ((spread.Mask & ((KAFFINITY)1 << i)) != 0) {
+			spreadCount++;
+		}
+	}
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+		PROCESSOR_NUMBER procNumber;
+
+		channel->DeviceContext = DeviceContext;
+		channel->Channel = i;
+		KeInitializeSpinLock(&channel->ConsumerLock);
+		KeInitializeDpc(&channel->Dpc, CPCI429RxChannelDpc, channel);
+
+		//
+		// A medium importance DPC queued to another processor may wait for
+		// that processor's next clock tick; raise it so it runs at once.
+		//
+		KeSetImportanceDpc(&channel->Dpc, MediumHighImportance);
+
+		RtlZeroMemory(&procNumber, sizeof(procNumber));
+		if (DeviceContext->Config.RxDpcProcessor[i] == CPCI429_PROCESSOR_DEFAULT ||
+			!NT_SUCCESS(KeGetProcessorNumberFromIndex(DeviceContext->Config.RxDpcProcessor[i], &procNumber))) {
+			procNumber.Group = spread.Group;
+			procNumber.Number = spreadCount ? CPCI429NthSetBit(spread.Mask, i % spreadCount) : 0;
+		}
+
+		KeSetTargetProcessorDpcEx(&channel->Dpc, &procNumber);
+		channel->TargetProcessor = procNumber;
+		channel->Node = CPCI429ProcessorNode(&procNumber, DeviceContext->Node);
+
+		//
+		// Waiting reads are held across power transitions, like alarm waits.
+		//
+		WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+		queueConfig.PowerManaged = WdfFalse;
+
+		status = WdfIoQueueCreate(WdfObjectContextGetObject(DeviceContext), &queueConfig,
+			WDF_NO_OBJECT_ATTRIBUTES, &channel->ReadWaitQueue);
+		if (!NT_SUCCESS(status)) {
+			DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+			return status;
+		}
+	}
+
+	DeviceContext->CpuCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = WdfObjectContextGetObject(DeviceContext);
+
+	status = WdfMemoryCreate(&attributes, NonPagedPool, 'S924',
+		DeviceContext->CpuCount * sizeof(CPU_STATS), &memory, (PVOID*)&DeviceContext->CpuStats);
+	if (!NT_SUCCESS(status)) {
+		DeviceContext->CpuStats = NULL;
+		return status;
+	}
+	RtlZeroMemory(DeviceContext->CpuStats, DeviceContext->CpuCount * sizeof(CPU_STATS));
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+CPCI429RxAllocateRings(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Allocates each channel's receive ring and current-value table from
+    non-paged pool, preferring the NUMA node of the processor that its
+    DPC runs on. Nothing maps the ring for a device, so it need not be
+    physically contiguous.
+
+--*/
+{
+	POOL_EXTENDED_PARAMETER nodeParameter;
+	KIRQL irql;
+	ULONG i;
+
+	PAGED_CODE();
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+		PCPCI429_RX_RECORD ring;
+		SIZE_T recordBytes = DeviceContext->Config.RxRingWords * sizeof(CPCI429_RX_RECORD);
+		SIZE_T ringBytes = recordBytes + CPCI429_LABEL_SDI_COUNT * sizeof(LABEL_ENTRY);
+
+		RtlZeroMemory(&nodeParameter, sizeof(nodeParameter));
+		nodeParameter.Type = PoolExtendedParameterNumaNode;
+		nodeParameter.PreferredNode = channel->Node;
+
+		//
+		// ExAllocatePool3 is ExAllocatePool2 with the node hint, and zeroes
+		// the allocation just the same.
+		//
+		ring = (PCPCI429_RX_RECORD)ExAllocatePool3(POOL_FLAG_NON_PAGED, ringBytes, 'R924', &nodeParameter, 1);
+		if (ring == NULL) {
+			DbgPrint("[%s:%d]: ring allocation failed, channel %u", __FUNCDNAME__, __LINE__, i);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+
+		KeAcquireSpinLock(&channel->ConsumerLock, &irql);
+		channel->Ring = ring;
+		channel->Labels = (PLABEL_ENTRY)WDF_PTR_ADD_OFFSET(ring, recordBytes);
+		channel->RingBytes = ringBytes;
+		channel->RingMask = DeviceContext->Config.RxRingWords - 1;
+		channel->Head = 0;
+		channel->Tail = 0;
+		RtlZeroMemory(&channel->Fifo, sizeof(channel->Fifo));
+		if (DeviceContext->BAR0_VirtualAddress != NULL) {
+			CPCI429RegRxLostSince(DeviceContext->BAR0_VirtualAddress, i, &channel->Fifo.Lost);
+		}
+		KeReleaseSpinLock(&channel->ConsumerLock, irql);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429RxFreeRings(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Frees the receive rings. The interrupt is already disconnected, so
+    once queued DPCs are flushed nothing produces into the rings; readers
+    on the non-power-managed RX queue see a NULL ring and return nothing.
+
+--*/
+{
+	KIRQL irql;
+	ULONG i;
+
+	PAGED_CODE();
+
+	KeFlushQueuedDpcs();
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+		PCPCI429_RX_RECORD ring;
+
+		KeAcquireSpinLock(&channel->ConsumerLock, &irql);
+		ring = channel->Ring;
+		channel->Ring = NULL;
+		channel->Labels = NULL;
+		KeReleaseSpinLock(&channel->ConsumerLock, irql);
+
+		if (ring != NULL) {
+			ExFreePoolWithTag(ring, 'R924');
+		}
+	}
+}
+
+static
+VOID
+CPCI429RxDeliverWaits(
+	_In_ PRX_CHANNEL Channel
+)
+/*++
+
+Routine Description:
+
+    Completes parked CPCI429_IOCTL_RX_READ_WAIT requests while the ring
+    has records. A request that loses the records to another reader goes
+    back to the head of the queue.
+
+--*/
+{
+	WDFREQUEST request;
+	PVOID buffer;
+	size_t length;
+	ULONG count;
+
+	while (Channel->Ring != NULL && Channel->Head != Channel->Tail &&
+		NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Channel->ReadWaitQueue, &request))) {
+
+		if (!NT_SUCCESS(WdfRequestRetrieveOutputBuffer(request, sizeof(CPCI429_RX_RECORD), &buffer, &length))) {
+			WdfRequestComplete(request, STATUS_BUFFER_TOO_SMALL);
+			continue;
+		}
+
+		count = CPCI429RxRead(Channel, buffer, (ULONG)(length / sizeof(CPCI429_RX_RECORD)), TRUE);
+		if (count == 0) {
+			if (!NT_SUCCESS(WdfRequestRequeue(request))) {
+				WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, 0);
+			}
+			continue;
+		}
+
+		WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, count * sizeof(CPCI429_RX_RECORD));
+	}
+}
+
+static
+ULONG
+CPCI429RxDrainChannel(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PRX_CHANNEL Channel
+)
+/*++
+
+Routine Description:
+
+    Moves every word in the channel's FIFO into the receive ring. Words
+    that do not fit are counted as ring overflows and dropped.
+
+    FIFO sampling, loss tracking and gap tagging, the per-label health
+    statistics and on-change suppression are the shared receive path in
+    rxpath.h, which the Linux backend runs too. Every queued word becomes
+    the current value of its label and SDI.
+
+    During a loopback self-test, words on the tested channels go to
+    CPCI429SelfTestReceive instead, and during a bulk transfer the peer's
+    handshake words go to CPCI429BulkReceive.
+
+    Every word also feeds, before any suppression, the health statistics
+    of its entry, on an armed channel the trigger capture history
+    (CPCI429TriggerRecord) and, for aggregated sources, the window
+    aggregates (CPCI429AggregateUpdate), so on-change labels are
+    monitored, captured and summarized at their real rate.
+
+    While the channel has subscribers, every delivered record is also
+    written once to the shared fan-out ring, which never waits for its
+    readers.
+
+Return Value:
+
+    Number of words read from the FIFO.
+
+--*/
+{
+	RX_DRAIN drain;
+	ULONG head = Channel->Head;
+	ULONG queued = 0;
+	ULONG overflows = 0;
+	ULONG word;
+	ULONGLONG now = KeQueryInterruptTime();
+	ULONGLONG heartbeat = (ULONGLONG)Channel->HeartbeatInterval;
+	PCPCI429_SHARED_RING shared = Channel->SubscriberCount != 0 ? Channel->Shared : NULL;
+	ULONGLONG sequence = shared != NULL ? shared->Head : 0;
+	ULONGLONG published = 0;
+	PSELF_TEST selfTest = DeviceContext->SelfTest;
+	PBULK_TRANSFER bulk = DeviceContext->Bulk;
+	PTRIGGER_CAPTURE capture = NULL;
+	PAGGREGATOR aggregator = NULL;
+	ULONGLONG stamp = 0;
+
+	if (Channel->Ring == NULL) {
+		return 0;
+	}
+	if (Channel->Capture.History != NULL) {
+		capture = CPCI429TriggerBeginDrain(Channel);
+	}
+	if (Channel->Aggregator.Window != 0) {
+		aggregator = CPCI429AggregateBeginDrain(Channel);
+	}
+	if (selfTest != NULL) {
+		stamp = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+	}
+
+	CPCI429RxBeginDrain(&drain, &Channel->Fifo, DeviceContext->Config.RxFifoHighWater);
+
+	while (CPCI429RxNextWord(DeviceContext->BAR0_VirtualAddress, Channel->Channel, &Channel->Fifo, &drain, &word)) {
+		PLABEL_ENTRY entry = &Channel->Labels[CPCI429_LABEL_SDI_INDEX(word)];
+		CPCI429_RX_RECORD record;
+
+		if (selfTest != NULL && CPCI429SelfTestReceive(selfTest, Channel->Channel, word, stamp)) {
+			continue;
+		}
+		if (bulk != NULL && CPCI429BulkReceive(DeviceContext, bulk, Channel->Channel, word)) {
+			continue;
+		}
+
+		record.Word = word;
+		record.Flags = 0;
+		record.Timestamp = now;
+
+		CPCI429RxTagGap(&drain, &record);
+
+		if (CPCI429LabelUpdate(entry, word, now, &drain)) {
+			CPCI429HealthRaise(DeviceContext, Channel->Channel,
+				CPCI429_LABEL_SDI_INDEX(word), CPCI429_HEALTH_RECOVERED, now);
+		}
+
+		if (capture != NULL) {
+			CPCI429TriggerRecord(Channel, capture, &record);
+		}
+		if (aggregator != NULL && entry->AggregateSlot != 0) {
+			CPCI429AggregateUpdate(&aggregator->Slots[entry->AggregateSlot - 1], word, now);
+		}
+
+		if (CPCI429RxSuppress(Channel->OnChangeMask, heartbeat, entry, now, &record, &drain)) {
+			continue;
+		}
+
+		if (shared != NULL) {
+			//
+			// Claim the slot before overwriting it so readers can tell a
+			// torn copy from a good one.
+			//
+			InterlockedExchange64((volatile LONG64*)&shared->WriteHead, (LONG64)(sequence + 1));
+			Channel->SharedRecords[sequence & (shared->Capacity - 1)] = record;
+			sequence++;
+			published++;
+		}
+
+		if (head - Channel->Tail > Channel->RingMask) {
+			overflows++;
+			continue;
+		}
+
+		Channel->Ring[head & Channel->RingMask] = record;
+		head++;
+		queued++;
+
+		CPCI429LabelCommit(entry, word, now);
+	}
+
+	CPCI429RxEndDrain(&drain, &Channel->Fifo);
+
+	if (aggregator != NULL) {
+		CPCI429AggregateEndDrain(aggregator);
+	}
+
+	//
+	// Publish the new records to readers.
+	//
+	InterlockedExchange((volatile LONG*)&Channel->Head, (LONG)head);
+
+	if (published != 0) {
+		InterlockedExchange64((volatile LONG64*)&shared->Head, (LONG64)sequence);
+		CPCI429FanoutNotify(Channel);
+	}
+	if (queued != 0) {
+		CPCI429RxDeliverWaits(Channel);
+	}
+	if (capture != NULL) {
+		CPCI429TriggerEndDrain(Channel, now);
+	}
+
+	InterlockedAdd64(&Channel->WordsReceived, drain.Received);
+	InterlockedAdd64(&Channel->WordsQueued, queued);
+	InterlockedAdd64(&Channel->WordsSuppressed, drain.Suppressed);
+	InterlockedAdd64(&Channel->Heartbeats, drain.Heartbeats);
+	InterlockedAdd64(&Channel->RingOverflows, overflows);
+	InterlockedAdd64(&Channel->ParityErrors, drain.ParityErrors);
+	InterlockedAdd64(&Channel->SsmFailures, drain.SsmFailures);
+	InterlockedAdd64(&Channel->GapViolations, drain.GapViolations);
+	InterlockedAdd64(&Channel->FifoOverruns, drain.Overruns);
+	InterlockedAdd64(&Channel->FifoWordsLost, drain.LostWords);
+	InterlockedAdd64(&Channel->BurstDrains, drain.Bursts);
+
+	return drain.Received;
+}
+
+VOID
+CPCI429RxChannelDpc(
+	_In_ PKDPC Dpc,
+	_In_opt_ PVOID DeferredContext,
+	_In_opt_ PVOID SystemArgument1,
+	_In_opt_ PVOID SystemArgument2
+)
+{
+	PRX_CHANNEL channel = (PRX_CHANNEL)DeferredContext;
+	PDEVICE_CONTEXT pDeviceContext = channel->DeviceContext;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+	ULONG words;
+	ULONG cpu;
+
+	UNREFERENCED_PARAMETER(Dpc);
+	UNREFERENCED_PARAMETER(SystemArgument1);
+	UNREFERENCED_PARAMETER(SystemArgument2);
+
+	start = KeQueryPerformanceCounter(NULL);
+	words = CPCI429RxDrainChannel(pDeviceContext, channel);
+	end = KeQueryPerformanceCounter(NULL);
+
+	//
+	// DPCs on one processor never overlap, so each processor owns its entry.
+	//
+	cpu = KeGetCurrentProcessorNumberEx(NULL);
+	if (pDeviceContext->CpuStats != NULL && cpu < pDeviceContext->CpuCount) {
+		pDeviceContext->CpuStats[cpu].Dpcs++;
+		pDeviceContext->CpuStats[cpu].Words += words;
+		pDeviceContext->CpuStats[cpu].DpcTicks += end.QuadPart - start.QuadPart;
+	}
+}
+
+ULONG
+CPCI429RxRead(
+	_In_ PRX_CHANNEL Channel,
+	_Out_ PVOID Buffer,
+	_In_ ULONG MaxItems,
+	_In_ BOOLEAN Records
+)
+/*++
+
+Routine Description:
+
+    Copies up to MaxItems of the oldest received words out of the ring,
+    either as bare words or as full CPCI429_RX_RECORDs.
+
+Return Value:
+
+    Number of words copied.
+
+--*/
+{
+	KIRQL irql;
+	ULONG tail;
+	ULONG count;
+	ULONG i;
+
+	KeAcquireSpinLock(&Channel->ConsumerLock, &irql);
+
+	if (Channel->Ring == NULL) {
+		KeReleaseSpinLock(&Channel->ConsumerLock, irql);
+		return 0;
+	}
+
+	tail = Channel->Tail;
+	count = Channel->Head - tail;
+	KeMemoryBarrier();
+
+	if (count > MaxItems) {
+		count = MaxItems;
+	}
+	if (Records) {
+		PCPCI429_RX_RECORD records = (PCPCI429_RX_RECORD)Buffer;
+
+		for (i = 0; i < count; i++) {
+			records[i] = Channel->Ring[(tail + i) & Channel->RingMask];
+		}
+	} else {
+		PULONG words = (PULONG)Buffer;
+
+		for (i = 0; i < count; i++) {
+			words[i] = Channel->Ring[(tail + i) & Channel->RingMask].Word;
+		}
+	}
+
+	KeMemoryBarrier();
+	Channel->Tail = tail + count;
+
+	KeReleaseSpinLock(&Channel->ConsumerLock, irql);
+
+	return count;
+}
+
+VOID
+CPCI429RxReadWait(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Parks a CPCI429_IOCTL_RX_READ_WAIT request on its channel, then
+    delivers any records that arrived before it was parked.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_RX_READ rxRead;
+	PVOID buffer;
+	PRX_CHANNEL channel;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_RX_READ), (PVOID*)&rxRead, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_RX_RECORD), &buffer, NULL);
+	}
+	if (NT_SUCCESS(status) && rxRead->Channel >= CPCI429_MAX_RX_CHANNELS) {
+		status = STATUS_INVALID_PARAMETER;
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	channel = &DeviceContext->RxChannels[rxRead->Channel];
+
+	status = WdfRequestForwardToIoQueue(Request, channel->ReadWaitQueue);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	CPCI429RxDeliverWaits(channel);
+}
+
+VOID
+CPCI429RxCompleteCpuStats(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_CPU_STATS_SNAPSHOT snapshot;
+	LARGE_INTEGER frequency;
+	size_t length;
+	ULONG i;
+
+	length = FIELD_OFFSET(CPCI429_CPU_STATS_SNAPSHOT, Cpu) + DeviceContext->CpuCount * sizeof(CPCI429_CPU_STATS);
+
+	status = WdfRequestRetrieveOutputBuffer(Request, length, (PVOID*)&snapshot, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	KeQueryPerformanceCounter(&frequency);
+
+	snapshot->Node = DeviceContext->Node;
+	snapshot->TickFrequency = (ULONGLONG)frequency.QuadPart;
+	snapshot->CpuCount = DeviceContext->CpuCount;
+	snapshot->Reserved = 0;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		snapshot->ChannelProcessor[i] = KeGetProcessorIndexFromNumber(&DeviceContext->RxChannels[i].TargetProcessor);
+		snapshot->ChannelNode[i] = DeviceContext->RxChannels[i].Node;
+	}
+
+	for (i = 0; i < DeviceContext->CpuCount; i++) {
+		snapshot->Cpu[i].Dpcs = (ULONGLONG)DeviceContext->CpuStats[i].Dpcs;
+		snapshot->Cpu[i].Words = (ULONGLONG)DeviceContext->CpuStats[i].Words;
+		snapshot->Cpu[i].DpcTicks = (ULONGLONG)DeviceContext->CpuStats[i].DpcTicks;
+	}
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, length);
+}
+
+NTSTATUS
+CPCI429RxSetOnChange(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SET_ON_CHANGE. The DPC picks up the new mask and
+    heartbeat on its next word; a label being switched does not need to
+    be consistent with the others.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_ON_CHANGE_CONFIG config;
+	PRX_CHANNEL channel;
+	ULONG i;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_ON_CHANGE_CONFIG), (PVOID*)&config, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (config->Channel >= CPCI429_MAX_RX_CHANNELS) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	channel = &DeviceContext->RxChannels[config->Channel];
+
+	InterlockedExchange64(&channel->HeartbeatInterval, (LONG64)config->HeartbeatMs * 10000);
+	for (i = 0; i < ARRAYSIZE(channel->OnChangeMask); i++) {
+		InterlockedExchange((volatile LONG*)&channel->OnChangeMask[i], (LONG)config->LabelMask[i]);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429RxCompleteRxStats(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+{
+	NTSTATUS status;
+	PCPCI429_RX_STATS_SNAPSHOT snapshot;
+	ULONG i;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_RX_STATS_SNAPSHOT), (PVOID*)&snapshot, NULL);
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PRX_CHANNEL channel = &DeviceContext->RxChannels[i];
+
+		snapshot->Channel[i].WordsReceived = (ULONGLONG)channel->WordsReceived;
+		snapshot->Channel[i].WordsQueued = (ULONGLONG)channel->WordsQueued;
+		snapshot->Channel[i].RingOverflows = (ULONGLONG)channel->RingOverflows;
+		snapshot->Channel[i].WordsSuppressed = (ULONGLONG)channel->WordsSuppressed;
+		snapshot->Channel[i].Heartbeats = (ULONGLONG)channel->Heartbeats;
+		snapshot->Channel[i].ParityErrors = (ULONGLONG)channel->ParityErrors;
+		snapshot->Channel[i].SsmFailures = (ULONGLONG)channel->SsmFailures;
+		snapshot->Channel[i].GapViolations = (ULONGLONG)channel->GapViolations;
+		snapshot->Channel[i].StaleAlarms = (ULONGLONG)channel->StaleAlarms;
+		snapshot->Channel[i].Triggers = (ULONGLONG)channel->Capture.Triggers;
+		snapshot->Channel[i].TriggerWindowsDropped = (ULONGLONG)channel->Capture.WindowsDropped;
+		snapshot->Channel[i].FifoOverruns = (ULONGLONG)channel->FifoOverruns;
+		snapshot->Channel[i].FifoWordsLost = (ULONGLONG)channel->FifoWordsLost;
+		snapshot->Channel[i].BurstDrains = (ULONGLONG)channel->BurstDrains;
+	}
+
+	WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, sizeof(CPCI429_RX_STATS_SNAPSHOT));
+}
@@ -0,0 +1,68 @@
+/*++
+
+Module Name:
+
+    rx.h
+
+Abstract:
+
+    This file contains the receive path definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+NTSTATUS
+CPCI429RxInitialize(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+NTSTATUS
+CPCI429RxAllocateRings(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+CPCI429RxFreeRings(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+ULONG
+CPCI429RxRead(
+    _In_ PRX_CHANNEL Channel,
+    _Out_ PVOID Buffer,
+    _In_ ULONG MaxItems,
+    _In_ BOOLEAN Records
+    );
+
+VOID
+CPCI429RxReadWait(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429RxCompleteCpuStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+NTSTATUS
+CPCI429RxSetOnChange(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429RxCompleteRxStats(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+KDEFERRED_ROUTINE CPCI429RxChannelDpc;
+
+EXTERN_C_END
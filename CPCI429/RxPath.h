@@ -0,0 +1,441 @@
+/*++
+
+Module Name:
+
+    rxpath.h
+
+Abstract:
+
+    The per-word receive path, shared by the driver's channel DPC and the
+    Linux user-mode backend so that both turn a board FIFO into the same
+    record stream: FIFO sampling with burst draining and loss tracking,
+    gap tagging, the per-label current value and health statistics, and
+    on-change suppression. Each side keeps its own ring, locking and
+    clock; a drain pass runs as
+
+        CPCI429RxBeginDrain
+        while CPCI429RxNextWord (or CPCI429RxSampleFifo before a batch)
+            CPCI429RxTagGap, CPCI429LabelUpdate, CPCI429RxSuppress,
+            queue the record, CPCI429LabelCommit
+        CPCI429RxEndDrain
+
+    and the caller adds the pass's counters to its channel totals.
+
+Environment:
+
+    user and kernel
+
+--*/
+
+#ifndef _RXPATH_H
+#define _RXPATH_H
+
+#include "Registers.h"
+
+#define CPCI429_WORD_CHANGE_MASK 0x7FFFFC00    // data and SSM
+
+//
+// TRUE if the word has odd parity over all 32 bits, as ARINC 429 requires.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429OddParity(
+	_In_ ULONG Word
+)
+{
+	Word ^= Word >> 16;
+	Word ^= Word >> 8;
+	Word ^= Word >> 4;
+	return (BOOLEAN)((0x6996 >> (Word & 0xF)) & 1);
+}
+
+//
+// Current-value and health entry for one label and SDI on a receive
+// channel. The receive path updates these; limits are written by the
+// configuration path and Stale is shared with the staleness check.
+// Intervals and limits are in 100ns units, a zero limit is not checked.
+//
+typedef struct _LABEL_ENTRY
+{
+	ULONG LastWord;
+	BOOLEAN Valid;
+	UCHAR SsmFailMask;          // bit n set: SSM value n counts as a failure
+	USHORT AggregateSlot;       // 1 + index in the channel's aggregator, 0 if none
+	ULONGLONG LastDelivered;    // time the source last reached the ring
+	ULONGLONG LastUpdate;       // time of the last word, delivered or not
+
+	ULONG Updates;
+	ULONG MinInterval;
+	ULONG MaxInterval;
+	ULONG EwmaInterval;         // weight 1/8
+	ULONG GapViolations;        // interval above MaxLimit
+	ULONG RateViolations;       // interval below MinLimit
+	ULONG ParityErrors;
+	ULONG SsmFailures;
+
+	ULONGLONG MinLimit;
+	ULONGLONG MaxLimit;
+	ULONGLONG StaleLimit;
+	ULONGLONG StaleArmed;       // time StaleLimit was set, for labels never received
+	volatile LONG Stale;
+
+} LABEL_ENTRY, *PLABEL_ENTRY;
+
+#define CPCI429_MAX_STALE_WATCH 256
+
+//
+// Board FIFO loss tracking of one receive channel, owned by whoever
+// drains it. Lost is the last value seen in the lost-word counter;
+// GapPending holds lost words not yet tagged on a delivered record, or
+// RX_GAP_UNKNOWN. Overflowed follows the status register's overflow bit,
+// so that each time it latches counts as one overrun.
+//
+#define RX_GAP_UNKNOWN 0xFFFFFFFF
+
+typedef struct _RX_FIFO_STATE
+{
+	ULONG Lost;
+	ULONG GapPending;
+	BOOLEAN Overflowed;
+
+} RX_FIFO_STATE, *PRX_FIFO_STATE;
+
+//
+// One drain pass. Received counts words taken from the FIFO so far; the
+// rest are the pass's contribution to the channel totals.
+//
+typedef struct _RX_DRAIN
+{
+	ULONG HighWater;            // FIFO fill at which the pass reads in bursts
+	ULONG Burst;                // words left in the current burst
+	ULONG GapWords;
+	ULONG GapAt;                // the gap is tagged on the first record after this many words
+
+	ULONG Received;
+	ULONG Suppressed;
+	ULONG Heartbeats;
+	ULONG ParityErrors;
+	ULONG SsmFailures;
+	ULONG GapViolations;
+	ULONG Overruns;
+	ULONG LostWords;
+	ULONG Bursts;
+
+} RX_DRAIN, *PRX_DRAIN;
+
+FORCEINLINE
+VOID
+CPCI429RxBeginDrain(
+	_Out_ PRX_DRAIN Drain,
+	_In_ const RX_FIFO_STATE *Fifo,
+	_In_ ULONG HighWater
+)
+{
+	RtlZeroMemory(Drain, sizeof(RX_DRAIN));
+	Drain->HighWater = HighWater;
+	Drain->GapWords = Fifo->GapPending;
+}
+
+FORCEINLINE
+VOID
+CPCI429RxEndDrain(
+	_In_ const RX_DRAIN *Drain,
+	_Inout_ PRX_FIFO_STATE Fifo
+)
+{
+	Fifo->GapPending = Drain->GapWords;
+}
+
+//
+// Reads the FIFO status for the pass. A sample with the overflow bit
+// set, and the first of each pass, also read the board's lost-word
+// counter. The FIFO has stayed full since the loss, so the gap follows
+// the words the status now counts. Returns the status register.
+//
+// The overflow bit decides that an overrun happened: each time it
+// latches counts one and opens a gap, whatever the counter says. The bit
+// stays set until the FIFO is drained empty, so none goes unseen. The
+// counter only supplies the number of words, which a board may publish
+// late: a gap it has not counted yet is tagged as saturated. Words it
+// shows while the bit stays set open a gap of their own, behind the
+// words still in the FIFO; once the bit has cleared they belong to a gap
+// already delivered and only reach the totals.
+//
+FORCEINLINE
+ULONG
+CPCI429RxSampleFifo(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel,
+	_Inout_ PRX_FIFO_STATE Fifo,
+	_Inout_ PRX_DRAIN Drain
+)
+{
+	ULONG status = CPCI429RegRxStatus(Bar, Channel);
+	BOOLEAN overflow = (status & CPCI429_FIFO_OVERFLOW) != 0;
+	BOOLEAN latched = overflow && !Fifo->Overflowed;
+	ULONG lost;
+
+	Fifo->Overflowed = overflow;
+	if (!overflow && Drain->Received != 0) {
+		return status;
+	}
+
+	lost = CPCI429RegRxLostSince(Bar, Channel, &Fifo->Lost);
+	if (lost == 0 && !latched) {
+		return status;
+	}
+
+	if (!latched && Drain->GapWords == RX_GAP_UNKNOWN) {
+		Drain->GapWords = lost;
+	} else if (latched || overflow) {
+		status = CPCI429RegRxStatus(Bar, Channel);
+		if (Drain->GapWords == 0) {
+			Drain->GapAt = Drain->Received + CPCI429_FIFO_COUNT(status);
+		}
+		Drain->GapWords = lost == 0 || Drain->GapWords == RX_GAP_UNKNOWN ||
+			Drain->GapWords + lost < Drain->GapWords ? RX_GAP_UNKNOWN : Drain->GapWords + lost;
+		Drain->Overruns += latched;
+	}
+
+	Drain->LostWords += lost;
+
+	return status;
+}
+
+//
+// Takes the next word from the FIFO. The status is sampled once per word
+// until the fill reaches the high-water mark; from there each sample is
+// followed by a burst read of every word it counted. Returns FALSE once
+// the FIFO is empty.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429RxNextWord(
+	_In_ PVOID Bar,
+	_In_ ULONG Channel,
+	_Inout_ PRX_FIFO_STATE Fifo,
+	_Inout_ PRX_DRAIN Drain,
+	_Out_ PULONG Word
+)
+{
+	ULONG status;
+
+	if (Drain->Burst == 0) {
+		status = CPCI429RxSampleFifo(Bar, Channel, Fifo, Drain);
+		if ((status & CPCI429_FIFO_EMPTY) != 0) {
+			return FALSE;
+		}
+		Drain->Burst = CPCI429_FIFO_COUNT(status);
+		if (Drain->Burst >= Drain->HighWater) {
+			Drain->Bursts++;
+		} else {
+			Drain->Burst = 1;
+		}
+	}
+
+	*Word = CPCI429RegRxReadWord(Bar, Channel);
+	Drain->Burst--;
+	Drain->Received++;
+
+	return TRUE;
+}
+
+//
+// Tags the record of the word just taken if a gap is pending before it.
+// A gap record is never suppressed.
+//
+FORCEINLINE
+VOID
+CPCI429RxTagGap(
+	_Inout_ PRX_DRAIN Drain,
+	_Inout_ PCPCI429_RX_RECORD Record
+)
+{
+	if (Drain->GapWords != 0 && Drain->Received > Drain->GapAt) {
+		Record->Flags |= CPCI429_RX_FLAG_GAP |
+			((Drain->GapWords < 0xFFFF ? Drain->GapWords : 0xFFFF) << CPCI429_RX_GAP_SHIFT);
+		Drain->GapWords = 0;
+	}
+}
+
+//
+// Per-word health bookkeeping. Constant time. Returns TRUE if the word
+// ends a staleness alarm, for the caller to report the recovery.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429LabelUpdate(
+	_Inout_ PLABEL_ENTRY Entry,
+	_In_ ULONG Word,
+	_In_ ULONGLONG Now,
+	_Inout_ PRX_DRAIN Drain
+)
+{
+	if (Entry->Updates != 0) {
+		ULONGLONG elapsed = Now - Entry->LastUpdate;
+		ULONG interval = elapsed > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)elapsed;
+
+		if (Entry->Updates == 1) {
+			Entry->MinInterval = interval;
+			Entry->MaxInterval = interval;
+			Entry->EwmaInterval = interval;
+		} else {
+			if (interval < Entry->MinInterval) {
+				Entry->MinInterval = interval;
+			}
+			if (interval > Entry->MaxInterval) {
+				Entry->MaxInterval = interval;
+			}
+			Entry->EwmaInterval = (ULONG)((LONGLONG)Entry->EwmaInterval +
+				(((LONGLONG)interval - (LONGLONG)Entry->EwmaInterval) >> 3));
+		}
+
+		if (Entry->MaxLimit != 0 && elapsed > Entry->MaxLimit) {
+			Entry->GapViolations++;
+			Drain->GapViolations++;
+		}
+		if (Entry->MinLimit != 0 && elapsed < Entry->MinLimit) {
+			Entry->RateViolations++;
+		}
+	}
+
+	Entry->Updates++;
+	Entry->LastUpdate = Now;
+
+	if (!CPCI429OddParity(Word)) {
+		Entry->ParityErrors++;
+		Drain->ParityErrors++;
+	}
+	if ((Entry->SsmFailMask >> CPCI429_WORD_SSM(Word)) & 1) {
+		Entry->SsmFailures++;
+		Drain->SsmFailures++;
+	}
+
+	return Entry->Stale && InterlockedExchange(&Entry->Stale, 0) != 0;
+}
+
+//
+// On-change suppression. For labels set in OnChangeMask, a word whose
+// data and SSM match the source's last delivered value is suppressed
+// unless Heartbeat is set and has passed since that delivery, in which
+// case the record is flagged as a heartbeat. Returns TRUE to drop it.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429RxSuppress(
+	_In_reads_(256 / 32) const volatile ULONG *OnChangeMask,
+	_In_ ULONGLONG Heartbeat,
+	_In_ const LABEL_ENTRY *Entry,
+	_In_ ULONGLONG Now,
+	_Inout_ PCPCI429_RX_RECORD Record,
+	_Inout_ PRX_DRAIN Drain
+)
+{
+	ULONG label = CPCI429_WORD_LABEL(Record->Word);
+
+	if ((OnChangeMask[label >> 5] & (1UL << (label & 31))) == 0 || (Record->Flags & CPCI429_RX_FLAG_GAP) != 0 ||
+		!Entry->Valid || ((Record->Word ^ Entry->LastWord) & CPCI429_WORD_CHANGE_MASK) != 0) {
+		return FALSE;
+	}
+
+	if (Heartbeat == 0 || Now - Entry->LastDelivered < Heartbeat) {
+		Drain->Suppressed++;
+		return TRUE;
+	}
+
+	Record->Flags |= CPCI429_RX_FLAG_HEARTBEAT;
+	Drain->Heartbeats++;
+
+	return FALSE;
+}
+
+//
+// Makes a queued word its source's last value. Only a queued word does,
+// so a change dropped for ring overflow is still delivered by the next
+// repeat.
+//
+FORCEINLINE
+VOID
+CPCI429LabelCommit(
+	_Inout_ PLABEL_ENTRY Entry,
+	_In_ ULONG Word,
+	_In_ ULONGLONG Now
+)
+{
+	Entry->LastWord = Word;
+	Entry->Valid = TRUE;
+	Entry->LastDelivered = Now;
+}
+
+//
+// Applies a CPCI429_IOCTL_SET_LABEL_HEALTH configuration to one entry.
+// A label that has never been received goes stale StaleMs after this.
+//
+FORCEINLINE
+VOID
+CPCI429LabelSetLimits(
+	_Inout_ PLABEL_ENTRY Entry,
+	_In_ const CPCI429_LABEL_HEALTH_CONFIG *Config,
+	_In_ ULONGLONG Now
+)
+{
+	Entry->SsmFailMask = Config->SsmFailMask;
+	Entry->MinLimit = (ULONGLONG)Config->MinIntervalMs * 10000;
+	Entry->MaxLimit = (ULONGLONG)Config->MaxIntervalMs * 10000;
+
+	//
+	// Arm before publishing the limit so a concurrent check never sees a
+	// limit without its start time.
+	//
+	Entry->StaleArmed = Now;
+	MemoryBarrier();
+	Entry->StaleLimit = (ULONGLONG)Config->StaleMs * 10000;
+}
+
+//
+// Staleness check of one watched entry. Returns TRUE when the entry
+// has just gone stale, for the caller to raise the alarm once.
+//
+FORCEINLINE
+BOOLEAN
+CPCI429LabelCheckStale(
+	_Inout_ PLABEL_ENTRY Entry,
+	_In_ ULONGLONG Now
+)
+{
+	ULONGLONG last;
+
+	if (Entry->StaleLimit == 0 || Entry->Stale) {
+		return FALSE;
+	}
+
+	last = Entry->Updates != 0 ? Entry->LastUpdate : Entry->StaleArmed;
+	if (Now - last <= Entry->StaleLimit) {
+		return FALSE;
+	}
+
+	return InterlockedCompareExchange(&Entry->Stale, 1, 0) == 0;
+}
+
+FORCEINLINE
+VOID
+CPCI429LabelGetHealth(
+	_In_ const LABEL_ENTRY *Entry,
+	_In_ ULONGLONG Now,
+	_Out_ PCPCI429_LABEL_HEALTH Health
+)
+{
+	Health->SinceLastUpdate = Entry->Updates != 0 ? Now - Entry->LastUpdate : 0;
+	Health->Updates = Entry->Updates;
+	Health->MinInterval = Entry->MinInterval;
+	Health->MaxInterval = Entry->MaxInterval;
+	Health->EwmaInterval = Entry->EwmaInterval;
+	Health->GapViolations = Entry->GapViolations;
+	Health->RateViolations = Entry->RateViolations;
+	Health->ParityErrors = Entry->ParityErrors;
+	Health->SsmFailures = Entry->SsmFailures;
+	Health->Stale = (ULONG)Entry->Stale;
+	Health->Reserved = 0;
+}
+
+#endif // _RXPATH_H
@@ -0,0 +1,417 @@
+/*++
+
+Module Name:
+
+    selftest.c
+
+Abstract:
+
+    This file contains the line-rate loopback self-test. A periodic timer
+    keeps the transmit FIFOs of the tested channels full of numbered
+    words; the receive DPCs hand the looped-back words to
+    CPCI429SelfTestReceive (loopback.h) instead of the ring, which checks
+    their sequence and content and measures the latency. When the run
+    ends a work item restores the channels and completes the request with
+    the results.
+
+    Everything goes through CPCI429ReadRegister and CPCI429WriteRegister,
+    so the test runs unchanged against any backend behind them.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "selftest.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429SelfTestInitialize)
+#pragma alloc_text (PAGE, CPCI429SelfTestStop)
+#pragma alloc_text (PAGE, CPCI429EvtSelfTestWorkItem)
+#endif
+
+NTSTATUS
+CPCI429SelfTestInitialize(
+	_In_ WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_TIMER_CONFIG timerConfig;
+	WDF_WORKITEM_CONFIG workItemConfig;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	WDF_OBJECT_ATTRIBUTES attributes;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+
+	//
+	// At the default timer resolution a 1 ms period fires every 15.6 ms,
+	// and a FIFO holding a few ms of words would run dry between pumps.
+	//
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, CPCI429EvtSelfTestTimer, CPCI429_SELF_TEST_TIMER_MS);
+	timerConfig.UseHighResolutionTimer = WdfTrue;
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &pDeviceContext->SelfTestTimer);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfTimerCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	WDF_WORKITEM_CONFIG_INIT(&workItemConfig, CPCI429EvtSelfTestWorkItem);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = Device;
+
+	status = WdfWorkItemCreate(&workItemConfig, &attributes, &pDeviceContext->SelfTestWorkItem);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfWorkItemCreate failed %x", __FUNCDNAME__, __LINE__, status);
+		return status;
+	}
+
+	//
+	// The running test's request waits here, so the control queue stays
+	// free and a canceled request ends the run.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+	queueConfig.EvtIoCanceledOnQueue = CPCI429EvtSelfTestCanceled;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->SelfTestQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+	}
+
+	return status;
+}
+
+static
+VOID
+CPCI429SelfTestCpuTotals(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_Out_ PULONGLONG Dpcs,
+	_Out_ PULONGLONG DpcTicks
+)
+{
+	ULONG i;
+
+	*Dpcs = 0;
+	*DpcTicks = 0;
+
+	for (i = 0; i < DeviceContext->CpuCount; i++) {
+		*Dpcs += DeviceContext->CpuStats[i].Dpcs;
+		*DpcTicks += DeviceContext->CpuStats[i].DpcTicks;
+	}
+}
+
+static
+VOID
+CPCI429SelfTestRestore(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ PSELF_TEST Test
+)
+/*++
+
+Routine Description:
+
+    Puts the tested channels back as they were before the run and lets
+    transmit requests use them again. Callable at DISPATCH_LEVEL.
+
+--*/
+{
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PSELF_TEST_CHANNEL channel = &Test->Channel[i];
+
+		if (!(Test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		CPCI429WriteRegister(DeviceContext, CPCI429_TX_CHANNEL_BASE(i) + CPCI429_CH_CONTROL, channel->SavedTxControl);
+		CPCI429WriteRegister(DeviceContext, CPCI429_RX_CHANNEL_BASE(i) + CPCI429_CH_CONTROL, channel->SavedRxControl);
+	}
+
+	InterlockedExchange(&DeviceContext->SelfTestChannels, 0);
+}
+
+VOID
+CPCI429SelfTestStart(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SELF_TEST from the control queue. Configures
+    the tested channel pairs, publishes the run to the receive DPCs and
+    starts the pump. The request completes when the run ends.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_SELF_TEST_CONFIG config;
+	PVOID result;
+	PSELF_TEST test;
+	LARGE_INTEGER frequency;
+	ULONGLONG start;
+	ULONG i;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_SELF_TEST_CONFIG), (PVOID*)&config, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(CPCI429_SELF_TEST_RESULT), &result, NULL);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+	if (!CPCI429SelfTestValidConfig(config)) {
+		WdfRequestComplete(Request, STATUS_INVALID_PARAMETER);
+		return;
+	}
+	if (DeviceContext->SelfTest != NULL || DeviceContext->SelfTestFinishing != 0) {
+		WdfRequestComplete(Request, STATUS_DEVICE_BUSY);
+		return;
+	}
+	if (DeviceContext->BAR0_VirtualAddress == NULL || DeviceContext->CpuStats == NULL) {
+		WdfRequestComplete(Request, STATUS_DEVICE_NOT_READY);
+		return;
+	}
+
+	test = (PSELF_TEST)CPCI429PoolAllocate(&DeviceContext->Pools[CPCI429_POOL_CONTEXTS]);
+	if (test == NULL) {
+		WdfRequestComplete(Request, STATUS_INSUFFICIENT_RESOURCES);
+		return;
+	}
+	RtlZeroMemory(test, sizeof(SELF_TEST));
+
+	start = (ULONGLONG)KeQueryPerformanceCounter(&frequency).QuadPart;
+	CPCI429SelfTestBegin(test, config, start, (ULONGLONG)frequency.QuadPart);
+	CPCI429SelfTestCpuTotals(DeviceContext, &test->Dpcs, &test->DpcTicks);
+
+	//
+	// Claim the channels before touching them, so that a transmit request
+	// racing in from the transmit queue cannot mix its words into the run.
+	//
+	InterlockedExchange(&DeviceContext->SelfTestChannels, (LONG)test->ChannelMask);
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PSELF_TEST_CHANNEL channel = &test->Channel[i];
+		ULONG txBase = CPCI429_TX_CHANNEL_BASE(i);
+		ULONG rxBase = CPCI429_RX_CHANNEL_BASE(i);
+
+		if (!(test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		channel->SavedTxControl = CPCI429ReadRegister(DeviceContext, txBase + CPCI429_CH_CONTROL);
+		channel->SavedRxControl = CPCI429ReadRegister(DeviceContext, rxBase + CPCI429_CH_CONTROL);
+
+		CPCI429WriteRegister(DeviceContext, txBase + CPCI429_CH_CONTROL, CPCI429SelfTestControl(config, FALSE));
+		CPCI429WriteRegister(DeviceContext, rxBase + CPCI429_CH_CONTROL, CPCI429SelfTestControl(config, TRUE));
+	}
+
+	DeviceContext->SelfTestCanceled = FALSE;
+	DeviceContext->SelfTestAborted = FALSE;
+
+	//
+	// The run has not been published, so nothing else holds the test and
+	// it can be undone here; the work item is pageable and this is not.
+	//
+	status = WdfRequestForwardToIoQueue(Request, DeviceContext->SelfTestQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfRequestForwardToIoQueue failed %x", __FUNCDNAME__, __LINE__, status);
+		CPCI429SelfTestRestore(DeviceContext, test);
+		CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_CONTEXTS], test);
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	InterlockedExchangePointer((PVOID volatile*)&DeviceContext->SelfTest, test);
+	WdfTimerStart(DeviceContext->SelfTestTimer, WDF_REL_TIMEOUT_IN_MS(CPCI429_SELF_TEST_TIMER_MS));
+}
+
+VOID
+CPCI429EvtSelfTestTimer(
+	_In_ WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+    Tops up the transmit FIFO of every tested channel until the run's
+    duration is over, then leaves the receivers a grace period before
+    handing the run to the work item.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	PSELF_TEST test = pDeviceContext->SelfTest;
+	ULONGLONG now;
+	ULONG i;
+
+	if (test == NULL || pDeviceContext->SelfTestFinishing != 0) {
+		return;
+	}
+
+	now = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+
+	if (!test->Draining && (now >= test->Deadline || pDeviceContext->SelfTestCanceled)) {
+		test->Draining = TRUE;
+		test->Stopped = now;
+	}
+
+	if (test->Draining) {
+		if ((now - test->Stopped >= test->TickFrequency * CPCI429_SELF_TEST_GRACE_MS / 1000 ||
+			pDeviceContext->SelfTestCanceled) &&
+			InterlockedCompareExchange(&pDeviceContext->SelfTestFinishing, 1, 0) == 0) {
+			WdfWorkItemEnqueue(pDeviceContext->SelfTestWorkItem);
+		}
+		return;
+	}
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PSELF_TEST_CHANNEL channel = &test->Channel[i];
+		ULONG base = CPCI429_TX_CHANNEL_BASE(i);
+		ULONG fifoStatus;
+		ULONG room;
+		ULONG n;
+
+		if (!(test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		fifoStatus = CPCI429ReadRegister(pDeviceContext, base + CPCI429_CH_FIFO_STATUS);
+		if ((fifoStatus & CPCI429_FIFO_EMPTY) && channel->NextSend != 0) {
+			channel->Result.TxUnderruns++;
+		}
+
+		room = CPCI429SelfTestRoom(test, fifoStatus);
+		for (n = 0; n < room && !(fifoStatus & CPCI429_FIFO_FULL); n++) {
+			ULONG sequence = channel->NextSend;
+
+			//
+			// Stamp before the write so the receiver never sees a word
+			// without its send time.
+			//
+			channel->Stamps[sequence & (CPCI429_SELF_TEST_STAMPS - 1)] =
+				CPCI429SelfTestSendTime(test, now, CPCI429_FIFO_COUNT(fifoStatus));
+			KeMemoryBarrier();
+			CPCI429WriteRegister(pDeviceContext, base + CPCI429_CH_FIFO_DATA,
+				CPCI429SelfTestWord(test->Label, i, sequence));
+			channel->NextSend = sequence + 1;
+
+			fifoStatus = CPCI429ReadRegister(pDeviceContext, base + CPCI429_CH_FIFO_STATUS);
+		}
+
+		channel->Result.WordsSent += n;
+	}
+
+	test->Pumps++;
+	test->PumpTicks += (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart - now;
+}
+
+VOID
+CPCI429EvtSelfTestWorkItem(
+	_In_ WDFWORKITEM WorkItem
+)
+/*++
+
+Routine Description:
+
+    Ends the run: stops the pump, waits out the receive DPCs, restores
+    the channels and completes the request, if it was not canceled,
+    with the results.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfWorkItemGetParentObject(WorkItem));
+	PSELF_TEST test = pDeviceContext->SelfTest;
+	PCPCI429_SELF_TEST_RESULT result;
+	WDFREQUEST request;
+	ULONGLONG dpcs;
+	ULONGLONG dpcTicks;
+
+	PAGED_CODE();
+
+	WdfTimerStop(pDeviceContext->SelfTestTimer, TRUE);
+
+	InterlockedExchangePointer((PVOID volatile*)&pDeviceContext->SelfTest, NULL);
+	KeFlushQueuedDpcs();
+
+	if (test == NULL) {
+		InterlockedExchange(&pDeviceContext->SelfTestFinishing, 0);
+		return;
+	}
+	if (!test->Draining) {
+		test->Stopped = (ULONGLONG)KeQueryPerformanceCounter(NULL).QuadPart;
+	}
+
+	CPCI429SelfTestRestore(pDeviceContext, test);
+
+	if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(pDeviceContext->SelfTestQueue, &request))) {
+		if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(request, sizeof(CPCI429_SELF_TEST_RESULT), (PVOID*)&result, NULL))) {
+			CPCI429SelfTestCpuTotals(pDeviceContext, &dpcs, &dpcTicks);
+
+			CPCI429SelfTestResults(test, result);
+			result->Outcome = pDeviceContext->SelfTestAborted ? CPCI429_SELF_TEST_ABORTED : CPCI429_SELF_TEST_COMPLETED;
+			result->Dpcs = dpcs - test->Dpcs;
+			result->DpcTicks = dpcTicks - test->DpcTicks;
+
+			WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, sizeof(CPCI429_SELF_TEST_RESULT));
+		} else {
+			WdfRequestComplete(request, STATUS_BUFFER_TOO_SMALL);
+		}
+	}
+
+	CPCI429PoolFree(&pDeviceContext->Pools[CPCI429_POOL_CONTEXTS], test);
+
+	InterlockedExchange(&pDeviceContext->SelfTestFinishing, 0);
+}
+
+VOID
+CPCI429EvtSelfTestCanceled(
+	_In_ WDFQUEUE Queue,
+	_In_ WDFREQUEST Request
+)
+{
+	PDEVICE_CONTEXT pDeviceContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+
+	pDeviceContext->SelfTestCanceled = TRUE;
+
+	WdfRequestComplete(Request, STATUS_CANCELLED);
+}
+
+VOID
+CPCI429SelfTestStop(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Ends a running test early because the device is leaving D0. Called
+    while the registers are still accessible.
+
+--*/
+{
+	PAGED_CODE();
+
+	if (DeviceContext->SelfTest == NULL) {
+		return;
+	}
+
+	DeviceContext->SelfTestAborted = TRUE;
+	WdfTimerStop(DeviceContext->SelfTestTimer, TRUE);
+
+	if (InterlockedCompareExchange(&DeviceContext->SelfTestFinishing, 1, 0) == 0) {
+		CPCI429EvtSelfTestWorkItem(DeviceContext->SelfTestWorkItem);
+	}
+
+	WdfWorkItemFlush(DeviceContext->SelfTestWorkItem);
+}
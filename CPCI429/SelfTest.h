@@ -0,0 +1,42 @@
+/*++
+
+Module Name:
+
+    selftest.h
+
+Abstract:
+
+    This file contains the driver side of the loopback self-test. The
+    run state and word checking are in loopback.h.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+#define CPCI429_SELF_TEST_TIMER_MS 1
+
+NTSTATUS
+CPCI429SelfTestInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CPCI429SelfTestStart(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+CPCI429SelfTestStop(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+EVT_WDF_TIMER CPCI429EvtSelfTestTimer;
+EVT_WDF_WORKITEM CPCI429EvtSelfTestWorkItem;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE CPCI429EvtSelfTestCanceled;
+
+EXTERN_C_END
@@ -0,0 +1,551 @@
+/*++
+
+Module Name:
+
+    trigger.c
+
+Abstract:
+
+    This file contains trigger capture. An armed receive channel copies
+    every word it drains into a history ring held in a record pool
+    block (CPCI429TriggerRecord). A trigger - a label and value match, a
+    parity error, a staleness alarm or CPCI429_IOCTL_TRIGGER - opens a
+    window reaching PreRecords words back; the window is closed once
+    PostInterval has passed, copied into a block of its own and handed
+    to a CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE request parked in a manual
+    queue. Nothing else leaves the driver, so the steady-state cost of
+    an armed channel is the history write.
+
+    Windows are closed by the channel DPC after a drain, or by the
+    health timer when the channel has gone quiet.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+#include "driver.h"
+#include "trigger.tmh"
+
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, CPCI429TriggerInitialize)
+#endif
+
+NTSTATUS
+CPCI429TriggerInitialize(
+	_In_ WDFDEVICE Device
+)
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT pDeviceContext;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	ULONG i;
+
+	PAGED_CODE();
+
+	pDeviceContext = DeviceGetContext(Device);
+	KeInitializeSpinLock(&pDeviceContext->TriggerLock);
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		KeInitializeSpinLock(&pDeviceContext->RxChannels[i].Capture.Lock);
+	}
+
+	//
+	// Capture waits are held across power transitions.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(Device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &pDeviceContext->TriggerWaitQueue);
+	if (!NT_SUCCESS(status)) {
+		DbgPrint("[%s:%d]: WdfIoQueueCreate failed %x", __FUNCDNAME__, __LINE__, status);
+	}
+
+	return status;
+}
+
+VOID
+CPCI429TriggerRelease(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Disarms every channel and drops the windows nobody collected, so
+    that the record pool can be released with the hardware.
+
+--*/
+{
+	PTRIGGER_CAPTURE capture;
+	PCPCI429_RX_RECORD history;
+	KIRQL irql;
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		capture = &DeviceContext->RxChannels[i].Capture;
+
+		KeAcquireSpinLock(&capture->Lock, &irql);
+		history = capture->History;
+		capture->History = NULL;
+		capture->Open = FALSE;
+		KeReleaseSpinLock(&capture->Lock, irql);
+
+		if (history != NULL) {
+			CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_RECORDS], history);
+		}
+	}
+
+	KeAcquireSpinLock(&DeviceContext->TriggerLock, &irql);
+
+	while (DeviceContext->TriggerWindowCount != 0) {
+		CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_RECORDS],
+			DeviceContext->TriggerWindows[DeviceContext->TriggerWindowFirst].Records);
+		DeviceContext->TriggerWindowFirst = (DeviceContext->TriggerWindowFirst + 1) % ARRAYSIZE(DeviceContext->TriggerWindows);
+		DeviceContext->TriggerWindowCount--;
+	}
+
+	KeReleaseSpinLock(&DeviceContext->TriggerLock, irql);
+}
+
+static
+VOID
+CPCI429TriggerDeliver(
+	_In_ PDEVICE_CONTEXT DeviceContext
+)
+/*++
+
+Routine Description:
+
+    Hands finished windows to parked wait requests until either runs
+    out.
+
+--*/
+{
+	NTSTATUS status;
+	WDFREQUEST request;
+	PCPCI429_TRIGGER_CAPTURE capture;
+	TRIGGER_WINDOW window;
+	size_t length;
+	ULONG count;
+	KIRQL irql;
+
+	for (;;) {
+		KeAcquireSpinLock(&DeviceContext->TriggerLock, &irql);
+
+		if (DeviceContext->TriggerWindowCount == 0 ||
+			!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->TriggerWaitQueue, &request))) {
+			KeReleaseSpinLock(&DeviceContext->TriggerLock, irql);
+			return;
+		}
+
+		status = WdfRequestRetrieveOutputBuffer(request, FIELD_OFFSET(CPCI429_TRIGGER_CAPTURE, Records),
+			(PVOID*)&capture, &length);
+		if (!NT_SUCCESS(status)) {
+			KeReleaseSpinLock(&DeviceContext->TriggerLock, irql);
+			WdfRequestComplete(request, status);
+			continue;
+		}
+
+		window = DeviceContext->TriggerWindows[DeviceContext->TriggerWindowFirst];
+		DeviceContext->TriggerWindowFirst = (DeviceContext->TriggerWindowFirst + 1) % ARRAYSIZE(DeviceContext->TriggerWindows);
+		DeviceContext->TriggerWindowCount--;
+
+		KeReleaseSpinLock(&DeviceContext->TriggerLock, irql);
+
+		count = (ULONG)((length - FIELD_OFFSET(CPCI429_TRIGGER_CAPTURE, Records)) / sizeof(CPCI429_RX_RECORD));
+		if (count > window.Header.RecordCount) {
+			count = window.Header.RecordCount;
+		}
+
+		*capture = window.Header;
+		capture->RecordCount = count;
+		capture->RecordsDropped = window.Header.RecordCount - count;
+		RtlCopyMemory(capture->Records, window.Records, count * sizeof(CPCI429_RX_RECORD));
+
+		CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_RECORDS], window.Records);
+
+		WdfRequestCompleteWithInformation(request, STATUS_SUCCESS,
+			FIELD_OFFSET(CPCI429_TRIGGER_CAPTURE, Records) + count * sizeof(CPCI429_RX_RECORD));
+	}
+}
+
+VOID
+CPCI429TriggerOpen(
+	_Inout_ PTRIGGER_CAPTURE Capture,
+	_In_ USHORT Cause,
+	_In_ ULONG Source,
+	_In_ ULONGLONG Index,
+	_In_ ULONGLONG Time
+)
+/*++
+
+Routine Description:
+
+    Opens a window at history index Index, the first record at or after
+    the trigger. Called with the capture lock held.
+
+--*/
+{
+	if (Capture->Open) {
+		InterlockedIncrement64(&Capture->TriggersIgnored);
+		return;
+	}
+
+	Capture->Open = TRUE;
+	Capture->Cause = Cause;
+	Capture->Source = Source;
+	Capture->WindowStart = Index - min(Index, (ULONGLONG)Capture->PreRecords);
+	Capture->TriggerIndex = Index;
+	Capture->TriggerTime = Time;
+	Capture->CloseTime = Time + Capture->PostInterval;
+
+	InterlockedIncrement64(&Capture->Triggers);
+}
+
+VOID
+CPCI429TriggerClose(
+	_In_ PRX_CHANNEL Channel,
+	_In_ USHORT Flags
+)
+/*++
+
+Routine Description:
+
+    Copies the open window out of the history and queues it for
+    delivery. Called with the capture lock held; the caller delivers
+    once it has released the lock. When the record pool is dry, or too
+    many windows are unclaimed, the new window is dropped and counted.
+
+--*/
+{
+	PDEVICE_CONTEXT pDeviceContext = Channel->DeviceContext;
+	PTRIGGER_CAPTURE capture = &Channel->Capture;
+	PCPCI429_RX_RECORD records;
+	PTRIGGER_WINDOW window;
+	ULONG count;
+	ULONG i;
+
+	capture->Open = FALSE;
+	capture->Closed = TRUE;
+
+	records = (PCPCI429_RX_RECORD)CPCI429PoolAllocate(&pDeviceContext->Pools[CPCI429_POOL_RECORDS]);
+	if (records == NULL) {
+		InterlockedIncrement64(&capture->WindowsDropped);
+		return;
+	}
+
+	count = (ULONG)(capture->Written - capture->WindowStart);
+	for (i = 0; i < count; i++) {
+		records[i] = capture->History[(ULONG)(capture->WindowStart + i) & capture->HistoryMask];
+	}
+
+	KeAcquireSpinLockAtDpcLevel(&pDeviceContext->TriggerLock);
+
+	if (pDeviceContext->TriggerWindowCount == ARRAYSIZE(pDeviceContext->TriggerWindows)) {
+		KeReleaseSpinLockFromDpcLevel(&pDeviceContext->TriggerLock);
+		CPCI429PoolFree(&pDeviceContext->Pools[CPCI429_POOL_RECORDS], records);
+		InterlockedIncrement64(&capture->WindowsDropped);
+		return;
+	}
+
+	window = &pDeviceContext->TriggerWindows[(pDeviceContext->TriggerWindowFirst + pDeviceContext->TriggerWindowCount) % ARRAYSIZE(pDeviceContext->TriggerWindows)];
+	window->Records = records;
+	window->Header.Channel = Channel->Channel;
+	window->Header.Cause = capture->Cause;
+	window->Header.Flags = Flags;
+	window->Header.TriggerTime = capture->TriggerTime;
+	window->Header.Source = capture->Source;
+	window->Header.PreTriggerCount = (ULONG)(capture->TriggerIndex - capture->WindowStart);
+	window->Header.RecordCount = count;
+	window->Header.RecordsDropped = 0;
+	pDeviceContext->TriggerWindowCount++;
+
+	KeReleaseSpinLockFromDpcLevel(&pDeviceContext->TriggerLock);
+}
+
+BOOLEAN
+CPCI429TriggerFire(
+	_In_ PRX_CHANNEL Channel,
+	_In_ USHORT Cause,
+	_In_ ULONG Source,
+	_In_ ULONGLONG Time
+)
+/*++
+
+Routine Description:
+
+    Fires the channel's trigger from outside the receive path. The
+    window starts with the next word drained.
+
+Return Value:
+
+    FALSE if the channel is not armed.
+
+--*/
+{
+	PTRIGGER_CAPTURE capture = &Channel->Capture;
+	BOOLEAN armed;
+	KIRQL irql;
+
+	KeAcquireSpinLock(&capture->Lock, &irql);
+
+	armed = capture->History != NULL;
+	if (armed) {
+		CPCI429TriggerOpen(capture, Cause, Source, capture->Written, Time);
+	}
+
+	KeReleaseSpinLock(&capture->Lock, irql);
+
+	return armed;
+}
+
+PTRIGGER_CAPTURE
+CPCI429TriggerBeginDrain(
+	_In_ PRX_CHANNEL Channel
+)
+/*++
+
+Routine Description:
+
+    Takes the capture lock for a drain of an armed channel, at
+    DISPATCH_LEVEL. Returns NULL, without the lock, if the channel was
+    disarmed meanwhile.
+
+--*/
+{
+	PTRIGGER_CAPTURE capture = &Channel->Capture;
+
+	KeAcquireSpinLockAtDpcLevel(&capture->Lock);
+
+	if (capture->History == NULL) {
+		KeReleaseSpinLockFromDpcLevel(&capture->Lock);
+		return NULL;
+	}
+
+	return capture;
+}
+
+VOID
+CPCI429TriggerEndDrain(
+	_In_ PRX_CHANNEL Channel,
+	_In_ ULONGLONG Now
+)
+/*++
+
+Routine Description:
+
+    Closes the open window if its post-trigger time has passed, drops
+    the capture lock and delivers what the drain finished.
+
+--*/
+{
+	PTRIGGER_CAPTURE capture = &Channel->Capture;
+	BOOLEAN closed;
+
+	if (capture->Open && Now >= capture->CloseTime) {
+		CPCI429TriggerClose(Channel, 0);
+	}
+
+	closed = capture->Closed;
+	capture->Closed = FALSE;
+
+	KeReleaseSpinLockFromDpcLevel(&capture->Lock);
+
+	if (closed) {
+		CPCI429TriggerDeliver(Channel->DeviceContext);
+	}
+}
+
+VOID
+CPCI429TriggerTick(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ ULONGLONG Now
+)
+/*++
+
+Routine Description:
+
+    Called by the health timer. Closes windows that are due on channels
+    whose DPC has not run since.
+
+--*/
+{
+	PTRIGGER_CAPTURE capture;
+	BOOLEAN closed = FALSE;
+	KIRQL irql;
+	ULONG i;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		capture = &DeviceContext->RxChannels[i].Capture;
+
+		if (!capture->Open) {
+			continue;
+		}
+
+		KeAcquireSpinLock(&capture->Lock, &irql);
+
+		if (capture->Open && Now >= capture->CloseTime) {
+			CPCI429TriggerClose(&DeviceContext->RxChannels[i], 0);
+		}
+		closed |= capture->Closed;
+		capture->Closed = FALSE;
+
+		KeReleaseSpinLock(&capture->Lock, irql);
+	}
+
+	if (closed) {
+		CPCI429TriggerDeliver(DeviceContext);
+	}
+}
+
+NTSTATUS
+CPCI429TriggerSetConfig(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_SET_TRIGGER_CAPTURE from the sequential control
+    queue, which is the only place a history is taken or given back
+    while the hardware is prepared. Arming an armed channel keeps its
+    history but discards an open window.
+
+--*/
+{
+	NTSTATUS status;
+	PCPCI429_TRIGGER_CONFIG config;
+	PRX_CHANNEL channel;
+	PTRIGGER_CAPTURE capture;
+	PCPCI429_RX_RECORD history;
+	PCPCI429_RX_RECORD previous;
+	KIRQL irql;
+	ULONG i;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(CPCI429_TRIGGER_CONFIG), (PVOID*)&config, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (config->Channel >= CPCI429_MAX_RX_CHANNELS || config->MatchCount > CPCI429_MAX_TRIGGER_MATCHES ||
+		(config->Sources & ~(CPCI429_TRIGGER_ON_MATCH | CPCI429_TRIGGER_ON_PARITY | CPCI429_TRIGGER_ON_STALE)) != 0 ||
+		config->PreTriggerRecords >= DeviceContext->Config.PoolBlockRecords) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	channel = &DeviceContext->RxChannels[config->Channel];
+	capture = &channel->Capture;
+	if (channel->Ring == NULL) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	history = capture->History;
+	if (config->Enable && history == NULL) {
+		history = (PCPCI429_RX_RECORD)CPCI429PoolAllocate(&DeviceContext->Pools[CPCI429_POOL_RECORDS]);
+		if (history == NULL) {
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+	}
+
+	KeAcquireSpinLock(&capture->Lock, &irql);
+
+	previous = capture->History;
+	capture->Open = FALSE;
+	capture->Sources = config->Sources;
+	capture->PreRecords = config->PreTriggerRecords;
+	capture->PostInterval = (ULONGLONG)config->PostTriggerMs * 10000;
+	capture->HistoryMask = DeviceContext->Config.PoolBlockRecords - 1;
+
+	RtlZeroMemory(capture->MatchLabels, sizeof(capture->MatchLabels));
+	capture->MatchCount = 0;
+	if ((config->Sources & CPCI429_TRIGGER_ON_MATCH) != 0) {
+		for (i = 0; i < config->MatchCount; i++) {
+			UCHAR label = config->Matches[i].Label;
+
+			capture->Matches[i] = config->Matches[i];
+			capture->MatchLabels[label >> 5] |= 1UL << (label & 31);
+		}
+		capture->MatchCount = config->MatchCount;
+	}
+
+	if (config->Enable) {
+		capture->History = history;
+		if (previous == NULL) {
+			capture->Written = 0;
+		}
+		previous = NULL;
+	} else {
+		capture->History = NULL;
+	}
+
+	KeReleaseSpinLock(&capture->Lock, irql);
+
+	if (previous != NULL) {
+		CPCI429PoolFree(&DeviceContext->Pools[CPCI429_POOL_RECORDS], previous);
+	}
+
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS
+CPCI429TriggerFireRequest(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Handles CPCI429_IOCTL_TRIGGER.
+
+--*/
+{
+	NTSTATUS status;
+	PULONG channelIndex;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(ULONG), (PVOID*)&channelIndex, NULL);
+	if (!NT_SUCCESS(status)) {
+		return status;
+	}
+	if (*channelIndex >= CPCI429_MAX_RX_CHANNELS) {
+		return STATUS_INVALID_PARAMETER;
+	}
+
+	if (!CPCI429TriggerFire(&DeviceContext->RxChannels[*channelIndex], CPCI429_TRIGGER_CAUSE_EXPLICIT,
+		0, KeQueryInterruptTime())) {
+		return STATUS_DEVICE_NOT_READY;
+	}
+
+	return STATUS_SUCCESS;
+}
+
+VOID
+CPCI429TriggerWait(
+	_In_ PDEVICE_CONTEXT DeviceContext,
+	_In_ WDFREQUEST Request
+)
+/*++
+
+Routine Description:
+
+    Parks a CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE request, then delivers any
+    window finished before it was parked.
+
+--*/
+{
+	NTSTATUS status;
+	PVOID buffer;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, FIELD_OFFSET(CPCI429_TRIGGER_CAPTURE, Records), &buffer, NULL);
+	if (NT_SUCCESS(status)) {
+		status = WdfRequestForwardToIoQueue(Request, DeviceContext->TriggerWaitQueue);
+	}
+	if (!NT_SUCCESS(status)) {
+		WdfRequestComplete(Request, status);
+		return;
+	}
+
+	CPCI429TriggerDeliver(DeviceContext);
+}
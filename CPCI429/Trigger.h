@@ -0,0 +1,132 @@
+/*++
+
+Module Name:
+
+    trigger.h
+
+Abstract:
+
+    This file contains the trigger capture definitions.
+
+Environment:
+
+    Kernel-mode Driver Framework
+
+--*/
+
+EXTERN_C_START
+
+NTSTATUS
+CPCI429TriggerInitialize(
+    _In_ WDFDEVICE Device
+    );
+
+VOID
+CPCI429TriggerRelease(
+    _In_ PDEVICE_CONTEXT DeviceContext
+    );
+
+NTSTATUS
+CPCI429TriggerSetConfig(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+NTSTATUS
+CPCI429TriggerFireRequest(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+BOOLEAN
+CPCI429TriggerFire(
+    _In_ PRX_CHANNEL Channel,
+    _In_ USHORT Cause,
+    _In_ ULONG Source,
+    _In_ ULONGLONG Time
+    );
+
+VOID
+CPCI429TriggerOpen(
+    _Inout_ PTRIGGER_CAPTURE Capture,
+    _In_ USHORT Cause,
+    _In_ ULONG Source,
+    _In_ ULONGLONG Index,
+    _In_ ULONGLONG Time
+    );
+
+VOID
+CPCI429TriggerClose(
+    _In_ PRX_CHANNEL Channel,
+    _In_ USHORT Flags
+    );
+
+PTRIGGER_CAPTURE
+CPCI429TriggerBeginDrain(
+    _In_ PRX_CHANNEL Channel
+    );
+
+VOID
+CPCI429TriggerEndDrain(
+    _In_ PRX_CHANNEL Channel,
+    _In_ ULONGLONG Now
+    );
+
+VOID
+CPCI429TriggerTick(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ ULONGLONG Now
+    );
+
+VOID
+CPCI429TriggerWait(
+    _In_ PDEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+//
+// Per-word trigger capture for the receive path, between
+// CPCI429TriggerBeginDrain and CPCI429TriggerEndDrain. In the steady
+// state this is the history write and one bitmap test.
+//
+FORCEINLINE
+VOID
+CPCI429TriggerRecord(
+    _In_ PRX_CHANNEL Channel,
+    _Inout_ PTRIGGER_CAPTURE Capture,
+    _In_ const CPCI429_RX_RECORD *Record
+    )
+{
+    ULONG word = Record->Word;
+    ULONG label = CPCI429_WORD_LABEL(word);
+    USHORT cause = 0;
+    ULONG i;
+
+    Capture->History[(ULONG)Capture->Written & Capture->HistoryMask] = *Record;
+    Capture->Written++;
+
+    if ((Capture->MatchLabels[label >> 5] & (1UL << (label & 31))) != 0) {
+        for (i = 0; i < Capture->MatchCount; i++) {
+            if (Capture->Matches[i].Label == label &&
+                (word & Capture->Matches[i].Mask) == Capture->Matches[i].Value) {
+                cause = CPCI429_TRIGGER_CAUSE_MATCH;
+                break;
+            }
+        }
+    }
+    if (cause == 0 && (Capture->Sources & CPCI429_TRIGGER_ON_PARITY) != 0 && !CPCI429OddParity(word)) {
+        cause = CPCI429_TRIGGER_CAUSE_PARITY;
+    }
+    if (cause != 0) {
+        CPCI429TriggerOpen(Capture, cause, word, Capture->Written - 1, Record->Timestamp);
+    }
+
+    //
+    // The post-trigger side has caught up with the start of the window.
+    //
+    if (Capture->Open && Capture->Written - Capture->WindowStart > Capture->HistoryMask) {
+        CPCI429TriggerClose(Channel, CPCI429_TRIGGER_TRUNCATED);
+    }
+}
+
+EXTERN_C_END
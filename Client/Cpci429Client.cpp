@@ -0,0 +1,337 @@
+/*++
+
+Module Name:
+
+    cpci429client.cpp
+
+Abstract:
+
+    IoContext, the Windows driver transport and the board operations of
+    the coroutine client.
+
+Environment:
+
+    User mode, C++20
+
+--*/
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+#include "Cpci429Client.h"
+
+namespace cpci429 {
+
+#ifdef _WIN32
+
+//
+// Completion keys: device completions carry the driver's status in the
+// OVERLAPPED, posted ones already have their result filled in.
+//
+static const ULONG_PTR CompletionKeyDevice = 0;
+static const ULONG_PTR CompletionKeyPosted = 1;
+static const ULONG_PTR CompletionKeyStop = 2;
+
+static int StatusToErrno(NTSTATUS Status)
+{
+	switch (static_cast<ULONG>(Status)) {
+	case 0x00000000: return 0;                  // STATUS_SUCCESS
+	case 0xC0000120: return -ECANCELED;         // STATUS_CANCELLED
+	case 0xC0000010: return -ENOTTY;            // STATUS_INVALID_DEVICE_REQUEST
+	case 0xC000000D:                            // STATUS_INVALID_PARAMETER
+	case 0xC0000023: return -EINVAL;            // STATUS_BUFFER_TOO_SMALL
+	case 0x80000011: return -EBUSY;             // STATUS_DEVICE_BUSY
+	case 0xC00000A3: return -EAGAIN;            // STATUS_DEVICE_NOT_READY
+	case 0xC000009A: return -ENOMEM;            // STATUS_INSUFFICIENT_RESOURCES
+	default: return -EIO;
+	}
+}
+
+IoContext::IoContext()
+{
+	m_Port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+}
+
+IoContext::~IoContext()
+{
+	if (m_Port != nullptr) {
+		CloseHandle(m_Port);
+	}
+}
+
+void IoContext::Complete(IoOperation& Operation, IoResult Result)
+{
+	Operation.Result = Result;
+	PostQueuedCompletionStatus(m_Port, 0, CompletionKeyPosted, &Operation.Overlapped);
+}
+
+size_t IoContext::Poll(int TimeoutMs)
+{
+	OVERLAPPED_ENTRY entries[64];
+	ULONG count = 0;
+	size_t resumed = 0;
+
+	if (!GetQueuedCompletionStatusEx(m_Port, entries, ARRAYSIZE(entries), &count,
+		TimeoutMs < 0 ? INFINITE : static_cast<DWORD>(TimeoutMs), FALSE)) {
+		return 0;
+	}
+
+	for (ULONG i = 0; i < count; i++) {
+		IoOperation* operation = reinterpret_cast<IoOperation*>(entries[i].lpOverlapped);
+
+		if (entries[i].lpCompletionKey == CompletionKeyStop || operation == nullptr) {
+			continue;
+		}
+		if (entries[i].lpCompletionKey == CompletionKeyDevice) {
+			operation->Result.Status = StatusToErrno(static_cast<NTSTATUS>(operation->Overlapped.Internal));
+			operation->Result.Information = entries[i].dwNumberOfBytesTransferred;
+		}
+
+		operation->Waiter.resume();
+		resumed++;
+	}
+
+	return resumed;
+}
+
+void IoContext::Stop()
+{
+	m_Stopping = true;
+	PostQueuedCompletionStatus(m_Port, 0, CompletionKeyStop, nullptr);
+}
+
+DeviceTransport::DeviceTransport(IoContext& Context, const wchar_t* DevicePath)
+	: m_Context(Context)
+{
+	m_Handle = CreateFileW(DevicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+	if (m_Handle != INVALID_HANDLE_VALUE &&
+		CreateIoCompletionPort(m_Handle, Context.Port(), CompletionKeyDevice, 0) == nullptr) {
+		CloseHandle(m_Handle);
+		m_Handle = INVALID_HANDLE_VALUE;
+	}
+}
+
+DeviceTransport::~DeviceTransport()
+{
+	if (m_Handle != INVALID_HANDLE_VALUE) {
+		CloseHandle(m_Handle);
+	}
+}
+
+void DeviceTransport::Start(IoOperation& Operation)
+{
+	std::memset(&Operation.Overlapped, 0, sizeof(Operation.Overlapped));
+
+	//
+	// Success and ERROR_IO_PENDING both end up on the completion port.
+	//
+	if (!DeviceIoControl(m_Handle, Operation.Code, const_cast<void*>(Operation.In), Operation.InLength,
+		Operation.Out, Operation.OutLength, nullptr, &Operation.Overlapped) &&
+		GetLastError() != ERROR_IO_PENDING) {
+		Operation.Context->Complete(Operation, { GetLastError() == ERROR_INVALID_FUNCTION ? -ENOTTY : -EIO, 0 });
+	}
+}
+
+void DeviceTransport::CancelAll()
+{
+	CancelIoEx(m_Handle, nullptr);
+}
+
+#else
+
+IoContext::IoContext() = default;
+IoContext::~IoContext() = default;
+
+void IoContext::Complete(IoOperation& Operation, IoResult Result)
+{
+	Operation.Result = Result;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		m_Completed.push_back(&Operation);
+	}
+	m_Ready.notify_one();
+}
+
+size_t IoContext::Poll(int TimeoutMs)
+{
+	std::vector<IoOperation*> completed;
+
+	{
+		std::unique_lock<std::mutex> lock(m_Lock);
+		auto ready = [this] { return !m_Completed.empty() || m_Stopping; };
+
+		if (TimeoutMs < 0) {
+			m_Ready.wait(lock, ready);
+		} else {
+			m_Ready.wait_for(lock, std::chrono::milliseconds(TimeoutMs), ready);
+		}
+		completed.swap(m_Completed);
+	}
+
+	for (IoOperation* operation : completed) {
+		operation->Waiter.resume();
+	}
+
+	return completed.size();
+}
+
+void IoContext::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		m_Stopping = true;
+	}
+	m_Ready.notify_all();
+}
+
+#endif
+
+void IoContext::Run()
+{
+	while (!m_Stopping) {
+		Poll(-1);
+	}
+}
+
+Task<long> Client::ReadBatch(ULONG Channel, std::span<CPCI429_RX_RECORD> Records)
+{
+	CPCI429_RX_READ rxRead = { Channel };
+
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_RX_READ_WAIT, &rxRead, sizeof(rxRead),
+		Records.data(), Records.size_bytes());
+
+	co_return result.Status != 0 ? result.Status : static_cast<long>(result.Information / sizeof(CPCI429_RX_RECORD));
+}
+
+Task<long> Client::SubmitTx(ULONG Channel, std::span<const ULONG> Words)
+{
+	std::vector<ULONG> buffer(2 + Words.size());
+	PCPCI429_TX_SUBMIT submit = reinterpret_cast<PCPCI429_TX_SUBMIT>(buffer.data());
+
+	submit->Channel = Channel;
+	submit->WordCount = static_cast<ULONG>(Words.size());
+	std::memcpy(submit->Words, Words.data(), Words.size_bytes());
+
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_TX_SUBMIT, submit,
+		FIELD_OFFSET(CPCI429_TX_SUBMIT, Words) + Words.size_bytes(), nullptr, 0);
+
+	co_return result.Status != 0 ? result.Status : static_cast<long>(result.Information / sizeof(ULONG));
+}
+
+Task<long> Client::Subscribe(ULONG Channel, std::span<const UCHAR> Labels)
+{
+	CPCI429_SUBSCRIBE subscribe = {};
+	CPCI429_SUBSCRIPTION subscription = {};
+
+	subscribe.Channel = Channel;
+	for (UCHAR label : Labels) {
+		subscribe.LabelMask[label >> 5] |= 1UL << (label & 31);
+	}
+
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_SUBSCRIBE, &subscribe, sizeof(subscribe),
+		&subscription, sizeof(subscription));
+	if (result.Status != 0) {
+		co_return result.Status;
+	}
+
+	std::memcpy(m_LabelMask, subscribe.LabelMask, sizeof(m_LabelMask));
+	m_Next = m_End = subscription.StartSequence;
+	m_Ring = reinterpret_cast<const CPCI429_SHARED_RING*>(static_cast<uintptr_t>(subscription.RingAddress));
+
+	co_return 0;
+}
+
+Task<long> Client::WaitLabelChange(std::span<CPCI429_RX_RECORD> Records, ULONGLONG* Lost)
+{
+	bool allLabels = true;
+
+	*Lost = 0;
+	if (m_Ring == nullptr) {
+		co_return -EINVAL;
+	}
+	for (ULONG mask : m_LabelMask) {
+		allLabels = allLabels && mask == 0;
+	}
+
+	for (;;) {
+		size_t count = 0;
+
+		//
+		// Records a previous call had no room for are returned before
+		// waiting for new ones.
+		//
+		if (m_Next == m_End) {
+			CPCI429_SUBSCRIBER_WAIT_RESULT wait = {};
+
+			IoResult result = co_await Ioctl(CPCI429_IOCTL_SUBSCRIBER_WAIT, nullptr, 0, &wait, sizeof(wait));
+			if (result.Status != 0) {
+				co_return result.Status;
+			}
+
+			*Lost += wait.Lost;
+			m_Next = wait.First;
+			m_End = wait.End;
+		}
+
+		//
+		// The driver never waits for readers, so pending records may have
+		// been overwritten since the wait, and a slot may be rewritten
+		// under the copy; WriteHead tells afterwards which copies are good.
+		//
+		ULONGLONG writeHead = m_Ring->WriteHead;
+		ULONGLONG oldest = writeHead > m_Ring->Capacity ? writeHead - m_Ring->Capacity : 0;
+		if (m_Next < oldest) {
+			ULONGLONG skipped = std::min(oldest, m_End) - m_Next;
+
+			*Lost += skipped;
+			m_Next += skipped;
+		}
+
+		for (; m_Next < m_End && count < Records.size(); m_Next++) {
+			CPCI429_RX_RECORD record = *CPCI429_SHARED_RECORD(m_Ring, m_Next);
+			ULONG label = CPCI429_WORD_LABEL(record.Word);
+
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_Ring->WriteHead > m_Next + m_Ring->Capacity) {
+				(*Lost)++;
+				continue;
+			}
+			if (allLabels || (m_LabelMask[label >> 5] & (1UL << (label & 31))) != 0) {
+				Records[count++] = record;
+			}
+		}
+
+		if (count != 0 || *Lost != 0) {
+			co_return static_cast<long>(count);
+		}
+	}
+}
+
+Task<long> Client::WaitHealthAlarm(std::span<CPCI429_HEALTH_EVENT> Events)
+{
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_WAIT_HEALTH_ALARM, nullptr, 0,
+		Events.data(), Events.size_bytes());
+
+	co_return result.Status != 0 ? result.Status : static_cast<long>(result.Information / sizeof(CPCI429_HEALTH_EVENT));
+}
+
+Task<long> Client::WaitTriggerCapture(std::span<UCHAR> Buffer)
+{
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE, nullptr, 0, Buffer.data(), Buffer.size());
+
+	co_return result.Status != 0 ? result.Status : static_cast<long>(result.Information);
+}
+
+Task<long> Client::WaitAggregates(std::span<UCHAR> Buffer)
+{
+	IoResult result = co_await Ioctl(CPCI429_IOCTL_WAIT_AGGREGATES, nullptr, 0, Buffer.data(), Buffer.size());
+
+	co_return result.Status != 0 ? result.Status : static_cast<long>(result.Information);
+}
+
+} // namespace cpci429
@@ -0,0 +1,399 @@
+/*++
+
+Module Name:
+
+    cpci429client.h
+
+Abstract:
+
+    C++20 coroutine client for CPCI429 boards. Every device operation is
+    an awaitable that starts an overlapped IOCTL and resumes the awaiting
+    coroutine when it completes, so one thread running an IoContext can
+    keep requests outstanding on many channels and boards at once.
+
+    Completions are delivered through an IoContext: an I/O completion
+    port on Windows, a completion queue elsewhere. Coroutines are only
+    ever resumed inside IoContext::Poll or IoContext::Run, on the thread
+    that calls them.
+
+    The device itself is reached through a Transport. DeviceTransport
+    talks to the driver; HostTransport (Cpci429HostTransport.h) drives
+    the Linux user-mode backend, including the simulator's boards opened
+    with CPCI429HostOpenModel.
+
+    Errors are returned, not thrown: operations yield a count or a
+    negative errno value, with driver statuses mapped as in
+    Cpci429Host.h.
+
+Environment:
+
+    User mode, C++20
+
+--*/
+
+#ifndef _CPCI429CLIENT_H
+#define _CPCI429CLIENT_H
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include "Compat.h"
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "Public.h"
+
+namespace cpci429 {
+
+class IoContext;
+
+struct IoResult {
+	int Status;                 // 0 or a negative errno value
+	size_t Information;         // bytes written to the output buffer
+};
+
+//
+// One IOCTL in flight. It lives in the awaiting coroutine's frame until
+// the transport hands it back through IoContext::Complete.
+//
+struct IoOperation {
+#ifdef _WIN32
+	OVERLAPPED Overlapped;      // first, so a completion entry leads back here
+#endif
+	IoContext* Context;
+	ULONG Code;
+	const void* In;
+	ULONG InLength;
+	void* Out;
+	ULONG OutLength;
+	IoResult Result;
+	std::coroutine_handle<> Waiter;
+};
+
+class Transport {
+public:
+	virtual ~Transport() = default;
+
+	//
+	// Starts Operation. Whatever happens, the transport completes it
+	// exactly once through Operation.Context->Complete, possibly before
+	// Start returns.
+	//
+	virtual void Start(IoOperation& Operation) = 0;
+
+	//
+	// Completes every operation still outstanding with -ECANCELED.
+	//
+	virtual void CancelAll() = 0;
+};
+
+class IoContext {
+public:
+	IoContext();
+	~IoContext();
+
+	IoContext(const IoContext&) = delete;
+	IoContext& operator=(const IoContext&) = delete;
+
+	//
+	// Hands a finished operation back; callable from any thread.
+	//
+	void Complete(IoOperation& Operation, IoResult Result);
+
+	//
+	// Resumes the waiters of completed operations, waiting up to
+	// TimeoutMs (-1 for ever) for the first one. Returns the number
+	// resumed.
+	//
+	size_t Poll(int TimeoutMs);
+
+	//
+	// Polls until Stop is called.
+	//
+	void Run();
+	void Stop();
+
+#ifdef _WIN32
+	HANDLE Port() const { return m_Port; }
+#endif
+
+private:
+	std::atomic<bool> m_Stopping{false};
+#ifdef _WIN32
+	HANDLE m_Port;
+#else
+	std::mutex m_Lock;
+	std::condition_variable m_Ready;
+	std::vector<IoOperation*> m_Completed;
+#endif
+};
+
+#ifdef _WIN32
+//
+// A handle to the driver, opened for overlapped I/O and bound to one
+// IoContext's completion port. DevicePath is a device interface path of
+// GUID_DEVINTERFACE_CPCI429.
+//
+class DeviceTransport : public Transport {
+public:
+	DeviceTransport(IoContext& Context, const wchar_t* DevicePath);
+	~DeviceTransport() override;
+
+	bool IsOpen() const { return m_Handle != INVALID_HANDLE_VALUE; }
+
+	void Start(IoOperation& Operation) override;
+	void CancelAll() override;
+
+private:
+	IoContext& m_Context;
+	HANDLE m_Handle;
+};
+#endif
+
+//
+// Lazily started coroutine that yields T to the coroutine awaiting it.
+//
+template <typename T>
+class Task;
+
+namespace detail {
+
+template <typename T>
+struct TaskPromiseBase {
+	std::coroutine_handle<> Continuation;
+	std::exception_ptr Error;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> Handle) noexcept
+		{
+			std::coroutine_handle<> continuation = Handle.promise().Continuation;
+			return continuation ? continuation : std::noop_coroutine();
+		}
+
+		void await_resume() noexcept {}
+	};
+
+	FinalAwaiter final_suspend() noexcept { return {}; }
+
+	void unhandled_exception() { Error = std::current_exception(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase<T> {
+	std::optional<T> Value;
+
+	Task<T> get_return_object();
+	void return_value(T Result) { Value.emplace(std::move(Result)); }
+
+	T Take()
+	{
+		if (this->Error) {
+			std::rethrow_exception(this->Error);
+		}
+		return std::move(*Value);
+	}
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void> {
+	Task<void> get_return_object();
+	void return_void() {}
+
+	void Take()
+	{
+		if (Error) {
+			std::rethrow_exception(Error);
+		}
+	}
+};
+
+} // namespace detail
+
+template <typename T>
+class Task {
+public:
+	using promise_type = detail::TaskPromise<T>;
+
+	explicit Task(std::coroutine_handle<promise_type> Handle) : m_Handle(Handle) {}
+	Task(Task&& Other) noexcept : m_Handle(std::exchange(Other.m_Handle, nullptr)) {}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+	~Task()
+	{
+		if (m_Handle) {
+			m_Handle.destroy();
+		}
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> Awaiting) noexcept
+	{
+		m_Handle.promise().Continuation = Awaiting;
+		return m_Handle;
+	}
+
+	T await_resume() { return m_Handle.promise().Take(); }
+
+private:
+	std::coroutine_handle<promise_type> m_Handle;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+} // namespace detail
+
+//
+// Runs Work to completion without an awaiting coroutine. It starts on
+// the calling thread and continues wherever its operations complete.
+//
+inline detail::Detached Spawn(Task<void> Work)
+{
+	co_await Work;
+}
+
+//
+// Awaitable for one IOCTL. Buffers must stay valid until it resumes.
+//
+class IoAwaitable {
+public:
+	IoAwaitable(Transport& Device, IoContext& Context, ULONG Code,
+		const void* In, size_t InLength, void* Out, size_t OutLength)
+		: m_Device(Device)
+	{
+		m_Operation = {};
+		m_Operation.Context = &Context;
+		m_Operation.Code = Code;
+		m_Operation.In = In;
+		m_Operation.InLength = static_cast<ULONG>(InLength);
+		m_Operation.Out = Out;
+		m_Operation.OutLength = static_cast<ULONG>(OutLength);
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> Awaiting)
+	{
+		m_Operation.Waiter = Awaiting;
+		m_Device.Start(m_Operation);
+	}
+
+	IoResult await_resume() const noexcept { return m_Operation.Result; }
+
+private:
+	Transport& m_Device;
+	IoOperation m_Operation;
+};
+
+//
+// The board operations, on one transport. Each returns a count or a
+// negative errno value.
+//
+class Client {
+public:
+	Client(Transport& Device, IoContext& Context) : m_Device(Device), m_Context(Context) {}
+
+	IoAwaitable Ioctl(ULONG Code, const void* In, size_t InLength, void* Out, size_t OutLength)
+	{
+		return IoAwaitable(m_Device, m_Context, Code, In, InLength, Out, OutLength);
+	}
+
+	//
+	// Waits until Channel has received records and returns how many were
+	// copied to Records (CPCI429_IOCTL_RX_READ_WAIT).
+	//
+	Task<long> ReadBatch(ULONG Channel, std::span<CPCI429_RX_RECORD> Records);
+
+	//
+	// Queues Words on a transmit channel and returns how many the FIFO
+	// accepted (CPCI429_IOCTL_TX_SUBMIT).
+	//
+	Task<long> SubmitTx(ULONG Channel, std::span<const ULONG> Words);
+
+	//
+	// Selects the labels WaitLabelChange reports. The driver allows one
+	// subscription per handle, so use a Client on its own transport per
+	// subscription. Pair it with CPCI429_IOCTL_SET_ON_CHANGE to be woken
+	// only by changed values.
+	//
+	Task<long> Subscribe(ULONG Channel, std::span<const UCHAR> Labels);
+
+	//
+	// Waits for new records of the subscribed labels and copies them to
+	// Records, oldest first (CPCI429_IOCTL_SUBSCRIBER_WAIT). Records that
+	// do not fit stay pending and are returned by the next call before it
+	// waits again. Lost receives the records the subscription fell behind
+	// by, including pending ones overwritten before they were copied.
+	//
+	Task<long> WaitLabelChange(std::span<CPCI429_RX_RECORD> Records, ULONGLONG* Lost);
+
+	//
+	// Waits for bus health alarms (CPCI429_IOCTL_WAIT_HEALTH_ALARM).
+	//
+	Task<long> WaitHealthAlarm(std::span<CPCI429_HEALTH_EVENT> Events);
+
+	//
+	// Waits for a finished trigger capture window of any channel and
+	// copies it to Buffer as a CPCI429_TRIGGER_CAPTURE followed by its
+	// records (CPCI429_IOCTL_WAIT_TRIGGER_CAPTURE). Returns the number of
+	// bytes written; CPCI429CaptureWriteWindow stores a window as a file.
+	//
+	Task<long> WaitTriggerCapture(std::span<UCHAR> Buffer);
+
+	//
+	// Waits for finished aggregation windows and copies as many as fit to
+	// Buffer, each a CPCI429_AGGREGATE_WINDOW of
+	// CPCI429_AGGREGATE_WINDOW_BYTES(Count) bytes
+	// (CPCI429_IOCTL_WAIT_AGGREGATES). Returns the number of bytes written.
+	//
+	Task<long> WaitAggregates(std::span<UCHAR> Buffer);
+
+private:
+	Transport& m_Device;
+	IoContext& m_Context;
+	const CPCI429_SHARED_RING* m_Ring = nullptr;
+	ULONG m_LabelMask[256 / 32] = {};
+	ULONGLONG m_Next = 0;       // ring records [m_Next, m_End) are pending
+	ULONGLONG m_End = 0;
+};
+
+} // namespace cpci429
+
+#endif // _CPCI429CLIENT_H
@@ -0,0 +1,574 @@
+/*++
+
+Module Name:
+
+    cpci429clientbench.cpp
+
+Abstract:
+
+    Receive throughput of the coroutine client, compared between one
+    thread per channel, each with its own IoContext, and every channel's
+    coroutine sharing one IoContext on one thread.
+
+        cpci429bench [--seconds N] [--batch N] BOARD...
+        cpci429bench [--seconds N] [--batch N] --sim BOARDS
+
+    On Windows BOARD is a device interface path. Elsewhere it is a file
+    used as a fake BAR0, created with every receive channel pending and
+    never empty, so the numbers measure the client and transport rather
+    than the bus.
+
+    --sim instead opens BOARDS simulated boards (Cpci429Sim.h) through
+    CPCI429HostOpenModel. Every receive channel hears a 100 kbps bus
+    kept full by 64 labels, and a thread steps the simulator as fast as
+    the readers drain it, so each mode also reports how much simulated
+    time it got through and how many of the words received it read;
+    the rest were still queued when the readers stopped. It then sets a
+    50 ms stale limit on a label the simulator never sends and checks
+    that WaitHealthAlarm resumes with its CPCI429_HEALTH_STALE alarm.
+
+Environment:
+
+    User mode, C++20
+
+--*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "Cpci429Client.h"
+
+#ifdef _WIN32
+#include <cwchar>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include "Cpci429HostTransport.h"
+#include "Cpci429Sim.h"
+#endif
+
+using namespace cpci429;
+
+namespace {
+
+struct Options {
+	std::vector<std::string> Paths;
+	ULONG SimBoards = 0;
+	size_t Batch = 256;
+	double Seconds = 2.0;
+
+	size_t BoardCount() const { return SimBoards != 0 ? SimBoards : Paths.size(); }
+};
+
+//
+// What a run read and, on the simulator, what the boards received.
+//
+struct BenchState {
+	std::atomic<bool> Running{true};
+	std::atomic<ULONGLONG> Words{0};
+	std::atomic<ULONG> Active{0};
+	std::atomic<ULONG> Errors{0};
+#ifndef _WIN32
+	CPCI429_SIM_STATS Sim = {};
+#endif
+};
+
+Task<void> ReadLoop(Client& Board, ULONG Channel, size_t Batch, BenchState& State)
+{
+	std::vector<CPCI429_RX_RECORD> records(Batch);
+
+	while (State.Running) {
+		long count = co_await Board.ReadBatch(Channel, records);
+
+		if (count < 0) {
+			if (count != -ECANCELED) {
+				State.Errors++;
+			}
+			break;
+		}
+		State.Words += static_cast<ULONGLONG>(count);
+	}
+
+	State.Active--;
+}
+
+//
+// One board. On Windows the handle is bound to the completion port of
+// the IoContext it was opened with, so each thread opens its own; the
+// host backend completes through any IoContext and is shared.
+//
+struct Board {
+	std::unique_ptr<Transport> Device;
+#ifndef _WIN32
+	PCPCI429_HOST Host = nullptr;
+#endif
+
+	bool Open(const std::string& Path, IoContext& Context)
+	{
+#ifdef _WIN32
+		std::wstring path(Path.begin(), Path.end());
+		auto device = std::make_unique<DeviceTransport>(Context, path.c_str());
+
+		if (!device->IsOpen()) {
+			return false;
+		}
+		Device = std::move(device);
+#else
+		(void)Context;
+		if (CPCI429HostOpenFake(Path.c_str(), -1, &Host) != 0) {
+			return false;
+		}
+		Device = std::make_unique<HostTransport>(Host);
+#endif
+		return true;
+	}
+
+#ifndef _WIN32
+	bool OpenSim(PCPCI429_SIM Sim, ULONG Index)
+	{
+		CPCI429_HOST_MODEL model;
+		CPCI429_CHANNEL_CONFIG config = {};
+
+		if (CPCI429SimBoardModel(Sim, Index, &model) != 0 || CPCI429HostOpenModel(&model, &Host) != 0) {
+			return false;
+		}
+
+		config.Enable = TRUE;
+		config.Direction = CPCI429_DIRECTION_RX;
+		config.Speed = CPCI429_SPEED_HIGH;
+		for (config.Channel = 0; config.Channel < CPCI429_MAX_RX_CHANNELS; config.Channel++) {
+			if (CPCI429HostIoctl(Host, CPCI429_IOCTL_SET_CHANNEL_CONFIG, &config, sizeof(config), nullptr, 0, nullptr) != 0) {
+				return false;
+			}
+		}
+
+		Device = std::make_unique<HostTransport>(Host);
+		return true;
+	}
+#endif
+
+	~Board()
+	{
+		Device.reset();
+#ifndef _WIN32
+		if (Host != nullptr) {
+			CPCI429HostClose(Host);
+		}
+#endif
+	}
+};
+
+#ifndef _WIN32
+bool CreateFakeBar(const std::string& Path)
+{
+	std::vector<UCHAR> bar(CPCI429_BAR0_SIZE);
+	ULONG pending = CPCI429_INT_RX_MASK;
+	bool written;
+	int fd;
+
+	std::memcpy(&bar[CPCI429_REG_INT_STATUS], &pending, sizeof(pending));
+	for (ULONG channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+		ULONG word = 0x60000000 | (channel << 8) | 0x0A;
+		ULONG status = 0;
+
+		std::memcpy(&bar[CPCI429_RX_CHANNEL_BASE(channel) + CPCI429_CH_FIFO_DATA], &word, sizeof(word));
+		std::memcpy(&bar[CPCI429_RX_CHANNEL_BASE(channel) + CPCI429_CH_FIFO_STATUS], &status, sizeof(status));
+	}
+
+	fd = open(Path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return false;
+	}
+	written = write(fd, bar.data(), bar.size()) == static_cast<ssize_t>(bar.size());
+	close(fd);
+
+	return written;
+}
+
+//
+// The simulated boards of one --sim run. Stepping starts once every
+// board is open and must stop before any is closed.
+//
+struct SimSystem {
+	PCPCI429_SIM Sim = nullptr;
+	std::thread Stepper;
+	std::atomic<bool> Stepping{false};
+
+	bool Create(ULONG BoardCount)
+	{
+		CPCI429_SIM_CONFIG config = {};
+		CPCI429_SIM_LABEL labels[64];
+
+		config.BoardCount = BoardCount;
+		if (CPCI429SimCreate(&config, &Sim) != 0) {
+			return false;
+		}
+
+		for (ULONG board = 0; board < BoardCount; board++) {
+			for (ULONG channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+				for (ULONG i = 0; i < std::size(labels); i++) {
+					labels[i].Word = (board << 16) | (channel << 8) | i;
+					labels[i].PeriodUs = 20000;
+					labels[i].OffsetUs = i * 20000 / std::size(labels);
+				}
+				if (CPCI429SimAddSource(Sim, board, channel, TRUE, labels, std::size(labels)) != 0) {
+					return false;
+				}
+			}
+		}
+
+		return true;
+	}
+
+	void Start()
+	{
+		Stepping = true;
+		Stepper = std::thread([this] {
+			while (Stepping) {
+				CPCI429SimRun(Sim, 10000);
+			}
+		});
+	}
+
+	void Stop(CPCI429_SIM_STATS& Stats)
+	{
+		if (Stepper.joinable()) {
+			Stepping = false;
+			Stepper.join();
+		}
+		CPCI429SimGetStats(Sim, &Stats);
+	}
+
+	~SimSystem()
+	{
+		if (Stepper.joinable()) {
+			Stepping = false;
+			Stepper.join();
+		}
+		if (Sim != nullptr) {
+			CPCI429SimDestroy(Sim);
+		}
+	}
+};
+#endif
+
+//
+// Runs the read loops until Seconds have passed, then cancels what is
+// still parked and waits for every loop to finish.
+//
+void Finish(const std::vector<Transport*>& Devices, IoContext& Context, BenchState& State,
+	std::chrono::steady_clock::time_point Deadline)
+{
+	while (std::chrono::steady_clock::now() < Deadline) {
+		Context.Poll(10);
+	}
+
+	State.Running = false;
+	for (Transport* device : Devices) {
+		device->CancelAll();
+	}
+	while (State.Active != 0) {
+		Context.Poll(10);
+	}
+}
+
+#ifndef _WIN32
+//
+// Opens every board of a run on the host backend, from the simulator
+// with --sim, and starts the simulator once all are attached.
+//
+bool OpenShared(const Options& Settings, SimSystem& Simulated, std::vector<std::unique_ptr<Board>>& Boards)
+{
+	IoContext unused;
+
+	if (Settings.SimBoards != 0 && !Simulated.Create(Settings.SimBoards)) {
+		return false;
+	}
+
+	for (size_t index = 0; index < Settings.BoardCount(); index++) {
+		Boards.push_back(std::make_unique<Board>());
+		if (Settings.SimBoards != 0 ? !Boards.back()->OpenSim(Simulated.Sim, static_cast<ULONG>(index)) :
+			!Boards.back()->Open(Settings.Paths[index], unused)) {
+			return false;
+		}
+	}
+
+	if (Settings.SimBoards != 0) {
+		Simulated.Start();
+	}
+
+	return true;
+}
+#endif
+
+bool RunThreads(const Options& Settings, BenchState& State)
+{
+#ifndef _WIN32
+	SimSystem simulated;        // outlives the boards
+#endif
+	std::vector<std::thread> threads;
+	std::atomic<bool> failed{false};
+	std::vector<std::unique_ptr<Board>> shared;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(Settings.Seconds));
+
+#ifndef _WIN32
+	if (!OpenShared(Settings, simulated, shared)) {
+		return false;
+	}
+#endif
+
+	for (size_t index = 0; index < Settings.BoardCount(); index++) {
+		for (ULONG channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+			threads.emplace_back([&, index, channel] {
+				IoContext context;
+				Board own;
+				Transport* device;
+				BenchState local;
+
+				if (!shared.empty()) {
+					device = shared[index]->Device.get();
+				} else if (own.Open(Settings.Paths[index], context)) {
+					device = own.Device.get();
+				} else {
+					failed = true;
+					return;
+				}
+
+				//
+				// A shared transport's CancelAll also ends reads of other
+				// threads; all stop at the same deadline.
+				//
+				Client board(*device, context);
+				local.Active = 1;
+				Spawn(ReadLoop(board, channel, Settings.Batch, local));
+				Finish({ device }, context, local, deadline);
+
+				State.Words += local.Words;
+				State.Errors += local.Errors;
+			});
+		}
+	}
+
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+
+#ifndef _WIN32
+	if (Settings.SimBoards != 0) {
+		simulated.Stop(State.Sim);
+	}
+#endif
+
+	return !failed;
+}
+
+bool RunCoroutines(const Options& Settings, BenchState& State)
+{
+#ifndef _WIN32
+	SimSystem simulated;        // outlives the boards
+#endif
+	IoContext context;
+	std::vector<std::unique_ptr<Board>> boards;
+	std::vector<std::unique_ptr<Client>> clients;
+	std::vector<Transport*> devices;
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+		std::chrono::duration<double>(Settings.Seconds));
+
+#ifdef _WIN32
+	for (const std::string& path : Settings.Paths) {
+		boards.push_back(std::make_unique<Board>());
+		if (!boards.back()->Open(path, context)) {
+			return false;
+		}
+	}
+#else
+	if (!OpenShared(Settings, simulated, boards)) {
+		return false;
+	}
+#endif
+
+	for (auto& board : boards) {
+		devices.push_back(board->Device.get());
+		clients.push_back(std::make_unique<Client>(*devices.back(), context));
+	}
+
+	for (auto& client : clients) {
+		for (ULONG channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+			State.Active++;
+			Spawn(ReadLoop(*client, channel, Settings.Batch, State));
+		}
+	}
+
+	Finish(devices, context, State, deadline);
+
+#ifndef _WIN32
+	if (Settings.SimBoards != 0) {
+		simulated.Stop(State.Sim);
+	}
+#endif
+
+	return true;
+}
+
+#ifndef _WIN32
+Task<void> WaitAlarm(Client& Board, std::span<CPCI429_HEALTH_EVENT> Events, long& Result, bool& Done)
+{
+	Result = co_await Board.WaitHealthAlarm(Events);
+	Done = true;
+}
+
+//
+// Sets a stale limit on label 300 of channel 0, which the simulator does
+// not send, and waits for the alarm through the client. The simulator
+// runs ahead of real time, so a second of wall clock is plenty.
+//
+bool CheckHealthAlarm(const Options& Settings, CPCI429_HEALTH_EVENT& Event)
+{
+	SimSystem simulated;        // outlives the boards
+	Options single = Settings;
+	std::vector<std::unique_ptr<Board>> boards;
+	CPCI429_LABEL_HEALTH_CONFIG config = {};
+	CPCI429_HEALTH_EVENT events[4];
+	IoContext context;
+	long result = 0;
+	bool done = false;
+
+	single.SimBoards = 1;
+	if (!OpenShared(single, simulated, boards)) {
+		return false;
+	}
+
+	config.Channel = 0;
+	config.Label = 0xC0;
+	config.Sdi = CPCI429_SDI_ANY_SOURCE;
+	config.StaleMs = 50;
+	if (CPCI429HostIoctl(boards[0]->Host, CPCI429_IOCTL_SET_LABEL_HEALTH, &config, sizeof(config),
+		nullptr, 0, nullptr) != 0) {
+		return false;
+	}
+
+	Client board(*boards[0]->Device, context);
+	Spawn(WaitAlarm(board, events, result, done));
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+	while (!done && std::chrono::steady_clock::now() < deadline) {
+		context.Poll(10);
+	}
+	if (!done) {
+		boards[0]->Device->CancelAll();
+		while (!done) {
+			context.Poll(10);
+		}
+	}
+
+	for (long i = 0; i < result; i++) {
+		if (events[i].Type == CPCI429_HEALTH_STALE && events[i].Channel == 0 &&
+			(events[i].LabelSdi & 0xFF) == config.Label) {
+			Event = events[i];
+			return true;
+		}
+	}
+
+	return false;
+}
+#endif
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	Options settings;
+	bool valid = true;
+
+	for (int i = 1; i < argc && valid; i++) {
+		if (!std::strcmp(argv[i], "--seconds") && i + 1 < argc) {
+			settings.Seconds = std::atof(argv[++i]);
+		} else if (!std::strcmp(argv[i], "--batch") && i + 1 < argc) {
+			settings.Batch = static_cast<size_t>(std::atoi(argv[++i]));
+#ifndef _WIN32
+		} else if (!std::strcmp(argv[i], "--sim") && i + 1 < argc) {
+			settings.SimBoards = static_cast<ULONG>(std::atoi(argv[++i]));
+			valid = settings.SimBoards != 0 && settings.SimBoards <= CPCI429_SIM_MAX_BOARDS;
+#endif
+		} else if (argv[i][0] == '-') {
+			valid = false;
+		} else {
+			settings.Paths.push_back(argv[i]);
+		}
+	}
+
+	if (!valid || settings.BoardCount() == 0 || (settings.SimBoards != 0 && !settings.Paths.empty()) ||
+		settings.Seconds <= 0 || settings.Batch == 0) {
+#ifdef _WIN32
+		std::fprintf(stderr, "usage: cpci429bench [--seconds N] [--batch N] BOARD...\n");
+#else
+		std::fprintf(stderr, "usage: cpci429bench [--seconds N] [--batch N] BOARD...\n"
+			"       cpci429bench [--seconds N] [--batch N] --sim BOARDS\n");
+#endif
+		return 2;
+	}
+
+#ifndef _WIN32
+	for (const std::string& path : settings.Paths) {
+		if (!CreateFakeBar(path)) {
+			std::fprintf(stderr, "cpci429bench: %s: %s\n", path.c_str(), std::strerror(errno));
+			return 1;
+		}
+	}
+#endif
+
+	struct {
+		const char* Name;
+		bool (*Run)(const Options&, BenchState&);
+	} const modes[] = {
+		{ "thread per channel", RunThreads },
+		{ "coroutines, one thread", RunCoroutines },
+	};
+
+	for (const auto& mode : modes) {
+		BenchState state;
+		auto start = std::chrono::steady_clock::now();
+
+		if (!mode.Run(settings, state)) {
+			std::fprintf(stderr, "cpci429bench: cannot open a board\n");
+			return 1;
+		}
+
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::printf("%-24s %zu channels, %.0f words/s, %lu errors\n", mode.Name,
+			settings.BoardCount() * CPCI429_MAX_RX_CHANNELS, static_cast<double>(state.Words) / elapsed,
+			static_cast<unsigned long>(state.Errors.load()));
+#ifndef _WIN32
+		if (settings.SimBoards != 0) {
+			std::printf("%-24s %.1f s simulated, %.1fx real time, read %llu of %llu words received\n", "",
+				static_cast<double>(state.Sim.SimulatedNs) / 1e9,
+				static_cast<double>(state.Sim.SimulatedNs) / (elapsed * 1e9),
+				static_cast<unsigned long long>(state.Words.load()),
+				static_cast<unsigned long long>(state.Sim.WordsReceived));
+		}
+#endif
+	}
+
+#ifndef _WIN32
+	if (settings.SimBoards != 0) {
+		CPCI429_HEALTH_EVENT event;
+
+		if (!CheckHealthAlarm(settings, event)) {
+			std::fprintf(stderr, "cpci429bench: no stale alarm for label 300 within a second\n");
+			return 1;
+		}
+		std::printf("%-24s stale alarm for label 300 at %.1f ms simulated\n", "health alarm",
+			static_cast<double>(event.Time) / 1e4);
+	}
+#endif
+
+	return 0;
+}
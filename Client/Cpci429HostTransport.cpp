@@ -0,0 +1,137 @@
+/*++
+
+Module Name:
+
+    cpci429hosttransport.cpp
+
+Abstract:
+
+    Coroutine client transport over the Linux user-mode backend.
+
+Environment:
+
+    Linux user mode, C++20
+
+--*/
+
+#include <cerrno>
+
+#include "Cpci429HostTransport.h"
+
+namespace cpci429 {
+
+HostTransport::HostTransport(PCPCI429_HOST Host, int ServiceTimeoutMs)
+	: m_Host(Host), m_ServiceTimeoutMs(ServiceTimeoutMs)
+{
+	m_Thread = std::thread([this] { Service(); });
+}
+
+HostTransport::~HostTransport()
+{
+	m_Stopping = true;
+	m_Thread.join();
+	CancelAll();
+}
+
+bool HostTransport::TryRead(IoOperation& Operation)
+{
+	size_t information = 0;
+	int status;
+
+	status = CPCI429HostIoctl(m_Host, CPCI429_IOCTL_RX_READ_RECORDS, Operation.In, Operation.InLength,
+		Operation.Out, Operation.OutLength, &information);
+	if (status == 0 && information == 0) {
+		return false;
+	}
+
+	Operation.Context->Complete(Operation, { status, information });
+	return true;
+}
+
+bool HostTransport::TryAlarm(IoOperation& Operation)
+{
+	int count;
+
+	count = CPCI429HostHealthWait(m_Host, static_cast<PCPCI429_HEALTH_EVENT>(Operation.Out),
+		static_cast<ULONG>(Operation.OutLength / sizeof(CPCI429_HEALTH_EVENT)), 0);
+	if (count == 0) {
+		return false;
+	}
+
+	if (count < 0) {
+		Operation.Context->Complete(Operation, { count, 0 });
+	} else {
+		Operation.Context->Complete(Operation, { 0, count * sizeof(CPCI429_HEALTH_EVENT) });
+	}
+	return true;
+}
+
+void HostTransport::Start(IoOperation& Operation)
+{
+	size_t information = 0;
+	int status;
+
+	switch (Operation.Code) {
+	case CPCI429_IOCTL_RX_READ_WAIT:
+		if (!TryRead(Operation)) {
+			std::lock_guard<std::mutex> lock(m_Lock);
+			m_Reads.push_back(&Operation);
+		}
+		return;
+
+	case CPCI429_IOCTL_WAIT_HEALTH_ALARM:
+		if (Operation.OutLength < sizeof(CPCI429_HEALTH_EVENT)) {
+			Operation.Context->Complete(Operation, { -EINVAL, 0 });
+		} else {
+			std::lock_guard<std::mutex> lock(m_Lock);
+			m_Alarms.push_back(&Operation);
+		}
+		return;
+
+	default:
+		status = CPCI429HostIoctl(m_Host, Operation.Code, Operation.In, Operation.InLength,
+			Operation.Out, Operation.OutLength, &information);
+		Operation.Context->Complete(Operation, { status, information });
+		return;
+	}
+}
+
+void HostTransport::CancelAll()
+{
+	std::vector<IoOperation*> canceled;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Lock);
+		canceled.swap(m_Reads);
+		canceled.insert(canceled.end(), m_Alarms.begin(), m_Alarms.end());
+		m_Alarms.clear();
+	}
+
+	for (IoOperation* operation : canceled) {
+		operation->Context->Complete(*operation, { -ECANCELED, 0 });
+	}
+}
+
+void HostTransport::Service()
+{
+	while (!m_Stopping) {
+		CPCI429HostService(m_Host, m_ServiceTimeoutMs);
+
+		//
+		// Retried every pass, not only after words arrived, so a read
+		// parked just after a drain is not left waiting for the next one.
+		//
+		std::lock_guard<std::mutex> lock(m_Lock);
+		std::erase_if(m_Reads, [this](IoOperation* Operation) { return TryRead(*Operation); });
+
+		//
+		// Alarms are raised by the staleness check inside the service
+		// call, so they are collected here rather than by a thread
+		// blocked in the backend; oldest waiter first, as the driver's
+		// manual queue hands them out.
+		//
+		std::erase_if(m_Alarms, [this](IoOperation* Operation) { return TryAlarm(*Operation); });
+	}
+}
+
+} // namespace cpci429
@@ -0,0 +1,66 @@
+/*++
+
+Module Name:
+
+    cpci429hosttransport.h
+
+Abstract:
+
+    Transport of the coroutine client over the Linux user-mode backend
+    (Cpci429Host.h). A service thread per board takes the place of the
+    driver's interrupt path and completes parked requests:
+
+        CPCI429_IOCTL_RX_READ_WAIT      completes once the ring has records
+        CPCI429_IOCTL_WAIT_HEALTH_ALARM completes once the backend has
+                                        raised alarms, collected without
+                                        blocking after each service pass
+
+    Other codes run synchronously through CPCI429HostIoctl; subscriptions
+    are not supported by the backend and fail with -ENOTTY.
+
+Environment:
+
+    Linux user mode, C++20
+
+--*/
+
+#ifndef _CPCI429HOSTTRANSPORT_H
+#define _CPCI429HOSTTRANSPORT_H
+
+#include <thread>
+
+#include "Cpci429Client.h"
+#include "Cpci429Host.h"
+
+namespace cpci429 {
+
+class HostTransport : public Transport {
+public:
+	//
+	// Host stays owned by the caller and must outlive the transport.
+	// ServiceTimeoutMs bounds how long a parked read waits on a backend
+	// without interrupts.
+	//
+	explicit HostTransport(PCPCI429_HOST Host, int ServiceTimeoutMs = 1);
+	~HostTransport() override;
+
+	void Start(IoOperation& Operation) override;
+	void CancelAll() override;
+
+private:
+	bool TryRead(IoOperation& Operation);
+	bool TryAlarm(IoOperation& Operation);
+	void Service();
+
+	PCPCI429_HOST m_Host;
+	int m_ServiceTimeoutMs;
+	std::mutex m_Lock;
+	std::vector<IoOperation*> m_Reads;      // parked RX_READ_WAIT
+	std::vector<IoOperation*> m_Alarms;     // parked WAIT_HEALTH_ALARM
+	std::atomic<bool> m_Stopping{false};
+	std::thread m_Thread;
+};
+
+} // namespace cpci429
+
+#endif // _CPCI429HOSTTRANSPORT_H
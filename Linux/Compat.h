@@ -0,0 +1,107 @@
+/*++
+
+Module Name:
+
+    compat.h
+
+Abstract:
+
+    Windows types and macros used by the shared driver headers, so that
+    Public.h, Registers.h, RxPath.h, Loopback.h, BulkSender.h, Decode.h
+    and Capture.h build unchanged on Linux. IOCTL codes come out
+    bit-identical to the Windows ones.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#ifndef _COMPAT_H
+#define _COMPAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef void VOID;
+typedef void *PVOID;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BOOLEAN;
+typedef uint16_t USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+
+#define TRUE  1
+#define FALSE 0
+
+#define MAXULONGLONG ((ULONGLONG)~(ULONGLONG)0)
+
+#define FORCEINLINE static inline __attribute__((always_inline))
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END   }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+
+#define _In_
+#define _Out_
+#define _Inout_
+#define _In_opt_
+#define _Out_opt_
+#define _In_reads_(n)
+#define _In_reads_bytes_(n)
+#define _Out_writes_(n)
+#define _Out_writes_opt_(n)
+#define _Out_writes_bytes_(n)
+
+#define RtlZeroMemory(d, n) memset((d), 0, (n))
+#define MemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define RtlFindMostSignificantBit(x) ((int)(63 - __builtin_clzll((ULONGLONG)(x))))
+#define InterlockedExchange(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+static inline BOOLEAN
+_BitScanForward(ULONG *Index, ULONG Mask)
+{
+	if (Mask == 0) {
+		return FALSE;
+	}
+	*Index = (ULONG)__builtin_ctz(Mask);
+	return TRUE;
+}
+
+static inline BOOLEAN
+_BitScanReverse(ULONG *Index, ULONG Mask)
+{
+	if (Mask == 0) {
+		return FALSE;
+	}
+	*Index = (ULONG)(31 - __builtin_clz(Mask));
+	return TRUE;
+}
+
+static inline LONG
+InterlockedCompareExchange(volatile LONG *Destination, LONG Exchange, LONG Comparand)
+{
+	__atomic_compare_exchange_n(Destination, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return Comparand;
+}
+
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED     0
+#define METHOD_IN_DIRECT    1
+#define METHOD_OUT_DIRECT   2
+#define METHOD_NEITHER      3
+#define FILE_ANY_ACCESS     0
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#endif // _COMPAT_H
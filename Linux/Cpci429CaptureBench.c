@@ -0,0 +1,287 @@
+/*++
+
+Module Name:
+
+    cpci429capturebench.c
+
+Abstract:
+
+    Compression ratio and speed of the capture format (Capture.h) on
+    synthetic periodic label traffic, round-tripped through a capture
+    file.
+
+        cpci429capturebench [--seconds N] [--channels N] [--labels N]
+                            [--rate HZ] [--file PATH]
+
+    By default 4 channels each carry 64 labels at 50 Hz for 600 seconds,
+    7.68M records. The labels of a channel are spread evenly over the
+    period; half of them hold a constant value, the other half a value
+    that drifts by a few counts per update. Records are stamped at drain
+    time, every millisecond with up to 200 us of jitter, as the driver
+    stamps them. Encoding is timed over CPCI429CaptureWrite and the file
+    writes, decoding over reading the index and every chunk. Every
+    decoded record is compared with the one written, and a seek by time
+    and by label is checked against the index. Without --file the capture
+    goes to an unnamed temporary file.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Compat.h"
+#include "Capture.h"
+#include "RxPath.h"
+
+#define CPCI429_BENCH_TICKS 10000000    // timestamps are in 100ns units
+#define CPCI429_BENCH_DRAIN (CPCI429_BENCH_TICKS / 1000)
+#define CPCI429_BENCH_JITTER (CPCI429_BENCH_TICKS / 5000)
+
+static
+ULONGLONG
+CPCI429BenchNs(
+	void
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (ULONGLONG)now.tv_sec * 1000000000 + (ULONGLONG)now.tv_nsec;
+}
+
+//
+// The records of Seconds of traffic, in timestamp order.
+//
+static
+PCPCI429_CAPTURE_RECORD
+CPCI429BenchTraffic(
+	_In_ ULONG Seconds,
+	_In_ ULONG Channels,
+	_In_ ULONG Labels,
+	_In_ ULONG Rate,
+	_Out_ PULONGLONG Count
+)
+{
+	ULONG slots = Channels * Labels;
+	ULONGLONG period = CPCI429_BENCH_TICKS / Rate;
+	ULONGLONG frames = (ULONGLONG)Seconds * Rate;
+	ULONGLONG drain = 0;
+	ULONGLONG stamp = 0;
+	PCPCI429_CAPTURE_RECORD records;
+	ULONG *values;
+	ULONGLONG frame;
+	ULONGLONG count = 0;
+	ULONG slot;
+
+	records = (PCPCI429_CAPTURE_RECORD)malloc(frames * slots * sizeof(*records));
+	values = (ULONG *)calloc(slots, sizeof(*values));
+	if (records == NULL || values == NULL) {
+		free(records);
+		free(values);
+		return NULL;
+	}
+
+	srand(429);
+	for (slot = 0; slot < slots; slot++) {
+		values[slot] = ((ULONG)rand() & 0x3FFFF) << 10;
+	}
+
+	for (frame = 0; frame < frames; frame++) {
+		for (slot = 0; slot < slots; slot++) {
+			ULONGLONG arrival = frame * period + slot * period / slots;
+			ULONG label = slot / Channels;
+			ULONG channel = slot % Channels;
+			ULONG word;
+
+			while (drain < arrival) {
+				drain += CPCI429_BENCH_DRAIN;
+				stamp = drain + (ULONG)rand() % CPCI429_BENCH_JITTER;
+			}
+
+			if (label & 1) {
+				values[slot] = (values[slot] + (((ULONG)rand() % 7) << 10)) & 0x7FFFFC00;
+			}
+			word = values[slot] | ((channel & 0x3) << 8) | (0x40 + label);
+			word = CPCI429OddParity(word) ? word : word | 0x80000000;
+
+			records[count].Word = word;
+			records[count].Channel = (UCHAR)channel;
+			records[count].Flags = 0;
+			records[count].Reserved = 0;
+			records[count].Timestamp = stamp;
+			count++;
+		}
+	}
+
+	free(values);
+	*Count = count;
+
+	return records;
+}
+
+int
+main(
+	int argc,
+	char **argv
+)
+{
+	static CPCI429_CAPTURE_WRITER writer;
+	static CPCI429_CAPTURE_DECODER decoder;
+	const char *path = NULL;
+	ULONG seconds = 600;
+	ULONG channels = 4;
+	ULONG labels = 64;
+	ULONG rate = 50;
+	PCPCI429_CAPTURE_RECORD records;
+	PCPCI429_CAPTURE_RECORD decoded;
+	PCPCI429_CAPTURE_INDEX_ENTRY index;
+	ULONGLONG count;
+	ULONGLONG done;
+	ULONGLONG start;
+	ULONGLONG encodeNs;
+	ULONGLONG decodeNs;
+	ULONGLONG fileBytes;
+	ULONGLONG middle;
+	ULONG chunkCount;
+	ULONG found;
+	PVOID buffer;
+	FILE *file;
+	ULONG i;
+	int status = 0;
+
+	for (i = 1; i < (ULONG)argc; i++) {
+		if (!strcmp(argv[i], "--seconds") && i + 1 < (ULONG)argc) {
+			seconds = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--channels") && i + 1 < (ULONG)argc) {
+			channels = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--labels") && i + 1 < (ULONG)argc) {
+			labels = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--rate") && i + 1 < (ULONG)argc) {
+			rate = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--file") && i + 1 < (ULONG)argc) {
+			path = argv[++i];
+		} else {
+			status = -EINVAL;
+		}
+	}
+
+	if (status != 0 || seconds == 0 || channels == 0 || channels > CPCI429_MAX_RX_CHANNELS ||
+		labels == 0 || labels > 0xC0 || rate == 0 || rate > 1000) {
+		fprintf(stderr, "usage: cpci429capturebench [--seconds N] [--channels 1-%u] [--labels 1-192]\n"
+			"                           [--rate 1-1000] [--file PATH]\n", CPCI429_MAX_RX_CHANNELS);
+		return 2;
+	}
+
+	records = CPCI429BenchTraffic(seconds, channels, labels, rate, &count);
+	if (records == NULL) {
+		fprintf(stderr, "cpci429capturebench: %s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	file = path != NULL ? fopen(path, "w+b") : tmpfile();
+	if (file == NULL) {
+		fprintf(stderr, "cpci429capturebench: %s: %s\n", path != NULL ? path : "tmpfile", strerror(errno));
+		return 1;
+	}
+
+	start = CPCI429BenchNs();
+	if (!CPCI429CaptureWriterOpen(&writer, file)) {
+		status = -EIO;
+	}
+	for (done = 0; status == 0 && done < count; done += 4096) {
+		if (!CPCI429CaptureWrite(&writer, &records[done], (ULONG)(count - done < 4096 ? count - done : 4096))) {
+			status = -EIO;
+		}
+	}
+	if (status == 0 && (!CPCI429CaptureWriterClose(&writer) || fflush(file) != 0)) {
+		status = -EIO;
+	}
+	encodeNs = CPCI429BenchNs() - start;
+	if (status != 0) {
+		fprintf(stderr, "cpci429capturebench: writing the capture failed: %s\n", strerror(errno));
+		return 1;
+	}
+	fileBytes = (ULONGLONG)ftello(file);
+
+	decoded = (PCPCI429_CAPTURE_RECORD)malloc(count * sizeof(*decoded));
+	buffer = malloc(CPCI429_CAPTURE_CHUNK_BYTES);
+	if (decoded == NULL || buffer == NULL) {
+		fprintf(stderr, "cpci429capturebench: %s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	start = CPCI429BenchNs();
+	index = CPCI429CaptureReadIndex(file, &chunkCount);
+	done = 0;
+	for (i = 0; index != NULL && i < chunkCount; i++) {
+		if (index[i].Bytes > CPCI429_CAPTURE_CHUNK_BYTES || done + index[i].Count > count ||
+			!CPCI429CaptureReadChunk(file, &index[i], &decoder, buffer, &decoded[done])) {
+			break;
+		}
+		done += index[i].Count;
+	}
+	decodeNs = CPCI429BenchNs() - start;
+
+	if (index == NULL || i != chunkCount || done != count) {
+		fprintf(stderr, "cpci429capturebench: reading the capture failed at chunk %u\n", i);
+		return 1;
+	}
+
+	for (done = 0; done < count; done++) {
+		if (memcmp(&decoded[done], &records[done], sizeof(*records)) != 0) {
+			fprintf(stderr, "cpci429capturebench: record %llu decoded as %08x at %llu, written %08x at %llu\n",
+				(unsigned long long)done, decoded[done].Word, (unsigned long long)decoded[done].Timestamp,
+				records[done].Word, (unsigned long long)records[done].Timestamp);
+			status = -EIO;
+			break;
+		}
+	}
+
+	//
+	// The chunk found for a time must hold the first record at or after
+	// it, and the chunk found for a label must contain it.
+	//
+	middle = records[count / 2].Timestamp + 1;
+	for (done = count / 2; done < count && records[done].Timestamp < middle; done++) {
+	}
+	for (i = 0; i < chunkCount && done >= index[i].Count; i++) {
+		done -= index[i].Count;
+	}
+	found = CPCI429CaptureFindTime(index, chunkCount, middle);
+	if (found != i) {
+		fprintf(stderr, "cpci429capturebench: seeking to %llu found chunk %u, not %u\n",
+			(unsigned long long)middle, found, i);
+		status = -EIO;
+	}
+	found = CPCI429CaptureFindLabel(index, chunkCount, 0, 0x40 + labels - 1);
+	if (found != 0) {
+		fprintf(stderr, "cpci429capturebench: label %03o first found in chunk %u\n", 0x40 + labels - 1, found);
+		status = -EIO;
+	}
+
+	printf("%u channels x %u labels at %u Hz for %u s: %llu records in %u chunks\n",
+		channels, labels, rate, seconds, (unsigned long long)count, chunkCount);
+	printf("size:   %llu bytes, %.2f bytes/record against %u raw (ratio %.1f)\n",
+		(unsigned long long)fileBytes, (double)fileBytes / (double)count, (ULONG)sizeof(*records),
+		(double)count * sizeof(*records) / (double)fileBytes);
+	printf("encode: %.1f MRecords/s\n", (double)count * 1e3 / (double)encodeNs);
+	printf("decode: %.1f MRecords/s, including file reads\n", (double)count * 1e3 / (double)decodeNs);
+
+	free(index);
+	free(buffer);
+	free(decoded);
+	free(records);
+	fclose(file);
+
+	return status == 0 ? 0 : 1;
+}
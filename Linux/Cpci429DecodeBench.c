@@ -0,0 +1,184 @@
+/*++
+
+Module Name:
+
+    cpci429decodebench.c
+
+Abstract:
+
+    Throughput of the shared ICD decoder (Decode.h) in millions of words
+    per second, for raw integer decoding and for batch decoding into
+    engineering units.
+
+        cpci429decodebench [--icd FILE] [--words N] [--passes N]
+
+    Without --icd the table holds 64 BNR, 32 BCD and 32 discrete labels,
+    each over bits 11-29 for every SDI. An ICD whose name ends in .json
+    is read with CPCI429DecodeLoadIcdJson, any other with
+    CPCI429DecodeLoadIcd. Words are drawn at random from the labels the
+    table defines.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Compat.h"
+#include "Decode.h"
+
+static
+ULONGLONG
+CPCI429BenchNs(
+	void
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (ULONGLONG)now.tv_sec * 1000000000 + (ULONGLONG)now.tv_nsec;
+}
+
+static
+void
+CPCI429BenchDefaultTable(
+	_Out_ PCPCI429_DECODE_TABLE Table
+)
+{
+	ULONG label;
+
+	memset(Table, 0, sizeof(*Table));
+
+	for (label = 0; label < 128; label++) {
+		CPCI429DecodeSetEntry(Table, (UCHAR)(0x40 + label), CPCI429_SDI_ANY_SOURCE,
+			label < 64 ? CPCI429_ENCODING_BNR : label < 96 ? CPCI429_ENCODING_BCD : CPCI429_ENCODING_DISCRETE,
+			11, 29, 0.25);
+	}
+}
+
+int
+main(
+	int argc,
+	char **argv
+)
+{
+	static CPCI429_DECODE_TABLE table;
+	const char *icd = NULL;
+	ULONG wordCount = 1 << 20;
+	ULONG passes = 64;
+	ULONG defined[CPCI429_LABEL_SDI_COUNT];
+	ULONG definedCount = 0;
+	ULONG *words;
+	LONG *raw;
+	double *values;
+	UCHAR *valid;
+	ULONGLONG start;
+	ULONGLONG rawNs;
+	ULONGLONG batchNs;
+	double checksum = 0;
+	FILE *file;
+	int errorLine = 0;
+	int loaded;
+	ULONG i;
+	ULONG pass;
+	int status = 0;
+
+	for (i = 1; i < (ULONG)argc; i++) {
+		if (!strcmp(argv[i], "--icd") && i + 1 < (ULONG)argc) {
+			icd = argv[++i];
+		} else if (!strcmp(argv[i], "--words") && i + 1 < (ULONG)argc) {
+			wordCount = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--passes") && i + 1 < (ULONG)argc) {
+			passes = (ULONG)atoi(argv[++i]);
+		} else {
+			status = -EINVAL;
+		}
+	}
+
+	if (status != 0 || wordCount == 0 || passes == 0) {
+		fprintf(stderr, "usage: cpci429decodebench [--icd FILE] [--words N] [--passes N]\n");
+		return 2;
+	}
+
+	if (icd != NULL) {
+		file = fopen(icd, "r");
+		if (file == NULL) {
+			fprintf(stderr, "cpci429decodebench: %s: %s\n", icd, strerror(errno));
+			return 1;
+		}
+		if (strlen(icd) > 5 && !strcmp(icd + strlen(icd) - 5, ".json")) {
+			loaded = CPCI429DecodeLoadIcdJson(file, &table, &errorLine);
+		} else {
+			loaded = CPCI429DecodeLoadIcd(file, &table, &errorLine);
+		}
+		fclose(file);
+		if (loaded < 0) {
+			fprintf(stderr, "cpci429decodebench: %s:%d: invalid entry\n", icd, errorLine);
+			return 1;
+		}
+	} else {
+		CPCI429BenchDefaultTable(&table);
+	}
+
+	for (i = 0; i < CPCI429_LABEL_SDI_COUNT; i++) {
+		if (table.Entry[i].Encoding != CPCI429_ENCODING_NONE) {
+			defined[definedCount++] = i;
+		}
+	}
+	if (definedCount == 0) {
+		fprintf(stderr, "cpci429decodebench: the ICD defines no labels\n");
+		return 1;
+	}
+
+	words = (ULONG *)malloc(wordCount * sizeof(ULONG));
+	raw = (LONG *)malloc(wordCount * sizeof(LONG));
+	values = (double *)malloc(wordCount * sizeof(double));
+	valid = (UCHAR *)malloc(wordCount);
+	if (words == NULL || raw == NULL || values == NULL || valid == NULL) {
+		fprintf(stderr, "cpci429decodebench: %s\n", strerror(ENOMEM));
+		return 1;
+	}
+
+	srand(429);
+	for (i = 0; i < wordCount; i++) {
+		ULONG index = defined[(ULONG)rand() % definedCount];
+
+		words[i] = (((ULONG)rand() << 10) & 0xFFFFFC00) | ((index >> 8) << 8) | (index & 0xFF);
+	}
+
+	start = CPCI429BenchNs();
+	for (pass = 0; pass < passes; pass++) {
+		for (i = 0; i < wordCount; i++) {
+			raw[i] = CPCI429DecodeRaw(&table.Entry[CPCI429_LABEL_SDI_INDEX(words[i])], words[i]);
+		}
+		checksum += raw[pass % wordCount];
+	}
+	rawNs = CPCI429BenchNs() - start;
+
+	start = CPCI429BenchNs();
+	for (pass = 0; pass < passes; pass++) {
+		CPCI429DecodeBatch(&table, words, wordCount, values, valid);
+		checksum += values[pass % wordCount];
+	}
+	batchNs = CPCI429BenchNs() - start;
+
+	printf("%u labels and SDIs defined, %u words x %u passes\n", definedCount, wordCount, passes);
+	printf("raw decode:   %.1f MWords/s\n", (double)wordCount * passes * 1e3 / (double)rawNs);
+	printf("batch decode: %.1f MWords/s (checksum %g)\n", (double)wordCount * passes * 1e3 / (double)batchNs, checksum);
+
+	free(words);
+	free(raw);
+	free(values);
+	free(valid);
+
+	return 0;
+}
@@ -0,0 +1,547 @@
+/*++
+
+Module Name:
+
+    cpci429gateway.c
+
+Abstract:
+
+    Receive republishing and transmit intake for local clients. Each
+    board has a service thread that waits for the board's interrupt,
+    drains every channel's ring in batches and packs the records into
+    datagrams, flushing whatever is left at the end of each pass so that
+    no word waits longer than one service timeout.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "Cpci429Gateway.h"
+
+#define CPCI429_SEGMENT_HEADER_BYTES 64
+#define CPCI429_GATEWAY_RECEIVE_POLL_MS 100
+
+typedef struct _CPCI429_GATEWAY_BOARD {
+	PCPCI429_GATEWAY Gateway;
+	PCPCI429_HOST Host;
+	ULONG Index;
+	ULONG Sequence;
+	pthread_t Thread;
+	BOOLEAN Started;
+	union {
+		CPCI429_DATAGRAM_HEADER Header;
+		UCHAR Bytes[CPCI429_DATAGRAM_BYTES];
+	} Datagram;
+} CPCI429_GATEWAY_BOARD, *PCPCI429_GATEWAY_BOARD;
+
+struct _CPCI429_GATEWAY {
+	CPCI429_GATEWAY_CONFIG Config;
+	ULONG BoardCount;
+	CPCI429_GATEWAY_BOARD Boards[CPCI429_GATEWAY_MAX_BOARDS];
+
+	int SendSocket;
+	int ListenSocket;
+	pthread_t ReceiveThread;
+	BOOLEAN ReceiveStarted;
+
+	PCPCI429_GATEWAY_SEGMENT Segment;
+	size_t SegmentBytes;
+	pthread_mutex_t SegmentLock;    // serializes the board threads' publishing
+
+	volatile int Stopping;
+	CPCI429_GATEWAY_STATS Stats;    // updated with __atomic builtins
+};
+
+static
+void
+CPCI429GatewayCount(
+	_Inout_ ULONGLONG *Counter,
+	_In_ ULONGLONG Value
+)
+{
+	__atomic_add_fetch(Counter, Value, __ATOMIC_RELAXED);
+}
+
+static
+int
+CPCI429GatewayCreateSegment(
+	_Inout_ PCPCI429_GATEWAY Gateway
+)
+{
+	PCPCI429_GATEWAY_SEGMENT segment;
+	ULONG slots = Gateway->Config.SegmentSlots != 0 ? Gateway->Config.SegmentSlots : CPCI429_GATEWAY_DEFAULT_SLOTS;
+	size_t bytes;
+	int fd;
+
+	if ((slots & (slots - 1)) != 0) {
+		return -EINVAL;
+	}
+	bytes = CPCI429_SEGMENT_HEADER_BYTES + (size_t)slots * sizeof(CPCI429_SEGMENT_SLOT);
+
+	fd = shm_open(Gateway->Config.SegmentName, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		return -errno;
+	}
+	if (ftruncate(fd, (off_t)bytes) != 0) {
+		int status = -errno;
+
+		close(fd);
+		return status;
+	}
+
+	segment = (PCPCI429_GATEWAY_SEGMENT)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (segment == MAP_FAILED) {
+		return -errno;
+	}
+
+	//
+	// Readers that find a stale segment wait for the magic to come back.
+	//
+	__atomic_store_n(&segment->Magic, 0, __ATOMIC_RELEASE);
+	memset((PUCHAR)segment + sizeof(ULONG), 0, bytes - sizeof(ULONG));
+	segment->SlotCount = slots;
+	segment->SlotBytes = sizeof(CPCI429_SEGMENT_SLOT);
+	segment->SlotOffset = CPCI429_SEGMENT_HEADER_BYTES;
+	__atomic_store_n(&segment->Magic, CPCI429_SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+	Gateway->Segment = segment;
+	Gateway->SegmentBytes = bytes;
+
+	return 0;
+}
+
+static
+void
+CPCI429GatewayPublish(
+	_In_ PCPCI429_GATEWAY Gateway,
+	_In_ const void *Datagram,
+	_In_ ULONG Length
+)
+{
+	PCPCI429_GATEWAY_SEGMENT segment = Gateway->Segment;
+	PCPCI429_SEGMENT_SLOT slot;
+	ULONGLONG n;
+
+	pthread_mutex_lock(&Gateway->SegmentLock);
+
+	n = segment->Published;
+	slot = CPCI429_SEGMENT_SLOT_AT(segment, n);
+
+	__atomic_store_n(&slot->Sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->Length = Length;
+	memcpy(slot->Datagram, Datagram, Length);
+	__atomic_store_n(&slot->Sequence, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&segment->Published, n + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&Gateway->SegmentLock);
+}
+
+int
+CPCI429GatewaySegmentRead(
+	_In_ const CPCI429_GATEWAY_SEGMENT *Segment,
+	_In_ ULONGLONG Sequence,
+	_Out_writes_bytes_(CPCI429_DATAGRAM_BYTES) void *Datagram,
+	_Out_ size_t *Length
+)
+{
+	const CPCI429_SEGMENT_SLOT *slot;
+	ULONG length;
+
+	*Length = 0;
+
+	if (Sequence >= __atomic_load_n(&Segment->Published, __ATOMIC_ACQUIRE)) {
+		return -EAGAIN;
+	}
+
+	slot = CPCI429_SEGMENT_SLOT_AT(Segment, Sequence);
+	if (__atomic_load_n(&slot->Sequence, __ATOMIC_ACQUIRE) != Sequence + 1) {
+		return -ESTALE;
+	}
+
+	length = slot->Length;
+	if (length > CPCI429_DATAGRAM_BYTES) {
+		length = CPCI429_DATAGRAM_BYTES;
+	}
+	memcpy(Datagram, slot->Datagram, length);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->Sequence, __ATOMIC_RELAXED) != Sequence + 1) {
+		return -ESTALE;
+	}
+
+	*Length = length;
+
+	return 0;
+}
+
+static
+void
+CPCI429GatewayFlush(
+	_Inout_ PCPCI429_GATEWAY_BOARD Board
+)
+{
+	PCPCI429_GATEWAY gateway = Board->Gateway;
+	PCPCI429_DATAGRAM_HEADER header = &Board->Datagram.Header;
+	ULONG length;
+	ULONG i;
+
+	if (header->Count == 0) {
+		return;
+	}
+
+	header->Magic = CPCI429_DATAGRAM_MAGIC;
+	header->Version = CPCI429_DATAGRAM_VERSION;
+	header->Type = CPCI429_DATAGRAM_RX;
+	header->Board = Board->Index;
+	header->Sequence = Board->Sequence++;
+	length = sizeof(CPCI429_DATAGRAM_HEADER) + header->Count * sizeof(CPCI429_DATAGRAM_WORD);
+
+	//
+	// A client that stops reading must not stall the drain; its datagrams
+	// are dropped and counted instead.
+	//
+	for (i = 0; i < gateway->Config.EndpointCount; i++) {
+		if (sendto(gateway->SendSocket, Board->Datagram.Bytes, length, MSG_DONTWAIT,
+			(const struct sockaddr*)&gateway->Config.Endpoints[i], sizeof(struct sockaddr_in)) != (ssize_t)length) {
+			CPCI429GatewayCount(&gateway->Stats.SendErrors, 1);
+		}
+	}
+
+	if (gateway->Segment != NULL) {
+		CPCI429GatewayPublish(gateway, Board->Datagram.Bytes, length);
+	}
+
+	CPCI429GatewayCount(&gateway->Stats.DatagramsSent, 1);
+	CPCI429GatewayCount(&gateway->Stats.WordsSent, header->Count);
+
+	header->Count = 0;
+}
+
+static
+void
+CPCI429GatewayAppend(
+	_Inout_ PCPCI429_GATEWAY_BOARD Board,
+	_In_ ULONG Channel,
+	_In_ const CPCI429_RX_RECORD *Record
+)
+{
+	PCPCI429_DATAGRAM_HEADER header = &Board->Datagram.Header;
+	PCPCI429_DATAGRAM_WORD words = (PCPCI429_DATAGRAM_WORD)(header + 1);
+
+	if (header->Count != 0 &&
+		(header->Count == CPCI429_DATAGRAM_MAX_WORDS ||
+		 Record->Timestamp < header->BaseTime ||
+		 Record->Timestamp - header->BaseTime > CPCI429_DATAGRAM_MAX_DELTA)) {
+		CPCI429GatewayFlush(Board);
+	}
+	if (header->Count == 0) {
+		header->BaseTime = Record->Timestamp;
+	}
+
+	words[header->Count].Word = Record->Word;
+	words[header->Count].Stamp = CPCI429_DATAGRAM_STAMP(Channel, Record->Timestamp - header->BaseTime);
+	words[header->Count].Flags = Record->Flags;
+	header->Count++;
+
+	if ((Record->Flags & CPCI429_RX_FLAG_GAP) != 0) {
+		CPCI429GatewayCount(&Board->Gateway->Stats.Gaps, 1);
+		if (CPCI429_RX_GAP_WORDS(Record->Flags) == 0xFFFF) {
+			CPCI429GatewayCount(&Board->Gateway->Stats.GapsSaturated, 1);
+		} else {
+			CPCI429GatewayCount(&Board->Gateway->Stats.GapWords, CPCI429_RX_GAP_WORDS(Record->Flags));
+		}
+	}
+}
+
+static
+void*
+CPCI429GatewayBoardThread(
+	_In_ void *Context
+)
+{
+	PCPCI429_GATEWAY_BOARD board = (PCPCI429_GATEWAY_BOARD)Context;
+	PCPCI429_GATEWAY gateway = board->Gateway;
+	int timeout = gateway->Config.ServiceTimeoutMs != 0 ? gateway->Config.ServiceTimeoutMs : 1;
+	CPCI429_RX_RECORD records[CPCI429_DATAGRAM_MAX_WORDS];
+	CPCI429_RX_READ rxRead;
+	size_t information;
+	ULONG count;
+	ULONG i;
+
+	while (!__atomic_load_n(&gateway->Stopping, __ATOMIC_ACQUIRE)) {
+		if (CPCI429HostService(board->Host, timeout) < 0) {
+			poll(NULL, 0, timeout);
+		}
+
+		for (rxRead.Channel = 0; rxRead.Channel < CPCI429_MAX_RX_CHANNELS; rxRead.Channel++) {
+			do {
+				if (CPCI429HostIoctl(board->Host, CPCI429_IOCTL_RX_READ_RECORDS, &rxRead, sizeof(rxRead),
+					records, sizeof(records), &information) != 0) {
+					break;
+				}
+
+				count = (ULONG)(information / sizeof(CPCI429_RX_RECORD));
+				for (i = 0; i < count; i++) {
+					CPCI429GatewayAppend(board, rxRead.Channel, &records[i]);
+				}
+			} while (count == CPCI429_DATAGRAM_MAX_WORDS);
+		}
+
+		CPCI429GatewayFlush(board);
+	}
+
+	return NULL;
+}
+
+static
+void
+CPCI429GatewaySubmit(
+	_In_ PCPCI429_GATEWAY Gateway,
+	_In_ const CPCI429_DATAGRAM_HEADER *Header
+)
+/*++
+
+Routine Description:
+
+    Hands a TX datagram to its board, one TX_SUBMIT per run of words for
+    the same channel, in datagram order.
+
+--*/
+{
+	const CPCI429_DATAGRAM_WORD *words = (const CPCI429_DATAGRAM_WORD*)(Header + 1);
+	PCPCI429_HOST host = Gateway->Boards[Header->Board].Host;
+	ULONG buffer[2 + CPCI429_DATAGRAM_MAX_WORDS];
+	PCPCI429_TX_SUBMIT submit = (PCPCI429_TX_SUBMIT)buffer;
+	size_t information;
+	ULONG first;
+	ULONG last;
+
+	for (first = 0; first < Header->Count; first = last) {
+		submit->Channel = CPCI429_DATAGRAM_CHANNEL(words[first].Stamp);
+		for (last = first; last < Header->Count && CPCI429_DATAGRAM_CHANNEL(words[last].Stamp) == submit->Channel; last++) {
+			submit->Words[last - first] = words[last].Word;
+		}
+		submit->WordCount = last - first;
+
+		if (CPCI429HostIoctl(host, CPCI429_IOCTL_TX_SUBMIT, submit,
+			FIELD_OFFSET(CPCI429_TX_SUBMIT, Words) + submit->WordCount * sizeof(ULONG),
+			NULL, 0, &information) != 0) {
+			information = 0;
+		}
+
+		CPCI429GatewayCount(&Gateway->Stats.WordsSubmitted, information / sizeof(ULONG));
+		CPCI429GatewayCount(&Gateway->Stats.WordsRejected, submit->WordCount - information / sizeof(ULONG));
+	}
+}
+
+static
+void*
+CPCI429GatewayReceiveThread(
+	_In_ void *Context
+)
+{
+	PCPCI429_GATEWAY gateway = (PCPCI429_GATEWAY)Context;
+	union {
+		CPCI429_DATAGRAM_HEADER Header;
+		UCHAR Bytes[CPCI429_DATAGRAM_BYTES];
+	} datagram;
+	ssize_t length;
+
+	while (!__atomic_load_n(&gateway->Stopping, __ATOMIC_ACQUIRE)) {
+		length = recv(gateway->ListenSocket, datagram.Bytes, sizeof(datagram), 0);
+		if (length < 0) {
+			continue;
+		}
+
+		CPCI429GatewayCount(&gateway->Stats.DatagramsReceived, 1);
+
+		if ((size_t)length < sizeof(CPCI429_DATAGRAM_HEADER) ||
+			datagram.Header.Magic != CPCI429_DATAGRAM_MAGIC ||
+			datagram.Header.Version != CPCI429_DATAGRAM_VERSION ||
+			datagram.Header.Type != CPCI429_DATAGRAM_TX ||
+			datagram.Header.Board >= gateway->BoardCount ||
+			(size_t)length != sizeof(CPCI429_DATAGRAM_HEADER) + datagram.Header.Count * sizeof(CPCI429_DATAGRAM_WORD)) {
+			CPCI429GatewayCount(&gateway->Stats.BadDatagrams, 1);
+			continue;
+		}
+
+		CPCI429GatewaySubmit(gateway, &datagram.Header);
+	}
+
+	return NULL;
+}
+
+static
+int
+CPCI429GatewayOpenSockets(
+	_Inout_ PCPCI429_GATEWAY Gateway
+)
+{
+	struct sockaddr_in address;
+	struct timeval timeout = { 0, CPCI429_GATEWAY_RECEIVE_POLL_MS * 1000 };
+
+	Gateway->SendSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (Gateway->SendSocket < 0) {
+		return -errno;
+	}
+
+	if (Gateway->Config.ListenPort == 0) {
+		return 0;
+	}
+
+	Gateway->ListenSocket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (Gateway->ListenSocket < 0) {
+		return -errno;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(Gateway->Config.ListenPort);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	//
+	// The timeout lets the receive thread notice CPCI429GatewayStop.
+	//
+	if (setsockopt(Gateway->ListenSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+		bind(Gateway->ListenSocket, (const struct sockaddr*)&address, sizeof(address)) != 0) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+int
+CPCI429GatewayStart(
+	_In_ const CPCI429_GATEWAY_CONFIG *Config,
+	_In_reads_(HostCount) PCPCI429_HOST *Hosts,
+	_In_ ULONG HostCount,
+	_Out_ PCPCI429_GATEWAY *Gateway
+)
+{
+	PCPCI429_GATEWAY gateway;
+	ULONG i;
+	int status;
+
+	*Gateway = NULL;
+
+	if (HostCount == 0 || HostCount > CPCI429_GATEWAY_MAX_BOARDS ||
+		Config->EndpointCount > CPCI429_GATEWAY_MAX_ENDPOINTS) {
+		return -EINVAL;
+	}
+
+	gateway = (PCPCI429_GATEWAY)calloc(1, sizeof(*gateway));
+	if (gateway == NULL) {
+		return -ENOMEM;
+	}
+
+	gateway->Config = *Config;
+	gateway->BoardCount = HostCount;
+	gateway->SendSocket = -1;
+	gateway->ListenSocket = -1;
+	pthread_mutex_init(&gateway->SegmentLock, NULL);
+
+	for (i = 0; i < HostCount; i++) {
+		gateway->Boards[i].Gateway = gateway;
+		gateway->Boards[i].Host = Hosts[i];
+		gateway->Boards[i].Index = i;
+	}
+
+	status = CPCI429GatewayOpenSockets(gateway);
+	if (status == 0 && Config->SegmentName != NULL) {
+		status = CPCI429GatewayCreateSegment(gateway);
+	}
+	if (status != 0) {
+		CPCI429GatewayStop(gateway);
+		return status;
+	}
+
+	for (i = 0; i < HostCount; i++) {
+		status = -pthread_create(&gateway->Boards[i].Thread, NULL, CPCI429GatewayBoardThread, &gateway->Boards[i]);
+		if (status != 0) {
+			CPCI429GatewayStop(gateway);
+			return status;
+		}
+		gateway->Boards[i].Started = TRUE;
+	}
+
+	if (gateway->ListenSocket >= 0) {
+		status = -pthread_create(&gateway->ReceiveThread, NULL, CPCI429GatewayReceiveThread, gateway);
+		if (status != 0) {
+			CPCI429GatewayStop(gateway);
+			return status;
+		}
+		gateway->ReceiveStarted = TRUE;
+	}
+
+	*Gateway = gateway;
+
+	return 0;
+}
+
+void
+CPCI429GatewayStop(
+	_In_ PCPCI429_GATEWAY Gateway
+)
+{
+	ULONG i;
+
+	__atomic_store_n(&Gateway->Stopping, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < Gateway->BoardCount; i++) {
+		if (Gateway->Boards[i].Started) {
+			pthread_join(Gateway->Boards[i].Thread, NULL);
+		}
+	}
+	if (Gateway->ReceiveStarted) {
+		pthread_join(Gateway->ReceiveThread, NULL);
+	}
+
+	if (Gateway->Segment != NULL) {
+		munmap(Gateway->Segment, Gateway->SegmentBytes);
+		shm_unlink(Gateway->Config.SegmentName);
+	}
+	if (Gateway->ListenSocket >= 0) {
+		close(Gateway->ListenSocket);
+	}
+	if (Gateway->SendSocket >= 0) {
+		close(Gateway->SendSocket);
+	}
+
+	pthread_mutex_destroy(&Gateway->SegmentLock);
+	free(Gateway);
+}
+
+void
+CPCI429GatewayGetStats(
+	_In_ PCPCI429_GATEWAY Gateway,
+	_Out_ PCPCI429_GATEWAY_STATS Stats
+)
+{
+	Stats->DatagramsSent = __atomic_load_n(&Gateway->Stats.DatagramsSent, __ATOMIC_RELAXED);
+	Stats->WordsSent = __atomic_load_n(&Gateway->Stats.WordsSent, __ATOMIC_RELAXED);
+	Stats->SendErrors = __atomic_load_n(&Gateway->Stats.SendErrors, __ATOMIC_RELAXED);
+	Stats->Gaps = __atomic_load_n(&Gateway->Stats.Gaps, __ATOMIC_RELAXED);
+	Stats->GapWords = __atomic_load_n(&Gateway->Stats.GapWords, __ATOMIC_RELAXED);
+	Stats->GapsSaturated = __atomic_load_n(&Gateway->Stats.GapsSaturated, __ATOMIC_RELAXED);
+	Stats->DatagramsReceived = __atomic_load_n(&Gateway->Stats.DatagramsReceived, __ATOMIC_RELAXED);
+	Stats->WordsSubmitted = __atomic_load_n(&Gateway->Stats.WordsSubmitted, __ATOMIC_RELAXED);
+	Stats->WordsRejected = __atomic_load_n(&Gateway->Stats.WordsRejected, __ATOMIC_RELAXED);
+	Stats->BadDatagrams = __atomic_load_n(&Gateway->Stats.BadDatagrams, __ATOMIC_RELAXED);
+}
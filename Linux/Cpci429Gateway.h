@@ -0,0 +1,162 @@
+/*++
+
+Module Name:
+
+    cpci429gateway.h
+
+Abstract:
+
+    Gateway that opens each CPCI429 board once and republishes its
+    receive traffic to any number of local processes. Received words are
+    drained in batches and packed into datagrams of many timestamped
+    words, which go to a list of UDP endpoints and to a shared-memory
+    broadcast segment. Datagrams of type CPCI429_DATAGRAM_TX arriving on
+    the gateway's UDP port are submitted to the boards' transmitters.
+
+    The datagram and segment layouts below are the wire format for
+    clients. All fields are in host byte order; the gateway is meant for
+    loopback and same-host use.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#ifndef _CPCI429GATEWAY_H
+#define _CPCI429GATEWAY_H
+
+#include <netinet/in.h>
+
+#include "Cpci429Host.h"
+
+#define CPCI429_DATAGRAM_MAGIC   0x34323947     // 'G924'
+#define CPCI429_DATAGRAM_VERSION 2
+
+#define CPCI429_DATAGRAM_RX 0   // received words, gateway to clients
+#define CPCI429_DATAGRAM_TX 1   // words to transmit, clients to gateway
+
+#define CPCI429_DATAGRAM_BYTES 1472     // fits one Ethernet-sized UDP payload
+
+typedef struct _CPCI429_DATAGRAM_HEADER {
+	ULONG Magic;
+	UCHAR Version;
+	UCHAR Type;                 // CPCI429_DATAGRAM_*
+	USHORT Count;               // words that follow the header
+	ULONG Board;
+	ULONG Sequence;             // per board and type, gaps mean lost datagrams
+	ULONGLONG BaseTime;         // 100ns units, CLOCK_MONOTONIC
+} CPCI429_DATAGRAM_HEADER, *PCPCI429_DATAGRAM_HEADER;
+
+//
+// Stamp packs the channel and the word's time after BaseTime in 100ns
+// units. Flags is the record's CPCI429_RX_FLAG_* value, the count of
+// words lost in a gap included. TX datagrams only use the channel.
+//
+typedef struct _CPCI429_DATAGRAM_WORD {
+	ULONG Word;
+	ULONG Stamp;
+	ULONG Flags;
+} CPCI429_DATAGRAM_WORD, *PCPCI429_DATAGRAM_WORD;
+
+#define CPCI429_DATAGRAM_MAX_DELTA 0x1FFFFFFF  // 53.6 seconds
+#define CPCI429_DATAGRAM_STAMP(channel, delta) \
+	(((ULONG)(channel) << 29) | ((ULONG)(delta) & CPCI429_DATAGRAM_MAX_DELTA))
+#define CPCI429_DATAGRAM_CHANNEL(stamp) ((stamp) >> 29)
+#define CPCI429_DATAGRAM_DELTA(stamp)   ((stamp) & CPCI429_DATAGRAM_MAX_DELTA)
+
+#define CPCI429_DATAGRAM_MAX_WORDS \
+	((CPCI429_DATAGRAM_BYTES - sizeof(CPCI429_DATAGRAM_HEADER)) / sizeof(CPCI429_DATAGRAM_WORD))
+
+//
+// Shared-memory broadcast segment, created with shm_open. Datagram n,
+// counting from 0, is kept in slot n & (SlotCount - 1); Published is the
+// number of datagrams written. A slot's Sequence is n + 1 once datagram n
+// is complete in it and 0 while it is rewritten, so a copy is valid only
+// if Sequence reads n + 1 both before and after it.
+//
+#define CPCI429_SEGMENT_MAGIC 0x34323953    // 'S924'
+
+typedef struct _CPCI429_GATEWAY_SEGMENT {
+	ULONG Magic;
+	ULONG SlotCount;            // power of two
+	ULONG SlotBytes;
+	ULONG SlotOffset;           // bytes from the start of the segment to slot 0
+	volatile ULONGLONG Published;
+} CPCI429_GATEWAY_SEGMENT, *PCPCI429_GATEWAY_SEGMENT;
+
+typedef struct _CPCI429_SEGMENT_SLOT {
+	volatile ULONGLONG Sequence;
+	ULONG Length;
+	ULONG Reserved;
+	UCHAR Datagram[CPCI429_DATAGRAM_BYTES];
+} CPCI429_SEGMENT_SLOT, *PCPCI429_SEGMENT_SLOT;
+
+#define CPCI429_SEGMENT_SLOT_AT(segment, n) \
+	((PCPCI429_SEGMENT_SLOT)((PUCHAR)(segment) + (segment)->SlotOffset) + ((n) & ((segment)->SlotCount - 1)))
+
+#define CPCI429_GATEWAY_MAX_BOARDS    8
+#define CPCI429_GATEWAY_MAX_ENDPOINTS 8
+#define CPCI429_GATEWAY_DEFAULT_SLOTS 1024
+
+typedef struct _CPCI429_GATEWAY_CONFIG {
+	ULONG EndpointCount;
+	struct sockaddr_in Endpoints[CPCI429_GATEWAY_MAX_ENDPOINTS];
+	USHORT ListenPort;          // inbound TX datagrams on 127.0.0.1, 0 for none
+	const char *SegmentName;    // shm_open name such as "/cpci429", NULL for none
+	ULONG SegmentSlots;         // power of two, 0 for the default
+	int ServiceTimeoutMs;       // longest a partial batch waits, 0 for 1 ms
+} CPCI429_GATEWAY_CONFIG, *PCPCI429_GATEWAY_CONFIG;
+
+typedef struct _CPCI429_GATEWAY_STATS {
+	ULONGLONG DatagramsSent;    // RX datagrams built, whatever the endpoint count
+	ULONGLONG WordsSent;
+	ULONGLONG SendErrors;
+	ULONGLONG Gaps;             // RX words tagged CPCI429_RX_FLAG_GAP
+	ULONGLONG GapWords;         // words lost in the unsaturated ones, by their tags
+	ULONGLONG GapsSaturated;    // tagged 0xFFFF, size unknown
+	ULONGLONG DatagramsReceived;
+	ULONGLONG WordsSubmitted;   // accepted by a transmit FIFO
+	ULONGLONG WordsRejected;    // transmit FIFO full
+	ULONGLONG BadDatagrams;
+} CPCI429_GATEWAY_STATS, *PCPCI429_GATEWAY_STATS;
+
+typedef struct _CPCI429_GATEWAY CPCI429_GATEWAY, *PCPCI429_GATEWAY;
+
+//
+// Starts one service thread per board and, with a ListenPort, a receive
+// thread. Board i of the datagrams is Hosts[i]. The hosts stay owned by
+// the caller and must outlive the gateway. Returns 0 or a negative errno.
+//
+int
+CPCI429GatewayStart(
+	_In_ const CPCI429_GATEWAY_CONFIG *Config,
+	_In_reads_(HostCount) PCPCI429_HOST *Hosts,
+	_In_ ULONG HostCount,
+	_Out_ PCPCI429_GATEWAY *Gateway
+);
+
+void
+CPCI429GatewayStop(
+	_In_ PCPCI429_GATEWAY Gateway
+);
+
+void
+CPCI429GatewayGetStats(
+	_In_ PCPCI429_GATEWAY Gateway,
+	_Out_ PCPCI429_GATEWAY_STATS Stats
+);
+
+//
+// Client side: copies datagram Sequence out of a mapped segment. Returns
+// 0, -EAGAIN if it is not published yet or -ESTALE if it was overwritten.
+//
+int
+CPCI429GatewaySegmentRead(
+	_In_ const CPCI429_GATEWAY_SEGMENT *Segment,
+	_In_ ULONGLONG Sequence,
+	_Out_writes_bytes_(CPCI429_DATAGRAM_BYTES) void *Datagram,
+	_Out_ size_t *Length
+);
+
+#endif // _CPCI429GATEWAY_H
@@ -0,0 +1,432 @@
+/*++
+
+Module Name:
+
+    cpci429gatewaymain.c
+
+Abstract:
+
+    Command line front end of the gateway. Opens the listed boards,
+    starts the gateway and prints datagram and word rates once a second
+    until interrupted.
+
+        cpci429gw [--uio /dev/uioN | --vfio GROUP DEVICE | --fake FILE]...
+                  [--to PORT]... [--listen PORT] [--shm NAME] [--batch-ms N]
+        cpci429gw --sim BOARDS [--seconds S] [--labels N] [--fifo N] [--pace X]
+                  [--stall-ms N --stall-every-ms N]
+                  [--to PORT]... [--listen PORT] [--shm NAME] [--batch-ms N]
+
+    --fake uses FILE as a polled BAR0, for a board model in another
+    process. Endpoints given with --to are loopback UDP ports.
+
+    --sim serves BOARDS simulated boards (Cpci429Sim.h) instead, for
+    --seconds of simulated time (default 10), free running or --pace
+    times real time. Receive channels 0-5 hear a 100 kbps and channel 6
+    a 12.5 kbps source of --labels labels each (default 32); channel 7
+    hears transmit channel 0 of the previous board, which TX datagrams
+    sent to --listen can drive. --fifo sets the boards' FIFO depth, and
+    --stall-ms stops the gateway draining for that long out of every
+    --stall-every-ms, so that a shallow FIFO overruns. Rates are printed
+    for every simulated second, then the totals. The run fails unless
+    the gateway forwarded every word the boards received and, with
+    --stall-ms, tagged every word they lost in the datagrams.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "Cpci429Gateway.h"
+#include "Cpci429Sim.h"
+
+static volatile sig_atomic_t Interrupted;
+
+static
+void
+CPCI429GatewaySignal(
+	int Signal
+)
+{
+	(void)Signal;
+	Interrupted = 1;
+}
+
+static
+int
+CPCI429GatewayUsage(
+	void
+)
+{
+	fprintf(stderr,
+		"usage: cpci429gw [--uio /dev/uioN | --vfio GROUP DEVICE | --fake FILE]...\n"
+		"                 [--to PORT]... [--listen PORT] [--shm NAME] [--batch-ms N]\n"
+		"       cpci429gw --sim BOARDS [--seconds S] [--labels N] [--fifo N] [--pace X]\n"
+		"                 [--stall-ms N --stall-every-ms N]\n"
+		"                 [--to PORT]... [--listen PORT] [--shm NAME] [--batch-ms N]\n");
+	return 2;
+}
+
+static
+double
+CPCI429GatewaySeconds(
+	void
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+static
+void
+CPCI429GatewayReport(
+	_In_ const CPCI429_GATEWAY_STATS *Last,
+	_In_ const CPCI429_GATEWAY_STATS *Stats,
+	_In_ double Elapsed
+)
+{
+	printf("out %.0f datagrams/s %.0f words/s, in %.0f datagrams/s %.0f words/s, "
+		"%llu send errors, %llu rejected, %llu bad\n",
+		(double)(Stats->DatagramsSent - Last->DatagramsSent) / Elapsed,
+		(double)(Stats->WordsSent - Last->WordsSent) / Elapsed,
+		(double)(Stats->DatagramsReceived - Last->DatagramsReceived) / Elapsed,
+		(double)(Stats->WordsSubmitted - Last->WordsSubmitted) / Elapsed,
+		(unsigned long long)Stats->SendErrors,
+		(unsigned long long)Stats->WordsRejected,
+		(unsigned long long)Stats->BadDatagrams);
+	fflush(stdout);
+}
+
+static
+int
+CPCI429GatewaySimBoards(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ ULONG LabelCount,
+	_Out_ PCPCI429_SIM *Sim,
+	_Out_writes_(Config->BoardCount) PCPCI429_HOST *Hosts,
+	_Out_ PULONG HostCount
+)
+/*++
+
+Routine Description:
+
+    Builds the simulated system described in the header and opens its
+    boards. On failure the hosts opened so far are left in Hosts for the
+    caller to close before destroying the simulator.
+
+--*/
+{
+	CPCI429_SIM_LABEL labels[256];
+	CPCI429_CHANNEL_CONFIG channelConfig;
+	CPCI429_HOST_MODEL model;
+	ULONG board;
+	ULONG channel;
+	ULONG i;
+	int status;
+
+	*HostCount = 0;
+
+	status = CPCI429SimCreate(Config, Sim);
+
+	for (board = 0; board < Config->BoardCount && status == 0; board++) {
+		for (channel = 0; channel < 7 && status == 0; channel++) {
+			for (i = 0; i < LabelCount; i++) {
+				labels[i].Word = (board << 16) | (channel << 8) | i;
+				labels[i].PeriodUs = (20000 + (i * 7919 + channel * 104729) % 80000) * (channel == 6 ? 8 : 1);
+				labels[i].OffsetUs = (i * 1237 + board * 97) % 20000;
+			}
+			status = CPCI429SimAddSource(*Sim, board, channel, channel != 6, labels, LabelCount);
+		}
+		if (status == 0) {
+			status = CPCI429SimConnect(*Sim, (board + Config->BoardCount - 1) % Config->BoardCount, 0, board, 7);
+		}
+	}
+
+	memset(&channelConfig, 0, sizeof(channelConfig));
+	channelConfig.Enable = TRUE;
+
+	for (board = 0; board < Config->BoardCount && status == 0; board++) {
+		status = CPCI429SimBoardModel(*Sim, board, &model);
+		if (status == 0) {
+			status = CPCI429HostOpenModel(&model, &Hosts[*HostCount]);
+			*HostCount += status == 0;
+		}
+
+		for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS && status == 0; channel++) {
+			channelConfig.Direction = CPCI429_DIRECTION_RX;
+			channelConfig.Channel = channel;
+			channelConfig.Speed = channel == 6 ? CPCI429_SPEED_LOW : CPCI429_SPEED_HIGH;
+			status = CPCI429HostIoctl(Hosts[board], CPCI429_IOCTL_SET_CHANNEL_CONFIG,
+				&channelConfig, sizeof(channelConfig), NULL, 0, NULL);
+		}
+		if (status == 0) {
+			channelConfig.Direction = CPCI429_DIRECTION_TX;
+			channelConfig.Channel = 0;
+			channelConfig.Speed = CPCI429_SPEED_HIGH;
+			status = CPCI429HostIoctl(Hosts[board], CPCI429_IOCTL_SET_CHANNEL_CONFIG,
+				&channelConfig, sizeof(channelConfig), NULL, 0, NULL);
+		}
+	}
+
+	return status;
+}
+
+static
+int
+CPCI429GatewaySimRun(
+	_In_ PCPCI429_SIM Sim,
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ PCPCI429_GATEWAY Gateway,
+	_In_ double Seconds
+)
+/*++
+
+Routine Description:
+
+    Runs the simulator a second at a time while the gateway serves its
+    boards, then checks the words and gaps the gateway forwarded against
+    what the boards received and lost.
+
+--*/
+{
+	CPCI429_SIM_STATS simStats;
+	CPCI429_GATEWAY_STATS first;
+	CPCI429_GATEWAY_STATS last;
+	CPCI429_GATEWAY_STATS stats;
+	ULONGLONG durationUs = (ULONGLONG)(Seconds * 1e6);
+	ULONGLONG doneUs;
+	double start;
+	double lastTime;
+	double now;
+	double elapsed;
+	int waitMs;
+
+	//
+	// End a quantum past a stall, so that the words of the last one are
+	// drained.
+	//
+	if (Config->StallEveryUs != 0) {
+		durationUs = (durationUs + Config->StallEveryUs - 1) / Config->StallEveryUs * Config->StallEveryUs +
+			Config->StallUs + 1000;
+	}
+
+	CPCI429GatewayGetStats(Gateway, &first);
+	last = stats = first;
+	start = lastTime = CPCI429GatewaySeconds();
+
+	for (doneUs = 0; doneUs < durationUs && !Interrupted; doneUs += 1000000) {
+		CPCI429SimRun(Sim, durationUs - doneUs < 1000000 ? durationUs - doneUs : 1000000);
+
+		CPCI429GatewayGetStats(Gateway, &stats);
+		now = CPCI429GatewaySeconds();
+		CPCI429GatewayReport(&last, &stats, now - lastTime);
+		last = stats;
+		lastTime = now;
+	}
+
+	//
+	// The boards' last step is drained into the host rings, but the
+	// gateway may not have read it yet.
+	//
+	CPCI429SimGetStats(Sim, &simStats);
+	for (waitMs = 0; waitMs < 1000 && stats.WordsSent - first.WordsSent < simStats.WordsReceived; waitMs++) {
+		usleep(1000);
+		CPCI429GatewayGetStats(Gateway, &stats);
+	}
+	elapsed = CPCI429GatewaySeconds() - start;
+
+	printf("%u boards, %.1f s simulated in %.3f s: %.1fx real time\n",
+		Config->BoardCount, (double)simStats.SimulatedNs / 1e9, (double)simStats.WallNs / 1e9,
+		(double)simStats.SimulatedNs / (double)simStats.WallNs);
+	printf("forwarded %llu of %llu words received in %llu datagrams, %.1f words each: "
+		"%.0f words/s, %.0f datagrams/s\n",
+		(unsigned long long)(stats.WordsSent - first.WordsSent), (unsigned long long)simStats.WordsReceived,
+		(unsigned long long)(stats.DatagramsSent - first.DatagramsSent),
+		stats.DatagramsSent != first.DatagramsSent ?
+			(double)(stats.WordsSent - first.WordsSent) / (double)(stats.DatagramsSent - first.DatagramsSent) : 0,
+		(double)(stats.WordsSent - first.WordsSent) / elapsed,
+		(double)(stats.DatagramsSent - first.DatagramsSent) / elapsed);
+
+	if (Interrupted) {
+		return 0;
+	}
+
+	if (stats.WordsSent - first.WordsSent != simStats.WordsReceived) {
+		fprintf(stderr, "cpci429gw: words went missing between the boards and the datagrams\n");
+		return -EIO;
+	}
+
+	if (Config->StallEveryUs != 0) {
+		printf("host stalled %u of every %u ms: boards lost %llu words, datagrams tagged %llu gaps, "
+			"%llu saturated, the rest of %llu words\n",
+			Config->StallUs / 1000, Config->StallEveryUs / 1000, (unsigned long long)simStats.WordsOverrun,
+			(unsigned long long)(stats.Gaps - first.Gaps),
+			(unsigned long long)(stats.GapsSaturated - first.GapsSaturated),
+			(unsigned long long)(stats.GapWords - first.GapWords));
+
+		//
+		// A saturated tag does not give its gap's size, so the others
+		// add up exactly only when there are none.
+		//
+		if (stats.GapWords - first.GapWords > simStats.WordsOverrun ||
+			(stats.GapsSaturated == first.GapsSaturated && stats.GapWords - first.GapWords != simStats.WordsOverrun) ||
+			(simStats.Overruns != 0 && stats.Gaps == first.Gaps)) {
+			fprintf(stderr, "cpci429gw: FIFO losses went untagged\n");
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(
+	int argc,
+	char **argv
+)
+{
+	CPCI429_GATEWAY_CONFIG config;
+	CPCI429_SIM_CONFIG simConfig;
+	PCPCI429_SIM sim = NULL;
+	PCPCI429_HOST hosts[CPCI429_GATEWAY_MAX_BOARDS];
+	ULONG hostCount = 0;
+	ULONG labelCount = 32;
+	double seconds = 10;
+	PCPCI429_GATEWAY gateway;
+	CPCI429_GATEWAY_STATS last;
+	CPCI429_GATEWAY_STATS stats;
+	double lastTime;
+	int status = 0;
+	int i;
+
+	memset(&config, 0, sizeof(config));
+	memset(&simConfig, 0, sizeof(simConfig));
+
+	for (i = 1; i < argc && status == 0; i++) {
+		const char *option = argv[i];
+
+		if ((hostCount == CPCI429_GATEWAY_MAX_BOARDS || simConfig.BoardCount != 0) &&
+			(!strcmp(option, "--uio") || !strcmp(option, "--vfio") || !strcmp(option, "--fake"))) {
+			status = -EINVAL;
+		} else if (!strcmp(option, "--uio") && i + 1 < argc) {
+			status = CPCI429HostOpenUio(argv[++i], &hosts[hostCount]);
+			hostCount += status == 0;
+		} else if (!strcmp(option, "--vfio") && i + 2 < argc) {
+			status = CPCI429HostOpenVfio(argv[i + 1], argv[i + 2], &hosts[hostCount]);
+			hostCount += status == 0;
+			i += 2;
+		} else if (!strcmp(option, "--fake") && i + 1 < argc) {
+			status = CPCI429HostOpenFake(argv[++i], -1, &hosts[hostCount]);
+			hostCount += status == 0;
+		} else if (!strcmp(option, "--sim") && i + 1 < argc && hostCount == 0) {
+			simConfig.BoardCount = (ULONG)atoi(argv[++i]);
+			if (simConfig.BoardCount == 0 || simConfig.BoardCount > CPCI429_GATEWAY_MAX_BOARDS) {
+				status = -EINVAL;
+			}
+		} else if (!strcmp(option, "--seconds") && i + 1 < argc) {
+			seconds = atof(argv[++i]);
+		} else if (!strcmp(option, "--labels") && i + 1 < argc) {
+			labelCount = (ULONG)atoi(argv[++i]);
+			if (labelCount == 0 || labelCount > 256) {
+				status = -EINVAL;
+			}
+		} else if (!strcmp(option, "--fifo") && i + 1 < argc) {
+			simConfig.FifoWords = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(option, "--pace") && i + 1 < argc) {
+			simConfig.Speedup = atof(argv[++i]);
+		} else if (!strcmp(option, "--stall-ms") && i + 1 < argc) {
+			simConfig.StallUs = (ULONG)atoi(argv[++i]) * 1000;
+		} else if (!strcmp(option, "--stall-every-ms") && i + 1 < argc) {
+			simConfig.StallEveryUs = (ULONG)atoi(argv[++i]) * 1000;
+		} else if (!strcmp(option, "--to") && i + 1 < argc && config.EndpointCount < CPCI429_GATEWAY_MAX_ENDPOINTS) {
+			struct sockaddr_in *endpoint = &config.Endpoints[config.EndpointCount++];
+
+			endpoint->sin_family = AF_INET;
+			endpoint->sin_port = htons((USHORT)atoi(argv[++i]));
+			endpoint->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		} else if (!strcmp(option, "--listen") && i + 1 < argc) {
+			config.ListenPort = (USHORT)atoi(argv[++i]);
+		} else if (!strcmp(option, "--shm") && i + 1 < argc) {
+			config.SegmentName = argv[++i];
+		} else if (!strcmp(option, "--batch-ms") && i + 1 < argc) {
+			config.ServiceTimeoutMs = atoi(argv[++i]);
+		} else {
+			status = -EINVAL;
+		}
+
+		if (status != 0) {
+			fprintf(stderr, "cpci429gw: %s: %s\n", option, strerror(-status));
+		}
+	}
+
+	if (status == 0 && simConfig.BoardCount != 0) {
+		if (seconds <= 0 || (simConfig.StallEveryUs != 0 && simConfig.StallUs >= simConfig.StallEveryUs) ||
+			(simConfig.StallUs != 0 && simConfig.StallEveryUs == 0)) {
+			status = CPCI429GatewayUsage();
+		} else {
+			status = CPCI429GatewaySimBoards(&simConfig, labelCount, &sim, hosts, &hostCount);
+			if (status != 0) {
+				fprintf(stderr, "cpci429gw: simulator: %s\n", strerror(-status));
+			}
+		}
+	} else if (status == 0 && hostCount == 0) {
+		status = CPCI429GatewayUsage();
+	}
+
+	if (status == 0) {
+		status = CPCI429GatewayStart(&config, hosts, hostCount, &gateway);
+		if (status != 0) {
+			fprintf(stderr, "cpci429gw: %s\n", strerror(-status));
+		}
+	}
+
+	if (status == 0) {
+		signal(SIGINT, CPCI429GatewaySignal);
+		signal(SIGTERM, CPCI429GatewaySignal);
+
+		if (sim != NULL) {
+			status = CPCI429GatewaySimRun(sim, &simConfig, gateway, seconds);
+		}
+
+		CPCI429GatewayGetStats(gateway, &last);
+		lastTime = CPCI429GatewaySeconds();
+
+		while (sim == NULL && !Interrupted) {
+			double now;
+
+			sleep(1);
+
+			CPCI429GatewayGetStats(gateway, &stats);
+			now = CPCI429GatewaySeconds();
+			CPCI429GatewayReport(&last, &stats, now - lastTime);
+
+			last = stats;
+			lastTime = now;
+		}
+
+		CPCI429GatewayStop(gateway);
+	}
+
+	while (hostCount > 0) {
+		CPCI429HostClose(hosts[--hostCount]);
+	}
+	if (sim != NULL) {
+		CPCI429SimDestroy(sim);
+	}
+
+	return status < 0 ? 1 : status;
+}
@@ -0,0 +1,1639 @@
+/*++
+
+Module Name:
+
+    cpci429host.c
+
+Abstract:
+
+    Linux user-mode backend for the CPCI429 board: device access through
+    UIO, VFIO, a fake BAR file or an in-process board model, interrupt
+    servicing and the subset of the driver's IOCTLs that does not depend
+    on kernel-only machinery. Words go from the FIFOs to the rings through
+    the driver's own receive path (RxPath.h).
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/vfio.h>
+
+#include "Cpci429Host.h"
+
+#define CPCI429_HOST_UIO    0
+#define CPCI429_HOST_VFIO   1
+#define CPCI429_HOST_FAKE   2
+#define CPCI429_HOST_INPROC 3           // board model, CPCI429HostOpenModel
+
+#define CPCI429_HOST_FIFO_HIGH_WATER 64 // FIFO fill at which draining goes to bursts
+#define CPCI429_HOST_HEALTH_INTERVAL 100000 // staleness checks, 100ns units
+#define CPCI429_HOST_NO_CHANNEL      (-1)   // BulkTxChannel while no transfer runs
+
+//
+// Receive ring and label table of one channel, as on the driver's
+// RX_CHANNEL. The service thread is the only producer and the only
+// writer of Fifo and the label values; readers serialize on Lock, as on
+// the driver's ConsumerLock. Limits, the watch list and the on-change
+// settings are written under the host's ControlLock.
+//
+typedef struct _CPCI429_HOST_CHANNEL {
+	CPCI429_RX_RECORD Ring[CPCI429_HOST_RING_WORDS];
+	ULONG Head;
+	ULONG Tail;
+	pthread_mutex_t Lock;
+
+	LABEL_ENTRY Labels[CPCI429_LABEL_SDI_COUNT];
+	USHORT StaleWatch[CPCI429_MAX_STALE_WATCH];
+	LONG StaleWatchCount;
+	ULONG OnChangeMask[256 / 32];
+	ULONGLONG HeartbeatInterval;    // 100ns units
+	RX_FIFO_STATE Fifo;
+
+	ULONGLONG WordsReceived;
+	ULONGLONG WordsQueued;
+	ULONGLONG RingOverflows;
+	ULONGLONG WordsSuppressed;
+	ULONGLONG Heartbeats;
+	ULONGLONG ParityErrors;
+	ULONGLONG SsmFailures;
+	ULONGLONG GapViolations;
+	ULONGLONG StaleAlarms;
+	ULONGLONG FifoOverruns;
+	ULONGLONG FifoWordsLost;
+	ULONGLONG BurstDrains;
+} CPCI429_HOST_CHANNEL, *PCPCI429_HOST_CHANNEL;
+
+struct _CPCI429_HOST {
+	int Kind;                   // CPCI429_HOST_*
+	int DeviceFd;
+	int GroupFd;
+	int ContainerFd;
+	int InterruptFd;
+	ULONG VfioIrqIndex;
+	PVOID Bar;
+	size_t BarSize;
+	ULONG PhysicalAddress;
+	ULONG OffsetAddressFromApp;
+	CPCI429_HOST_MODEL Model;
+	CPCI429_HOST_CHANNEL RxChannels[CPCI429_MAX_RX_CHANNELS];
+	pthread_mutex_t ControlLock;    // serializes configuration, like the control queue
+
+	//
+	// Health alarms not yet handed to a CPCI429_IOCTL_WAIT_HEALTH_ALARM
+	// caller, oldest first. HealthChecked is the time of the last
+	// staleness check, made from the service thread. HealthRaised, on
+	// CLOCK_MONOTONIC, is also broadcast when close sets HealthClosing and
+	// when a waiter leaves, so close can wait for HealthWaiters to drain.
+	//
+	pthread_mutex_t HealthLock;
+	pthread_cond_t HealthRaised;
+	CPCI429_HEALTH_EVENT HealthEvents[64];
+	ULONG HealthEventFirst;
+	ULONG HealthEventCount;
+	ULONGLONG HealthEventsDropped;
+	ULONGLONG HealthChecked;
+	BOOLEAN HealthClosing;
+	ULONG HealthWaiters;
+
+	//
+	// Loopback self-test. The CPCI429_IOCTL_SELF_TEST caller publishes the
+	// run in SelfTest and waits on SelfTestEnded; the service thread pumps
+	// it, checks the looped words and sets SelfTestOver once the grace
+	// period is up, after which it no longer touches the run.
+	// SelfTestChannels holds the transmit channels the run owns.
+	//
+	pthread_mutex_t SelfTestLock;
+	pthread_cond_t SelfTestEnded;
+	PSELF_TEST volatile SelfTest;
+	BOOLEAN SelfTestOver;
+	volatile LONG SelfTestChannels;
+	ULONGLONG SelfTestDrains;
+	ULONGLONG SelfTestDrainTicks;
+
+	//
+	// Bulk transfer, run the same way: the CPCI429_IOCTL_BULK_TRANSFER
+	// caller publishes the sender in Bulk and waits on BulkEnded; the
+	// service thread feeds it the handshake words, pumps it and sets
+	// BulkOver once it is done. BulkTxChannel is the transmit channel the
+	// transfer owns. BulkStatus, the last finished transfer, is guarded
+	// by BulkLock.
+	//
+	pthread_mutex_t BulkLock;
+	pthread_cond_t BulkEnded;
+	PBULK_SENDER volatile Bulk;
+	BOOLEAN BulkOver;
+	volatile LONG BulkTxChannel;
+	CPCI429_BULK_STATUS BulkStatus;
+};
+
+static
+PCPCI429_HOST
+CPCI429HostAllocate(
+	int Kind
+)
+{
+	pthread_condattr_t clock;
+	PCPCI429_HOST host;
+	ULONG i;
+
+	host = (PCPCI429_HOST)calloc(1, sizeof(*host));
+	if (host == NULL) {
+		return NULL;
+	}
+
+	host->Kind = Kind;
+	host->DeviceFd = -1;
+	host->GroupFd = -1;
+	host->ContainerFd = -1;
+	host->InterruptFd = -1;
+	host->Bar = MAP_FAILED;
+	host->BulkTxChannel = CPCI429_HOST_NO_CHANNEL;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		pthread_mutex_init(&host->RxChannels[i].Lock, NULL);
+	}
+	pthread_mutex_init(&host->ControlLock, NULL);
+	pthread_mutex_init(&host->HealthLock, NULL);
+	pthread_condattr_init(&clock);
+	pthread_condattr_setclock(&clock, CLOCK_MONOTONIC);
+	pthread_cond_init(&host->HealthRaised, &clock);
+	pthread_condattr_destroy(&clock);
+	pthread_mutex_init(&host->SelfTestLock, NULL);
+	pthread_cond_init(&host->SelfTestEnded, NULL);
+	pthread_mutex_init(&host->BulkLock, NULL);
+	pthread_cond_init(&host->BulkEnded, NULL);
+
+	return host;
+}
+
+static
+int
+CPCI429HostMapBar(
+	_Inout_ PCPCI429_HOST Host,
+	_In_ int Fd,
+	_In_ off_t Offset,
+	_In_ size_t Size
+)
+{
+	if (Size < CPCI429_BAR0_SIZE) {
+		return -ENXIO;
+	}
+
+	Host->Bar = mmap(NULL, Size, PROT_READ | PROT_WRITE, MAP_SHARED, Fd, Offset);
+	if (Host->Bar == MAP_FAILED) {
+		return -errno;
+	}
+	Host->BarSize = Size;
+
+	return 0;
+}
+
+static
+int
+CPCI429HostReadSysfs(
+	_In_ const char *Path,
+	_Out_ unsigned long long *Value
+)
+{
+	FILE *file = fopen(Path, "r");
+	int matched;
+
+	if (file == NULL) {
+		return -errno;
+	}
+	matched = fscanf(file, "%llx", Value);
+	fclose(file);
+
+	return matched == 1 ? 0 : -EINVAL;
+}
+
+static
+int
+CPCI429HostStart(
+	_Inout_ PCPCI429_HOST Host,
+	_Out_ PCPCI429_HOST *Result
+)
+{
+	ULONG channel;
+
+	for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+		CPCI429RegRxLostSince(Host->Bar, channel, &Host->RxChannels[channel].Fifo.Lost);
+	}
+
+	CPCI429RegEnableRxInterrupts(Host->Bar, CPCI429_INT_RX_MASK);
+	*Result = Host;
+
+	return 0;
+}
+
+int
+CPCI429HostOpenUio(
+	_In_ const char *UioDevice,
+	_Out_ PCPCI429_HOST *Host
+)
+{
+	PCPCI429_HOST host;
+	const char *name = strrchr(UioDevice, '/');
+	char path[PATH_MAX];
+	unsigned long long size = 0;
+	unsigned long long address = 0;
+	int status;
+
+	*Host = NULL;
+	name = name != NULL ? name + 1 : UioDevice;
+
+	host = CPCI429HostAllocate(CPCI429_HOST_UIO);
+	if (host == NULL) {
+		return -ENOMEM;
+	}
+
+	host->DeviceFd = open(UioDevice, O_RDWR | O_CLOEXEC);
+	if (host->DeviceFd < 0) {
+		status = -errno;
+		goto Fail;
+	}
+	host->InterruptFd = host->DeviceFd;
+
+	snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/size", name);
+	if (CPCI429HostReadSysfs(path, &size) == 0) {
+		snprintf(path, sizeof(path), "/sys/class/uio/%s/maps/map0/addr", name);
+		CPCI429HostReadSysfs(path, &address);
+		status = CPCI429HostMapBar(host, host->DeviceFd, 0, (size_t)size);
+	} else {
+		struct stat info;
+		int barFd;
+
+		//
+		// uio_pci_generic only forwards interrupts; BAR0 is mapped
+		// through the PCI device's sysfs resource file.
+		//
+		snprintf(path, sizeof(path), "/sys/class/uio/%s/device/resource0", name);
+		barFd = open(path, O_RDWR | O_CLOEXEC);
+		if (barFd < 0) {
+			status = -errno;
+			goto Fail;
+		}
+		status = fstat(barFd, &info) == 0 ? CPCI429HostMapBar(host, barFd, 0, (size_t)info.st_size) : -errno;
+		close(barFd);
+	}
+	if (status != 0) {
+		goto Fail;
+	}
+
+	host->PhysicalAddress = (ULONG)address;
+
+	return CPCI429HostStart(host, Host);
+
+Fail:
+	CPCI429HostClose(host);
+	return status;
+}
+
+static
+int
+CPCI429HostVfioSetIrq(
+	_In_ PCPCI429_HOST Host,
+	_In_ ULONG Index,
+	_In_ ULONG Flags,
+	_In_ int Fd
+)
+{
+	char buffer[sizeof(struct vfio_irq_set) + sizeof(int)];
+	struct vfio_irq_set *set = (struct vfio_irq_set*)buffer;
+
+	set->argsz = (Flags & VFIO_IRQ_SET_DATA_EVENTFD) ? sizeof(buffer) : sizeof(*set);
+	set->flags = Flags;
+	set->index = Index;
+	set->start = 0;
+	set->count = 1;
+	memcpy(set->data, &Fd, sizeof(Fd));
+
+	return ioctl(Host->DeviceFd, VFIO_DEVICE_SET_IRQS, set) == 0 ? 0 : -errno;
+}
+
+int
+CPCI429HostOpenVfio(
+	_In_ const char *GroupPath,
+	_In_ const char *DeviceName,
+	_Out_ PCPCI429_HOST *Host
+)
+{
+	PCPCI429_HOST host;
+	struct vfio_group_status groupStatus = { .argsz = sizeof(groupStatus) };
+	struct vfio_region_info region = { .argsz = sizeof(region), .index = VFIO_PCI_BAR0_REGION_INDEX };
+	struct vfio_irq_info irq = { .argsz = sizeof(irq), .index = VFIO_PCI_MSI_IRQ_INDEX };
+	int status;
+
+	*Host = NULL;
+
+	host = CPCI429HostAllocate(CPCI429_HOST_VFIO);
+	if (host == NULL) {
+		return -ENOMEM;
+	}
+
+	host->ContainerFd = open("/dev/vfio/vfio", O_RDWR | O_CLOEXEC);
+	host->GroupFd = open(GroupPath, O_RDWR | O_CLOEXEC);
+	if (host->ContainerFd < 0 || host->GroupFd < 0) {
+		status = -errno;
+		goto Fail;
+	}
+	if (ioctl(host->ContainerFd, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+		ioctl(host->GroupFd, VFIO_GROUP_GET_STATUS, &groupStatus) != 0 ||
+		!(groupStatus.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		status = -ENODEV;
+		goto Fail;
+	}
+	if (ioctl(host->GroupFd, VFIO_GROUP_SET_CONTAINER, &host->ContainerFd) != 0 ||
+		ioctl(host->ContainerFd, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU) != 0) {
+		status = -errno;
+		goto Fail;
+	}
+
+	host->DeviceFd = ioctl(host->GroupFd, VFIO_GROUP_GET_DEVICE_FD, DeviceName);
+	if (host->DeviceFd < 0) {
+		status = -errno;
+		goto Fail;
+	}
+
+	if (ioctl(host->DeviceFd, VFIO_DEVICE_GET_REGION_INFO, &region) != 0) {
+		status = -errno;
+		goto Fail;
+	}
+	if (!(region.flags & VFIO_REGION_INFO_FLAG_MMAP)) {
+		status = -ENOTSUP;
+		goto Fail;
+	}
+	status = CPCI429HostMapBar(host, host->DeviceFd, (off_t)region.offset, (size_t)region.size);
+	if (status != 0) {
+		goto Fail;
+	}
+
+	host->InterruptFd = eventfd(0, EFD_CLOEXEC);
+	if (host->InterruptFd < 0) {
+		status = -errno;
+		goto Fail;
+	}
+
+	host->VfioIrqIndex = VFIO_PCI_MSI_IRQ_INDEX;
+	if (ioctl(host->DeviceFd, VFIO_DEVICE_GET_IRQ_INFO, &irq) != 0 || irq.count == 0) {
+		host->VfioIrqIndex = VFIO_PCI_INTX_IRQ_INDEX;
+	}
+	status = CPCI429HostVfioSetIrq(host, host->VfioIrqIndex,
+		VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER, host->InterruptFd);
+	if (status != 0) {
+		goto Fail;
+	}
+
+	return CPCI429HostStart(host, Host);
+
+Fail:
+	CPCI429HostClose(host);
+	return status;
+}
+
+int
+CPCI429HostOpenFake(
+	_In_ const char *BarFile,
+	_In_ int InterruptFd,
+	_Out_ PCPCI429_HOST *Host
+)
+{
+	PCPCI429_HOST host;
+	struct stat info;
+	int status;
+
+	*Host = NULL;
+
+	host = CPCI429HostAllocate(CPCI429_HOST_FAKE);
+	if (host == NULL) {
+		return -ENOMEM;
+	}
+
+	host->DeviceFd = open(BarFile, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (host->DeviceFd < 0 || fstat(host->DeviceFd, &info) != 0) {
+		status = -errno;
+		goto Fail;
+	}
+	if (info.st_size < CPCI429_BAR0_SIZE && ftruncate(host->DeviceFd, CPCI429_BAR0_SIZE) != 0) {
+		status = -errno;
+		goto Fail;
+	}
+
+	status = CPCI429HostMapBar(host, host->DeviceFd, 0,
+		info.st_size < CPCI429_BAR0_SIZE ? CPCI429_BAR0_SIZE : (size_t)info.st_size);
+	if (status != 0) {
+		goto Fail;
+	}
+
+	host->InterruptFd = InterruptFd;
+
+	return CPCI429HostStart(host, Host);
+
+Fail:
+	CPCI429HostClose(host);
+	return status;
+}
+
+int
+CPCI429HostOpenModel(
+	_In_ const CPCI429_HOST_MODEL *Model,
+	_Out_ PCPCI429_HOST *Host
+)
+{
+	PCPCI429_HOST host;
+
+	*Host = NULL;
+
+	host = CPCI429HostAllocate(CPCI429_HOST_INPROC);
+	if (host == NULL) {
+		return -ENOMEM;
+	}
+
+	host->Model = *Model;
+	host->Bar = Model->Bar;
+	host->BarSize = CPCI429_BAR0_SIZE;
+
+	return CPCI429HostStart(host, Host);
+}
+
+void
+CPCI429HostClose(
+	_In_ PCPCI429_HOST Host
+)
+{
+	ULONG i;
+
+	if (Host == NULL) {
+		return;
+	}
+
+	//
+	// Wake alarm waiters with -ECANCELED and wait for them to leave before
+	// the primitives go away.
+	//
+	pthread_mutex_lock(&Host->HealthLock);
+	Host->HealthClosing = TRUE;
+	pthread_cond_broadcast(&Host->HealthRaised);
+	while (Host->HealthWaiters != 0) {
+		pthread_cond_wait(&Host->HealthRaised, &Host->HealthLock);
+	}
+	pthread_mutex_unlock(&Host->HealthLock);
+
+	if (Host->Bar != MAP_FAILED) {
+		CPCI429RegEnableRxInterrupts(Host->Bar, 0);
+		if (Host->Kind == CPCI429_HOST_INPROC) {
+			Host->Model.Detach(Host->Model.Context);
+		} else {
+			munmap(Host->Bar, Host->BarSize);
+		}
+	}
+
+	if (Host->Kind == CPCI429_HOST_VFIO && Host->InterruptFd >= 0) {
+		CPCI429HostVfioSetIrq(Host, Host->VfioIrqIndex, VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_TRIGGER, -1);
+		close(Host->InterruptFd);
+	}
+	if (Host->DeviceFd >= 0) {
+		close(Host->DeviceFd);
+	}
+	if (Host->GroupFd >= 0) {
+		close(Host->GroupFd);
+	}
+	if (Host->ContainerFd >= 0) {
+		close(Host->ContainerFd);
+	}
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		pthread_mutex_destroy(&Host->RxChannels[i].Lock);
+	}
+	pthread_mutex_destroy(&Host->ControlLock);
+	pthread_cond_destroy(&Host->HealthRaised);
+	pthread_mutex_destroy(&Host->HealthLock);
+	pthread_cond_destroy(&Host->SelfTestEnded);
+	pthread_mutex_destroy(&Host->SelfTestLock);
+	pthread_cond_destroy(&Host->BulkEnded);
+	pthread_mutex_destroy(&Host->BulkLock);
+
+	free(Host);
+}
+
+static
+ULONGLONG
+CPCI429HostTime(
+	void
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (ULONGLONG)now.tv_sec * 10000000 + (ULONGLONG)now.tv_nsec / 100;
+}
+
+//
+// The host's clock, in 100ns units: the model's for a board model, so
+// that it matches the record timestamps, else CLOCK_MONOTONIC.
+//
+static
+ULONGLONG
+CPCI429HostNow(
+	_In_ PCPCI429_HOST Host
+)
+{
+	if (Host->Kind == CPCI429_HOST_INPROC) {
+		return Host->Model.Now(Host->Model.Context);
+	}
+
+	return CPCI429HostTime();
+}
+
+static
+void
+CPCI429HostHealthRaise(
+	_In_ PCPCI429_HOST Host,
+	_In_ ULONG Channel,
+	_In_ ULONG LabelSdi,
+	_In_ USHORT Type,
+	_In_ ULONGLONG Time
+)
+/*++
+
+Routine Description:
+
+    Records an alarm and wakes the waiting monitors, as the driver's
+    CPCI429HealthRaise. When nobody collects alarms the oldest ones are
+    dropped and counted.
+
+--*/
+{
+	PCPCI429_HEALTH_EVENT event;
+
+	pthread_mutex_lock(&Host->HealthLock);
+
+	if (Host->HealthEventCount == ARRAYSIZE(Host->HealthEvents)) {
+		Host->HealthEventFirst = (Host->HealthEventFirst + 1) % ARRAYSIZE(Host->HealthEvents);
+		Host->HealthEventCount--;
+		Host->HealthEventsDropped++;
+	}
+
+	event = &Host->HealthEvents[(Host->HealthEventFirst + Host->HealthEventCount) % ARRAYSIZE(Host->HealthEvents)];
+	event->Channel = Channel;
+	event->LabelSdi = (USHORT)LabelSdi;
+	event->Type = Type;
+	event->Time = Time;
+	Host->HealthEventCount++;
+
+	pthread_cond_broadcast(&Host->HealthRaised);
+	pthread_mutex_unlock(&Host->HealthLock);
+}
+
+static
+void
+CPCI429HostCheckStale(
+	_In_ PCPCI429_HOST Host
+)
+/*++
+
+Routine Description:
+
+    The driver's health timer: raises a staleness alarm for every
+    watched label that has gone longer than its limit without a word.
+    Runs on the service thread at most every CPCI429_HOST_HEALTH_INTERVAL.
+
+--*/
+{
+	ULONGLONG now = CPCI429HostNow(Host);
+	ULONG i;
+	LONG n;
+
+	if (now - Host->HealthChecked < CPCI429_HOST_HEALTH_INTERVAL) {
+		return;
+	}
+	Host->HealthChecked = now;
+
+	for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+		PCPCI429_HOST_CHANNEL channel = &Host->RxChannels[i];
+		LONG watchCount = __atomic_load_n(&channel->StaleWatchCount, __ATOMIC_ACQUIRE);
+
+		for (n = 0; n < watchCount; n++) {
+			ULONG index = channel->StaleWatch[n];
+
+			if (CPCI429LabelCheckStale(&channel->Labels[index], now)) {
+				__atomic_add_fetch(&channel->StaleAlarms, 1, __ATOMIC_RELAXED);
+				CPCI429HostHealthRaise(Host, i, index, CPCI429_HEALTH_STALE, now);
+			}
+		}
+	}
+}
+
+static
+ULONG
+CPCI429HostDrainChannel(
+	_In_ PCPCI429_HOST Host,
+	_In_ ULONG Channel
+)
+/*++
+
+Routine Description:
+
+    Moves the channel's FIFO into its ring through the shared receive
+    path, like the driver's channel DPC: gap tagging, health statistics,
+    on-change suppression and the label table behave the same.
+
+    During a self-test the words of the tested channels go to
+    CPCI429SelfTestReceive instead, and during a bulk transfer the
+    handshake words go to its sender, as in the driver.
+
+    A board model hands over records in batches, stamped with the model's
+    arrival time of each word, rather than a word per register read; its
+    status and lost-word registers are still sampled from the register
+    image before each batch. A pass reads at most one ring's worth of
+    words, which bounds it on a fake BAR whose FIFO never runs empty.
+
+--*/
+{
+	PCPCI429_HOST_CHANNEL channel = &Host->RxChannels[Channel];
+	PSELF_TEST selfTest = __atomic_load_n(&Host->SelfTest, __ATOMIC_ACQUIRE);
+	PBULK_SENDER bulk = __atomic_load_n(&Host->Bulk, __ATOMIC_ACQUIRE);
+	CPCI429_RX_RECORD batch[256];
+	RX_DRAIN drain;
+	ULONG head = channel->Head;
+	ULONG tail = __atomic_load_n(&channel->Tail, __ATOMIC_ACQUIRE);
+	ULONGLONG now = CPCI429HostNow(Host);
+	ULONGLONG started = selfTest != NULL ? CPCI429HostTime() : 0;
+	ULONGLONG heartbeat = __atomic_load_n(&channel->HeartbeatInterval, __ATOMIC_RELAXED);
+	ULONG queued = 0;
+	ULONG overflows = 0;
+	ULONG count = 0;
+	ULONG next = 0;
+	ULONG word;
+
+	CPCI429RxBeginDrain(&drain, &channel->Fifo, CPCI429_HOST_FIFO_HIGH_WATER);
+
+	while (drain.Received < CPCI429_HOST_RING_WORDS) {
+		CPCI429_RX_RECORD record;
+		PLABEL_ENTRY entry;
+
+		if (Host->Kind == CPCI429_HOST_INPROC) {
+			if (next == count) {
+				CPCI429RxSampleFifo(Host->Bar, Channel, &channel->Fifo, &drain);
+
+				count = CPCI429_HOST_RING_WORDS - drain.Received;
+				count = Host->Model.RxPop(Host->Model.Context, Channel, batch,
+					count < ARRAYSIZE(batch) ? count : ARRAYSIZE(batch));
+				next = 0;
+				if (count == 0) {
+					break;
+				}
+			}
+			record = batch[next++];
+			record.Flags = 0;
+			drain.Received++;
+		} else {
+			if (!CPCI429RxNextWord(Host->Bar, Channel, &channel->Fifo, &drain, &word)) {
+				break;
+			}
+			record.Word = word;
+			record.Flags = 0;
+			record.Timestamp = now;
+		}
+
+		if (selfTest != NULL && !Host->SelfTestOver &&
+			CPCI429SelfTestReceive(selfTest, Channel, record.Word, now)) {
+			continue;
+		}
+		if (bulk != NULL && !Host->BulkOver && CPCI429BulkAnswer(bulk, Channel, record.Word, now)) {
+			continue;
+		}
+
+		entry = &channel->Labels[CPCI429_LABEL_SDI_INDEX(record.Word)];
+
+		CPCI429RxTagGap(&drain, &record);
+
+		if (CPCI429LabelUpdate(entry, record.Word, record.Timestamp, &drain)) {
+			CPCI429HostHealthRaise(Host, Channel, CPCI429_LABEL_SDI_INDEX(record.Word),
+				CPCI429_HEALTH_RECOVERED, record.Timestamp);
+		}
+
+		if (CPCI429RxSuppress(channel->OnChangeMask, heartbeat, entry, record.Timestamp, &record, &drain)) {
+			continue;
+		}
+
+		if (head - tail >= CPCI429_HOST_RING_WORDS) {
+			tail = __atomic_load_n(&channel->Tail, __ATOMIC_ACQUIRE);
+			if (head - tail >= CPCI429_HOST_RING_WORDS) {
+				overflows++;
+				continue;
+			}
+		}
+
+		channel->Ring[head & (CPCI429_HOST_RING_WORDS - 1)] = record;
+		head++;
+		queued++;
+
+		CPCI429LabelCommit(entry, record.Word, record.Timestamp);
+	}
+
+	CPCI429RxEndDrain(&drain, &channel->Fifo);
+
+	__atomic_store_n(&channel->Head, head, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&channel->WordsReceived, drain.Received, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->WordsQueued, queued, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->RingOverflows, overflows, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->WordsSuppressed, drain.Suppressed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->Heartbeats, drain.Heartbeats, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->ParityErrors, drain.ParityErrors, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->SsmFailures, drain.SsmFailures, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->GapViolations, drain.GapViolations, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->FifoOverruns, drain.Overruns, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->FifoWordsLost, drain.LostWords, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&channel->BurstDrains, drain.Bursts, __ATOMIC_RELAXED);
+
+	if (selfTest != NULL) {
+		Host->SelfTestDrains++;
+		Host->SelfTestDrainTicks += CPCI429HostTime() - started;
+	}
+
+	return drain.Received;
+}
+
+static
+void
+CPCI429HostSelfTestPump(
+	_In_ PCPCI429_HOST Host
+)
+/*++
+
+Routine Description:
+
+    The driver's self-test timer: tops up the transmit FIFO of every
+    tested channel until the run's duration is over, then leaves the
+    receivers a grace period before handing the run back to the waiting
+    CPCI429_IOCTL_SELF_TEST caller.
+
+--*/
+{
+	PSELF_TEST test = __atomic_load_n(&Host->SelfTest, __ATOMIC_ACQUIRE);
+	ULONG words[CPCI429_SELF_TEST_BURST];
+	ULONGLONG started;
+	ULONGLONG now;
+	ULONG i;
+
+	if (test == NULL || Host->SelfTestOver) {
+		return;
+	}
+
+	now = CPCI429HostNow(Host);
+
+	if (!test->Draining && now >= test->Deadline) {
+		test->Draining = TRUE;
+		test->Stopped = now;
+	}
+
+	if (test->Draining) {
+		if (now - test->Stopped >= test->TickFrequency * CPCI429_SELF_TEST_GRACE_MS / 1000) {
+			pthread_mutex_lock(&Host->SelfTestLock);
+			Host->SelfTestOver = TRUE;
+			pthread_cond_broadcast(&Host->SelfTestEnded);
+			pthread_mutex_unlock(&Host->SelfTestLock);
+		}
+		return;
+	}
+
+	started = CPCI429HostTime();
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PSELF_TEST_CHANNEL channel = &test->Channel[i];
+		ULONG sequence = channel->NextSend;
+		ULONG fifoStatus;
+		ULONG room;
+		ULONG sent;
+		ULONG n;
+
+		if (!(test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		fifoStatus = CPCI429_BAR_READ(Host->Bar, CPCI429_TX_CHANNEL_BASE(i) + CPCI429_CH_FIFO_STATUS);
+		if ((fifoStatus & CPCI429_FIFO_EMPTY) && sequence != 0) {
+			channel->Result.TxUnderruns++;
+		}
+
+		room = CPCI429SelfTestRoom(test, fifoStatus);
+		for (n = 0; n < room; n++) {
+			words[n] = CPCI429SelfTestWord(test->Label, i, sequence + n);
+		}
+
+		if (room == 0) {
+			sent = 0;
+		} else if (Host->Kind == CPCI429_HOST_INPROC) {
+			sent = Host->Model.TxPush(Host->Model.Context, i, words, room);
+		} else {
+			sent = CPCI429RegTxWrite(Host->Bar, i, words, room);
+		}
+
+		//
+		// The receiving side runs on this thread too, so the stamps can
+		// follow the write and cover only the words that fit.
+		//
+		for (n = 0; n < sent; n++) {
+			channel->Stamps[(sequence + n) & (CPCI429_SELF_TEST_STAMPS - 1)] =
+				CPCI429SelfTestSendTime(test, now, CPCI429_FIFO_COUNT(fifoStatus) + n);
+		}
+
+		channel->NextSend = sequence + sent;
+		channel->Result.WordsSent += sent;
+	}
+
+	test->Pumps++;
+	test->PumpTicks += CPCI429HostTime() - started;
+}
+
+static
+void
+CPCI429HostBulkPump(
+	_In_ PCPCI429_HOST Host
+)
+/*++
+
+Routine Description:
+
+    The driver's bulk timer: queues as much of the running transfer as
+    the transmit FIFO and the handshake allow, resends overdue blocks and
+    hands the transfer back to the waiting CPCI429_IOCTL_BULK_TRANSFER
+    caller once it is done. Answers drained in the same service pass
+    are acted on at once.
+
+--*/
+{
+	PBULK_SENDER bulk = __atomic_load_n(&Host->Bulk, __ATOMIC_ACQUIRE);
+	ULONGLONG now;
+	ULONG word;
+	ULONG sent;
+
+	if (bulk == NULL || Host->BulkOver) {
+		return;
+	}
+
+	now = CPCI429HostNow(Host);
+
+	while (CPCI429BulkNextWord(bulk, now, &word)) {
+		if (Host->Kind == CPCI429_HOST_INPROC) {
+			sent = Host->Model.TxPush(Host->Model.Context, bulk->TxChannel, &word, 1);
+		} else {
+			sent = CPCI429RegTxWrite(Host->Bar, bulk->TxChannel, &word, 1);
+		}
+		if (sent == 0) {
+			break;
+		}
+		CPCI429BulkWordSent(bulk, now);
+	}
+
+	if (bulk->State == BulkDone) {
+		pthread_mutex_lock(&Host->BulkLock);
+		Host->BulkOver = TRUE;
+		pthread_cond_broadcast(&Host->BulkEnded);
+		pthread_mutex_unlock(&Host->BulkLock);
+	}
+}
+
+int
+CPCI429HostService(
+	_In_ PCPCI429_HOST Host,
+	_In_ int TimeoutMs
+)
+{
+	struct pollfd poller = { .fd = Host->InterruptFd, .events = POLLIN };
+	ULONGLONG events;
+	ULONG pending;
+	ULONG channel;
+	int words = 0;
+	int ready;
+
+	if (Host->Kind == CPCI429_HOST_INPROC) {
+		pending = Host->Model.Wait(Host->Model.Context, TimeoutMs);
+
+		for (channel = 0; pending != 0; channel++, pending >>= 1) {
+			if (pending & 1) {
+				words += (int)CPCI429HostDrainChannel(Host, channel);
+			}
+		}
+		CPCI429HostCheckStale(Host);
+		CPCI429HostSelfTestPump(Host);
+		CPCI429HostBulkPump(Host);
+		Host->Model.Drained(Host->Model.Context);
+
+		return words;
+	}
+
+	if (Host->Kind == CPCI429_HOST_UIO) {
+		//
+		// UIO masks the interrupt line after each event until re-enabled.
+		//
+		ULONG enable = 1;
+
+		if (write(Host->DeviceFd, &enable, sizeof(enable)) != sizeof(enable) && errno != EINVAL) {
+			return -errno;
+		}
+	}
+
+	if (Host->InterruptFd < 0) {
+		if (poll(NULL, 0, TimeoutMs < 0 ? 1 : TimeoutMs) < 0) {
+			return -errno;
+		}
+	} else {
+		ready = poll(&poller, 1, TimeoutMs);
+		if (ready <= 0) {
+			if (ready == 0) {
+				CPCI429HostCheckStale(Host);
+				CPCI429HostSelfTestPump(Host);
+				CPCI429HostBulkPump(Host);
+			}
+			return ready < 0 ? -errno : 0;
+		}
+
+		if (Host->Kind == CPCI429_HOST_UIO) {
+			ULONG count;
+
+			if (read(Host->InterruptFd, &count, sizeof(count)) != sizeof(count)) {
+				return -errno;
+			}
+		} else if (read(Host->InterruptFd, &events, sizeof(events)) != sizeof(events)) {
+			return -errno;
+		}
+	}
+
+	pending = CPCI429RegAckRxInterrupts(Host->Bar);
+
+	for (channel = 0; pending != 0; channel++, pending >>= 1) {
+		if (pending & 1) {
+			words += (int)CPCI429HostDrainChannel(Host, channel);
+		}
+	}
+
+	if (Host->Kind == CPCI429_HOST_VFIO && Host->VfioIrqIndex == VFIO_PCI_INTX_IRQ_INDEX) {
+		CPCI429HostVfioSetIrq(Host, VFIO_PCI_INTX_IRQ_INDEX, VFIO_IRQ_SET_DATA_NONE | VFIO_IRQ_SET_ACTION_UNMASK, -1);
+	}
+
+	CPCI429HostCheckStale(Host);
+	CPCI429HostSelfTestPump(Host);
+	CPCI429HostBulkPump(Host);
+
+	return words;
+}
+
+static
+ULONG
+CPCI429HostRxRead(
+	_In_ PCPCI429_HOST_CHANNEL Channel,
+	_Out_ PVOID Buffer,
+	_In_ ULONG MaxItems,
+	_In_ BOOLEAN Records
+)
+{
+	ULONG tail;
+	ULONG count;
+	ULONG i;
+
+	pthread_mutex_lock(&Channel->Lock);
+
+	tail = Channel->Tail;
+	count = __atomic_load_n(&Channel->Head, __ATOMIC_ACQUIRE) - tail;
+	if (count > MaxItems) {
+		count = MaxItems;
+	}
+
+	if (Records) {
+		PCPCI429_RX_RECORD records = (PCPCI429_RX_RECORD)Buffer;
+
+		for (i = 0; i < count; i++) {
+			records[i] = Channel->Ring[(tail + i) & (CPCI429_HOST_RING_WORDS - 1)];
+		}
+	} else {
+		PULONG words = (PULONG)Buffer;
+
+		for (i = 0; i < count; i++) {
+			words[i] = Channel->Ring[(tail + i) & (CPCI429_HOST_RING_WORDS - 1)].Word;
+		}
+	}
+
+	__atomic_store_n(&Channel->Tail, tail + count, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&Channel->Lock);
+
+	return count;
+}
+
+static
+int
+CPCI429HostSetOnChange(
+	_In_ PCPCI429_HOST Host,
+	_In_ const CPCI429_ON_CHANGE_CONFIG *Config
+)
+/*++
+
+Routine Description:
+
+    The driver's CPCI429RxSetOnChange. The service thread picks up the
+    new mask and heartbeat on its next word.
+
+--*/
+{
+	PCPCI429_HOST_CHANNEL channel;
+	ULONG i;
+
+	if (Config->Channel >= CPCI429_MAX_RX_CHANNELS) {
+		return -EINVAL;
+	}
+
+	channel = &Host->RxChannels[Config->Channel];
+
+	__atomic_store_n(&channel->HeartbeatInterval, (ULONGLONG)Config->HeartbeatMs * 10000, __ATOMIC_RELAXED);
+	for (i = 0; i < ARRAYSIZE(channel->OnChangeMask); i++) {
+		__atomic_store_n(&channel->OnChangeMask[i], Config->LabelMask[i], __ATOMIC_RELAXED);
+	}
+
+	return 0;
+}
+
+static
+int
+CPCI429HostSetLabelHealth(
+	_In_ PCPCI429_HOST Host,
+	_In_ const CPCI429_LABEL_HEALTH_CONFIG *Config
+)
+/*++
+
+Routine Description:
+
+    The driver's CPCI429HealthSetLabel. ControlLock stands in for the
+    sequential control queue as the only writer of the limits and the
+    watch list.
+
+--*/
+{
+	PCPCI429_HOST_CHANNEL channel;
+	ULONGLONG now;
+	ULONG sdi;
+	int status = 0;
+
+	if (Config->Channel >= CPCI429_MAX_RX_CHANNELS ||
+		(Config->Sdi != CPCI429_SDI_ANY_SOURCE && Config->Sdi > 3)) {
+		return -EINVAL;
+	}
+
+	channel = &Host->RxChannels[Config->Channel];
+	now = CPCI429HostNow(Host);
+
+	pthread_mutex_lock(&Host->ControlLock);
+
+	for (sdi = 0; sdi < 4; sdi++) {
+		ULONG index = (sdi << 8) | Config->Label;
+		LONG n;
+
+		if (Config->Sdi != CPCI429_SDI_ANY_SOURCE && Config->Sdi != sdi) {
+			continue;
+		}
+
+		CPCI429LabelSetLimits(&channel->Labels[index], Config, now);
+
+		if (Config->StaleMs == 0) {
+			continue;
+		}
+
+		for (n = 0; n < channel->StaleWatchCount; n++) {
+			if (channel->StaleWatch[n] == index) {
+				break;
+			}
+		}
+		if (n == channel->StaleWatchCount) {
+			if (n == CPCI429_MAX_STALE_WATCH) {
+				status = -ENOMEM;
+				break;
+			}
+			channel->StaleWatch[n] = (USHORT)index;
+			__atomic_store_n(&channel->StaleWatchCount, n + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	pthread_mutex_unlock(&Host->ControlLock);
+
+	return status;
+}
+
+int
+CPCI429HostHealthWait(
+	_In_ PCPCI429_HOST Host,
+	_Out_writes_(MaxEvents) PCPCI429_HEALTH_EVENT Events,
+	_In_ ULONG MaxEvents,
+	_In_ int TimeoutMs
+)
+/*++
+
+Routine Description:
+
+    The driver's CPCI429HealthWait and CPCI429HealthDeliver: waits up to
+    TimeoutMs (-1 for ever, 0 not at all) for at least one alarm to be
+    pending and hands over as many as fit. Closing the host ends the wait
+    with -ECANCELED.
+
+--*/
+{
+	struct timespec deadline;
+	ULONG count;
+	ULONG i;
+	int status = 0;
+
+	if (TimeoutMs > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += TimeoutMs / 1000;
+		deadline.tv_nsec += (long)(TimeoutMs % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	pthread_mutex_lock(&Host->HealthLock);
+
+	Host->HealthWaiters++;
+	while (Host->HealthEventCount == 0 && !Host->HealthClosing && status == 0 && TimeoutMs != 0) {
+		if (TimeoutMs < 0) {
+			pthread_cond_wait(&Host->HealthRaised, &Host->HealthLock);
+		} else {
+			status = pthread_cond_timedwait(&Host->HealthRaised, &Host->HealthLock, &deadline);
+		}
+	}
+	Host->HealthWaiters--;
+
+	if (Host->HealthClosing) {
+		pthread_cond_broadcast(&Host->HealthRaised);
+		pthread_mutex_unlock(&Host->HealthLock);
+		return -ECANCELED;
+	}
+
+	count = MaxEvents < Host->HealthEventCount ? MaxEvents : Host->HealthEventCount;
+	for (i = 0; i < count; i++) {
+		Events[i] = Host->HealthEvents[(Host->HealthEventFirst + i) % ARRAYSIZE(Host->HealthEvents)];
+	}
+	Host->HealthEventFirst = (Host->HealthEventFirst + count) % ARRAYSIZE(Host->HealthEvents);
+	Host->HealthEventCount -= count;
+
+	pthread_mutex_unlock(&Host->HealthLock);
+
+	return (int)count;
+}
+
+static
+int
+CPCI429HostSelfTest(
+	_In_ PCPCI429_HOST Host,
+	_In_ const CPCI429_SELF_TEST_CONFIG *Config,
+	_Out_ PCPCI429_SELF_TEST_RESULT Result
+)
+/*++
+
+Routine Description:
+
+    The driver's CPCI429SelfTestStart and its work item: configures the
+    tested channel pairs, publishes the run to the service thread, waits
+    for it to end and restores the channels.
+
+--*/
+{
+	PSELF_TEST test;
+	ULONGLONG drains;
+	ULONGLONG drainTicks;
+	ULONG i;
+
+	if (!CPCI429SelfTestValidConfig(Config)) {
+		return -EINVAL;
+	}
+
+	test = (PSELF_TEST)calloc(1, sizeof(SELF_TEST));
+	if (test == NULL) {
+		return -ENOMEM;
+	}
+
+	//
+	// Claim the channels before touching them, so that a concurrent
+	// transmit request cannot mix its words into the run.
+	//
+	pthread_mutex_lock(&Host->SelfTestLock);
+	if (Host->SelfTestChannels != 0) {
+		pthread_mutex_unlock(&Host->SelfTestLock);
+		free(test);
+		return -EBUSY;
+	}
+	__atomic_store_n(&Host->SelfTestChannels, (LONG)Config->ChannelMask, __ATOMIC_RELEASE);
+	Host->SelfTestOver = FALSE;
+	pthread_mutex_unlock(&Host->SelfTestLock);
+
+	CPCI429SelfTestBegin(test, Config, CPCI429HostNow(Host), 10000000);
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		PSELF_TEST_CHANNEL channel = &test->Channel[i];
+		ULONG txBase = CPCI429_TX_CHANNEL_BASE(i);
+		ULONG rxBase = CPCI429_RX_CHANNEL_BASE(i);
+
+		if (!(test->ChannelMask & (1UL << i))) {
+			continue;
+		}
+
+		channel->SavedTxControl = CPCI429_BAR_READ(Host->Bar, txBase + CPCI429_CH_CONTROL);
+		channel->SavedRxControl = CPCI429_BAR_READ(Host->Bar, rxBase + CPCI429_CH_CONTROL);
+
+		CPCI429_BAR_WRITE(Host->Bar, txBase + CPCI429_CH_CONTROL, CPCI429SelfTestControl(Config, FALSE));
+		CPCI429_BAR_WRITE(Host->Bar, rxBase + CPCI429_CH_CONTROL, CPCI429SelfTestControl(Config, TRUE));
+	}
+
+	drains = Host->SelfTestDrains;
+	drainTicks = Host->SelfTestDrainTicks;
+
+	__atomic_store_n(&Host->SelfTest, test, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&Host->SelfTestLock);
+	while (!Host->SelfTestOver) {
+		pthread_cond_wait(&Host->SelfTestEnded, &Host->SelfTestLock);
+	}
+	pthread_mutex_unlock(&Host->SelfTestLock);
+
+	//
+	// The service thread leaves the run alone once it is over.
+	//
+	__atomic_store_n(&Host->SelfTest, NULL, __ATOMIC_RELEASE);
+
+	for (i = 0; i < CPCI429_MAX_TX_CHANNELS; i++) {
+		if (test->ChannelMask & (1UL << i)) {
+			CPCI429_BAR_WRITE(Host->Bar, CPCI429_TX_CHANNEL_BASE(i) + CPCI429_CH_CONTROL, test->Channel[i].SavedTxControl);
+			CPCI429_BAR_WRITE(Host->Bar, CPCI429_RX_CHANNEL_BASE(i) + CPCI429_CH_CONTROL, test->Channel[i].SavedRxControl);
+		}
+	}
+
+	CPCI429SelfTestResults(test, Result);
+	Result->Outcome = CPCI429_SELF_TEST_COMPLETED;
+	Result->Dpcs = Host->SelfTestDrains - drains;
+	Result->DpcTicks = Host->SelfTestDrainTicks - drainTicks;
+
+	free(test);
+	__atomic_store_n(&Host->SelfTestChannels, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static
+int
+CPCI429HostBulkStatus(
+	_In_ BULK_OUTCOME Outcome
+)
+{
+	switch (Outcome) {
+	case BulkDelivered:
+		return 0;
+	case BulkTimedOut:
+		return -ETIMEDOUT;
+	case BulkRejected:
+		return -EIO;
+	case BulkPeerAborted:
+		return -ECONNABORTED;
+	default:
+		return -ECANCELED;
+	}
+}
+
+static
+int
+CPCI429HostBulkTransfer(
+	_In_ PCPCI429_HOST Host,
+	_In_ const CPCI429_BULK_CONFIG *Config,
+	_In_reads_bytes_(Length) const UCHAR *Data,
+	_In_ size_t Length,
+	_Out_ size_t *Delivered
+)
+/*++
+
+Routine Description:
+
+    The driver's CPCI429BulkStart and its work item: claims the transmit
+    channel, publishes the transfer to the service thread, waits for it
+    to end and restores the channel.
+
+--*/
+{
+	PBULK_SENDER bulk;
+	CPCI429_BULK_STATUS result;
+	LONG none = CPCI429_HOST_NO_CHANNEL;
+	ULONG base = CPCI429_TX_CHANNEL_BASE(Config->TxChannel);
+	ULONG savedControl;
+	ULONG control;
+
+	*Delivered = 0;
+
+	if (!CPCI429BulkValidConfig(Config) || Length == 0) {
+		return -EINVAL;
+	}
+
+	bulk = (PBULK_SENDER)calloc(1, sizeof(BULK_SENDER));
+	if (bulk == NULL) {
+		return -ENOMEM;
+	}
+
+	if (!__atomic_compare_exchange_n(&Host->BulkTxChannel, &none, (LONG)Config->TxChannel,
+		FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(bulk);
+		return -EBUSY;
+	}
+
+	pthread_mutex_lock(&Host->BulkLock);
+	Host->BulkOver = FALSE;
+	pthread_mutex_unlock(&Host->BulkLock);
+
+	CPCI429BulkBegin(bulk, Config, Data, Length, CPCI429HostNow(Host), 10000000);
+
+	savedControl = CPCI429_BAR_READ(Host->Bar, base + CPCI429_CH_CONTROL);
+	control = CPCI429_CTRL_ENABLE | CPCI429_CTRL_ODD_PARITY;
+	if (Config->Speed == CPCI429_SPEED_HIGH) {
+		control |= CPCI429_CTRL_HIGH_SPEED;
+	}
+	CPCI429_BAR_WRITE(Host->Bar, base + CPCI429_CH_CONTROL, control);
+
+	__atomic_store_n(&Host->Bulk, bulk, __ATOMIC_RELEASE);
+
+	pthread_mutex_lock(&Host->BulkLock);
+	while (!Host->BulkOver) {
+		pthread_cond_wait(&Host->BulkEnded, &Host->BulkLock);
+	}
+	pthread_mutex_unlock(&Host->BulkLock);
+
+	//
+	// The service thread leaves the sender alone once it is over.
+	//
+	__atomic_store_n(&Host->Bulk, NULL, __ATOMIC_RELEASE);
+
+	CPCI429_BAR_WRITE(Host->Bar, base + CPCI429_CH_CONTROL, savedControl);
+
+	CPCI429BulkResults(bulk, &result);
+	result.Status = CPCI429HostBulkStatus(bulk->Outcome);
+	*Delivered = (size_t)result.BytesDelivered;
+
+	pthread_mutex_lock(&Host->BulkLock);
+	Host->BulkStatus = result;
+	pthread_mutex_unlock(&Host->BulkLock);
+
+	free(bulk);
+	__atomic_store_n(&Host->BulkTxChannel, CPCI429_HOST_NO_CHANNEL, __ATOMIC_RELEASE);
+
+	return result.Status;
+}
+
+int
+CPCI429HostIoctl(
+	_In_ PCPCI429_HOST Host,
+	_In_ ULONG IoControlCode,
+	_In_reads_bytes_(InLength) const void *In,
+	_In_ size_t InLength,
+	_Out_writes_bytes_(OutLength) void *Out,
+	_In_ size_t OutLength,
+	_Out_opt_ size_t *Information
+)
+/*++
+
+Routine Description:
+
+    Mirrors the driver's CPCI429EvtIoDeviceControl and the queue handlers
+    it routes to, for the supported codes.
+
+--*/
+{
+	size_t information = 0;
+	int status = 0;
+
+	switch (IoControlCode) {
+	case CPCI429_IOCTL_WRITE_OFFSETADDRESS:
+		if (InLength < sizeof(ULONG)) {
+			status = -EINVAL;
+			break;
+		}
+		Host->OffsetAddressFromApp = *(const ULONG*)In;
+		information = sizeof(ULONG);
+		break;
+
+	case CPCI429_IOCTL_IN_BUFFERED:
+		if (InLength < sizeof(ULONG) ||
+			(size_t)Host->OffsetAddressFromApp + sizeof(ULONG) > Host->BarSize) {
+			status = -EINVAL;
+			break;
+		}
+		CPCI429_BAR_WRITE(Host->Bar, Host->OffsetAddressFromApp, *(const ULONG*)In);
+		information = sizeof(ULONG);
+		break;
+
+	case CPCI429_IOCTL_OUT_BUFFERED:
+		if (OutLength < sizeof(ULONG) ||
+			(size_t)Host->OffsetAddressFromApp + sizeof(ULONG) > Host->BarSize) {
+			status = -EINVAL;
+			break;
+		}
+		*(ULONG*)Out = CPCI429_BAR_READ(Host->Bar, Host->OffsetAddressFromApp);
+		information = sizeof(ULONG);
+		break;
+
+	case CPCI429_IOCTL_READ_PADDRESS:
+		if (OutLength < sizeof(ULONG)) {
+			status = -EINVAL;
+			break;
+		}
+		*(ULONG*)Out = Host->PhysicalAddress;
+		information = sizeof(ULONG);
+		break;
+
+	case CPCI429_IOCTL_RX_READ:
+	case CPCI429_IOCTL_RX_READ_RECORDS: {
+		size_t itemSize = IoControlCode == CPCI429_IOCTL_RX_READ ? sizeof(ULONG) : sizeof(CPCI429_RX_RECORD);
+		const CPCI429_RX_READ *rxRead = (const CPCI429_RX_READ*)In;
+		ULONG count;
+
+		if (InLength < sizeof(CPCI429_RX_READ) || OutLength < itemSize ||
+			rxRead->Channel >= CPCI429_MAX_RX_CHANNELS) {
+			status = -EINVAL;
+			break;
+		}
+		count = CPCI429HostRxRead(&Host->RxChannels[rxRead->Channel], Out,
+			(ULONG)(OutLength / itemSize), itemSize == sizeof(CPCI429_RX_RECORD));
+		information = count * itemSize;
+		break;
+	}
+
+	case CPCI429_IOCTL_TX_SUBMIT: {
+		const CPCI429_TX_SUBMIT *txSubmit = (const CPCI429_TX_SUBMIT*)In;
+
+		if (InLength < FIELD_OFFSET(CPCI429_TX_SUBMIT, Words) ||
+			txSubmit->Channel >= CPCI429_MAX_TX_CHANNELS ||
+			txSubmit->WordCount > (InLength - FIELD_OFFSET(CPCI429_TX_SUBMIT, Words)) / sizeof(ULONG)) {
+			status = -EINVAL;
+			break;
+		}
+		if ((__atomic_load_n(&Host->SelfTestChannels, __ATOMIC_ACQUIRE) & (1L << txSubmit->Channel)) != 0 ||
+			__atomic_load_n(&Host->BulkTxChannel, __ATOMIC_ACQUIRE) == (LONG)txSubmit->Channel) {
+			status = -EBUSY;
+			break;
+		}
+		if (Host->Kind == CPCI429_HOST_INPROC) {
+			information = Host->Model.TxPush(Host->Model.Context, txSubmit->Channel,
+				txSubmit->Words, txSubmit->WordCount) * sizeof(ULONG);
+		} else {
+			information = CPCI429RegTxWrite(Host->Bar, txSubmit->Channel, txSubmit->Words, txSubmit->WordCount) * sizeof(ULONG);
+		}
+		break;
+	}
+
+	case CPCI429_IOCTL_SET_CHANNEL_CONFIG:
+		if (InLength < sizeof(CPCI429_CHANNEL_CONFIG) ||
+			!CPCI429RegSetChannelConfig(Host->Bar, (const CPCI429_CHANNEL_CONFIG*)In)) {
+			status = -EINVAL;
+		}
+		break;
+
+	case CPCI429_IOCTL_SET_ON_CHANGE:
+		if (InLength < sizeof(CPCI429_ON_CHANGE_CONFIG)) {
+			status = -EINVAL;
+			break;
+		}
+		status = CPCI429HostSetOnChange(Host, (const CPCI429_ON_CHANGE_CONFIG*)In);
+		break;
+
+	case CPCI429_IOCTL_SET_LABEL_HEALTH:
+		if (InLength < sizeof(CPCI429_LABEL_HEALTH_CONFIG)) {
+			status = -EINVAL;
+			break;
+		}
+		status = CPCI429HostSetLabelHealth(Host, (const CPCI429_LABEL_HEALTH_CONFIG*)In);
+		break;
+
+	case CPCI429_IOCTL_GET_LABEL_HEALTH: {
+		PCPCI429_LABEL_HEALTH health = (PCPCI429_LABEL_HEALTH)Out;
+		PCPCI429_HOST_CHANNEL channel;
+		ULONGLONG now;
+		ULONG i;
+
+		if (InLength < sizeof(ULONG) || *(const ULONG*)In >= CPCI429_MAX_RX_CHANNELS ||
+			OutLength < CPCI429_LABEL_SDI_COUNT * sizeof(CPCI429_LABEL_HEALTH)) {
+			status = -EINVAL;
+			break;
+		}
+		channel = &Host->RxChannels[*(const ULONG*)In];
+		now = CPCI429HostNow(Host);
+
+		for (i = 0; i < CPCI429_LABEL_SDI_COUNT; i++) {
+			CPCI429LabelGetHealth(&channel->Labels[i], now, &health[i]);
+		}
+		information = CPCI429_LABEL_SDI_COUNT * sizeof(CPCI429_LABEL_HEALTH);
+		break;
+	}
+
+	case CPCI429_IOCTL_WAIT_HEALTH_ALARM:
+		if (OutLength < sizeof(CPCI429_HEALTH_EVENT)) {
+			status = -EINVAL;
+			break;
+		}
+		status = CPCI429HostHealthWait(Host, (PCPCI429_HEALTH_EVENT)Out,
+			(ULONG)(OutLength / sizeof(CPCI429_HEALTH_EVENT)), -1);
+		if (status >= 0) {
+			information = (size_t)status * sizeof(CPCI429_HEALTH_EVENT);
+			status = 0;
+		}
+		break;
+
+	case CPCI429_IOCTL_SELF_TEST:
+		if (InLength < sizeof(CPCI429_SELF_TEST_CONFIG) || OutLength < sizeof(CPCI429_SELF_TEST_RESULT)) {
+			status = -EINVAL;
+			break;
+		}
+		status = CPCI429HostSelfTest(Host, (const CPCI429_SELF_TEST_CONFIG*)In, (PCPCI429_SELF_TEST_RESULT)Out);
+		if (status == 0) {
+			information = sizeof(CPCI429_SELF_TEST_RESULT);
+		}
+		break;
+
+	case CPCI429_IOCTL_BULK_TRANSFER: {
+		size_t delivered;
+
+		if (InLength < sizeof(CPCI429_BULK_CONFIG) || OutLength == 0) {
+			status = -EINVAL;
+			break;
+		}
+		status = CPCI429HostBulkTransfer(Host, (const CPCI429_BULK_CONFIG*)In, (const UCHAR*)Out, OutLength,
+			&delivered);
+		information = delivered;
+		break;
+	}
+
+	case CPCI429_IOCTL_GET_BULK_STATUS:
+		if (OutLength < sizeof(CPCI429_BULK_STATUS)) {
+			status = -EINVAL;
+			break;
+		}
+		pthread_mutex_lock(&Host->BulkLock);
+		*(PCPCI429_BULK_STATUS)Out = Host->BulkStatus;
+		pthread_mutex_unlock(&Host->BulkLock);
+		information = sizeof(CPCI429_BULK_STATUS);
+		break;
+
+	case CPCI429_IOCTL_GET_RX_STATS: {
+		PCPCI429_RX_STATS_SNAPSHOT snapshot = (PCPCI429_RX_STATS_SNAPSHOT)Out;
+		ULONG i;
+
+		if (OutLength < sizeof(CPCI429_RX_STATS_SNAPSHOT)) {
+			status = -EINVAL;
+			break;
+		}
+		memset(snapshot, 0, sizeof(*snapshot));
+		for (i = 0; i < CPCI429_MAX_RX_CHANNELS; i++) {
+			PCPCI429_HOST_CHANNEL channel = &Host->RxChannels[i];
+
+			snapshot->Channel[i].WordsReceived = __atomic_load_n(&channel->WordsReceived, __ATOMIC_RELAXED);
+			snapshot->Channel[i].WordsQueued = __atomic_load_n(&channel->WordsQueued, __ATOMIC_RELAXED);
+			snapshot->Channel[i].RingOverflows = __atomic_load_n(&channel->RingOverflows, __ATOMIC_RELAXED);
+			snapshot->Channel[i].WordsSuppressed = __atomic_load_n(&channel->WordsSuppressed, __ATOMIC_RELAXED);
+			snapshot->Channel[i].Heartbeats = __atomic_load_n(&channel->Heartbeats, __ATOMIC_RELAXED);
+			snapshot->Channel[i].ParityErrors = __atomic_load_n(&channel->ParityErrors, __ATOMIC_RELAXED);
+			snapshot->Channel[i].SsmFailures = __atomic_load_n(&channel->SsmFailures, __ATOMIC_RELAXED);
+			snapshot->Channel[i].GapViolations = __atomic_load_n(&channel->GapViolations, __ATOMIC_RELAXED);
+			snapshot->Channel[i].StaleAlarms = __atomic_load_n(&channel->StaleAlarms, __ATOMIC_RELAXED);
+			snapshot->Channel[i].FifoOverruns = __atomic_load_n(&channel->FifoOverruns, __ATOMIC_RELAXED);
+			snapshot->Channel[i].FifoWordsLost = __atomic_load_n(&channel->FifoWordsLost, __ATOMIC_RELAXED);
+			snapshot->Channel[i].BurstDrains = __atomic_load_n(&channel->BurstDrains, __ATOMIC_RELAXED);
+		}
+		information = sizeof(CPCI429_RX_STATS_SNAPSHOT);
+		break;
+	}
+
+	default:
+		status = -ENOTTY;
+		break;
+	}
+
+	if (Information != NULL) {
+		*Information = information;
+	}
+
+	return status;
+}
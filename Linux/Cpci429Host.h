@@ -0,0 +1,213 @@
+/*++
+
+Module Name:
+
+    cpci429host.h
+
+Abstract:
+
+    Linux user-mode backend for the CPCI429 board. The board is opened
+    through UIO or VFIO, a file standing in for BAR0 or an in-process
+    board model, and driven with the same register operations
+    (Registers.h) and receive path (RxPath.h) as the Windows driver.
+    CPCI429HostIoctl accepts the driver's IOCTL codes and buffers from
+    Public.h with the same semantics, so applications port by replacing
+    DeviceIoControl.
+
+    Receive interrupts arrive on a pollable descriptor: the UIO device,
+    a VFIO eventfd, or for the fake BAR any eventfd the caller signals.
+    CPCI429HostService waits for one and drains the signalled channels
+    into per-channel receive rings, the work of the driver's ISR and
+    channel DPC, checks the stale-label limits, the work of its health
+    timer, and pumps a running self-test or bulk transfer, the work of
+    their timers. Call it from a dedicated thread; CPCI429HostIoctl may
+    be called concurrently from others.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#ifndef _CPCI429HOST_H
+#define _CPCI429HOST_H
+
+#include "Compat.h"
+#include "Public.h"
+#include "Registers.h"
+#include "RxPath.h"
+#include "Loopback.h"
+#include "BulkSender.h"
+
+#define CPCI429_HOST_RING_WORDS 4096    // per receive channel, power of two
+
+typedef struct _CPCI429_HOST CPCI429_HOST, *PCPCI429_HOST;
+
+EXTERN_C_START
+
+//
+// All functions return 0 or a negative errno value. Driver statuses map
+// as: STATUS_INVALID_PARAMETER and STATUS_BUFFER_TOO_SMALL to -EINVAL,
+// STATUS_INVALID_DEVICE_REQUEST to -ENOTTY, STATUS_DEVICE_BUSY to -EBUSY.
+//
+
+//
+// Opens /dev/uioN. BAR0 is taken from the UIO map 0, or from the PCI
+// device's resource0 when the UIO driver exports no maps, as
+// uio_pci_generic does.
+//
+int
+CPCI429HostOpenUio(
+	_In_ const char *UioDevice,
+	_Out_ PCPCI429_HOST *Host
+);
+
+//
+// Opens the device DeviceName ("0000:03:00.0") in the VFIO group
+// GroupPath ("/dev/vfio/12"), maps BAR0 and routes the MSI, or else the
+// INTx, interrupt to an eventfd.
+//
+int
+CPCI429HostOpenVfio(
+	_In_ const char *GroupPath,
+	_In_ const char *DeviceName,
+	_Out_ PCPCI429_HOST *Host
+);
+
+//
+// Uses the file BarFile, grown to CPCI429_BAR0_SIZE if shorter, as BAR0
+// and InterruptFd, an eventfd the caller writes to, as the interrupt.
+// The file can live in /dev/shm and be driven by a board model in
+// another process. InterruptFd stays owned by the caller; with -1 the
+// interrupt status register is polled every service timeout instead.
+//
+int
+CPCI429HostOpenFake(
+	_In_ const char *BarFile,
+	_In_ int InterruptFd,
+	_Out_ PCPCI429_HOST *Host
+);
+
+//
+// A board model running in this process, such as the simulator
+// (Cpci429Sim.h). Bar is the model's register image, read and written
+// like a mapped BAR0. The FIFO data registers, which pop and push on
+// access and so cannot live in plain memory, go through the callbacks
+// instead. All callbacks take Context.
+//
+typedef struct _CPCI429_HOST_MODEL {
+	PVOID Context;
+	PVOID Bar;
+
+	//
+	// Waits up to TimeoutMs for the model to move on and returns the
+	// pending receive channels, as CPCI429_REG_INT_STATUS would.
+	//
+	ULONG (*Wait)(PVOID Context, int TimeoutMs);
+
+	//
+	// Pops up to MaxRecords words from a receive FIFO. Records are
+	// stamped with the model's arrival time of each word.
+	//
+	ULONG (*RxPop)(PVOID Context, ULONG Channel, PCPCI429_RX_RECORD Records, ULONG MaxRecords);
+
+	//
+	// Called after each Wait once the channels it returned are drained.
+	//
+	void (*Drained)(PVOID Context);
+
+	//
+	// Queues words on a transmit FIFO and returns how many fit.
+	//
+	ULONG (*TxPush)(PVOID Context, ULONG Channel, const ULONG *Words, ULONG Count);
+
+	//
+	// The model's current time in 100ns units, the clock RxPop stamps
+	// records with. Health intervals and staleness are measured on it.
+	//
+	ULONGLONG (*Now)(PVOID Context);
+
+	//
+	// Called once from CPCI429HostClose.
+	//
+	void (*Detach)(PVOID Context);
+} CPCI429_HOST_MODEL, *PCPCI429_HOST_MODEL;
+
+//
+// Drives the board model Model, which is copied. Service waits on the
+// model instead of an interrupt.
+//
+int
+CPCI429HostOpenModel(
+	_In_ const CPCI429_HOST_MODEL *Model,
+	_Out_ PCPCI429_HOST *Host
+);
+
+void
+CPCI429HostClose(
+	_In_ PCPCI429_HOST Host
+);
+
+//
+// Waits up to TimeoutMs (-1 for ever) for a receive interrupt and
+// drains the channels it reports. Returns the number of words drained.
+// A polled fake BAR sleeps TimeoutMs and then checks the status; a model
+// returns as soon as it has moved on.
+//
+int
+CPCI429HostService(
+	_In_ PCPCI429_HOST Host,
+	_In_ int TimeoutMs
+);
+
+//
+// Waits up to TimeoutMs (-1 for ever, 0 not at all) for health alarms
+// and hands over up to MaxEvents of them, oldest first, as
+// CPCI429_IOCTL_WAIT_HEALTH_ALARM does. Returns the number handed over,
+// 0 when none was raised in time, or -ECANCELED once CPCI429HostClose has
+// begun; close waits for every caller to leave.
+//
+int
+CPCI429HostHealthWait(
+	_In_ PCPCI429_HOST Host,
+	_Out_writes_(MaxEvents) PCPCI429_HEALTH_EVENT Events,
+	_In_ ULONG MaxEvents,
+	_In_ int TimeoutMs
+);
+
+//
+// Same contract as DeviceIoControl on the driver. Supported are the
+// legacy register IOCTLs, CPCI429_IOCTL_RX_READ, RX_READ_RECORDS,
+// TX_SUBMIT, SET_CHANNEL_CONFIG, SET_ON_CHANGE, SET_LABEL_HEALTH,
+// GET_LABEL_HEALTH, WAIT_HEALTH_ALARM, SELF_TEST, BULK_TRANSFER,
+// GET_BULK_STATUS and GET_RX_STATS. Information receives the bytes
+// written to Out, or for BULK_TRANSFER, whose Out is the data to send,
+// the bytes delivered. WAIT_HEALTH_ALARM, SELF_TEST and BULK_TRANSFER
+// block until an alarm is raised or the run ends, so need
+// CPCI429HostService running on another thread; WAIT_HEALTH_ALARM fails
+// with -ECANCELED when the host is closed under it.
+//
+// A self-test is timed on the host's clock, the model's for a board
+// model and CLOCK_MONOTONIC otherwise, with a TickFrequency of 10^7,
+// and pumped once per service pass rather than every millisecond. Dpcs
+// and DpcTicks count the channel drains during the run and their
+// wall-clock time.
+//
+// A bulk transfer is timed the same way and cannot be canceled. Its
+// Status is 0 or a negative errno value: -ETIMEDOUT, -EIO after too
+// many NAKs, or -ECONNABORTED when the peer aborts.
+//
+int
+CPCI429HostIoctl(
+	_In_ PCPCI429_HOST Host,
+	_In_ ULONG IoControlCode,
+	_In_reads_bytes_(InLength) const void *In,
+	_In_ size_t InLength,
+	_Out_writes_bytes_(OutLength) void *Out,
+	_In_ size_t OutLength,
+	_Out_opt_ size_t *Information
+);
+
+EXTERN_C_END
+
+#endif // _CPCI429HOST_H
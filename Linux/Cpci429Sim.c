@@ -0,0 +1,1200 @@
+/*++
+
+Module Name:
+
+    cpci429sim.c
+
+Abstract:
+
+    Discrete-event simulator of CPCI429 boards and ARINC 429 buses.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Cpci429Sim.h"
+
+#define CPCI429_SIM_WHEEL_SLOTS 1024    // power of two
+#define CPCI429_SIM_BIT_NS_HIGH 10000   // 100 kbps
+#define CPCI429_SIM_BIT_NS_LOW  80000   // 12.5 kbps
+#define CPCI429_SIM_WORD_BITS   32
+#define CPCI429_SIM_GAP_BITS    4
+#define CPCI429_SIM_PEER_ANSWERS 8      // answers a bulk peer can have pending
+
+typedef struct _CPCI429_SIM_BOARD CPCI429_SIM_BOARD, *PCPCI429_SIM_BOARD;
+
+typedef struct _CPCI429_SIM_LISTENER {
+	PCPCI429_SIM_BOARD Board;   // NULL for a bulk peer
+	ULONG Channel;
+	PCPCI429_SIM_PEER Peer;
+} CPCI429_SIM_LISTENER;
+
+//
+// Anything that drives a bus: an external source playing a label
+// schedule, a bulk peer answering, or a board transmit channel emptying
+// its FIFO. It sits on the timing wheel while it has words to start.
+//
+typedef struct _CPCI429_SIM_TRANSMITTER {
+	struct _CPCI429_SIM_TRANSMITTER *Next;  // wheel slot chain
+	ULONGLONG Tick;             // step it is due in
+	BOOLEAN Scheduled;
+	ULONGLONG BusFree;          // earliest start of the next word, ns
+
+	ULONG ListenerCount;
+	CPCI429_SIM_LISTENER Listeners[CPCI429_SIM_MAX_LISTENERS];
+
+	//
+	// Bulk peer.
+	//
+	PCPCI429_SIM_PEER Peer;
+
+	//
+	// External source. Owner and Peer are NULL.
+	//
+	BOOLEAN HighSpeed;
+	ULONG LabelCount;
+	PCPCI429_SIM_LABEL Labels;
+	PULONGLONG NextDue;         // per label, ns
+	struct _CPCI429_SIM_TRANSMITTER *NextSource;
+
+	//
+	// Board transmit channel.
+	//
+	PCPCI429_SIM_BOARD Owner;
+	ULONG Channel;
+	PULONG Fifo;
+	ULONG FifoHead;
+	ULONG FifoCount;
+} CPCI429_SIM_TRANSMITTER, *PCPCI429_SIM_TRANSMITTER;
+
+typedef struct _CPCI429_SIM_RECEIVER {
+	PCPCI429_RX_RECORD Fifo;
+	ULONG FifoHead;
+	ULONG FifoCount;
+	ULONG Lost;                 // free running
+	ULONG LostShown;            // CPCI429_CH_FIFO_LOST, Lost as last published
+	BOOLEAN Overflowed;         // until the FIFO is next drained empty
+	BOOLEAN Driven;             // has its transmitter
+} CPCI429_SIM_RECEIVER, *PCPCI429_SIM_RECEIVER;
+
+//
+// A bulk peer. Expected is the word count of the block being received,
+// 0 between blocks; the block's data goes straight to the buffer after
+// the acknowledged part and is kept only when the block is acknowledged.
+//
+struct _CPCI429_SIM_PEER {
+	CPCI429_SIM_TRANSMITTER Tx;
+	CPCI429_SIM_BULK_PEER_CONFIG Config;
+	ULONG Answers[CPCI429_SIM_PEER_ANSWERS];
+	ULONGLONG AnswerDue[CPCI429_SIM_PEER_ANSWERS];  // ns
+	ULONG AnswerHead;
+	ULONG AnswerCount;
+	ULONG Block;
+	ULONG Expected;
+	ULONG Index;
+	BOOLEAN Bad;
+	ULONGLONG RtsSeen;
+	ULONGLONG BlocksSeen;
+	ULONGLONG Accepted;
+	CPCI429_SIM_BULK_PEER_STATS Stats;
+	PCPCI429_SIM_PEER NextPeer;
+};
+
+struct _CPCI429_SIM_BOARD {
+	ULONG Registers[CPCI429_BAR0_SIZE / sizeof(ULONG)];
+	PCPCI429_SIM Sim;
+	CPCI429_SIM_RECEIVER Rx[CPCI429_MAX_RX_CHANNELS];
+	CPCI429_SIM_TRANSMITTER Tx[CPCI429_MAX_TX_CHANNELS];
+	BOOLEAN Attached;
+	ULONGLONG SeenStep;         // last step the host was woken for
+	ULONGLONG DoneStep;         // last step the host finished draining
+};
+
+struct _CPCI429_SIM {
+	CPCI429_SIM_CONFIG Config;
+	ULONGLONG QuantumNs;
+
+	//
+	// One lock for the model. Hosts only take it between steps, while
+	// the runner waits for them anyway.
+	//
+	pthread_mutex_t Lock;
+	pthread_cond_t Stepped;     // hosts wait for the next step
+	pthread_cond_t Serviced;    // the runner waits for hosts
+
+	ULONGLONG Step;             // steps completed; the next one is this tick
+	PCPCI429_SIM_TRANSMITTER Wheel[CPCI429_SIM_WHEEL_SLOTS];
+	PCPCI429_SIM_TRANSMITTER Sources;
+	PCPCI429_SIM_PEER Peers;
+
+	CPCI429_SIM_STATS Stats;
+
+	PCPCI429_SIM_BOARD Boards;
+};
+
+static
+ULONGLONG
+CPCI429SimWallNs(
+	void
+)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (ULONGLONG)now.tv_sec * 1000000000 + (ULONGLONG)now.tv_nsec;
+}
+
+static
+ULONG
+CPCI429SimFifoStatus(
+	_In_ ULONG Count,
+	_In_ ULONG Depth,
+	_In_ BOOLEAN Overflowed
+)
+{
+	ULONG status = Count << 16;
+
+	if (Count == 0) {
+		status |= CPCI429_FIFO_EMPTY;
+	}
+	if (Count == Depth) {
+		status |= CPCI429_FIFO_FULL;
+	}
+	if (Count >= Depth / 2) {
+		status |= CPCI429_FIFO_HALF;
+	}
+	if (Overflowed) {
+		status |= CPCI429_FIFO_OVERFLOW;
+	}
+
+	return status;
+}
+
+static
+VOID
+CPCI429SimUpdateRx(
+	_In_ PCPCI429_SIM_BOARD Board,
+	_In_ ULONG Channel
+)
+/*++
+
+Routine Description:
+
+    Reflects a receive FIFO in its status register and the channel's
+    interrupt status bit.
+
+--*/
+{
+	PCPCI429_SIM_RECEIVER rx = &Board->Rx[Channel];
+	ULONG pending = Board->Registers[CPCI429_REG_INT_STATUS / sizeof(ULONG)];
+
+	Board->Registers[(CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_STATUS) / sizeof(ULONG)] =
+		CPCI429SimFifoStatus(rx->FifoCount, Board->Sim->Config.FifoWords, rx->Overflowed);
+	if (Board->Sim->Config.LostEveryUs == 0) {
+		rx->LostShown = rx->Lost;
+	}
+	Board->Registers[(CPCI429_RX_CHANNEL_BASE(Channel) + CPCI429_CH_FIFO_LOST) / sizeof(ULONG)] = rx->LostShown;
+
+	if (rx->FifoCount != 0) {
+		pending |= 1UL << Channel;
+	} else {
+		pending &= ~(1UL << Channel);
+	}
+	Board->Registers[CPCI429_REG_INT_STATUS / sizeof(ULONG)] = pending;
+}
+
+static
+VOID
+CPCI429SimUpdateTx(
+	_In_ PCPCI429_SIM_TRANSMITTER Tx
+)
+{
+	Tx->Owner->Registers[(CPCI429_TX_CHANNEL_BASE(Tx->Channel) + CPCI429_CH_FIFO_STATUS) / sizeof(ULONG)] =
+		CPCI429SimFifoStatus(Tx->FifoCount, Tx->Owner->Sim->Config.FifoWords, FALSE);
+}
+
+static
+ULONG
+CPCI429SimControl(
+	_In_ PCPCI429_SIM_BOARD Board,
+	_In_ ULONG Offset
+)
+{
+	return __atomic_load_n(&Board->Registers[(Offset + CPCI429_CH_CONTROL) / sizeof(ULONG)], __ATOMIC_RELAXED);
+}
+
+static
+VOID
+CPCI429SimSchedule(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_TRANSMITTER Transmitter,
+	_In_ ULONGLONG Tick
+)
+{
+	PCPCI429_SIM_TRANSMITTER *slot;
+
+	if (Transmitter->Scheduled) {
+		return;
+	}
+	if (Tick < Sim->Step) {
+		Tick = Sim->Step;
+	}
+
+	slot = &Sim->Wheel[Tick & (CPCI429_SIM_WHEEL_SLOTS - 1)];
+	Transmitter->Tick = Tick;
+	Transmitter->Scheduled = TRUE;
+	Transmitter->Next = *slot;
+	*slot = Transmitter;
+}
+
+static
+VOID
+CPCI429SimReceive(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_BOARD Board,
+	_In_ ULONG Channel,
+	_In_ ULONG Word,
+	_In_ ULONGLONG ArrivalNs,
+	_In_ BOOLEAN HighSpeed
+)
+{
+	PCPCI429_SIM_RECEIVER rx = &Board->Rx[Channel];
+	ULONG control = CPCI429SimControl(Board, CPCI429_RX_CHANNEL_BASE(Channel));
+	PCPCI429_RX_RECORD record;
+
+	if (!(control & CPCI429_CTRL_ENABLE) || !(control & CPCI429_CTRL_HIGH_SPEED) != !HighSpeed) {
+		Sim->Stats.WordsDropped++;
+		return;
+	}
+
+	if (rx->FifoCount == Sim->Config.FifoWords) {
+		if (!rx->Overflowed) {
+			rx->Overflowed = TRUE;
+			Sim->Stats.Overruns++;
+		}
+		rx->Lost++;
+		Sim->Stats.WordsOverrun++;
+	} else {
+		record = &rx->Fifo[(rx->FifoHead + rx->FifoCount) % Sim->Config.FifoWords];
+		record->Word = Word;
+		record->Flags = 0;
+		record->Timestamp = ArrivalNs / 100;
+		rx->FifoCount++;
+		Sim->Stats.WordsReceived++;
+	}
+
+	CPCI429SimUpdateRx(Board, Channel);
+}
+
+static
+VOID
+CPCI429SimPeerAnswer(
+	_In_ PCPCI429_SIM Sim,
+	_Inout_ PCPCI429_SIM_PEER Peer,
+	_In_ ULONG Type,
+	_In_ ULONG Value,
+	_In_ ULONGLONG HeardNs
+)
+/*++
+
+Routine Description:
+
+    Queues an answer to go out TurnaroundUs after the word it answers.
+    The step running now has already taken its wheel slot, so the peer
+    runs next step at the earliest; the word still starts on time when
+    that step covers it.
+
+--*/
+{
+	ULONG word = CPCI429_BULK_CONTROL_WORD(Peer->Config.ControlLabel, Type, Value);
+	ULONG slot;
+
+	if (Peer->AnswerCount == CPCI429_SIM_PEER_ANSWERS) {
+		return;
+	}
+
+	slot = (Peer->AnswerHead + Peer->AnswerCount) % CPCI429_SIM_PEER_ANSWERS;
+	Peer->Answers[slot] = CPCI429OddParity(word) ? word : word | 0x80000000;
+	Peer->AnswerDue[slot] = HeardNs + (ULONGLONG)Peer->Config.TurnaroundUs * 1000;
+	Peer->AnswerCount++;
+
+	CPCI429SimSchedule(Sim, &Peer->Tx, Sim->Step + 1);
+}
+
+static
+VOID
+CPCI429SimPeerHear(
+	_In_ PCPCI429_SIM Sim,
+	_Inout_ PCPCI429_SIM_PEER Peer,
+	_In_ ULONG Word,
+	_In_ ULONGLONG ArrivalNs,
+	_In_ BOOLEAN HighSpeed
+)
+/*++
+
+Routine Description:
+
+    The receiving side of the bulk transfer protocol. An RTS starts a
+    block, unless it is one the peer is set to ignore; the block's last
+    data word gets an ACK, or a NAK if a word was bad or the block is one
+    the peer is set to refuse.
+
+--*/
+{
+	ULONG label = CPCI429_WORD_LABEL(Word);
+	ULONGLONG position;
+
+	if (!HighSpeed != !Peer->Config.HighSpeed) {
+		Sim->Stats.WordsDropped++;
+		return;
+	}
+
+	if (label == Peer->Config.ControlLabel && CPCI429_BULK_TYPE(Word) == CPCI429_BULK_RTS) {
+		Peer->Expected = 0;
+		if (Peer->Config.IgnoreEvery != 0 && ++Peer->RtsSeen % Peer->Config.IgnoreEvery == 0) {
+			Peer->Stats.RtsIgnored++;
+			return;
+		}
+		Peer->Expected = CPCI429_BULK_VALUE(Word);
+		Peer->Index = 0;
+		Peer->Bad = FALSE;
+		if (Peer->Expected != 0) {
+			CPCI429SimPeerAnswer(Sim, Peer, CPCI429_BULK_CTS, Peer->Block & 0x7FFF, ArrivalNs);
+		}
+		return;
+	}
+
+	if (label != Peer->Config.DataLabel || Peer->Expected == 0) {
+		return;
+	}
+
+	if (!CPCI429OddParity(Word) || ((Word >> 24) & 0x1F) != (Peer->Index & 0x1F)) {
+		Peer->Bad = TRUE;
+		Peer->Stats.BadWords++;
+	} else {
+		position = Peer->Accepted + 2 * (ULONGLONG)Peer->Index;
+		if (position < Peer->Config.BufferLength) {
+			Peer->Config.Buffer[position] = (UCHAR)(Word >> 8);
+		}
+		if (position + 1 < Peer->Config.BufferLength) {
+			Peer->Config.Buffer[position + 1] = (UCHAR)(Word >> 16);
+		}
+	}
+
+	if (++Peer->Index < Peer->Expected) {
+		return;
+	}
+
+	if (Peer->Bad || (Peer->Config.NakEvery != 0 && ++Peer->BlocksSeen % Peer->Config.NakEvery == 0)) {
+		Peer->Stats.Naks++;
+		CPCI429SimPeerAnswer(Sim, Peer, CPCI429_BULK_NAK, Peer->Block & 0x7FFF, ArrivalNs);
+	} else {
+		CPCI429SimPeerAnswer(Sim, Peer, CPCI429_BULK_ACK, Peer->Block & 0x7FFF, ArrivalNs);
+		Peer->Accepted += 2 * (ULONGLONG)Peer->Expected;
+		Peer->Stats.BytesAccepted += 2 * (ULONGLONG)Peer->Expected;
+		Peer->Stats.Blocks++;
+		Peer->Block++;
+	}
+	Peer->Expected = 0;
+}
+
+static
+VOID
+CPCI429SimSend(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_TRANSMITTER Transmitter,
+	_In_ ULONG Word,
+	_In_ ULONGLONG ArrivalNs,
+	_In_ BOOLEAN HighSpeed
+)
+{
+	ULONG i;
+
+	Sim->Stats.WordsSent++;
+
+	for (i = 0; i < Transmitter->ListenerCount; i++) {
+		if (Transmitter->Listeners[i].Peer != NULL) {
+			CPCI429SimPeerHear(Sim, Transmitter->Listeners[i].Peer, Word, ArrivalNs, HighSpeed);
+		} else {
+			CPCI429SimReceive(Sim, Transmitter->Listeners[i].Board, Transmitter->Listeners[i].Channel,
+				Word, ArrivalNs, HighSpeed);
+		}
+	}
+
+	if (Transmitter->Owner != NULL &&
+		(CPCI429SimControl(Transmitter->Owner, CPCI429_RX_CHANNEL_BASE(Transmitter->Channel)) & CPCI429_CTRL_LOOPBACK)) {
+		CPCI429SimReceive(Sim, Transmitter->Owner, Transmitter->Channel, Word, ArrivalNs, HighSpeed);
+	}
+}
+
+static
+ULONG
+CPCI429SimNextLabel(
+	_In_ PCPCI429_SIM_TRANSMITTER Source
+)
+{
+	ULONG next = 0;
+	ULONG i;
+
+	for (i = 1; i < Source->LabelCount; i++) {
+		if (Source->NextDue[i] < Source->NextDue[next]) {
+			next = i;
+		}
+	}
+
+	return next;
+}
+
+static
+VOID
+CPCI429SimRunSource(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_TRANSMITTER Source,
+	_In_ ULONGLONG EndNs
+)
+/*++
+
+Routine Description:
+
+    Starts every word of the schedule that arrives by EndNs, back to
+    back when labels queue up, and goes back on the wheel for the step
+    in which the next one starts.
+
+--*/
+{
+	ULONGLONG bitNs = Source->HighSpeed ? CPCI429_SIM_BIT_NS_HIGH : CPCI429_SIM_BIT_NS_LOW;
+	ULONGLONG wordNs = bitNs * CPCI429_SIM_WORD_BITS;
+	ULONGLONG start;
+	ULONG label;
+
+	for (;;) {
+		label = CPCI429SimNextLabel(Source);
+		start = Source->NextDue[label] > Source->BusFree ? Source->NextDue[label] : Source->BusFree;
+		if (start + wordNs > EndNs) {
+			break;
+		}
+
+		CPCI429SimSend(Sim, Source, Source->Labels[label].Word, start + wordNs, Source->HighSpeed);
+
+		Source->BusFree = start + wordNs + bitNs * CPCI429_SIM_GAP_BITS;
+		Source->NextDue[label] += (ULONGLONG)Source->Labels[label].PeriodUs * 1000;
+	}
+
+	CPCI429SimSchedule(Sim, Source, start / Sim->QuantumNs > Sim->Step ? start / Sim->QuantumNs : Sim->Step + 1);
+}
+
+static
+VOID
+CPCI429SimRunTx(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_TRANSMITTER Tx,
+	_In_ ULONGLONG EndNs
+)
+{
+	ULONG control = CPCI429SimControl(Tx->Owner, CPCI429_TX_CHANNEL_BASE(Tx->Channel));
+	BOOLEAN highSpeed = (control & CPCI429_CTRL_HIGH_SPEED) != 0;
+	ULONGLONG bitNs = highSpeed ? CPCI429_SIM_BIT_NS_HIGH : CPCI429_SIM_BIT_NS_LOW;
+	ULONGLONG wordNs = bitNs * CPCI429_SIM_WORD_BITS;
+
+	//
+	// A disabled transmitter holds its FIFO; look again next step.
+	//
+	while ((control & CPCI429_CTRL_ENABLE) && Tx->FifoCount != 0 && Tx->BusFree + wordNs <= EndNs) {
+		CPCI429SimSend(Sim, Tx, Tx->Fifo[Tx->FifoHead], Tx->BusFree + wordNs, highSpeed);
+
+		Tx->FifoHead = (Tx->FifoHead + 1) % Sim->Config.FifoWords;
+		Tx->FifoCount--;
+		Tx->BusFree += wordNs + bitNs * CPCI429_SIM_GAP_BITS;
+	}
+
+	CPCI429SimUpdateTx(Tx);
+
+	if (Tx->FifoCount != 0) {
+		CPCI429SimSchedule(Sim, Tx,
+			Tx->BusFree / Sim->QuantumNs > Sim->Step ? Tx->BusFree / Sim->QuantumNs : Sim->Step + 1);
+	}
+}
+
+static
+VOID
+CPCI429SimRunPeer(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_TRANSMITTER Tx,
+	_In_ ULONGLONG EndNs
+)
+{
+	PCPCI429_SIM_PEER peer = Tx->Peer;
+	ULONGLONG bitNs = peer->Config.HighSpeed ? CPCI429_SIM_BIT_NS_HIGH : CPCI429_SIM_BIT_NS_LOW;
+	ULONGLONG wordNs = bitNs * CPCI429_SIM_WORD_BITS;
+	ULONGLONG start = 0;
+
+	while (peer->AnswerCount != 0) {
+		start = peer->AnswerDue[peer->AnswerHead] > Tx->BusFree ? peer->AnswerDue[peer->AnswerHead] : Tx->BusFree;
+		if (start + wordNs > EndNs) {
+			break;
+		}
+
+		CPCI429SimSend(Sim, Tx, peer->Answers[peer->AnswerHead], start + wordNs, peer->Config.HighSpeed);
+
+		Tx->BusFree = start + wordNs + bitNs * CPCI429_SIM_GAP_BITS;
+		peer->AnswerHead = (peer->AnswerHead + 1) % CPCI429_SIM_PEER_ANSWERS;
+		peer->AnswerCount--;
+	}
+
+	if (peer->AnswerCount != 0) {
+		CPCI429SimSchedule(Sim, Tx, start / Sim->QuantumNs > Sim->Step ? start / Sim->QuantumNs : Sim->Step + 1);
+	}
+}
+
+static
+VOID
+CPCI429SimRunStep(
+	_In_ PCPCI429_SIM Sim
+)
+/*++
+
+Routine Description:
+
+    Runs the transmitters due in the current step. Those parked in the
+    same slot for a later turn of the wheel go back in. Lost-word
+    counters that lag publish when the step ends on their period.
+
+--*/
+{
+	PCPCI429_SIM_TRANSMITTER *slot = &Sim->Wheel[Sim->Step & (CPCI429_SIM_WHEEL_SLOTS - 1)];
+	PCPCI429_SIM_TRANSMITTER transmitter = *slot;
+	PCPCI429_SIM_TRANSMITTER next;
+	ULONGLONG endNs = (Sim->Step + 1) * Sim->QuantumNs;
+	ULONGLONG periodNs = (ULONGLONG)Sim->Config.LostEveryUs * 1000;
+	ULONG board;
+	ULONG channel;
+
+	*slot = NULL;
+
+	for (; transmitter != NULL; transmitter = next) {
+		next = transmitter->Next;
+		transmitter->Scheduled = FALSE;
+
+		if (transmitter->Tick != Sim->Step) {
+			CPCI429SimSchedule(Sim, transmitter, transmitter->Tick);
+			continue;
+		}
+
+		Sim->Stats.Events++;
+		if (transmitter->Peer != NULL) {
+			CPCI429SimRunPeer(Sim, transmitter, endNs);
+		} else if (transmitter->Owner == NULL) {
+			CPCI429SimRunSource(Sim, transmitter, endNs);
+		} else {
+			CPCI429SimRunTx(Sim, transmitter, endNs);
+		}
+	}
+
+	if (periodNs != 0 && endNs / periodNs != Sim->Step * Sim->QuantumNs / periodNs) {
+		for (board = 0; board < Sim->Config.BoardCount; board++) {
+			for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+				Sim->Boards[board].Rx[channel].LostShown = Sim->Boards[board].Rx[channel].Lost;
+				CPCI429SimUpdateRx(&Sim->Boards[board], channel);
+			}
+		}
+	}
+}
+
+static
+BOOLEAN
+CPCI429SimHostsBehind(
+	_In_ PCPCI429_SIM Sim
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Sim->Config.BoardCount; i++) {
+		if (Sim->Boards[i].Attached && Sim->Boards[i].DoneStep < Sim->Step) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static
+ULONG
+CPCI429SimModelWait(
+	PVOID Context,
+	int TimeoutMs
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+	struct timespec deadline;
+	ULONG pending;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += TimeoutMs / 1000;
+	deadline.tv_nsec += (long)(TimeoutMs % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&sim->Lock);
+
+	while (sim->Step == board->SeenStep) {
+		if (TimeoutMs < 0) {
+			pthread_cond_wait(&sim->Stepped, &sim->Lock);
+		} else if (pthread_cond_timedwait(&sim->Stepped, &sim->Lock, &deadline) != 0) {
+			break;
+		}
+	}
+	board->SeenStep = sim->Step;
+
+	pending = board->Registers[CPCI429_REG_INT_STATUS / sizeof(ULONG)] &
+		__atomic_load_n(&board->Registers[CPCI429_REG_INT_ENABLE / sizeof(ULONG)], __ATOMIC_RELAXED);
+
+	//
+	// A stalled host sees nothing pending and drains nothing.
+	//
+	if (sim->Config.StallEveryUs != 0 &&
+		(sim->Step * sim->QuantumNs / 1000) % sim->Config.StallEveryUs < sim->Config.StallUs) {
+		pending = 0;
+	}
+
+	pthread_mutex_unlock(&sim->Lock);
+
+	return pending;
+}
+
+static
+ULONG
+CPCI429SimModelRxPop(
+	PVOID Context,
+	ULONG Channel,
+	PCPCI429_RX_RECORD Records,
+	ULONG MaxRecords
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+	PCPCI429_SIM_RECEIVER rx = &board->Rx[Channel];
+	ULONG count;
+	ULONG i;
+
+	pthread_mutex_lock(&sim->Lock);
+
+	count = rx->FifoCount < MaxRecords ? rx->FifoCount : MaxRecords;
+	for (i = 0; i < count; i++) {
+		Records[i] = rx->Fifo[(rx->FifoHead + i) % sim->Config.FifoWords];
+	}
+	rx->FifoHead = (rx->FifoHead + count) % sim->Config.FifoWords;
+	rx->FifoCount -= count;
+	if (rx->FifoCount == 0) {
+		rx->Overflowed = FALSE;
+	}
+	CPCI429SimUpdateRx(board, Channel);
+
+	pthread_mutex_unlock(&sim->Lock);
+
+	return count;
+}
+
+static
+void
+CPCI429SimModelDrained(
+	PVOID Context
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+
+	pthread_mutex_lock(&sim->Lock);
+	board->DoneStep = board->SeenStep;
+	pthread_cond_signal(&sim->Serviced);
+	pthread_mutex_unlock(&sim->Lock);
+}
+
+static
+ULONG
+CPCI429SimModelTxPush(
+	PVOID Context,
+	ULONG Channel,
+	const ULONG *Words,
+	ULONG Count
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+	PCPCI429_SIM_TRANSMITTER tx = &board->Tx[Channel];
+	ULONGLONG now;
+	ULONG i;
+
+	pthread_mutex_lock(&sim->Lock);
+
+	//
+	// Words queued between steps start no earlier than the step boundary.
+	//
+	now = sim->Step * sim->QuantumNs;
+	if (tx->FifoCount == 0 && tx->BusFree < now) {
+		tx->BusFree = now;
+	}
+
+	for (i = 0; i < Count && tx->FifoCount < sim->Config.FifoWords; i++) {
+		tx->Fifo[(tx->FifoHead + tx->FifoCount) % sim->Config.FifoWords] = Words[i];
+		tx->FifoCount++;
+	}
+	CPCI429SimUpdateTx(tx);
+
+	if (tx->FifoCount != 0) {
+		CPCI429SimSchedule(sim, tx, tx->BusFree / sim->QuantumNs);
+	}
+
+	pthread_mutex_unlock(&sim->Lock);
+
+	return i;
+}
+
+static
+ULONGLONG
+CPCI429SimModelNow(
+	PVOID Context
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+	ULONGLONG now;
+
+	pthread_mutex_lock(&sim->Lock);
+	now = sim->Step * sim->QuantumNs / 100;
+	pthread_mutex_unlock(&sim->Lock);
+
+	return now;
+}
+
+static
+void
+CPCI429SimModelDetach(
+	PVOID Context
+)
+{
+	PCPCI429_SIM_BOARD board = (PCPCI429_SIM_BOARD)Context;
+	PCPCI429_SIM sim = board->Sim;
+
+	pthread_mutex_lock(&sim->Lock);
+	board->Attached = FALSE;
+	pthread_cond_signal(&sim->Serviced);
+	pthread_mutex_unlock(&sim->Lock);
+}
+
+int
+CPCI429SimCreate(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_Out_ PCPCI429_SIM *Sim
+)
+{
+	PCPCI429_SIM sim;
+	ULONG board;
+	ULONG channel;
+
+	*Sim = NULL;
+
+	if (Config->BoardCount == 0 || Config->BoardCount > CPCI429_SIM_MAX_BOARDS ||
+		Config->FifoWords > CPCI429_FIFO_COUNT(0xFFFFFFFF) || Config->Speedup < 0 ||
+		(Config->StallEveryUs != 0 && Config->StallUs >= Config->StallEveryUs)) {
+		return -EINVAL;
+	}
+
+	sim = (PCPCI429_SIM)calloc(1, sizeof(*sim));
+	if (sim == NULL) {
+		return -ENOMEM;
+	}
+
+	sim->Config = *Config;
+	if (sim->Config.FifoWords == 0) {
+		sim->Config.FifoWords = 256;
+	}
+	if (sim->Config.QuantumUs == 0) {
+		sim->Config.QuantumUs = 1000;
+	}
+	sim->QuantumNs = (ULONGLONG)sim->Config.QuantumUs * 1000;
+
+	pthread_mutex_init(&sim->Lock, NULL);
+	pthread_cond_init(&sim->Stepped, NULL);
+	pthread_cond_init(&sim->Serviced, NULL);
+
+	sim->Boards = (PCPCI429_SIM_BOARD)calloc(Config->BoardCount, sizeof(CPCI429_SIM_BOARD));
+	if (sim->Boards == NULL) {
+		CPCI429SimDestroy(sim);
+		return -ENOMEM;
+	}
+
+	for (board = 0; board < Config->BoardCount; board++) {
+		PCPCI429_SIM_BOARD simBoard = &sim->Boards[board];
+
+		simBoard->Sim = sim;
+
+		for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+			simBoard->Rx[channel].Fifo = (PCPCI429_RX_RECORD)calloc(sim->Config.FifoWords, sizeof(CPCI429_RX_RECORD));
+			if (simBoard->Rx[channel].Fifo == NULL) {
+				CPCI429SimDestroy(sim);
+				return -ENOMEM;
+			}
+			CPCI429SimUpdateRx(simBoard, channel);
+		}
+
+		for (channel = 0; channel < CPCI429_MAX_TX_CHANNELS; channel++) {
+			simBoard->Tx[channel].Owner = simBoard;
+			simBoard->Tx[channel].Channel = channel;
+			simBoard->Tx[channel].Fifo = (PULONG)calloc(sim->Config.FifoWords, sizeof(ULONG));
+			if (simBoard->Tx[channel].Fifo == NULL) {
+				CPCI429SimDestroy(sim);
+				return -ENOMEM;
+			}
+			CPCI429SimUpdateTx(&simBoard->Tx[channel]);
+		}
+	}
+
+	*Sim = sim;
+
+	return 0;
+}
+
+void
+CPCI429SimDestroy(
+	_In_ PCPCI429_SIM Sim
+)
+{
+	PCPCI429_SIM_TRANSMITTER source;
+	PCPCI429_SIM_PEER peer;
+	ULONG board;
+	ULONG channel;
+
+	if (Sim == NULL) {
+		return;
+	}
+
+	while (Sim->Peers != NULL) {
+		peer = Sim->Peers;
+		Sim->Peers = peer->NextPeer;
+		free(peer);
+	}
+
+	while (Sim->Sources != NULL) {
+		source = Sim->Sources;
+		Sim->Sources = source->NextSource;
+		free(source->Labels);
+		free(source->NextDue);
+		free(source);
+	}
+
+	if (Sim->Boards != NULL) {
+		for (board = 0; board < Sim->Config.BoardCount; board++) {
+			for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+				free(Sim->Boards[board].Rx[channel].Fifo);
+			}
+			for (channel = 0; channel < CPCI429_MAX_TX_CHANNELS; channel++) {
+				free(Sim->Boards[board].Tx[channel].Fifo);
+			}
+		}
+		free(Sim->Boards);
+	}
+
+	pthread_cond_destroy(&Sim->Serviced);
+	pthread_cond_destroy(&Sim->Stepped);
+	pthread_mutex_destroy(&Sim->Lock);
+
+	free(Sim);
+}
+
+int
+CPCI429SimAddSource(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG Board,
+	_In_ ULONG Channel,
+	_In_ BOOLEAN HighSpeed,
+	_In_reads_(LabelCount) const CPCI429_SIM_LABEL *Labels,
+	_In_ ULONG LabelCount
+)
+{
+	PCPCI429_SIM_TRANSMITTER source;
+	ULONGLONG now;
+	ULONG i;
+	int status = 0;
+
+	if (Board >= Sim->Config.BoardCount || Channel >= CPCI429_MAX_RX_CHANNELS || LabelCount == 0) {
+		return -EINVAL;
+	}
+	for (i = 0; i < LabelCount; i++) {
+		if (Labels[i].PeriodUs == 0) {
+			return -EINVAL;
+		}
+	}
+
+	source = (PCPCI429_SIM_TRANSMITTER)calloc(1, sizeof(*source));
+	if (source == NULL) {
+		return -ENOMEM;
+	}
+	source->Labels = (PCPCI429_SIM_LABEL)malloc(LabelCount * sizeof(CPCI429_SIM_LABEL));
+	source->NextDue = (PULONGLONG)malloc(LabelCount * sizeof(ULONGLONG));
+	if (source->Labels == NULL || source->NextDue == NULL) {
+		free(source->Labels);
+		free(source->NextDue);
+		free(source);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_lock(&Sim->Lock);
+
+	if (Sim->Boards[Board].Rx[Channel].Driven) {
+		status = -EBUSY;
+	} else {
+		now = Sim->Step * Sim->QuantumNs;
+
+		memcpy(source->Labels, Labels, LabelCount * sizeof(CPCI429_SIM_LABEL));
+		for (i = 0; i < LabelCount; i++) {
+			source->NextDue[i] = now + (ULONGLONG)Labels[i].OffsetUs * 1000;
+		}
+		source->LabelCount = LabelCount;
+		source->HighSpeed = HighSpeed;
+		source->BusFree = now;
+		source->ListenerCount = 1;
+		source->Listeners[0].Board = &Sim->Boards[Board];
+		source->Listeners[0].Channel = Channel;
+
+		Sim->Boards[Board].Rx[Channel].Driven = TRUE;
+		source->NextSource = Sim->Sources;
+		Sim->Sources = source;
+
+		CPCI429SimSchedule(Sim, source, source->NextDue[CPCI429SimNextLabel(source)] / Sim->QuantumNs);
+	}
+
+	pthread_mutex_unlock(&Sim->Lock);
+
+	if (status != 0) {
+		free(source->Labels);
+		free(source->NextDue);
+		free(source);
+	}
+
+	return status;
+}
+
+int
+CPCI429SimConnect(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG TxBoard,
+	_In_ ULONG TxChannel,
+	_In_ ULONG RxBoard,
+	_In_ ULONG RxChannel
+)
+{
+	PCPCI429_SIM_TRANSMITTER tx;
+	int status = 0;
+
+	if (TxBoard >= Sim->Config.BoardCount || TxChannel >= CPCI429_MAX_TX_CHANNELS ||
+		RxBoard >= Sim->Config.BoardCount || RxChannel >= CPCI429_MAX_RX_CHANNELS) {
+		return -EINVAL;
+	}
+
+	pthread_mutex_lock(&Sim->Lock);
+
+	tx = &Sim->Boards[TxBoard].Tx[TxChannel];
+	if (tx->ListenerCount == CPCI429_SIM_MAX_LISTENERS) {
+		status = -ENOSPC;
+	} else if (Sim->Boards[RxBoard].Rx[RxChannel].Driven) {
+		status = -EBUSY;
+	} else {
+		tx->Listeners[tx->ListenerCount].Board = &Sim->Boards[RxBoard];
+		tx->Listeners[tx->ListenerCount].Channel = RxChannel;
+		tx->ListenerCount++;
+		Sim->Boards[RxBoard].Rx[RxChannel].Driven = TRUE;
+	}
+
+	pthread_mutex_unlock(&Sim->Lock);
+
+	return status;
+}
+
+int
+CPCI429SimAddBulkPeer(
+	_In_ PCPCI429_SIM Sim,
+	_In_ const CPCI429_SIM_BULK_PEER_CONFIG *Config,
+	_Out_ PCPCI429_SIM_PEER *Peer
+)
+{
+	PCPCI429_SIM_PEER peer;
+	PCPCI429_SIM_TRANSMITTER tx;
+	int status = 0;
+
+	*Peer = NULL;
+
+	if (Config->TxBoard >= Sim->Config.BoardCount || Config->TxChannel >= CPCI429_MAX_TX_CHANNELS ||
+		Config->RxBoard >= Sim->Config.BoardCount || Config->RxChannel >= CPCI429_MAX_RX_CHANNELS ||
+		(Config->Buffer == NULL && Config->BufferLength != 0)) {
+		return -EINVAL;
+	}
+
+	peer = (PCPCI429_SIM_PEER)calloc(1, sizeof(*peer));
+	if (peer == NULL) {
+		return -ENOMEM;
+	}
+
+	peer->Config = *Config;
+	peer->Tx.Peer = peer;
+	peer->Tx.ListenerCount = 1;
+	peer->Tx.Listeners[0].Board = &Sim->Boards[Config->RxBoard];
+	peer->Tx.Listeners[0].Channel = Config->RxChannel;
+
+	pthread_mutex_lock(&Sim->Lock);
+
+	tx = &Sim->Boards[Config->TxBoard].Tx[Config->TxChannel];
+	if (tx->ListenerCount == CPCI429_SIM_MAX_LISTENERS) {
+		status = -ENOSPC;
+	} else if (Sim->Boards[Config->RxBoard].Rx[Config->RxChannel].Driven) {
+		status = -EBUSY;
+	} else {
+		tx->Listeners[tx->ListenerCount].Peer = peer;
+		tx->ListenerCount++;
+		Sim->Boards[Config->RxBoard].Rx[Config->RxChannel].Driven = TRUE;
+		peer->Tx.BusFree = Sim->Step * Sim->QuantumNs;
+		peer->NextPeer = Sim->Peers;
+		Sim->Peers = peer;
+	}
+
+	pthread_mutex_unlock(&Sim->Lock);
+
+	if (status != 0) {
+		free(peer);
+		return status;
+	}
+
+	*Peer = peer;
+
+	return 0;
+}
+
+void
+CPCI429SimGetBulkPeerStats(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_PEER Peer,
+	_Out_ PCPCI429_SIM_BULK_PEER_STATS Stats
+)
+{
+	pthread_mutex_lock(&Sim->Lock);
+	*Stats = Peer->Stats;
+	pthread_mutex_unlock(&Sim->Lock);
+}
+
+int
+CPCI429SimBoardModel(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG Board,
+	_Out_ PCPCI429_HOST_MODEL Model
+)
+{
+	PCPCI429_SIM_BOARD board;
+	int status = 0;
+
+	if (Board >= Sim->Config.BoardCount) {
+		return -EINVAL;
+	}
+	board = &Sim->Boards[Board];
+
+	pthread_mutex_lock(&Sim->Lock);
+
+	if (board->Attached) {
+		status = -EBUSY;
+	} else {
+		board->Attached = TRUE;
+		board->SeenStep = Sim->Step;
+		board->DoneStep = Sim->Step;
+	}
+
+	pthread_mutex_unlock(&Sim->Lock);
+
+	if (status == 0) {
+		Model->Context = board;
+		Model->Bar = board->Registers;
+		Model->Wait = CPCI429SimModelWait;
+		Model->RxPop = CPCI429SimModelRxPop;
+		Model->Drained = CPCI429SimModelDrained;
+		Model->TxPush = CPCI429SimModelTxPush;
+		Model->Now = CPCI429SimModelNow;
+		Model->Detach = CPCI429SimModelDetach;
+	}
+
+	return status;
+}
+
+int
+CPCI429SimRun(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONGLONG DurationUs
+)
+{
+	ULONGLONG wallStart = CPCI429SimWallNs();
+	ULONGLONG simStart;
+	ULONGLONG endStep;
+	ULONGLONG target;
+	ULONGLONG wall;
+	struct timespec delay;
+
+	pthread_mutex_lock(&Sim->Lock);
+
+	simStart = Sim->Step * Sim->QuantumNs;
+	endStep = Sim->Step + (DurationUs * 1000 + Sim->QuantumNs - 1) / Sim->QuantumNs;
+
+	for (;;) {
+		while (CPCI429SimHostsBehind(Sim)) {
+			pthread_cond_wait(&Sim->Serviced, &Sim->Lock);
+		}
+		if (Sim->Step == endStep) {
+			break;
+		}
+
+		CPCI429SimRunStep(Sim);
+		Sim->Step++;
+		Sim->Stats.Steps++;
+		pthread_cond_broadcast(&Sim->Stepped);
+
+		if (Sim->Config.Speedup > 0) {
+			target = wallStart + (ULONGLONG)((double)(Sim->Step * Sim->QuantumNs - simStart) / Sim->Config.Speedup);
+			wall = CPCI429SimWallNs();
+			if (target > wall) {
+				delay.tv_sec = (time_t)((target - wall) / 1000000000);
+				delay.tv_nsec = (long)((target - wall) % 1000000000);
+
+				pthread_mutex_unlock(&Sim->Lock);
+				nanosleep(&delay, NULL);
+				pthread_mutex_lock(&Sim->Lock);
+			}
+		}
+	}
+
+	Sim->Stats.SimulatedNs = Sim->Step * Sim->QuantumNs;
+	Sim->Stats.WallNs += CPCI429SimWallNs() - wallStart;
+
+	pthread_mutex_unlock(&Sim->Lock);
+
+	return 0;
+}
+
+void
+CPCI429SimGetStats(
+	_In_ PCPCI429_SIM Sim,
+	_Out_ PCPCI429_SIM_STATS Stats
+)
+{
+	pthread_mutex_lock(&Sim->Lock);
+	*Stats = Sim->Stats;
+	pthread_mutex_unlock(&Sim->Lock);
+}
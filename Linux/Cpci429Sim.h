@@ -0,0 +1,221 @@
+/*++
+
+Module Name:
+
+    cpci429sim.h
+
+Abstract:
+
+    Discrete-event simulator of CPCI429 boards and the ARINC 429 buses
+    between them, for validating schedules and capacity of systems with
+    more boards than a bench can hold. It runs on simulated time, free
+    or paced at a multiple of real time.
+
+    Each board is modelled at the register level: a BAR0 image holding
+    the channel control, FIFO status and interrupt registers the driver
+    uses, behind receive and transmit FIFOs of configurable depth. A
+    board plugs into the user-mode backend through
+    CPCI429HostOpenModel, so everything built on Cpci429Host.h, the
+    gateway and the coroutine client included, runs against it.
+
+    Buses carry 32-bit words at 12.5 or 100 kbps, the rate taken from
+    the transmitting channel's control register, with the minimum four
+    bit-time gap between words. A receiver that is disabled or set to
+    the other rate drops the words it sees; a full receive FIFO loses
+    them, counts them in CPCI429_CH_FIFO_LOST and raises
+    CPCI429_FIFO_OVERFLOW until it is drained empty. Each bus has one transmitter:
+    either a scheduled external source or a board transmit channel.
+
+    Time advances in steps of one quantum. A timing wheel with one slot
+    per quantum holds a transmitter only for the steps in which it has
+    words to start, and a transmitter runs once per step for all of
+    them, so idle and slow buses cost nothing and busy ones cost one
+    event per quantum. Words still carry their exact arrival time.
+
+    A bulk peer stands in for an LRU loaded with the bulk transfer
+    protocol: it listens to a board transmit channel, answers RTS with
+    CTS and every complete block with ACK or NAK on a receive channel
+    after a turnaround time, and keeps the acknowledged data. It can
+    NAK or ignore blocks at fixed intervals to exercise the sender's
+    retransmits and timeouts.
+
+    Boards opened by a host step in lockstep with it: a step starts only
+    after every attached host has drained the previous one, so host
+    speed never shows up as simulated FIFO overruns. Host stalls are
+    simulated instead: for part of every period the boards hide their
+    pending interrupts, so hosts drain nothing while the buses run on.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#ifndef _CPCI429SIM_H
+#define _CPCI429SIM_H
+
+#include "Cpci429Host.h"
+
+#define CPCI429_SIM_MAX_BOARDS    64
+#define CPCI429_SIM_MAX_LISTENERS 4     // receivers per transmit channel
+
+typedef struct _CPCI429_SIM CPCI429_SIM, *PCPCI429_SIM;
+typedef struct _CPCI429_SIM_PEER CPCI429_SIM_PEER, *PCPCI429_SIM_PEER;
+
+typedef struct _CPCI429_SIM_CONFIG {
+	ULONG BoardCount;           // 1 to CPCI429_SIM_MAX_BOARDS
+	ULONG FifoWords;            // FIFO depth, 0 for 256, at most 4095
+	ULONG QuantumUs;            // simulated time per step, 0 for 1000
+	double Speedup;             // 0 to run free, else simulated / real time
+	ULONG StallUs;              // simulated host stall at the start of every
+	ULONG StallEveryUs;         //  StallEveryUs; 0 for none
+	ULONG LostEveryUs;          // lost-word counters publish this often; 0 at once
+} CPCI429_SIM_CONFIG, *PCPCI429_SIM_CONFIG;
+
+//
+// One label of an external source's schedule. Word is sent as given,
+// parity included, every PeriodUs from OffsetUs on. Labels that fall due
+// together queue on the bus.
+//
+typedef struct _CPCI429_SIM_LABEL {
+	ULONG Word;
+	ULONG PeriodUs;
+	ULONG OffsetUs;
+} CPCI429_SIM_LABEL, *PCPCI429_SIM_LABEL;
+
+//
+// A bulk peer hearing TxChannel of TxBoard and answering on RxChannel of
+// RxBoard, with the labels and speed of the transfers it accepts.
+// Acknowledged data is stored in Buffer, of BufferLength bytes, which
+// must outlive the simulator.
+//
+typedef struct _CPCI429_SIM_BULK_PEER_CONFIG {
+	ULONG TxBoard;
+	ULONG TxChannel;
+	ULONG RxBoard;
+	ULONG RxChannel;
+	UCHAR DataLabel;
+	UCHAR ControlLabel;
+	BOOLEAN HighSpeed;
+	ULONG TurnaroundUs;         // from the end of a word to its answer
+	ULONG NakEvery;             // NAK every Nth complete block; 0 for never
+	ULONG IgnoreEvery;          // leave every Nth RTS unanswered; 0 for never
+	PUCHAR Buffer;
+	ULONGLONG BufferLength;
+} CPCI429_SIM_BULK_PEER_CONFIG, *PCPCI429_SIM_BULK_PEER_CONFIG;
+
+typedef struct _CPCI429_SIM_BULK_PEER_STATS {
+	ULONGLONG BytesAccepted;    // in acknowledged blocks, padding included
+	ULONGLONG Blocks;           // acknowledged
+	ULONGLONG Naks;
+	ULONGLONG RtsIgnored;
+	ULONGLONG BadWords;         // data words out of sequence or with bad parity
+} CPCI429_SIM_BULK_PEER_STATS, *PCPCI429_SIM_BULK_PEER_STATS;
+
+typedef struct _CPCI429_SIM_STATS {
+	ULONGLONG SimulatedNs;
+	ULONGLONG WallNs;           // spent in CPCI429SimRun
+	ULONGLONG Steps;
+	ULONGLONG Events;           // transmitter batches run off the wheel
+	ULONGLONG WordsSent;
+	ULONGLONG WordsReceived;    // entered a receive FIFO
+	ULONGLONG WordsDropped;     // receiver disabled or at the other rate
+	ULONGLONG WordsOverrun;     // lost to a full receive FIFO
+	ULONGLONG Overruns;         // times a receive FIFO overflowed, until drained empty
+} CPCI429_SIM_STATS, *PCPCI429_SIM_STATS;
+
+//
+// All functions return 0 or a negative errno value.
+//
+EXTERN_C_START
+
+int
+CPCI429SimCreate(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_Out_ PCPCI429_SIM *Sim
+);
+
+//
+// Every host opened on the simulator's boards must be closed first.
+//
+void
+CPCI429SimDestroy(
+	_In_ PCPCI429_SIM Sim
+);
+
+//
+// Feeds receive channel Channel of Board from an external transmitter
+// sending Labels at HighSpeed (100 kbps) or low speed.
+//
+int
+CPCI429SimAddSource(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG Board,
+	_In_ ULONG Channel,
+	_In_ BOOLEAN HighSpeed,
+	_In_reads_(LabelCount) const CPCI429_SIM_LABEL *Labels,
+	_In_ ULONG LabelCount
+);
+
+//
+// Wires a board's transmit channel to a receive channel, on the same
+// board or another. A receive channel also hears its own board's
+// transmit twin while CPCI429_CTRL_LOOPBACK is set.
+//
+int
+CPCI429SimConnect(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG TxBoard,
+	_In_ ULONG TxChannel,
+	_In_ ULONG RxBoard,
+	_In_ ULONG RxChannel
+);
+
+//
+// Adds a bulk peer. The answer channel must not be driven yet.
+//
+int
+CPCI429SimAddBulkPeer(
+	_In_ PCPCI429_SIM Sim,
+	_In_ const CPCI429_SIM_BULK_PEER_CONFIG *Config,
+	_Out_ PCPCI429_SIM_PEER *Peer
+);
+
+void
+CPCI429SimGetBulkPeerStats(
+	_In_ PCPCI429_SIM Sim,
+	_In_ PCPCI429_SIM_PEER Peer,
+	_Out_ PCPCI429_SIM_BULK_PEER_STATS Stats
+);
+
+//
+// Fills Model for CPCI429HostOpenModel and attaches the board: from
+// then on each step waits for the host to service it, until the host
+// is closed.
+//
+int
+CPCI429SimBoardModel(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONG Board,
+	_Out_ PCPCI429_HOST_MODEL Model
+);
+
+//
+// Advances simulated time by DurationUs on the calling thread. Hosts of
+// attached boards must be serviced from other threads meanwhile.
+//
+int
+CPCI429SimRun(
+	_In_ PCPCI429_SIM Sim,
+	_In_ ULONGLONG DurationUs
+);
+
+void
+CPCI429SimGetStats(
+	_In_ PCPCI429_SIM Sim,
+	_Out_ PCPCI429_SIM_STATS Stats
+);
+
+EXTERN_C_END
+
+#endif // _CPCI429SIM_H
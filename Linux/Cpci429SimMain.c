@@ -0,0 +1,1144 @@
+/*++
+
+Module Name:
+
+    cpci429simmain.c
+
+Abstract:
+
+    Capacity run on the simulator. Builds a system of many boards, opens
+    each through the user-mode backend like real hardware, runs it for
+    the given simulated time and reports throughput, word timing as seen
+    by the host and the simulated-to-wall-clock speedup.
+
+        cpci429sim [--boards N] [--seconds S] [--labels N] [--quantum-us N]
+                   [--fifo N] [--threads N] [--pace X] [--sweep]
+                   [--stall-ms N --stall-every-ms N [--lost-every-ms N]]
+        cpci429sim --on-change HEARTBEAT_MS [--boards N] [--seconds S] [--labels N]
+        cpci429sim --self-test MASK [--boards N] [--seconds S] [--low-speed]
+        cpci429sim --bulk BYTES [--block N] [--turnaround-us N] [--nak-every N]
+                   [--ignore-every N] [--low-speed]
+
+    On every board receive channels 0-5 hear a 100 kbps source and
+    channel 6 a 12.5 kbps source, each playing a schedule of N labels.
+    Channel 7 is wired to transmit channel 0 of the previous board, which
+    the host feeds a word per service pass.
+
+    With --sweep the run is repeated for 1, 2, 4 and more boards up to
+    --boards, and a table shows how the host's receive throughput scales
+    with the boards and service threads.
+
+    Each run also reports the CPU time the simulator thread and every
+    service thread used, from their thread CPU clocks, against the wall
+    time of the run, summed per core. A thread is counted on the core it
+    last ran on, so one that migrated shows on a single core.
+
+    With --stall-ms the hosts stop draining for that long out of every
+    --stall-every-ms of simulated time. The run, rounded up to whole
+    stall periods so that the last stall is drained, then checks that
+    every word the boards lost to a full FIFO is counted by the host and
+    tagged in the stream it reads, and fails if any loss went unseen.
+    --lost-every-ms makes the boards publish their lost-word counters
+    only that often, like boards whose counter lags the overflow flag:
+    every overrun must still be counted and tagged, as a saturated gap
+    when its words were not known yet.
+
+    --on-change runs the boards twice on repeated-label traffic: channels
+    0-5 each hear N labels of constant value at 50 Hz. The first run
+    reads everything; the second sets CPCI429_IOCTL_SET_ON_CHANGE on
+    every label of every channel with the given heartbeat. For both it
+    reports the reads that returned words, standing in for completed
+    RX_READ_WAIT requests, the words delivered, and WordsSuppressed and
+    Heartbeats from CPCI429_IOCTL_GET_RX_STATS, and fails if a received
+    word was neither delivered nor suppressed.
+
+    --self-test instead runs CPCI429_IOCTL_SELF_TEST on every board for
+    the given simulated time, over the internal loopback of the transmit
+    channels in MASK, reports each channel's results and fails if any
+    word went missing or came back wrong.
+
+    --bulk sends BYTES of random data with CPCI429_IOCTL_BULK_TRANSFER,
+    in blocks of --block words, to a simulated LRU that answers after
+    --turnaround-us (default 500) and NAKs every --nak-every-th block
+    and ignores every --ignore-every-th RTS. It reports the bytes
+    delivered, throughput against what the line can carry, line
+    utilization and retransmits, and fails unless the LRU holds exactly
+    the data sent and every retransmit and timeout matches a NAK or an
+    ignored RTS.
+
+Environment:
+
+    Linux user mode
+
+--*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Cpci429Sim.h"
+
+#define CPCI429_SIM_HIGH_GAP 3600       // word and gap at 100 kbps, 100ns units
+#define CPCI429_SIM_LOW_GAP  28800      // the same at 12.5 kbps
+
+typedef struct _CPCI429_SIM_SERVICE {
+	pthread_t Thread;
+	PCPCI429_HOST *Hosts;
+	ULONG HostCount;
+	volatile int Stop;
+	volatile int Core;              // sched_getcpu after the last pass
+	ULONG Migrations;               // passes that found the thread on another core
+
+	ULONGLONG Reads;                // RX_READ_RECORDS calls that returned words
+	ULONGLONG WordsRead;
+	ULONGLONG WordsSubmitted;
+	ULONGLONG GapViolations;
+	ULONGLONG Gaps;                 // CPCI429_RX_FLAG_GAP records read
+	ULONGLONG GapWords;             // words lost in the unsaturated ones
+	ULONGLONG GapsSaturated;        // tagged 0xFFFF, too large or not yet counted
+	ULONGLONG MinGap[2];            // high, low speed; 100ns units
+	ULONGLONG LastStamp[CPCI429_SIM_MAX_BOARDS][CPCI429_MAX_RX_CHANNELS];
+} CPCI429_SIM_SERVICE, *PCPCI429_SIM_SERVICE;
+
+//
+// CPU use of a capacity run: the simulator thread and the service
+// threads, summed per core as the CPU time of the run over its wall time.
+//
+typedef struct _CPCI429_SIM_CPU {
+	ULONG CoreCount;
+	int Core[CPCI429_SIM_MAX_BOARDS + 1];      // ascending
+	double Busy[CPCI429_SIM_MAX_BOARDS + 1];   // 1.0 is a core fully used
+	ULONG Migrations;
+} CPCI429_SIM_CPU, *PCPCI429_SIM_CPU;
+
+static
+void
+CPCI429SimReadChannel(
+	_Inout_ PCPCI429_SIM_SERVICE Service,
+	_In_ ULONG Host,
+	_In_ ULONG Channel
+)
+{
+	CPCI429_RX_RECORD records[256];
+	CPCI429_RX_READ rxRead = { Channel };
+	ULONGLONG minGap = Channel == 6 ? CPCI429_SIM_LOW_GAP : CPCI429_SIM_HIGH_GAP;
+	PULONGLONG last = &Service->LastStamp[Host][Channel];
+	size_t information;
+	ULONG count;
+	ULONG i;
+
+	do {
+		if (CPCI429HostIoctl(Service->Hosts[Host], CPCI429_IOCTL_RX_READ_RECORDS, &rxRead, sizeof(rxRead),
+			records, sizeof(records), &information) != 0) {
+			return;
+		}
+		count = (ULONG)(information / sizeof(CPCI429_RX_RECORD));
+
+		for (i = 0; i < count; i++) {
+			if ((records[i].Flags & CPCI429_RX_FLAG_GAP) != 0) {
+				Service->Gaps++;
+				if (CPCI429_RX_GAP_WORDS(records[i].Flags) == 0xFFFF) {
+					Service->GapsSaturated++;
+				} else {
+					Service->GapWords += CPCI429_RX_GAP_WORDS(records[i].Flags);
+				}
+			}
+			if (*last != 0) {
+				ULONGLONG gap = records[i].Timestamp - *last;
+				PULONGLONG observed = &Service->MinGap[Channel == 6];
+
+				if (gap < minGap) {
+					Service->GapViolations++;
+				}
+				if (*observed == 0 || gap < *observed) {
+					*observed = gap;
+				}
+			}
+			*last = records[i].Timestamp;
+		}
+		Service->Reads += count != 0;
+		Service->WordsRead += count;
+	} while (count == ARRAYSIZE(records));
+}
+
+static
+void *
+CPCI429SimServiceThread(
+	void *Context
+)
+/*++
+
+Routine Description:
+
+    Services a share of the boards. Only the last one blocks, so one
+    thread keeps every board it owns in lockstep with the simulator.
+
+--*/
+{
+	PCPCI429_SIM_SERVICE service = (PCPCI429_SIM_SERVICE)Context;
+	ULONG word = 0;
+	ULONG i;
+	ULONG channel;
+	int core;
+
+	service->Core = sched_getcpu();
+
+	while (!service->Stop) {
+		core = sched_getcpu();
+		service->Migrations += core != service->Core;
+		service->Core = core;
+
+		for (i = 0; i < service->HostCount; i++) {
+			UCHAR submit[FIELD_OFFSET(CPCI429_TX_SUBMIT, Words) + sizeof(ULONG)];
+			PCPCI429_TX_SUBMIT txSubmit = (PCPCI429_TX_SUBMIT)submit;
+			size_t information;
+
+			if (CPCI429HostService(service->Hosts[i], i + 1 == service->HostCount ? 100 : 0) < 0) {
+				continue;
+			}
+			for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+				CPCI429SimReadChannel(service, i, channel);
+			}
+
+			txSubmit->Channel = 0;
+			txSubmit->WordCount = 1;
+			txSubmit->Words[0] = 0x60000000 | (word++ & 0xFF);
+			if (CPCI429HostIoctl(service->Hosts[i], CPCI429_IOCTL_TX_SUBMIT, submit, sizeof(submit),
+				NULL, 0, &information) == 0) {
+				service->WordsSubmitted += information / sizeof(ULONG);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static
+int
+CPCI429SimConfigureBoard(
+	_In_ PCPCI429_HOST Host
+)
+{
+	CPCI429_CHANNEL_CONFIG config;
+	ULONG channel;
+	int status = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.Enable = TRUE;
+
+	for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS && status == 0; channel++) {
+		config.Direction = CPCI429_DIRECTION_RX;
+		config.Channel = channel;
+		config.Speed = channel == 6 ? CPCI429_SPEED_LOW : CPCI429_SPEED_HIGH;
+		status = CPCI429HostIoctl(Host, CPCI429_IOCTL_SET_CHANNEL_CONFIG, &config, sizeof(config), NULL, 0, NULL);
+	}
+
+	if (status == 0) {
+		config.Direction = CPCI429_DIRECTION_TX;
+		config.Channel = 0;
+		config.Speed = CPCI429_SPEED_HIGH;
+		status = CPCI429HostIoctl(Host, CPCI429_IOCTL_SET_CHANNEL_CONFIG, &config, sizeof(config), NULL, 0, NULL);
+	}
+
+	return status;
+}
+
+static
+ULONGLONG
+CPCI429SimCpuNs(
+	_In_ clockid_t Clock
+)
+{
+	struct timespec now;
+
+	if (clock_gettime(Clock, &now) != 0) {
+		return 0;
+	}
+
+	return (ULONGLONG)now.tv_sec * 1000000000 + (ULONGLONG)now.tv_nsec;
+}
+
+static
+void
+CPCI429SimCpuAdd(
+	_Inout_ PCPCI429_SIM_CPU Cpu,
+	_In_ int Core,
+	_In_ double Busy
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Cpu->CoreCount && Cpu->Core[i] < Core; i++) {
+	}
+	if (i == Cpu->CoreCount || Cpu->Core[i] != Core) {
+		memmove(&Cpu->Core[i + 1], &Cpu->Core[i], (Cpu->CoreCount - i) * sizeof(Cpu->Core[0]));
+		memmove(&Cpu->Busy[i + 1], &Cpu->Busy[i], (Cpu->CoreCount - i) * sizeof(Cpu->Busy[0]));
+		Cpu->Core[i] = Core;
+		Cpu->Busy[i] = 0;
+		Cpu->CoreCount++;
+	}
+	Cpu->Busy[i] += Busy;
+}
+
+static
+void
+CPCI429SimCpuPrint(
+	_In_ const CPCI429_SIM_CPU *Cpu
+)
+{
+	ULONG i;
+
+	for (i = 0; i < Cpu->CoreCount; i++) {
+		printf("%s%d:%.0f%%", i == 0 ? "" : " ", Cpu->Core[i], Cpu->Busy[i] * 100);
+	}
+}
+
+static
+int
+CPCI429SimCapacity(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ ULONG LabelCount,
+	_In_ ULONG ThreadCount,
+	_In_ double Seconds,
+	_Out_ double *WordsPerSecond,
+	_Out_ PCPCI429_SIM_CPU Cpu
+)
+/*++
+
+Routine Description:
+
+    Builds the system described in the header, runs it and prints its
+    report. WordsPerSecond receives the words the hosts read per second
+    of wall-clock time, Cpu the CPU use of the run per core.
+
+--*/
+{
+	clockid_t clocks[CPCI429_SIM_MAX_BOARDS];
+	ULONGLONG cpuNs[CPCI429_SIM_MAX_BOARDS];
+	ULONGLONG simCpuNs;
+	ULONGLONG serviceCpuNs = 0;
+	CPCI429_SIM_LABEL labels[256];
+	CPCI429_SIM_STATS stats;
+	CPCI429_RX_STATS_SNAPSHOT rxStats;
+	CPCI429_HOST_MODEL model;
+	PCPCI429_SIM sim = NULL;
+	PCPCI429_HOST hosts[CPCI429_SIM_MAX_BOARDS];
+	CPCI429_SIM_SERVICE *services = NULL;
+	ULONG hostCount = 0;
+	ULONG board;
+	ULONG channel;
+	ULONG i;
+	ULONGLONG durationUs;
+	ULONGLONG read = 0;
+	ULONGLONG submitted = 0;
+	ULONGLONG violations = 0;
+	ULONGLONG gaps = 0;
+	ULONGLONG gapWords = 0;
+	ULONGLONG saturated = 0;
+	ULONGLONG overruns = 0;
+	ULONGLONG lost = 0;
+	ULONGLONG minGap[2] = { 0, 0 };
+	int status;
+
+	*WordsPerSecond = 0;
+	memset(Cpu, 0, sizeof(*Cpu));
+
+	status = CPCI429SimCreate(Config, &sim);
+
+	//
+	// Periods of 20 to 100 ms, spread so labels rarely fall due together;
+	// the low-speed bus runs the same schedule eight times slower.
+	//
+	for (board = 0; board < Config->BoardCount && status == 0; board++) {
+		for (channel = 0; channel < 7 && status == 0; channel++) {
+			for (i = 0; i < LabelCount; i++) {
+				labels[i].Word = (board << 16) | (channel << 8) | i;
+				labels[i].PeriodUs = (20000 + (i * 7919 + channel * 104729) % 80000) * (channel == 6 ? 8 : 1);
+				labels[i].OffsetUs = (i * 1237 + board * 97) % 20000;
+			}
+			status = CPCI429SimAddSource(sim, board, channel, channel != 6, labels, LabelCount);
+		}
+		if (status == 0) {
+			status = CPCI429SimConnect(sim, (board + Config->BoardCount - 1) % Config->BoardCount, 0, board, 7);
+		}
+	}
+
+	for (board = 0; board < Config->BoardCount && status == 0; board++) {
+		status = CPCI429SimBoardModel(sim, board, &model);
+		if (status == 0) {
+			status = CPCI429HostOpenModel(&model, &hosts[hostCount]);
+			hostCount += status == 0;
+		}
+		if (status == 0) {
+			status = CPCI429SimConfigureBoard(hosts[hostCount - 1]);
+		}
+	}
+
+	if (status == 0) {
+		if (ThreadCount > hostCount) {
+			ThreadCount = hostCount;
+		}
+		services = (CPCI429_SIM_SERVICE*)calloc(ThreadCount, sizeof(CPCI429_SIM_SERVICE));
+		status = services == NULL ? -ENOMEM : 0;
+	}
+
+	if (status == 0) {
+		for (i = 0; i < ThreadCount; i++) {
+			services[i].Hosts = &hosts[hostCount * i / ThreadCount];
+			services[i].HostCount = hostCount * (i + 1) / ThreadCount - hostCount * i / ThreadCount;
+			pthread_create(&services[i].Thread, NULL, CPCI429SimServiceThread, &services[i]);
+			pthread_getcpuclockid(services[i].Thread, &clocks[i]);
+		}
+
+		durationUs = (ULONGLONG)(Seconds * 1e6);
+		if (Config->StallEveryUs != 0) {
+			durationUs = (durationUs + Config->StallEveryUs - 1) / Config->StallEveryUs * Config->StallEveryUs;
+		}
+
+		//
+		// The service threads' clocks are read while they still run, and
+		// only over the simulated run.
+		//
+		for (i = 0; i < ThreadCount; i++) {
+			cpuNs[i] = CPCI429SimCpuNs(clocks[i]);
+		}
+		simCpuNs = CPCI429SimCpuNs(CLOCK_THREAD_CPUTIME_ID);
+		CPCI429SimRun(sim, durationUs);
+		simCpuNs = CPCI429SimCpuNs(CLOCK_THREAD_CPUTIME_ID) - simCpuNs;
+		for (i = 0; i < ThreadCount; i++) {
+			cpuNs[i] = CPCI429SimCpuNs(clocks[i]) - cpuNs[i];
+		}
+
+		for (i = 0; i < ThreadCount; i++) {
+			services[i].Stop = 1;
+			pthread_join(services[i].Thread, NULL);
+
+			read += services[i].WordsRead;
+			submitted += services[i].WordsSubmitted;
+			violations += services[i].GapViolations;
+			gaps += services[i].Gaps;
+			gapWords += services[i].GapWords;
+			saturated += services[i].GapsSaturated;
+			for (channel = 0; channel < 2; channel++) {
+				if (services[i].MinGap[channel] != 0 && (minGap[channel] == 0 || services[i].MinGap[channel] < minGap[channel])) {
+					minGap[channel] = services[i].MinGap[channel];
+				}
+			}
+		}
+
+		CPCI429SimGetStats(sim, &stats);
+		*WordsPerSecond = (double)read * 1e9 / (double)stats.WallNs;
+
+		CPCI429SimCpuAdd(Cpu, sched_getcpu(), (double)simCpuNs / (double)stats.WallNs);
+		for (i = 0; i < ThreadCount; i++) {
+			CPCI429SimCpuAdd(Cpu, services[i].Core, (double)cpuNs[i] / (double)stats.WallNs);
+			serviceCpuNs += cpuNs[i];
+			Cpu->Migrations += services[i].Migrations;
+		}
+
+		for (board = 0; board < hostCount; board++) {
+			if (CPCI429HostIoctl(hosts[board], CPCI429_IOCTL_GET_RX_STATS, NULL, 0,
+				&rxStats, sizeof(rxStats), NULL) == 0) {
+				for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+					overruns += rxStats.Channel[channel].FifoOverruns;
+					lost += rxStats.Channel[channel].FifoWordsLost;
+				}
+			}
+		}
+
+		printf("%u boards, %u receive channels, %.1f s simulated in %.3f s: %.1fx real time\n",
+			Config->BoardCount, Config->BoardCount * CPCI429_MAX_RX_CHANNELS,
+			(double)stats.SimulatedNs / 1e9, (double)stats.WallNs / 1e9,
+			(double)stats.SimulatedNs / (double)stats.WallNs);
+		printf("%llu steps, %llu events, %llu words sent, %llu received, %llu dropped, %llu overrun\n",
+			(unsigned long long)stats.Steps, (unsigned long long)stats.Events,
+			(unsigned long long)stats.WordsSent, (unsigned long long)stats.WordsReceived,
+			(unsigned long long)stats.WordsDropped, (unsigned long long)stats.WordsOverrun);
+		printf("host read %llu words, submitted %llu; minimum word spacing %.1f us at 100 kbps, "
+			"%.1f us at 12.5 kbps, %llu below the bus minimum\n",
+			(unsigned long long)read, (unsigned long long)submitted,
+			(double)minGap[0] / 10, (double)minGap[1] / 10, (unsigned long long)violations);
+		printf("CPU per core, simulator %.0f%%, %u service threads %.0f%%, %u migrations: ",
+			(double)simCpuNs * 100 / (double)stats.WallNs, ThreadCount,
+			(double)serviceCpuNs * 100 / (double)stats.WallNs,
+			Cpu->Migrations);
+		CPCI429SimCpuPrint(Cpu);
+		printf("\n");
+
+		if (Config->StallEveryUs != 0) {
+			if (Config->LostEveryUs != 0) {
+				printf("lost-word counters published every %u ms; %llu gaps tagged saturated\n",
+					Config->LostEveryUs / 1000, (unsigned long long)saturated);
+			}
+			printf("host stalled %u of every %u ms: boards overran %llu times, losing %llu words; "
+				"host counted %llu overruns, %llu words, and read %llu gaps, the unsaturated ones tagging %llu words\n",
+				Config->StallUs / 1000, Config->StallEveryUs / 1000,
+				(unsigned long long)stats.Overruns, (unsigned long long)stats.WordsOverrun,
+				(unsigned long long)overruns, (unsigned long long)lost,
+				(unsigned long long)gaps, (unsigned long long)gapWords);
+
+			//
+			// Every overrun is counted when the board flags it, and opens
+			// a gap, even before a lagging counter shows its words. A tag
+			// saturates when its gap was larger than one holds or was not
+			// counted yet, and says nothing about its size, so only the
+			// other tags are summed. With a prompt counter they add up
+			// exactly; a lagging one can show part of a gap's words only
+			// after it went out, and misses those lost since it last
+			// published.
+			//
+			if (overruns != stats.Overruns || (overruns != 0 && gaps == 0) ||
+				lost > stats.WordsOverrun || gapWords > lost ||
+				(Config->LostEveryUs == 0 &&
+				(lost != stats.WordsOverrun || (gapWords < lost && saturated == 0)))) {
+				fprintf(stderr, "cpci429sim: FIFO losses went unaccounted\n");
+				status = -EIO;
+			}
+		}
+	}
+
+	while (hostCount > 0) {
+		CPCI429HostClose(hosts[--hostCount]);
+	}
+	free(services);
+	CPCI429SimDestroy(sim);
+
+	return status;
+}
+
+static
+int
+CPCI429SimOnChange(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ ULONG LabelCount,
+	_In_ ULONG HeartbeatMs,
+	_In_ double Seconds
+)
+/*++
+
+Routine Description:
+
+    Runs the --on-change comparison described in the header, one service
+    thread per board, without and then with on-change delivery.
+
+--*/
+{
+	CPCI429_SIM_LABEL labels[64];
+	CPCI429_SIM_STATS stats;
+	CPCI429_RX_STATS_SNAPSHOT rxStats;
+	CPCI429_ON_CHANGE_CONFIG onChange;
+	CPCI429_HOST_MODEL model;
+	PCPCI429_SIM sim;
+	PCPCI429_HOST hosts[CPCI429_SIM_MAX_BOARDS];
+	CPCI429_SIM_SERVICE *services;
+	ULONG hostCount;
+	ULONG board;
+	ULONG channel;
+	ULONG run;
+	ULONG i;
+	ULONGLONG reads;
+	ULONGLONG read;
+	ULONGLONG received;
+	ULONGLONG queued;
+	ULONGLONG suppressed;
+	ULONGLONG heartbeats;
+	int status = 0;
+
+	memset(&onChange, 0, sizeof(onChange));
+	onChange.HeartbeatMs = HeartbeatMs;
+	memset(onChange.LabelMask, 0xFF, sizeof(onChange.LabelMask));
+
+	printf("%u boards, 6 channels each at 50 Hz x %u labels of constant value, %.1f s simulated\n",
+		Config->BoardCount, LabelCount, Seconds);
+	printf("on-change       reads  words read    received  suppressed  heartbeats\n");
+
+	for (run = 0; run < 2 && status == 0; run++) {
+		sim = NULL;
+		services = NULL;
+		hostCount = 0;
+		reads = read = received = queued = suppressed = heartbeats = 0;
+
+		status = CPCI429SimCreate(Config, &sim);
+		for (board = 0; board < Config->BoardCount && status == 0; board++) {
+			for (channel = 0; channel < 6 && status == 0; channel++) {
+				for (i = 0; i < LabelCount; i++) {
+					labels[i].Word = (board << 16) | (channel << 8) | i;
+					labels[i].PeriodUs = 20000;
+					labels[i].OffsetUs = i * 20000 / LabelCount;
+				}
+				status = CPCI429SimAddSource(sim, board, channel, TRUE, labels, LabelCount);
+			}
+		}
+
+		for (board = 0; board < Config->BoardCount && status == 0; board++) {
+			status = CPCI429SimBoardModel(sim, board, &model);
+			if (status == 0) {
+				status = CPCI429HostOpenModel(&model, &hosts[hostCount]);
+				hostCount += status == 0;
+			}
+			if (status == 0) {
+				status = CPCI429SimConfigureBoard(hosts[hostCount - 1]);
+			}
+			for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS && status == 0 && run == 1; channel++) {
+				onChange.Channel = channel;
+				status = CPCI429HostIoctl(hosts[hostCount - 1], CPCI429_IOCTL_SET_ON_CHANGE,
+					&onChange, sizeof(onChange), NULL, 0, NULL);
+			}
+		}
+
+		if (status == 0) {
+			services = (CPCI429_SIM_SERVICE*)calloc(hostCount, sizeof(CPCI429_SIM_SERVICE));
+			status = services == NULL ? -ENOMEM : 0;
+		}
+
+		if (status == 0) {
+			for (i = 0; i < hostCount; i++) {
+				services[i].Hosts = &hosts[i];
+				services[i].HostCount = 1;
+				pthread_create(&services[i].Thread, NULL, CPCI429SimServiceThread, &services[i]);
+			}
+
+			CPCI429SimRun(sim, (ULONGLONG)(Seconds * 1e6));
+
+			for (i = 0; i < hostCount; i++) {
+				services[i].Stop = 1;
+				pthread_join(services[i].Thread, NULL);
+				reads += services[i].Reads;
+				read += services[i].WordsRead;
+			}
+
+			for (board = 0; board < hostCount; board++) {
+				if (CPCI429HostIoctl(hosts[board], CPCI429_IOCTL_GET_RX_STATS, NULL, 0,
+					&rxStats, sizeof(rxStats), NULL) == 0) {
+					for (channel = 0; channel < CPCI429_MAX_RX_CHANNELS; channel++) {
+						received += rxStats.Channel[channel].WordsReceived;
+						queued += rxStats.Channel[channel].WordsQueued;
+						suppressed += rxStats.Channel[channel].WordsSuppressed;
+						heartbeats += rxStats.Channel[channel].Heartbeats;
+					}
+				}
+			}
+
+			CPCI429SimGetStats(sim, &stats);
+			if (run == 0) {
+				printf("off         ");
+			} else {
+				printf("%5u ms hb  ", HeartbeatMs);
+			}
+			printf("%9llu  %10llu  %10llu  %10llu  %10llu\n", (unsigned long long)reads,
+				(unsigned long long)read, (unsigned long long)received,
+				(unsigned long long)suppressed, (unsigned long long)heartbeats);
+
+			//
+			// Every word the host received is either queued for the
+			// reader or suppressed, and everything queued was read.
+			//
+			if (received != stats.WordsReceived || queued + suppressed != received || read != queued ||
+				(run == 0 && (suppressed != 0 || heartbeats != 0))) {
+				fprintf(stderr, "cpci429sim: on-change delivery lost track of words\n");
+				status = -EIO;
+			}
+		}
+
+		while (hostCount > 0) {
+			CPCI429HostClose(hosts[--hostCount]);
+		}
+		free(services);
+		CPCI429SimDestroy(sim);
+	}
+
+	return status;
+}
+
+//
+// A blocking IOCTL issued on its own thread while another services the
+// host, for the runs that drive a self-test or a bulk transfer.
+//
+typedef struct _CPCI429_SIM_TESTER {
+	pthread_t Thread;
+	pthread_t Service;
+	PCPCI429_HOST Host;
+	ULONG IoControlCode;
+	const void *In;
+	size_t InLength;
+	void *Out;
+	size_t OutLength;
+	size_t Information;
+	CPCI429_SELF_TEST_CONFIG Config;
+	CPCI429_SELF_TEST_RESULT Result;
+	int Status;
+	volatile int Done;
+	volatile int Stop;
+} CPCI429_SIM_TESTER, *PCPCI429_SIM_TESTER;
+
+static
+void *
+CPCI429SimTesterService(
+	void *Context
+)
+{
+	PCPCI429_SIM_TESTER tester = (PCPCI429_SIM_TESTER)Context;
+
+	//
+	// Serviced until the simulator stops stepping, not until the test
+	// returns: a step may already be waiting for this host.
+	//
+	while (!__atomic_load_n(&tester->Stop, __ATOMIC_ACQUIRE)) {
+		CPCI429HostService(tester->Host, 100);
+	}
+
+	return NULL;
+}
+
+static
+void *
+CPCI429SimTesterThread(
+	void *Context
+)
+{
+	PCPCI429_SIM_TESTER tester = (PCPCI429_SIM_TESTER)Context;
+
+	tester->Status = CPCI429HostIoctl(tester->Host, tester->IoControlCode,
+		tester->In, tester->InLength, tester->Out, tester->OutLength, &tester->Information);
+	__atomic_store_n(&tester->Done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static
+int
+CPCI429SimSelfTest(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ ULONG ChannelMask,
+	_In_ BOOLEAN HighSpeed,
+	_In_ double Seconds
+)
+/*++
+
+Routine Description:
+
+    Runs the loopback self-test on every board at once, each host with
+    its own service thread, and prints the results. The simulator keeps
+    stepping until every run, grace period included, is over.
+
+--*/
+{
+	CPCI429_HOST_MODEL model;
+	PCPCI429_SIM sim = NULL;
+	CPCI429_SIM_TESTER *testers;
+	ULONG started = 0;
+	ULONG board;
+	ULONG channel;
+	ULONG done;
+	int status;
+
+	testers = (CPCI429_SIM_TESTER*)calloc(Config->BoardCount, sizeof(CPCI429_SIM_TESTER));
+	if (testers == NULL) {
+		return -ENOMEM;
+	}
+
+	status = CPCI429SimCreate(Config, &sim);
+
+	for (board = 0; board < Config->BoardCount && status == 0; board++) {
+		PCPCI429_SIM_TESTER tester = &testers[board];
+
+		status = CPCI429SimBoardModel(sim, board, &model);
+		if (status == 0) {
+			status = CPCI429HostOpenModel(&model, &tester->Host);
+		}
+		if (status != 0) {
+			break;
+		}
+
+		tester->Config.ChannelMask = ChannelMask;
+		tester->Config.Loopback = CPCI429_LOOPBACK_INTERNAL;
+		tester->Config.Speed = HighSpeed ? CPCI429_SPEED_HIGH : CPCI429_SPEED_LOW;
+		tester->Config.DurationMs = (ULONG)(Seconds * 1000);
+		tester->Config.Label = 0x3A;
+		tester->Config.MaxLatencyUs = 0;
+		tester->IoControlCode = CPCI429_IOCTL_SELF_TEST;
+		tester->In = &tester->Config;
+		tester->InLength = sizeof(tester->Config);
+		tester->Out = &tester->Result;
+		tester->OutLength = sizeof(tester->Result);
+
+		pthread_create(&tester->Service, NULL, CPCI429SimTesterService, tester);
+		pthread_create(&tester->Thread, NULL, CPCI429SimTesterThread, tester);
+		started++;
+	}
+
+	do {
+		for (board = 0, done = 0; board < started; board++) {
+			done += __atomic_load_n(&testers[board].Done, __ATOMIC_ACQUIRE);
+		}
+		if (done < started) {
+			CPCI429SimRun(sim, 10000);
+		}
+	} while (done < started);
+
+	for (board = 0; board < started; board++) {
+		PCPCI429_SIM_TESTER tester = &testers[board];
+		PCPCI429_SELF_TEST_RESULT result = &tester->Result;
+
+		__atomic_store_n(&tester->Stop, 1, __ATOMIC_RELEASE);
+		pthread_join(tester->Thread, NULL);
+		pthread_join(tester->Service, NULL);
+
+		if (tester->Status != 0) {
+			status = tester->Status;
+			continue;
+		}
+
+		printf("board %u: %.3f s, %llu pumps, %llu drains\n", board,
+			(double)result->Elapsed / (double)result->TickFrequency,
+			(unsigned long long)result->Pumps, (unsigned long long)result->Dpcs);
+
+		for (channel = 0; channel < CPCI429_MAX_TX_CHANNELS; channel++) {
+			PCPCI429_SELF_TEST_CHANNEL results = &result->Channel[channel];
+
+			if (!(ChannelMask & (1UL << channel))) {
+				continue;
+			}
+
+			printf("  channel %u: %llu sent, %llu received, %llu lost, %llu sequence and %llu content errors, "
+				"%llu late, %llu underruns; latency %.0f/%.0f/%.0f us\n", channel,
+				(unsigned long long)results->WordsSent, (unsigned long long)results->WordsReceived,
+				(unsigned long long)results->WordsLost, (unsigned long long)results->SequenceErrors,
+				(unsigned long long)results->ContentErrors, (unsigned long long)results->LateWords,
+				(unsigned long long)results->TxUnderruns,
+				(double)results->LatencyMin * 1e6 / (double)result->TickFrequency,
+				results->WordsReceived == 0 ? 0 :
+				(double)results->LatencySum / (double)results->WordsReceived * 1e6 / (double)result->TickFrequency,
+				(double)results->LatencyMax * 1e6 / (double)result->TickFrequency);
+
+			if (results->WordsReceived == 0 || results->WordsLost != 0 ||
+				results->SequenceErrors != 0 || results->ContentErrors != 0) {
+				fprintf(stderr, "cpci429sim: board %u channel %u failed its self-test\n", board, channel);
+				status = -EIO;
+			}
+		}
+	}
+
+	for (board = 0; board < Config->BoardCount; board++) {
+		if (testers[board].Host != NULL) {
+			CPCI429HostClose(testers[board].Host);
+		}
+	}
+	CPCI429SimDestroy(sim);
+	free(testers);
+
+	return status;
+}
+
+static
+int
+CPCI429SimBulk(
+	_In_ const CPCI429_SIM_CONFIG *Config,
+	_In_ ULONG Bytes,
+	_In_ ULONG BlockWords,
+	_In_ const CPCI429_SIM_BULK_PEER_CONFIG *PeerConfig
+)
+/*++
+
+Routine Description:
+
+    Sends Bytes of random data with CPCI429_IOCTL_BULK_TRANSFER from
+    transmit channel 0 of board 0 to a bulk peer answering on its receive
+    channel 0, then checks what the peer acknowledged against what was
+    sent and the sender's counters against the peer's.
+
+--*/
+{
+	CPCI429_SIM_CONFIG config = *Config;
+	CPCI429_SIM_BULK_PEER_CONFIG peerConfig = *PeerConfig;
+	CPCI429_SIM_BULK_PEER_STATS peerStats;
+	CPCI429_SIM_TESTER tester;
+	CPCI429_HOST_MODEL model;
+	CPCI429_CHANNEL_CONFIG channelConfig;
+	CPCI429_BULK_CONFIG bulkConfig;
+	CPCI429_BULK_STATUS result;
+	PCPCI429_SIM sim = NULL;
+	PCPCI429_SIM_PEER peer;
+	PUCHAR data;
+	PUCHAR received;
+	double seconds;
+	double ceiling;
+	ULONG i;
+	int status;
+
+	data = (PUCHAR)malloc(Bytes);
+	received = (PUCHAR)calloc(1, Bytes);
+	if (data == NULL || received == NULL) {
+		free(data);
+		free(received);
+		return -ENOMEM;
+	}
+
+	srand(615);
+	for (i = 0; i < Bytes; i++) {
+		data[i] = (UCHAR)rand();
+	}
+
+	memset(&tester, 0, sizeof(tester));
+	memset(&channelConfig, 0, sizeof(channelConfig));
+	memset(&bulkConfig, 0, sizeof(bulkConfig));
+
+	config.BoardCount = 1;
+	peerConfig.Buffer = received;
+	peerConfig.BufferLength = Bytes;
+
+	status = CPCI429SimCreate(&config, &sim);
+	if (status == 0) {
+		status = CPCI429SimAddBulkPeer(sim, &peerConfig, &peer);
+	}
+	if (status == 0) {
+		status = CPCI429SimBoardModel(sim, 0, &model);
+	}
+	if (status == 0) {
+		status = CPCI429HostOpenModel(&model, &tester.Host);
+	}
+	if (status == 0) {
+		channelConfig.Channel = 0;
+		channelConfig.Direction = CPCI429_DIRECTION_RX;
+		channelConfig.Speed = peerConfig.HighSpeed ? CPCI429_SPEED_HIGH : CPCI429_SPEED_LOW;
+		channelConfig.OddParity = TRUE;
+		channelConfig.Enable = TRUE;
+		status = CPCI429HostIoctl(tester.Host, CPCI429_IOCTL_SET_CHANNEL_CONFIG,
+			&channelConfig, sizeof(channelConfig), NULL, 0, NULL);
+	}
+
+	if (status == 0) {
+		bulkConfig.TxChannel = 0;
+		bulkConfig.RxChannel = 0;
+		bulkConfig.DataLabel = peerConfig.DataLabel;
+		bulkConfig.ControlLabel = peerConfig.ControlLabel;
+		bulkConfig.Speed = channelConfig.Speed;
+		bulkConfig.BlockWords = BlockWords;
+		bulkConfig.TimeoutMs = 100;
+		bulkConfig.MaxRetries = 8;
+
+		tester.IoControlCode = CPCI429_IOCTL_BULK_TRANSFER;
+		tester.In = &bulkConfig;
+		tester.InLength = sizeof(bulkConfig);
+		tester.Out = data;
+		tester.OutLength = Bytes;
+
+		pthread_create(&tester.Service, NULL, CPCI429SimTesterService, &tester);
+		pthread_create(&tester.Thread, NULL, CPCI429SimTesterThread, &tester);
+
+		while (!__atomic_load_n(&tester.Done, __ATOMIC_ACQUIRE)) {
+			CPCI429SimRun(sim, 10000);
+		}
+
+		__atomic_store_n(&tester.Stop, 1, __ATOMIC_RELEASE);
+		pthread_join(tester.Thread, NULL);
+		pthread_join(tester.Service, NULL);
+
+		status = CPCI429HostIoctl(tester.Host, CPCI429_IOCTL_GET_BULK_STATUS, NULL, 0, &result, sizeof(result), NULL);
+	}
+
+	if (status == 0) {
+		CPCI429SimGetBulkPeerStats(sim, peer, &peerStats);
+
+		seconds = (double)result.Elapsed / (double)result.TickFrequency;
+		ceiling = (peerConfig.HighSpeed ? 100000.0 : 12500.0) / CPCI429_BULK_WORD_BITS * 2;
+
+		printf("%zu of %u bytes in %.3f s: %llu bytes/s, %.1f%% of the %.0f bytes/s the line carries\n",
+			tester.Information, Bytes, seconds, (unsigned long long)result.BytesPerSecond,
+			result.BytesPerSecond * 100.0 / ceiling, ceiling);
+		printf("%llu blocks, %llu words sent, line utilization %.1f%%; "
+			"%llu retransmits, %llu timeouts, %llu unexpected answers\n",
+			(unsigned long long)result.Blocks, (unsigned long long)result.WordsSent, result.LineUtilization / 100.0,
+			(unsigned long long)result.Retransmits, (unsigned long long)result.Timeouts,
+			(unsigned long long)result.UnexpectedWords);
+		printf("peer: %llu blocks acknowledged, %llu NAKs, %llu RTS ignored, %llu bad words\n",
+			(unsigned long long)peerStats.Blocks, (unsigned long long)peerStats.Naks,
+			(unsigned long long)peerStats.RtsIgnored, (unsigned long long)peerStats.BadWords);
+
+		if (tester.Status != 0 || tester.Information != Bytes || memcmp(data, received, Bytes) != 0) {
+			fprintf(stderr, "cpci429sim: the peer did not receive the data sent (%s)\n",
+				tester.Status != 0 ? strerror(-tester.Status) : "content differs");
+			status = -EIO;
+		} else if (result.Blocks != peerStats.Blocks ||
+			result.Retransmits != peerStats.Naks + peerStats.RtsIgnored ||
+			result.Timeouts != peerStats.RtsIgnored || peerStats.BadWords != 0 ||
+			result.LineUtilization == 0 || result.LineUtilization > 10000) {
+			fprintf(stderr, "cpci429sim: sender and peer disagree on the handshake\n");
+			status = -EIO;
+		}
+	}
+
+	if (tester.Host != NULL) {
+		CPCI429HostClose(tester.Host);
+	}
+	CPCI429SimDestroy(sim);
+	free(data);
+	free(received);
+
+	return status;
+}
+
+int
+main(
+	int argc,
+	char **argv
+)
+{
+	CPCI429_SIM_CONFIG config;
+	ULONG labelCount = 32;
+	ULONG threadCount = 4;
+	ULONG boardCount;
+	ULONG i;
+	double seconds = 10;
+	double rate[8];
+	CPCI429_SIM_CPU cpu[8];
+	ULONG runs = 0;
+	BOOLEAN sweep = FALSE;
+	BOOLEAN lowSpeed = FALSE;
+	ULONG selfTest = 0;
+	ULONG bulkBytes = 0;
+	ULONG bulkBlock = 0;
+	ULONG heartbeatMs = 0;
+	BOOLEAN onChange = FALSE;
+	CPCI429_SIM_BULK_PEER_CONFIG peerConfig;
+	int status = 0;
+
+	memset(&config, 0, sizeof(config));
+	config.BoardCount = 32;
+
+	memset(&peerConfig, 0, sizeof(peerConfig));
+	peerConfig.DataLabel = 0x61;
+	peerConfig.ControlLabel = 0x62;
+	peerConfig.TurnaroundUs = 500;
+
+	for (i = 1; i < (ULONG)argc; i++) {
+		if (!strcmp(argv[i], "--boards") && i + 1 < (ULONG)argc) {
+			config.BoardCount = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--seconds") && i + 1 < (ULONG)argc) {
+			seconds = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--labels") && i + 1 < (ULONG)argc) {
+			labelCount = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--quantum-us") && i + 1 < (ULONG)argc) {
+			config.QuantumUs = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--fifo") && i + 1 < (ULONG)argc) {
+			config.FifoWords = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < (ULONG)argc) {
+			threadCount = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--pace") && i + 1 < (ULONG)argc) {
+			config.Speedup = atof(argv[++i]);
+		} else if (!strcmp(argv[i], "--stall-ms") && i + 1 < (ULONG)argc) {
+			config.StallUs = (ULONG)atoi(argv[++i]) * 1000;
+		} else if (!strcmp(argv[i], "--stall-every-ms") && i + 1 < (ULONG)argc) {
+			config.StallEveryUs = (ULONG)atoi(argv[++i]) * 1000;
+		} else if (!strcmp(argv[i], "--lost-every-ms") && i + 1 < (ULONG)argc) {
+			config.LostEveryUs = (ULONG)atoi(argv[++i]) * 1000;
+		} else if (!strcmp(argv[i], "--sweep")) {
+			sweep = TRUE;
+		} else if (!strcmp(argv[i], "--on-change") && i + 1 < (ULONG)argc) {
+			onChange = TRUE;
+			heartbeatMs = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--self-test") && i + 1 < (ULONG)argc) {
+			selfTest = (ULONG)strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "--low-speed")) {
+			lowSpeed = TRUE;
+		} else if (!strcmp(argv[i], "--bulk") && i + 1 < (ULONG)argc) {
+			bulkBytes = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--block") && i + 1 < (ULONG)argc) {
+			bulkBlock = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--turnaround-us") && i + 1 < (ULONG)argc) {
+			peerConfig.TurnaroundUs = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--nak-every") && i + 1 < (ULONG)argc) {
+			peerConfig.NakEvery = (ULONG)atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--ignore-every") && i + 1 < (ULONG)argc) {
+			peerConfig.IgnoreEvery = (ULONG)atoi(argv[++i]);
+		} else {
+			status = -EINVAL;
+		}
+	}
+
+	if (status != 0 || labelCount == 0 || labelCount > 256 || threadCount == 0 || seconds <= 0 ||
+		config.BoardCount == 0 || config.BoardCount > CPCI429_SIM_MAX_BOARDS ||
+		(config.StallUs != 0) != (config.StallEveryUs != 0) ||
+		(config.LostEveryUs != 0 && config.StallEveryUs == 0) ||
+		(selfTest >> CPCI429_MAX_TX_CHANNELS) != 0 || (lowSpeed && selfTest == 0 && bulkBytes == 0) ||
+		(selfTest != 0 && bulkBytes != 0) || bulkBlock > CPCI429_BULK_MAX_BLOCK_WORDS ||
+		peerConfig.NakEvery == 1 || peerConfig.IgnoreEvery == 1 ||
+		(onChange && (labelCount > 50 || selfTest != 0 || bulkBytes != 0 || config.StallEveryUs != 0))) {
+		fprintf(stderr,
+			"usage: cpci429sim [--boards N] [--seconds S] [--labels N] [--quantum-us N]\n"
+			"                  [--fifo N] [--threads N] [--pace X] [--sweep]\n"
+			"                  [--stall-ms N --stall-every-ms N [--lost-every-ms N]]\n"
+			"       cpci429sim --on-change HEARTBEAT_MS [--boards N] [--seconds S] [--labels 1-50]\n"
+			"       cpci429sim --self-test MASK [--boards N] [--seconds S] [--low-speed]\n"
+			"       cpci429sim --bulk BYTES [--block N] [--turnaround-us N] [--nak-every N]\n"
+			"                  [--ignore-every N] [--low-speed]\n");
+		return 2;
+	}
+
+	if (bulkBytes != 0) {
+		peerConfig.HighSpeed = !lowSpeed;
+		status = CPCI429SimBulk(&config, bulkBytes, bulkBlock, &peerConfig);
+		if (status != 0) {
+			fprintf(stderr, "cpci429sim: %s\n", strerror(-status));
+		}
+		return status < 0 ? 1 : 0;
+	}
+
+	if (onChange) {
+		status = CPCI429SimOnChange(&config, labelCount, heartbeatMs, seconds);
+		if (status != 0) {
+			fprintf(stderr, "cpci429sim: %s\n", strerror(-status));
+		}
+		return status < 0 ? 1 : 0;
+	}
+
+	if (selfTest != 0) {
+		status = CPCI429SimSelfTest(&config, selfTest, !lowSpeed, seconds);
+		if (status != 0) {
+			fprintf(stderr, "cpci429sim: %s\n", strerror(-status));
+		}
+		return status < 0 ? 1 : 0;
+	}
+
+	//
+	// A sweep doubles the board count from one up to --boards, giving
+	// each run as many service threads as boards up to --threads.
+	//
+	boardCount = config.BoardCount;
+	for (config.BoardCount = sweep ? 1 : boardCount; status == 0; config.BoardCount *= 2) {
+		if (config.BoardCount > boardCount) {
+			config.BoardCount = boardCount;
+		}
+		status = CPCI429SimCapacity(&config, labelCount, threadCount, seconds, &rate[runs], &cpu[runs]);
+		runs++;
+		if (config.BoardCount == boardCount) {
+			break;
+		}
+	}
+
+	if (sweep && status == 0) {
+		printf("boards  threads  host words/s  per board  CPU per core\n");
+		for (i = 0, config.BoardCount = 1; i < runs; i++, config.BoardCount *= 2) {
+			if (config.BoardCount > boardCount) {
+				config.BoardCount = boardCount;
+			}
+			printf("%6u  %7u  %12.0f  %9.0f  ", config.BoardCount,
+				threadCount < config.BoardCount ? threadCount : config.BoardCount,
+				rate[i], rate[i] / config.BoardCount);
+			CPCI429SimCpuPrint(&cpu[i]);
+			printf("\n");
+		}
+	}
+
+	if (status != 0) {
+		fprintf(stderr, "cpci429sim: %s\n", strerror(-status));
+	}
+
+	return status < 0 ? 1 : 0;
+}